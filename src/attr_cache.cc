@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Attr_Cache class implementation
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#include "attr_cache.h"
+
+#include <string.h>
+
+Attr_Cache::Attr_Cache()
+    : m_timeout(0)
+{
+}
+
+Attr_Cache::~Attr_Cache()
+{
+}
+
+void Attr_Cache::init(time_t timeout)
+{
+    m_timeout = timeout;
+
+    if (!m_timeout)
+    {
+        clear();
+    }
+}
+
+bool Attr_Cache::enabled() const
+{
+    return (m_timeout != 0);
+}
+
+Attr_Cache::SHARD & Attr_Cache::shard(const std::string & virtfilepath)
+{
+    return m_shards[std::hash<std::string>()(virtfilepath) % ATTR_CACHE_SHARDS];
+}
+
+bool Attr_Cache::lookup(const std::string & virtfilepath, struct stat *stbuf, int *result)
+{
+    if (!enabled())
+    {
+        return false;
+    }
+
+    SHARD & s = shard(virtfilepath);
+    ATTR_ENTRY entry;
+
+    {
+        std::lock_guard<std::mutex> lock(s.m_mutex);
+
+        auto it = s.m_entries.find(virtfilepath);
+        if (it == s.m_entries.end())
+        {
+            s.m_misses++;
+            return false;
+        }
+
+        if (it->second.m_expires <= time(nullptr))
+        {
+            erase(s, it);
+            s.m_misses++;
+            return false;
+        }
+
+        entry = it->second;
+    }
+
+    if (!entry.m_origfile.empty())
+    {
+        // Check source file outside the lock, stat may block for a while on network drives
+        struct stat src_st;
+
+        if (lstat(entry.m_origfile.c_str(), &src_st) == -1 ||
+                src_st.st_mtime != entry.m_src_mtime ||
+                src_st.st_size != entry.m_src_size ||
+                src_st.st_ino != entry.m_src_ino)
+        {
+            std::lock_guard<std::mutex> lock(s.m_mutex);
+
+            auto it = s.m_entries.find(virtfilepath);
+            if (it != s.m_entries.end())
+            {
+                erase(s, it);
+            }
+            s.m_misses++;
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(s.m_mutex);
+
+    *result = entry.m_result;
+
+    if (!entry.m_result)
+    {
+        memcpy(stbuf, &entry.m_st, sizeof(struct stat));
+        s.m_hits++;
+    }
+    else
+    {
+        s.m_negative_hits++;
+    }
+
+    return true;
+}
+
+void Attr_Cache::store(const std::string & virtfilepath, const ATTR_ENTRY & entry)
+{
+    SHARD & s = shard(virtfilepath);
+
+    std::lock_guard<std::mutex> lock(s.m_mutex);
+
+    auto it = s.m_entries.find(virtfilepath);
+    if (it != s.m_entries.end())
+    {
+        // Expires later now
+        erase(s, it);
+    }
+
+    // Drop expired entries and, if still full, the one that would expire next
+    time_t now = time(nullptr);
+
+    while (!s.m_expiry.empty() && (s.m_entries.size() >= ATTR_CACHE_MAX_ENTRIES || s.m_entries.at(*s.m_expiry.front()).m_expires <= now))
+    {
+        erase(s, s.m_entries.find(*s.m_expiry.front()));
+    }
+
+    it = s.m_entries.insert(std::make_pair(virtfilepath, entry)).first;
+    it->second.m_expiry_pos = s.m_expiry.insert(s.m_expiry.end(), &it->first);
+}
+
+void Attr_Cache::erase(SHARD & s, ATTR_MAP::iterator it)
+{
+    s.m_expiry.erase(it->second.m_expiry_pos);
+    s.m_entries.erase(it);
+}
+
+void Attr_Cache::insert(const std::string & virtfilepath, const struct stat *stbuf, VIRTUALTYPE type, const std::string & origfile, const struct stat *src_st)
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    ATTR_ENTRY entry;
+
+    memcpy(&entry.m_st, stbuf, sizeof(struct stat));
+    entry.m_type        = type;
+    entry.m_origfile    = origfile;
+    entry.m_src_mtime   = !origfile.empty() ? src_st->st_mtime : 0;
+    entry.m_src_size    = !origfile.empty() ? src_st->st_size : 0;
+    entry.m_src_ino     = !origfile.empty() ? src_st->st_ino : 0;
+    entry.m_result      = 0;
+    entry.m_expires     = time(nullptr) + m_timeout;
+
+    store(virtfilepath, entry);
+}
+
+void Attr_Cache::insert_negative(const std::string & virtfilepath, int result)
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    ATTR_ENTRY entry;
+
+    memset(&entry.m_st, 0, sizeof(struct stat));
+    entry.m_type        = VIRTUALTYPE_REGULAR;
+    entry.m_src_mtime   = 0;
+    entry.m_src_size    = 0;
+    entry.m_src_ino     = 0;
+    entry.m_result      = result;
+    entry.m_expires     = time(nullptr) + m_timeout;
+
+    store(virtfilepath, entry);
+}
+
+void Attr_Cache::invalidate(const std::string & virtfilepath)
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    SHARD & s = shard(virtfilepath);
+
+    std::lock_guard<std::mutex> lock(s.m_mutex);
+
+    auto it = s.m_entries.find(virtfilepath);
+    if (it != s.m_entries.end())
+    {
+        erase(s, it);
+    }
+}
+
+void Attr_Cache::clear()
+{
+    for (SHARD & s : m_shards)
+    {
+        std::lock_guard<std::mutex> lock(s.m_mutex);
+
+        s.m_entries.clear();
+        s.m_expiry.clear();
+    }
+}
+
+void Attr_Cache::stats(uint64_t *hits, uint64_t *negative_hits, uint64_t *misses, size_t *entries)
+{
+    *hits           = 0;
+    *negative_hits  = 0;
+    *misses         = 0;
+    *entries        = 0;
+
+    for (SHARD & s : m_shards)
+    {
+        std::lock_guard<std::mutex> lock(s.m_mutex);
+
+        *hits           += s.m_hits;
+        *negative_hits  += s.m_negative_hits;
+        *misses         += s.m_misses;
+        *entries        += s.m_entries.size();
+    }
+}
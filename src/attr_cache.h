@@ -0,0 +1,177 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief In-memory file attribute cache
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#ifndef ATTR_CACHE_H
+#define ATTR_CACHE_H
+
+#pragma once
+
+#include "fileio.h"
+
+#include <unordered_map>
+#include <list>
+#include <mutex>
+
+#define ATTR_CACHE_SHARDS       16                                      /**< @brief Number of independently locked parts of the cache */
+#define ATTR_CACHE_MAX_ENTRIES  (64 * 1024)                             /**< @brief Max. number of entries per part */
+
+/**
+ * @brief The #Attr_Cache class
+ *
+ * Keeps the results of getattr calls for virtual files, so that a directory listing
+ * does not need to go to the transcoder cache for every file. Entries are found by
+ * virtual file path and expire after a fixed time. Entries for transcoded files also
+ * become invalid as soon as the source file changes (size, modification time or inode).
+ * Negative entries remember that a file does not exist.
+ *
+ * The cache is split into #ATTR_CACHE_SHARDS parts with separate locks, so parallel
+ * lookups of different files rarely wait for each other. All entries are kept for the
+ * same time, so each part keeps them in a list in order of expiry. A full part drops
+ * the head of that list.
+ */
+class Attr_Cache
+{
+    typedef std::list<const std::string *> EXPIRY_LIST;    /**< @brief Paths of the entries of a cache part, the one that expires first at the front */
+
+    typedef struct ATTR_ENTRY                       /**< @brief Cache entry */
+    {
+        struct stat     m_st;                       /**< @brief Attributes of virtual file as returned to FUSE */
+        VIRTUALTYPE     m_type;                     /**< @brief Type of virtual file */
+        std::string     m_origfile;                 /**< @brief Source file, empty if not to be checked */
+        time_t          m_src_mtime;                /**< @brief Modification time of source file */
+        off_t           m_src_size;                 /**< @brief Size of source file */
+        ino_t           m_src_ino;                  /**< @brief Inode of source file */
+        int             m_result;                   /**< @brief 0 for a valid entry, negative errno for a negative entry */
+        time_t          m_expires;                  /**< @brief Time after which the entry is discarded */
+        EXPIRY_LIST::iterator m_expiry_pos;         /**< @brief Position in the expiry list of the cache part */
+    } ATTR_ENTRY;
+
+    typedef std::unordered_map<std::string, ATTR_ENTRY> ATTR_MAP;  /**< @brief Entries by virtual file path */
+
+    typedef struct SHARD                            /**< @brief Independently locked part of the cache */
+    {
+        SHARD()
+            : m_hits(0)
+            , m_negative_hits(0)
+            , m_misses(0)
+        {}
+
+        std::mutex      m_mutex;                    /**< @brief Protects this part of the cache */
+        ATTR_MAP        m_entries;                  /**< @brief Entries by virtual file path */
+        EXPIRY_LIST     m_expiry;                   /**< @brief Keys of m_entries in order of expiry, points to the keys in the map */
+        uint64_t        m_hits;                     /**< @brief Number of lookups that returned attributes */
+        uint64_t        m_negative_hits;            /**< @brief Number of lookups that returned a negative entry */
+        uint64_t        m_misses;                   /**< @brief Number of lookups that found no valid entry */
+    } SHARD;
+
+public:
+    /**
+     * @brief Construct Attr_Cache object. The cache is disabled until init() is called.
+     */
+    explicit Attr_Cache();
+    /**
+     * @brief Destroy Attr_Cache object.
+     */
+    virtual ~Attr_Cache();
+
+    /**
+     * @brief Set time entries are kept.
+     * @param[in] timeout - Time in seconds, 0 disables the cache.
+     */
+    void            init(time_t timeout);
+    /**
+     * @brief Check if the cache is enabled.
+     * @return Returns true if enabled, false if not.
+     */
+    bool            enabled() const;
+    /**
+     * @brief Look up the attributes of a file.
+     * @param[in] virtfilepath - Virtual file path.
+     * @param[out] stbuf - Attributes of file, only set if a valid entry was found.
+     * @param[out] result - 0 if stbuf was set, negative errno for a negative entry.
+     * @return Returns true if a valid entry was found, false if not.
+     */
+    bool            lookup(const std::string & virtfilepath, struct stat *stbuf, int *result);
+    /**
+     * @brief Add attributes of a file.
+     * @param[in] virtfilepath - Virtual file path.
+     * @param[in] stbuf - Attributes of file as returned to FUSE.
+     * @param[in] type - Type of virtual file.
+     * @param[in] origfile - Source file to check for changes, empty if not to be checked.
+     * @param[in] src_st - Attributes of source file, ignored if origfile is empty.
+     */
+    void            insert(const std::string & virtfilepath, const struct stat *stbuf, VIRTUALTYPE type, const std::string & origfile, const struct stat *src_st);
+    /**
+     * @brief Remember that a file does not exist.
+     * @param[in] virtfilepath - Virtual file path.
+     * @param[in] result - Negative errno to return for this file.
+     */
+    void            insert_negative(const std::string & virtfilepath, int result);
+    /**
+     * @brief Remove a file from the cache.
+     * @param[in] virtfilepath - Virtual file path.
+     */
+    void            invalidate(const std::string & virtfilepath);
+    /**
+     * @brief Remove all entries.
+     */
+    void            clear();
+    /**
+     * @brief Get lookup statistics.
+     * @param[out] hits - Number of lookups that returned attributes.
+     * @param[out] negative_hits - Number of lookups that returned a negative entry.
+     * @param[out] misses - Number of lookups that found no valid entry.
+     * @param[out] entries - Number of entries currently cached.
+     */
+    void            stats(uint64_t *hits, uint64_t *negative_hits, uint64_t *misses, size_t *entries);
+
+protected:
+    /**
+     * @brief Get the part of the cache responsible for a file.
+     * @param[in] virtfilepath - Virtual file path.
+     * @return Returns the cache part.
+     */
+    SHARD &         shard(const std::string & virtfilepath);
+    /**
+     * @brief Add an entry, make room if the cache part is full.
+     * @param[in] virtfilepath - Virtual file path.
+     * @param[in] entry - Entry to add.
+     */
+    void            store(const std::string & virtfilepath, const ATTR_ENTRY & entry);
+    /**
+     * @brief Remove an entry.
+     * @note The mutex of the cache part must be locked by caller.
+     * @param[in] s - Cache part.
+     * @param[in] it - Entry to remove.
+     */
+    static void     erase(SHARD & s, ATTR_MAP::iterator it);
+
+protected:
+    time_t          m_timeout;                      /**< @brief Time in seconds entries are kept, 0 if disabled */
+    SHARD           m_shards[ATTR_CACHE_SHARDS];    /**< @brief Cache parts */
+};
+
+#endif // ATTR_CACHE_H
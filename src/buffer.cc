@@ -34,15 +34,148 @@
 
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <libgen.h>
+#include <iterator>
+#include <cstdint>
+#include <algorithm>
+#include <new>
+
+#define CACHE_INDEX_MAGIC   "FFCI"                  /**< @brief Magic bytes at start of cache index file */
+#define CACHE_INDEX_VERSION 1                       /**< @brief Version of cache index file format */
+#define CACHE_LOCK_MAGIC    "FFCL"                  /**< @brief Magic bytes at start of lock file */
+#define CACHE_COMPRESS_MAGIC "FFCZ"                 /**< @brief Magic bytes at start of compressed cache file */
+#define CACHE_COMPRESS_VERSION 1                    /**< @brief Version of compressed cache file format */
+
+/**
+ * @brief Progress of a cache file, published by the owner in the lock file
+ */
+typedef struct SHARED_PROGRESS
+{
+    char        m_magic[4];                         /**< @brief Magic bytes, #CACHE_LOCK_MAGIC */
+    uint32_t    m_state;                            /**< @brief One of SHARED_STATE_RUNNING, SHARED_STATE_FINISHED or SHARED_STATE_ABORTED */
+    uint64_t    m_filled;                           /**< @brief Bytes filled from the start of the file without a hole */
+    uint64_t    m_size;                             /**< @brief Final file size if finished, 0 otherwise */
+    int64_t     m_pid;                              /**< @brief Process ID of the owner */
+} SHARED_PROGRESS;
+
+/**
+ * @brief Header of a compressed cache file
+ *
+ * The header is followed by the compressed blocks. Blocks that do not get
+ * smaller are stored as they are. The block index at the end of the file holds
+ * the file offset of each block and the end of the last block.
+ */
+typedef struct COMPRESSED_HEADER
+{
+    char        m_magic[4];                         /**< @brief Magic bytes, #CACHE_COMPRESS_MAGIC */
+    uint32_t    m_version;                          /**< @brief Version of file format, #CACHE_COMPRESS_VERSION */
+    uint64_t    m_size;                             /**< @brief Uncompressed size */
+    uint32_t    m_block_size;                       /**< @brief Uncompressed size of one block */
+    uint32_t    m_blocks;                           /**< @brief Number of blocks */
+    uint64_t    m_index_offset;                     /**< @brief File offset of block index */
+} COMPRESSED_HEADER;
+
+/**
+ * @brief Read from a file until all data has been read.
+ * @param[in] fd - File handle.
+ * @param[out] data - Buffer to read to.
+ * @param[in] length - Number of bytes to read.
+ * @param[in] offset - File offset to read from.
+ * @return Returns true on success; false on error. If the file ends before, errno is set to EIO.
+ */
+static bool pread_all(int fd, void *data, size_t length, size_t offset)
+{
+    uint8_t *p = static_cast<uint8_t *>(data);
+
+    while (length)
+    {
+        ssize_t bytes = pread(fd, p, length, static_cast<off_t>(offset));
+
+        if (bytes <= 0)
+        {
+            if (bytes == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (!bytes)
+            {
+                errno = EIO;    // File has been truncated
+            }
+            return false;
+        }
+
+        p       += bytes;
+        offset  += static_cast<size_t>(bytes);
+        length  -= static_cast<size_t>(bytes);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Write to a file until all data has been written.
+ * @param[in] fd - File handle.
+ * @param[in] data - Data to write.
+ * @param[in] length - Number of bytes to write.
+ * @param[in] offset - File offset to write to.
+ * @return Returns true on success; false on error.
+ */
+static bool pwrite_all(int fd, const void *data, size_t length, size_t offset)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+
+    while (length)
+    {
+        ssize_t bytes = pwrite(fd, p, length, static_cast<off_t>(offset));
+
+        if (bytes <= 0)
+        {
+            if (bytes == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (!bytes)
+            {
+                errno = ENOSPC;
+            }
+            return false;
+        }
+
+        p       += bytes;
+        offset  += static_cast<size_t>(bytes);
+        length  -= static_cast<size_t>(bytes);
+    }
+
+    return true;
+}
 
 // Initially Buffer is empty. It will be allocated as needed.
-Buffer::Buffer()
-    : m_buffer_pos(0)
+Buffer::Buffer(const std::string & content_key, const std::string & settings_key, size_t stream_size)
+    : m_content_key(content_key)
+    , m_settings_key(settings_key)
+    , m_buffer_pos(0)
     , m_buffer_watermark(0)
     , m_is_open(false)
-    , m_buffer(nullptr)
+    , m_buffer_size(0)
     , m_fd(-1)
+    , m_lock_fd(-1)
+    , m_follower(false)
+    , m_shared_filled(0)
+    , m_resumable(false)
+    , m_finished(false)
+    , m_progress_seq(0)
+    , m_progress_waiters(0)
+    , m_compressed(false)
+    , m_block_fd(-1)
+    , m_uncompressed_size(0)
+    , m_block_size(0)
+    , m_raw_fd(-1)
+    , m_ram_reserved(0)
+    , m_stream_size(stream_size)
+#ifdef USE_LIBZSTD
+    , m_dctx(nullptr)
+#endif // USE_LIBZSTD
 {
 }
 
@@ -50,6 +183,12 @@ Buffer::Buffer()
 Buffer::~Buffer()
 {
     release();
+
+    end_ram_fill();
+
+#ifdef USE_LIBZSTD
+    ZSTD_freeDCtx(m_dctx);
+#endif // USE_LIBZSTD
 }
 
 VIRTUALTYPE Buffer::type() const
@@ -65,7 +204,9 @@ size_t Buffer::bufsize() const
 int Buffer::openX(const std::string & filename)
 {
     m_filename = filename;
-    make_cachefile_name(m_cachefile, filename, params.current_format(virtualfile())->desttype());
+    make_cachefile_name(m_cachefile, filename, params.current_format(virtualfile())->desttype(), m_content_key, m_settings_key);
+    m_indexfile = m_cachefile + ".idx";
+    m_lockfile = m_cachefile + ".lock";
     return 0;
 }
 
@@ -84,6 +225,57 @@ bool Buffer::init(bool erase_cache)
 
     try
     {
+        if (m_stream_size)
+        {
+            // Nothing goes to disk, the ring buffer is all there is
+            try
+            {
+                m_ring.resize(m_stream_size);
+            }
+            catch (std::bad_alloc &)
+            {
+                Logging::error(m_cachefile, "Error allocating stream buffer: Out of memory");
+                errno = ENOMEM;
+                throw false;
+            }
+
+            m_buffer_size       = 0;
+            m_buffer_pos        = 0;
+            m_buffer_watermark  = 0;
+            m_follower          = false;
+            m_ranges.clear();
+
+            Logging::debug(m_cachefile, "Streaming through a ring buffer of %1.", format_size(m_stream_size).c_str());
+            throw true;
+        }
+
+        if (ramcache != nullptr)
+        {
+            if (erase_cache)
+            {
+                ramcache->remove(m_cachefile);
+            }
+            else
+            {
+                m_ram = ramcache->lookup(m_cachefile);
+            }
+        }
+
+        if (m_ram != nullptr)
+        {
+            // Complete file in memory, no need to open the cache file
+            m_buffer_size       = m_ram->size();
+            m_buffer_pos        = m_ram->size();
+            m_buffer_watermark  = m_ram->size();
+            m_shared_filled     = 0;
+            m_follower          = false;
+            m_ranges.clear();
+            add_range(0, m_ram->size());
+
+            Logging::debug(m_cachefile, "Cache file is served from memory.");
+            throw true;
+        }
+
         // Create the path to the cache file
         char *cachefile = new_strdup(m_cachefile);
         if (cachefile == nullptr)
@@ -104,21 +296,34 @@ bool Buffer::init(bool erase_cache)
         delete [] cachefile;
 
         m_buffer_size = 0;
-        m_buffer = nullptr;
         m_buffer_pos = 0;
         m_buffer_watermark = 0;
+        m_shared_filled = 0;
+        m_finished = false;
+        m_ranges.clear();
 
-        if (erase_cache)
+        // If another instance is transcoding the file, only follow it and leave the file as it is
+        m_follower = !lock_cachefile();
+
+        if (erase_cache && !m_follower)
         {
             remove_cachefile();
             errno = 0;  // ignore this error
         }
 
+        if (!m_follower)
+        {
+            // Nobody else writes these files now, so they are left over from an
+            // interrupted compress() or index update, e.g. after a crash
+            remove_file(m_cachefile + ".tmp");
+            remove_file(m_indexfile + ".tmp");
+        }
+
         struct stat sb;
         size_t filesize;
-        void *p;
+        bool complete = false;
 
-        m_fd = ::open(m_cachefile.c_str(), O_CREAT | O_RDWR, static_cast<mode_t>(0644));
+        m_fd = ::open(m_cachefile.c_str(), O_CREAT | (m_follower ? O_RDONLY : O_RDWR), static_cast<mode_t>(0644));
         if (m_fd == -1)
         {
             Logging::error(m_cachefile, "Error opening cache file: (%1) %2", errno, strerror(errno));
@@ -137,6 +342,29 @@ bool Buffer::init(bool erase_cache)
             throw false;
         }
 
+        if (open_compressed())
+        {
+            // Only complete files are compressed, nothing to follow
+            Logging::debug(m_cachefile, "Cache file is compressed, %1 blocks.", m_block_offsets.size() - 1);
+            publish(SHARED_STATE_FINISHED);
+            throw true;
+        }
+        else if (errno)
+        {
+            throw false;
+        }
+
+        if (m_follower)
+        {
+            Logging::debug(m_cachefile, "Cache file is owned by another instance, following it.");
+            if (follow() == SHARED_STATE_ORPHANED && erase_cache)
+            {
+                // Owner has gone away in the meantime and left an incomplete file
+                clear();
+            }
+            throw true;
+        }
+
         if (!sb.st_size)
         {
             // If empty set file size to 1 page
@@ -152,18 +380,22 @@ bool Buffer::init(bool erase_cache)
         else
         {
             filesize = static_cast<size_t>(sb.st_size);
-            m_buffer_pos = m_buffer_watermark = filesize;
-        }
 
-        p = mmap(nullptr, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
-        if (p == MAP_FAILED)
-        {
-            Logging::error(m_cachefile,  "File mapping failed: (%1) %2 (fd = %3)", errno, strerror(errno), m_fd);
-            throw false;
+            if (!load_index(filesize))
+            {
+                // No index: File was completely written
+                add_range(0, filesize);
+                m_buffer_watermark = filesize;
+                m_finished = !m_follower;
+                complete = true;
+            }
+            m_buffer_pos = m_buffer_watermark;
         }
 
+        // Extents will be mapped on first access
         m_buffer_size = filesize;
-        m_buffer = static_cast<uint8_t*>(p);
+
+        publish(complete ? SHARED_STATE_FINISHED : SHARED_STATE_RUNNING);
     }
     catch (bool _success)
     {
@@ -177,6 +409,7 @@ bool Buffer::init(bool erase_cache)
                 ::close(m_fd);
                 m_fd = -1;
             }
+            unlock_cachefile();
         }
     }
 
@@ -193,34 +426,98 @@ bool Buffer::release(int flags /*= CLOSE_CACHE_NOOPT*/)
     {
         if (CACHE_CHECK_BIT(CLOSE_CACHE_DELETE, flags))
         {
-            remove_cachefile();
+            remove_unused(m_cachefile);
             errno = 0;  // ignore this error
         }
 
         return true;
     }
 
-    m_is_open       = false;
+    if (m_stream_size)
+    {
+        m_is_open           = false;
+        m_buffer_size       = 0;
+        m_buffer_pos        = 0;
+        m_buffer_watermark  = 0;
+        m_readers.clear();
+
+        // Free the memory now, not when the cache entry is deleted
+        std::vector<uint8_t>().swap(m_ring);
+
+        notify_progress();
+
+        return true;
+    }
+
+    if (m_ram != nullptr)
+    {
+        // The RAM cache writes the file back when it drops it
+        m_is_open       = false;
+        m_ram           = nullptr;
+        m_buffer_size   = 0;
+        m_buffer_pos    = 0;
+
+        close_compressed();
+        unlock_cachefile();
+
+        if (CACHE_CHECK_BIT(CLOSE_CACHE_DELETE, flags))
+        {
+            remove_unused(m_cachefile);
+            errno = 0;  // ignore this error
+        }
+
+        notify_progress();
+
+        return true;
+    }
+
+    if (m_follower)
+    {
+        // The file belongs to another instance, leave it alone
+        m_is_open       = false;
+
+        close_compressed();
+
+        ::close(m_fd);
+        m_fd            = -1;
+        m_buffer_size   = 0;
+        m_buffer_pos    = 0;
+        m_follower      = false;
+
+        unlock_cachefile();
+        notify_progress();
+
+        return true;
+    }
+
+    if (m_ram_fill != nullptr)
+    {
+        // Not finished, or not kept in memory: Keep what has been written for later
+        spill_ram();
+    }
 
     // Write it now to disk
     flush();
 
-    void *p         = m_buffer;
-    size_t size     = m_buffer_size;
+    m_is_open       = false;
+
     int fd          = m_fd;
 
-    m_buffer        = nullptr;
+    if (!unmap_extents())
+    {
+        success = false;
+    }
+
     m_buffer_size   = 0;
     m_buffer_pos    = 0;
     m_fd = -1;
 
-    if (munmap(p, size) == -1)
+    if (m_compressed)
     {
-        Logging::error(m_cachefile, "File unmapping failed: (%1) %2", errno, strerror(errno));
-        success = false;
+        // Compressed file has its final size already
+        close_compressed();
     }
-
-    if (ftruncate(fd, static_cast<off_t>(m_buffer_watermark)) == -1)
+    else if (ftruncate(fd, static_cast<off_t>(m_buffer_watermark)) == -1)
     {
         Logging::error(m_cachefile, "Error calling ftruncate() to resize and close the file: (%1) %2 (fd = %3)", errno, strerror(errno), fd);
         success = false;
@@ -231,14 +528,27 @@ bool Buffer::release(int flags /*= CLOSE_CACHE_NOOPT*/)
     if (CACHE_CHECK_BIT(CLOSE_CACHE_DELETE, flags))
     {
         remove_cachefile();
+        // Still holding the lock, nobody else can be using the lock file
+        remove_file(m_lockfile);
         errno = 0;  // ignore this error
     }
 
+    // Followers take over if the file is not complete
+    unlock_cachefile();
+
+    notify_progress();
+
     return success;
 }
 
 bool Buffer::remove_cachefile()
 {
+    if (ramcache != nullptr)
+    {
+        ramcache->remove(m_cachefile);
+    }
+
+    remove_file(m_indexfile);
     return remove_file(m_cachefile);
 }
 
@@ -246,38 +556,143 @@ bool Buffer::flush()
 {
     std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-    if (m_buffer != nullptr)
+    if (m_ram != nullptr || m_ram_fill != nullptr)
+    {
+        // Written back by the RAM cache
+        return true;
+    }
+
+    if (m_stream_size)
+    {
+        // Nothing goes to disk
+        return true;
+    }
+
+    if (m_fd == -1)
+    {
+        errno = EPERM;
+        return false;
+    }
+
+    if (m_follower || m_compressed)
+    {
+        // Nothing written here
+        return true;
+    }
+
+    for (std::list<size_t>::const_iterator it = m_extent_lru.cbegin(); it != m_extent_lru.cend(); ++it)
     {
-        if (msync(m_buffer, m_buffer_size, MS_SYNC) == -1)
+        size_t start = *it * CACHE_EXTENT_SIZE;
+
+        if (start >= m_buffer_size)
+        {
+            continue;
+        }
+
+        if (msync(m_extents[*it], std::min(static_cast<size_t>(CACHE_EXTENT_SIZE), m_buffer_size - start), MS_SYNC) == -1)
         {
             Logging::error(m_cachefile, "Could not sync to disk: (%1) %2", errno, strerror(errno));
             return false;
         }
     }
-    else
+
+    // Also write back extents that have already been unmapped. Only needed if the
+    // index is a checkpoint to resume from, for other files a crash loses everything
+    // anyway, as an incomplete file is transcoded again from the start.
+    if (m_resumable && !m_finished && fdatasync(m_fd) == -1)
     {
-        errno = EPERM;
+        Logging::error(m_cachefile, "Could not sync to disk: (%1) %2", errno, strerror(errno));
         return false;
     }
 
-    return true;
+    // Only save index after data has been written
+    return save_index(m_resumable);
+}
+
+void Buffer::set_resumable(bool resumable)
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    m_resumable = resumable;
+}
+
+bool Buffer::finish()
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    if (m_follower || m_stream_size || m_ram != nullptr)
+    {
+        // Not ours, or there is no index
+        return true;
+    }
+
+    m_finished = true;
+
+    if (m_ram_fill != nullptr)
+    {
+        // Index is removed by write_back() once the file is on disk
+        return true;
+    }
+
+    return save_index(false);
 }
 
 bool Buffer::clear()
 {
     std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-    if (m_buffer == nullptr)
+    if (m_stream_size)
+    {
+        // Readers that are still there start over
+        m_buffer_pos        = 0;
+        m_buffer_watermark  = 0;
+        m_buffer_size       = 0;
+        notify_progress();
+        return true;
+    }
+
+    if (m_ram != nullptr)
+    {
+        // Start again with the file on disk
+        m_ram       = nullptr;
+        m_is_open   = false;
+
+        close_compressed();
+        unlock_cachefile();
+
+        return init(true);
+    }
+
+    if (m_fd == -1)
     {
         errno = EBADF;
         return false;
     }
 
-    bool success = true;
+    if (m_follower)
+    {
+        // Only forget what has been seen so far, the file belongs to another instance
+        close_compressed();
+        m_buffer_pos        = 0;
+        m_buffer_watermark  = 0;
+        m_buffer_size       = 0;
+        m_ranges.clear();
+        return true;
+    }
+
+    bool success = unmap_extents();
+
+    // Start again with an uncompressed file, on disk until it is known to fit into memory
+    end_ram_fill();
+    m_finished = false;
+    close_compressed();
+    remove_file(m_indexfile);
 
     m_buffer_pos        = 0;
     m_buffer_watermark  = 0;
     m_buffer_size       = 0;
+    m_shared_filled     = 0;
+    m_ranges.clear();
 
     // If empty set file size to 1 page
     long filesize = sysconf (_SC_PAGESIZE);
@@ -291,90 +706,430 @@ bool Buffer::clear()
         }
     }
 
+    // Followers start again, too
+    publish(SHARED_STATE_RUNNING);
+
     return success;
 }
 
+void Buffer::discard(size_t offset)
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    m_ranges.clear();
+    add_range(0, offset);
+
+    if (m_buffer_watermark > offset)
+    {
+        m_buffer_watermark = offset;
+    }
+
+    if (m_shared_filled > offset)
+    {
+        publish(SHARED_STATE_RUNNING);
+    }
+}
+
 bool Buffer::reserve(size_t size)
-{    
+{
     std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-    if (m_buffer == nullptr)
+    if (m_stream_size)
+    {
+        // Only the size reported to the transcoder changes, the ring stays as it is
+        if (size)
+        {
+            m_buffer_size = size;
+        }
+        return true;
+    }
+
+    if (m_fd == -1)
     {
         errno = EBADF;
         return false;
     }
 
-    bool success = true;
+    if (m_follower || m_compressed)
+    {
+        errno = EPERM;
+        return false;
+    }
 
     if (!size)
     {
         size = m_buffer_size;
     }
 
-    m_buffer = static_cast<uint8_t*>(mremap (m_buffer, m_buffer_size, size, MREMAP_MAYMOVE));
-    if (m_buffer != nullptr)
+    if (m_ram_fill == nullptr && !m_buffer_watermark)
+    {
+        start_ram_fill(size);
+    }
+
+    if (m_ram_fill != nullptr)
     {
-        m_buffer_size = size;
+        if (size <= ramcache->max_file_size())
+        {
+            m_buffer_size = size;
+            return true;
+        }
+
+        // Too large for the RAM cache after all
+        if (!spill_ram())
+        {
+            return false;
+        }
     }
 
-    if (ftruncate(m_fd, static_cast<off_t>(m_buffer_size)) == -1)
+    // Only the file size changes, mapped extents stay where they are.
+    if (ftruncate(m_fd, static_cast<off_t>(size)) == -1)
     {
         Logging::error(m_cachefile, "Error calling ftruncate() to resize the file: (%1) %2 (fd = %3)", errno, strerror(errno), m_fd);
-        success = false;
+        return false;
     }
 
-    return ((m_buffer != nullptr) && success);
+    m_buffer_size = size;
+
+    return true;
 }
 
 size_t Buffer::write(const uint8_t* data, size_t length)
 {
     std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-    if (m_buffer == nullptr)
-    {
-        errno = EBADF;
-        return 0;
-    }
+    size_t written = write_at(m_buffer_pos, data, length);
 
-    uint8_t* write_ptr = write_prepare(length);
-    if (!write_ptr)
-    {
-        length = 0;
-    }
-    else
-    {
-        memcpy(write_ptr, data, length);
-        increment_pos(length);
-    }
+    increment_pos(written);
 
-    return length;
+    return written;
 }
 
-uint8_t* Buffer::write_prepare(size_t length)
+size_t Buffer::write_at(size_t offset, const uint8_t* data, size_t length)
 {
-    if (reallocate(m_buffer_pos + length))
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    if (m_stream_size)
     {
-        if (m_buffer_watermark < m_buffer_pos + length)
+        if (m_ring.empty())
         {
-            m_buffer_watermark = m_buffer_pos + length;
+            errno = EBADF;
+            return 0;
         }
-        return m_buffer + m_buffer_pos;
-    }
-    else
-    {
-        errno = ESPIPE;
-        return nullptr;
-    }
-}
 
-void Buffer::increment_pos(size_t increment)
-{
-    m_buffer_pos += increment;
-}
+        size_t end = std::max(m_buffer_watermark, offset + length);
+        size_t start = (end > m_stream_size) ? end - m_stream_size : 0;
 
-int Buffer::seek(long offset, int whence)
-{
-    if (m_buffer == nullptr)
+        if (offset < start)
+        {
+            // The data has already been dropped from the ring and may have been read.
+            // Only formats that never go back are streamed, so this is a bug: Fail
+            // rather than handing out a file with parts missing.
+            Logging::error(m_cachefile, "Cannot write to offset %1 of stream, it starts at %2 now.", offset, start);
+            errno = ESPIPE;
+            return 0;
+        }
+
+        copy_ring(offset, const_cast<uint8_t*>(data), length, true);
+
+        m_buffer_watermark = end;
+        if (m_buffer_size < end)
+        {
+            m_buffer_size = end;
+        }
+
+        notify_progress();
+
+        return length;
+    }
+
+    if (m_fd == -1)
+    {
+        errno = EBADF;
+        return 0;
+    }
+
+    if (m_follower || m_compressed)
+    {
+        errno = EPERM;
+        return 0;
+    }
+
+    if (m_ram_fill != nullptr)
+    {
+        bool fits = (offset + length <= ramcache->max_file_size());
+
+        if (fits && m_ram_reserved < offset + length)
+        {
+            // Larger than expected, the RAM cache may not have room for it
+            fits = ramcache->reserve(offset + length - m_ram_reserved);
+            if (fits)
+            {
+                m_ram_reserved = offset + length;
+            }
+        }
+
+        if (fits && m_ram_fill->size() < offset + length)
+        {
+            try
+            {
+                m_ram_fill->resize(offset + length);
+            }
+            catch (std::bad_alloc &)
+            {
+                fits = false;
+            }
+        }
+
+        if (fits)
+        {
+            memcpy(m_ram_fill->data() + offset, data, length);
+
+            if (m_buffer_watermark < offset + length)
+            {
+                m_buffer_watermark = offset + length;
+            }
+            if (m_buffer_size < offset + length)
+            {
+                m_buffer_size = offset + length;
+            }
+
+            // Not published, other instances cannot read it
+            add_range(offset, offset + length);
+            notify_progress();
+
+            return length;
+        }
+
+        // Larger than expected or out of memory, continue on disk
+        if (!spill_ram())
+        {
+            return 0;
+        }
+    }
+
+    if (!reallocate(offset + length) || !copy_extents(offset, const_cast<uint8_t*>(data), length, true))
+    {
+        errno = ESPIPE;
+        return 0;
+    }
+
+    if (m_buffer_watermark < offset + length)
+    {
+        m_buffer_watermark = offset + length;
+    }
+
+    add_range(offset, offset + length);
+    notify_progress();
+
+    if (filled() >= m_shared_filled + CACHE_SHARE_INTERVAL)
+    {
+        publish(SHARED_STATE_RUNNING);
+    }
+
+    return length;
+}
+
+uint8_t* Buffer::map_extent(size_t extent)
+{
+    if (extent >= m_extents.size())
+    {
+        m_extents.resize(extent + 1, nullptr);
+    }
+
+    if (m_extents[extent] != nullptr)
+    {
+        if (m_extent_lru.front() != extent)
+        {
+            m_extent_lru.remove(extent);
+            m_extent_lru.push_front(extent);
+        }
+        return m_extents[extent];
+    }
+
+    if (m_extent_lru.size() >= CACHE_MAX_EXTENTS)
+    {
+        // Unmap least recently used extent. Data stays in the page cache and will be written back by the kernel.
+        size_t lru = m_extent_lru.back();
+
+        if (munmap(m_extents[lru], CACHE_EXTENT_SIZE) == -1)
+        {
+            Logging::error(m_cachefile, "File unmapping failed: (%1) %2", errno, strerror(errno));
+        }
+
+        m_extents[lru] = nullptr;
+        m_extent_lru.pop_back();
+    }
+
+    // Extents may reach beyond the end of file. Only the part within the file is ever accessed.
+    void *p = mmap(nullptr, CACHE_EXTENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, static_cast<off_t>(extent * CACHE_EXTENT_SIZE));
+    if (p == MAP_FAILED)
+    {
+        Logging::error(m_cachefile, "File mapping failed: (%1) %2 (fd = %3)", errno, strerror(errno), m_fd);
+        return nullptr;
+    }
+
+    m_extents[extent] = static_cast<uint8_t*>(p);
+    m_extent_lru.push_front(extent);
+
+    return m_extents[extent];
+}
+
+bool Buffer::unmap_extents()
+{
+    bool success = true;
+
+    for (std::list<size_t>::const_iterator it = m_extent_lru.cbegin(); it != m_extent_lru.cend(); ++it)
+    {
+        if (munmap(m_extents[*it], CACHE_EXTENT_SIZE) == -1)
+        {
+            Logging::error(m_cachefile, "File unmapping failed: (%1) %2", errno, strerror(errno));
+            success = false;
+        }
+    }
+
+    m_extents.clear();
+    m_extent_lru.clear();
+
+    return success;
+}
+
+bool Buffer::copy_extents(size_t offset, uint8_t *data, size_t length, bool to_cache)
+{
+    while (length)
+    {
+        size_t extent_offset = offset % CACHE_EXTENT_SIZE;
+        size_t bytes = std::min(length, CACHE_EXTENT_SIZE - extent_offset);
+        uint8_t *p = map_extent(offset / CACHE_EXTENT_SIZE);
+
+        if (p == nullptr)
+        {
+            return false;
+        }
+
+        if (to_cache)
+        {
+            memcpy(p + extent_offset, data, bytes);
+        }
+        else
+        {
+            memcpy(data, p + extent_offset, bytes);
+        }
+
+        offset  += bytes;
+        data    += bytes;
+        length  -= bytes;
+    }
+
+    return true;
+}
+
+bool Buffer::save_index(bool sync)
+{
+    if (m_finished)
+    {
+        // Written from start to end, the file size tells all.
+        return remove_file(m_indexfile);
+    }
+
+    std::string tmpfile(m_indexfile + ".tmp");
+    FILE *fp = fopen(tmpfile.c_str(), "wb");
+    if (fp == nullptr)
+    {
+        Logging::error(m_indexfile, "Error creating index file: (%1) %2", errno, strerror(errno));
+        return false;
+    }
+
+    bool success = true;
+    uint32_t version = CACHE_INDEX_VERSION;
+    uint64_t count = m_ranges.size();
+
+    success &= (fwrite(CACHE_INDEX_MAGIC, 4, 1, fp) == 1);
+    success &= (fwrite(&version, sizeof(version), 1, fp) == 1);
+    success &= (fwrite(&count, sizeof(count), 1, fp) == 1);
+
+    for (std::map<size_t, size_t>::const_iterator it = m_ranges.cbegin(); it != m_ranges.cend() && success; ++it)
+    {
+        uint64_t range[2] = { it->first, it->second };
+
+        success &= (fwrite(range, sizeof(range), 1, fp) == 1);
+    }
+
+    success &= (fflush(fp) == 0 && (!sync || fsync(fileno(fp)) == 0));
+
+    fclose(fp);
+
+    // Replace old index atomically
+    if (!success || rename(tmpfile.c_str(), m_indexfile.c_str()) == -1)
+    {
+        Logging::error(m_indexfile, "Error writing index file: (%1) %2", errno, strerror(errno));
+        remove_file(tmpfile);
+        return false;
+    }
+
+    return true;
+}
+
+bool Buffer::load_index(size_t filesize)
+{
+    FILE *fp = fopen(m_indexfile.c_str(), "rb");
+    if (fp == nullptr)
+    {
+        errno = 0;  // Not an error
+        return false;
+    }
+
+    bool success = true;
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+
+    success &= (fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, CACHE_INDEX_MAGIC, sizeof(magic)));
+    success &= (fread(&version, sizeof(version), 1, fp) == 1 && version == CACHE_INDEX_VERSION);
+    success &= (fread(&count, sizeof(count), 1, fp) == 1);
+
+    for (uint64_t n = 0; n < count && success; n++)
+    {
+        uint64_t range[2];
+
+        success &= (fread(range, sizeof(range), 1, fp) == 1);
+
+        // Ignore anything the cache file does not contain (e.g. lost in a crash)
+        if (success && range[0] < filesize)
+        {
+            size_t end = static_cast<size_t>(std::min(range[1], static_cast<uint64_t>(filesize)));
+
+            add_range(static_cast<size_t>(range[0]), end);
+
+            if (m_buffer_watermark < end)
+            {
+                m_buffer_watermark = end;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    if (!success)
+    {
+        Logging::warning(m_indexfile, "Index file is invalid, ignoring it.");
+        m_ranges.clear();
+        m_buffer_watermark = 0;
+        return false;
+    }
+
+    Logging::debug(m_cachefile, "Loaded index with %1 filled range(s), %2 bytes.", m_ranges.size(), m_buffer_watermark);
+
+    return true;
+}
+
+void Buffer::increment_pos(size_t increment)
+{
+    m_buffer_pos += increment;
+}
+
+int Buffer::seek(long offset, int whence)
+{
+    if (m_fd == -1 && m_ram == nullptr && m_ring.empty())
     {
         errno = EBADF;
         return -1;
@@ -419,6 +1174,7 @@ int Buffer::seek(long offset, int whence)
     }
 
     m_buffer_pos = static_cast<uint64_t>(seek_pos);
+    notify_progress();
     return 0;
 }
 
@@ -442,11 +1198,65 @@ size_t Buffer::buffer_watermark() const
     return m_buffer_watermark;
 }
 
+int Buffer::fd() const
+{
+    // Data must be decompressed first, or is not in the file yet
+    return (m_compressed || m_ram_fill != nullptr) ? -1 : m_fd;
+}
+
 bool Buffer::copy(uint8_t* out_data, size_t offset, size_t bufsize)
 {
-    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+    std::unique_lock<std::recursive_mutex> lck (m_mutex);
+
+    if (m_ram != nullptr)
+    {
+        if (m_ram->size() < offset)
+        {
+            errno = ENOMEM;
+            return false;
+        }
+
+        memcpy(out_data, m_ram->data() + offset, std::min(bufsize, m_ram->size() - offset));
+        return true;
+    }
+
+    if (m_ram_fill != nullptr)
+    {
+        if (size() < offset)
+        {
+            errno = ENOMEM;
+            return false;
+        }
+
+        // Reserved but not yet written is zero, same as in the file
+        size_t bytes = std::min(bufsize, size() - offset);
+        size_t avail = (m_ram_fill->size() > offset) ? std::min(bytes, m_ram_fill->size() - offset) : 0;
+
+        memcpy(out_data, m_ram_fill->data() + offset, avail);
+        memset(out_data + avail, 0, bytes - avail);
+        return true;
+    }
+
+    if (m_stream_size)
+    {
+        if (m_ring.empty())
+        {
+            errno = EBADF;
+            return false;
+        }
+
+        if (offset < stream_start() || offset > m_buffer_watermark)
+        {
+            // Dropped from the ring or not written yet
+            errno = ESPIPE;
+            return false;
+        }
+
+        copy_ring(offset, out_data, std::min(bufsize, m_buffer_watermark - offset), false);
+        return true;
+    }
 
-    if (m_buffer == nullptr)
+    if (m_fd == -1)
     {
         errno = EBADF;
         return false;
@@ -454,14 +1264,35 @@ bool Buffer::copy(uint8_t* out_data, size_t offset, size_t bufsize)
 
     bool success = true;
 
-    if (size() >= offset && m_buffer != nullptr)
+    if (size() >= offset)
     {
         if (size() < offset + bufsize)
         {
-            bufsize = size() - offset - 1;
+            bufsize = size() - offset;
         }
 
-        memcpy(out_data, m_buffer + offset, bufsize);
+        if (m_compressed)
+        {
+            // Decompressing needs only the block cache, do not hold up everyone else using the buffer
+            std::lock_guard<std::mutex> block_lck (m_block_mutex);
+
+            lck.unlock();
+
+            success = copy_compressed(offset, out_data, bufsize);
+        }
+        else if (m_follower)
+        {
+            // The owner may shrink the file at any time, mapping it could end up in SIGBUS.
+            success = pread_all(m_fd, out_data, bufsize, offset);
+            if (!success)
+            {
+                Logging::error(m_cachefile, "Error reading cache file: (%1) %2", errno, strerror(errno));
+            }
+        }
+        else
+        {
+            success = copy_extents(offset, out_data, bufsize, false);
+        }
     }
     else
     {
@@ -472,40 +1303,1126 @@ bool Buffer::copy(uint8_t* out_data, size_t offset, size_t bufsize)
     return success;
 }
 
-bool Buffer::reallocate(size_t newsize)
+bool Buffer::is_filled(size_t offset, size_t len)
 {
-    if (newsize > size())
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    if (!len)
     {
-        size_t oldsize = size();
+        return true;
+    }
 
-        if (!reserve(newsize))
-        {
-            return false;
-        }
+    if (m_stream_size)
+    {
+        return (offset >= stream_start() && offset + len <= m_buffer_watermark);
+    }
 
-        Logging::trace(m_filename, "Buffer reallocate: %1 -> %2.", oldsize, newsize);
+    // Find the last range starting at or before offset
+    std::map<size_t, size_t>::const_iterator it = m_ranges.upper_bound(offset);
+    if (it == m_ranges.cbegin())
+    {
+        return false;
     }
-    return true;
-}
 
-const std::string & Buffer::filename() const
-{
-    return m_filename;
-}
+    --it;
 
-const std::string & Buffer::cachefile() const
-{
-    return m_cachefile;
+    return (it->second >= offset + len);
 }
 
-const std::string & Buffer::make_cachefile_name(std::string & cachefile, const std::string & filename, const std::string & desttype)
+size_t Buffer::find_hole(size_t offset, size_t *hole_end)
 {
-    transcoder_cache_path(cachefile);
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-    cachefile += params.m_mountpath;
-    cachefile += filename;
-    cachefile += ".cache.";
-    cachefile += desttype;
+    std::map<size_t, size_t>::const_iterator it = m_ranges.upper_bound(offset);
+    if (it != m_ranges.cbegin())
+    {
+        std::map<size_t, size_t>::const_iterator prev = std::prev(it);
+        if (prev->second > offset)
+        {
+            // Offset is inside a filled range, the hole starts at its end
+            offset = prev->second;
+        }
+    }
+
+    *hole_end = (it != m_ranges.cend()) ? it->first : SIZE_MAX;
+
+    return offset;
+}
+
+void Buffer::add_range(size_t start, size_t end)
+{
+    if (start >= end)
+    {
+        return;
+    }
+
+    std::map<size_t, size_t>::iterator it = m_ranges.upper_bound(start);
+    if (it != m_ranges.begin() && std::prev(it)->second >= start)
+    {
+        // Overlaps or touches the previous range: extend it. This is the
+        // common case when writing sequentially.
+        it = std::prev(it);
+        if (it->second >= end)
+        {
+            return;
+        }
+        it->second = end;
+    }
+    else
+    {
+        it = m_ranges.emplace_hint(it, start, end);
+    }
+
+    // Merge with following ranges that are now covered
+    std::map<size_t, size_t>::iterator next = std::next(it);
+    while (next != m_ranges.end() && next->first <= it->second)
+    {
+        if (next->second > it->second)
+        {
+            it->second = next->second;
+        }
+        next = m_ranges.erase(next);
+    }
+}
+
+unsigned int Buffer::progress_seq() const
+{
+    return m_progress_seq;
+}
+
+void Buffer::notify_progress()
+{
+    std::lock_guard<std::mutex> lck(m_progress_mutex);
+
+    m_progress_seq++;
+
+    if (m_progress_waiters)
+    {
+        // Only take the time stamp if someone is actually waiting
+        m_progress_time = std::chrono::steady_clock::now();
+        m_progress_cond.notify_all();
+    }
+}
+
+bool Buffer::wait_progress(unsigned int seq, std::chrono::milliseconds timeout, int64_t *latency)
+{
+    std::unique_lock<std::mutex> lck(m_progress_mutex);
+
+    if (latency != nullptr)
+    {
+        *latency = 0;
+    }
+
+    if (m_progress_seq != seq)
+    {
+        // Progressed since the snapshot was taken, no need to sleep
+        return true;
+    }
+
+    m_progress_waiters++;
+    bool progressed = m_progress_cond.wait_for(lck, timeout, [this, seq] { return m_progress_seq != seq; });
+    m_progress_waiters--;
+
+    if (progressed && latency != nullptr)
+    {
+        *latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_progress_time).count();
+    }
+
+    return progressed;
+}
+
+size_t Buffer::filled() const
+{
+    if (m_ranges.empty() || m_ranges.cbegin()->first)
+    {
+        return 0;
+    }
+
+    return m_ranges.cbegin()->second;
+}
+
+bool Buffer::is_follower() const
+{
+    return m_follower;
+}
+
+bool Buffer::is_stream() const
+{
+    return (m_stream_size != 0);
+}
+
+size_t Buffer::stream_start() const
+{
+    if (!m_stream_size || m_buffer_watermark <= m_stream_size)
+    {
+        return 0;
+    }
+
+    return m_buffer_watermark - m_stream_size;
+}
+
+void Buffer::stream_read(const void *reader, size_t offset)
+{
+    bool advanced;
+
+    {
+        std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+        std::map<const void *, STREAM_READER>::iterator it = m_readers.find(reader);
+
+        advanced = (it == m_readers.end() || it->second.m_pos < offset);
+
+        STREAM_READER & stream_reader = m_readers[reader];
+
+        stream_reader.m_pos     = offset;
+        stream_reader.m_time    = time(nullptr);
+    }
+
+    if (advanced)
+    {
+        // Transcoder may be waiting for room in the ring
+        notify_progress();
+    }
+}
+
+void Buffer::stream_detach(const void *reader)
+{
+    {
+        std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+        if (!m_readers.erase(reader))
+        {
+            return;
+        }
+    }
+
+    notify_progress();
+}
+
+bool Buffer::stream_sole_reader(const void *reader)
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    for (std::map<const void *, STREAM_READER>::const_iterator it = m_readers.cbegin(); it != m_readers.cend(); ++it)
+    {
+        if (it->first != reader)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Buffer::stream_full()
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    time_t now = time(nullptr);
+    size_t active = SIZE_MAX;
+    size_t idle = SIZE_MAX;
+
+    for (std::map<const void *, STREAM_READER>::const_iterator it = m_readers.cbegin(); it != m_readers.cend(); ++it)
+    {
+        if (now - it->second.m_time < STREAM_READER_IDLE)
+        {
+            active = std::min(active, it->second.m_pos);
+        }
+        else
+        {
+            idle = std::min(idle, it->second.m_pos);
+        }
+    }
+
+    size_t pos = (active != SIZE_MAX) ? active : idle;
+
+    if (pos == SIZE_MAX)
+    {
+        // Nobody has read anything yet, keep the start of the file
+        pos = 0;
+    }
+
+    size_t backlog = m_stream_size / STREAM_BACKLOG_SHARE;
+    size_t keep = (pos > backlog) ? pos - backlog : 0;
+
+    // Writing another backlog must not overwrite anything from keep on
+    return (m_buffer_watermark + backlog > keep + m_stream_size);
+}
+
+SHARED_STATE Buffer::follow()
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    if (!m_follower)
+    {
+        return SHARED_STATE_NONE;
+    }
+
+    if (m_compressed)
+    {
+        return SHARED_STATE_FINISHED;
+    }
+
+    SHARED_PROGRESS progress;
+    SHARED_STATE state = SHARED_STATE_RUNNING;
+
+    if (pread(m_lock_fd, &progress, sizeof(progress), 0) == static_cast<ssize_t>(sizeof(progress)) && !memcmp(progress.m_magic, CACHE_LOCK_MAGIC, sizeof(progress.m_magic)))
+    {
+        state = static_cast<SHARED_STATE>(progress.m_state);
+    }
+    else
+    {
+        // Owner has not published anything yet
+        memset(&progress, 0, sizeof(progress));
+    }
+
+    if (state != SHARED_STATE_FINISHED && flock(m_lock_fd, LOCK_EX | LOCK_NB) == 0)
+    {
+        // Lock is free: The owner has gone away before the file was complete
+        flock(m_lock_fd, LOCK_UN);
+
+        if (take_over())
+        {
+            Logging::info(m_cachefile, "Owner of cache file has gone away, taking over.");
+            return SHARED_STATE_ORPHANED;
+        }
+        // Another instance has been quicker, follow that one.
+        return SHARED_STATE_RUNNING;
+    }
+
+    struct stat sb_path;
+    struct stat sb_fd;
+
+    if (fstat(m_fd, &sb_fd) == -1)
+    {
+        Logging::error(m_cachefile, "File stat failed: (%1) %2 (fd = %3)", errno, strerror(errno), m_fd);
+        return SHARED_STATE_ABORTED;
+    }
+
+    // A finished file may have been replaced by a compressed copy, the open one still has the data
+    if (state != SHARED_STATE_FINISHED && stat(m_cachefile.c_str(), &sb_path) == 0 && (sb_path.st_ino != sb_fd.st_ino || sb_path.st_dev != sb_fd.st_dev))
+    {
+        // Owner has started again with a new file
+        int fd = ::open(m_cachefile.c_str(), O_RDONLY);
+        if (fd != -1)
+        {
+            ::close(m_fd);
+            m_fd = fd;
+            fstat(m_fd, &sb_fd);
+        }
+        progress.m_filled = 0;
+    }
+
+    size_t filled = static_cast<size_t>(std::min(progress.m_filled, static_cast<uint64_t>(sb_fd.st_size)));
+
+    if (filled < m_buffer_watermark)
+    {
+        // Owner has started again
+        m_ranges.clear();
+        m_buffer_watermark = 0;
+    }
+
+    if (filled != m_buffer_watermark || state == SHARED_STATE_FINISHED)
+    {
+        add_range(0, filled);
+        m_buffer_watermark  = filled;
+        m_buffer_size       = (state == SHARED_STATE_FINISHED) ? static_cast<size_t>(std::min(progress.m_size, static_cast<uint64_t>(sb_fd.st_size))) : filled;
+        notify_progress();
+    }
+
+    return state;
+}
+
+void Buffer::publish(SHARED_STATE state)
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    if (m_follower || m_lock_fd == -1 || m_ram_fill != nullptr)
+    {
+        // Data in memory is published by write_back()
+        return;
+    }
+
+    SHARED_PROGRESS progress;
+
+    memcpy(progress.m_magic, CACHE_LOCK_MAGIC, sizeof(progress.m_magic));
+    progress.m_state    = static_cast<uint32_t>(state);
+    progress.m_filled   = filled();
+    progress.m_size     = (state == SHARED_STATE_FINISHED) ? m_buffer_watermark : 0;
+    progress.m_pid      = getpid();
+
+    if (pwrite(m_lock_fd, &progress, sizeof(progress), 0) != static_cast<ssize_t>(sizeof(progress)))
+    {
+        Logging::warning(m_lockfile, "Could not publish progress to other instances: (%1) %2", errno, strerror(errno));
+        return;
+    }
+
+    m_shared_filled = progress.m_filled;
+}
+
+bool Buffer::lock_cachefile()
+{
+    for (;;)
+    {
+        m_lock_fd = ::open(m_lockfile.c_str(), O_CREAT | O_RDWR, static_cast<mode_t>(0644));
+        if (m_lock_fd == -1)
+        {
+            Logging::warning(m_lockfile, "Cannot open lock file, cache file will not be shared: (%1) %2", errno, strerror(errno));
+            errno = 0;
+            return true;
+        }
+
+        if (flock(m_lock_fd, LOCK_EX | LOCK_NB) == -1)
+        {
+            if (errno == EWOULDBLOCK)
+            {
+                // Keep the file open to check later if the owner is still there
+                errno = 0;
+                return false;
+            }
+
+            Logging::warning(m_lockfile, "Cannot lock cache file, cache file will not be shared: (%1) %2", errno, strerror(errno));
+            unlock_cachefile();
+            errno = 0;
+            return true;
+        }
+
+        // Make sure the lock file has not been removed by its last owner while we were locking it
+        struct stat sb_path;
+        struct stat sb_fd;
+
+        if (stat(m_lockfile.c_str(), &sb_path) == 0 && fstat(m_lock_fd, &sb_fd) == 0 && sb_path.st_ino == sb_fd.st_ino && sb_path.st_dev == sb_fd.st_dev)
+        {
+            return true;
+        }
+
+        unlock_cachefile();
+    }
+}
+
+void Buffer::unlock_cachefile()
+{
+    if (m_lock_fd != -1)
+    {
+        // Closing the file releases the lock
+        ::close(m_lock_fd);
+        m_lock_fd = -1;
+    }
+}
+
+bool Buffer::take_over()
+{
+    unlock_cachefile();
+
+    if (!lock_cachefile())
+    {
+        return false;
+    }
+
+    int fd = ::open(m_cachefile.c_str(), O_CREAT | O_RDWR, static_cast<mode_t>(0644));
+    if (fd == -1)
+    {
+        Logging::error(m_cachefile, "Error opening cache file: (%1) %2", errno, strerror(errno));
+        // Keep following, maybe another instance can do better
+        unlock_cachefile();
+        m_lock_fd = ::open(m_lockfile.c_str(), O_RDONLY);
+        return false;
+    }
+
+    struct stat sb;
+    size_t filesize = 0;
+
+    if (fstat(fd, &sb) == 0)
+    {
+        filesize = static_cast<size_t>(sb.st_size);
+    }
+
+    ::close(m_fd);
+    m_fd                = fd;
+    m_follower          = false;
+    m_finished          = false;
+
+    // Keep what the last owner has written
+    m_buffer_watermark  = std::min(filled(), filesize);
+    m_ranges.clear();
+    add_range(0, m_buffer_watermark);
+    m_buffer_size       = std::max(filesize, m_buffer_watermark);
+    m_buffer_pos        = m_buffer_watermark;
+
+    publish(SHARED_STATE_RUNNING);
+
+    return true;
+}
+
+bool Buffer::compress()
+{
+#ifdef USE_LIBZSTD
+    std::string tmpfile(m_cachefile + ".tmp");
+    size_t size;
+    int in_fd;
+    int out_fd;
+
+    {
+        std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+        if (m_fd == -1 || m_follower || m_compressed)
+        {
+            errno = EPERM;
+            return false;
+        }
+
+        if (m_ram_fill != nullptr && !spill_ram())
+        {
+            return false;
+        }
+
+        size = m_buffer_watermark;
+
+        if (!is_filled(0, size))
+        {
+            Logging::error(m_cachefile, "Cannot compress incomplete cache file.");
+            errno = EINVAL;
+            return false;
+        }
+
+        // Data is read through a separate handle, make sure it is on disk
+        if (!flush())
+        {
+            return false;
+        }
+
+        in_fd = dup(m_fd);
+        if (in_fd == -1)
+        {
+            Logging::error(m_cachefile, "Error opening cache file: (%1) %2", errno, strerror(errno));
+            return false;
+        }
+    }
+
+    out_fd = ::open(tmpfile.c_str(), O_CREAT | O_TRUNC | O_RDWR, static_cast<mode_t>(0644));
+    if (out_fd == -1)
+    {
+        Logging::error(tmpfile, "Error creating compressed cache file: (%1) %2", errno, strerror(errno));
+        ::close(in_fd);
+        return false;
+    }
+
+    // The file is complete and will not change: Compress without holding the lock so readers are not held up.
+    bool success = write_compressed(in_fd, size, out_fd);
+
+    ::close(in_fd);
+
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    try
+    {
+        if (!success)
+        {
+            throw false;
+        }
+
+        if (m_fd == -1 || m_buffer_watermark != size || !is_filled(0, size))
+        {
+            Logging::debug(m_cachefile, "Cache file has changed while compressing it, keeping it uncompressed.");
+            throw false;
+        }
+
+        if (rename(tmpfile.c_str(), m_cachefile.c_str()) == -1)
+        {
+            Logging::error(m_cachefile, "Error replacing cache file: (%1) %2", errno, strerror(errno));
+            throw false;
+        }
+
+        unmap_extents();
+        // fd() may have handed out the old file for a read that is still going on
+        m_raw_fd = m_fd;
+        m_fd = out_fd;
+
+        // A compressed file is always complete
+        remove_file(m_indexfile);
+
+        if (!open_compressed())
+        {
+            // Go on with the uncompressed data, it is still open
+            Logging::error(m_cachefile, "Compressed cache file cannot be read back.");
+            ::close(m_fd);
+            m_fd = m_raw_fd;
+            m_raw_fd = -1;
+            out_fd = -1;
+            throw false;
+        }
+    }
+    catch (bool _success)
+    {
+        if (out_fd != -1 && m_fd != out_fd)
+        {
+            ::close(out_fd);
+            remove_file(tmpfile);
+        }
+        return _success;
+    }
+
+    struct stat sb;
+
+    if (fstat(m_fd, &sb) == 0)
+    {
+        Logging::debug(m_cachefile, "Compressed cache file from %1 to %2.", format_size(size).c_str(), format_size(static_cast<size_t>(sb.st_size)).c_str());
+    }
+
+    return true;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif // !USE_LIBZSTD
+}
+
+bool Buffer::is_compressed() const
+{
+    return m_compressed;
+}
+
+size_t Buffer::disk_size()
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    if (m_compressed && m_fd != -1)
+    {
+        struct stat sb;
+
+        if (fstat(m_fd, &sb) == 0)
+        {
+            return static_cast<size_t>(sb.st_size);
+        }
+    }
+
+    return m_buffer_watermark;
+}
+
+void Buffer::copy_ring(size_t offset, uint8_t *data, size_t length, bool to_ring)
+{
+    while (length)
+    {
+        size_t pos = offset % m_stream_size;
+        size_t bytes = std::min(length, m_stream_size - pos);
+
+        if (to_ring)
+        {
+            memcpy(&m_ring[pos], data, bytes);
+        }
+        else
+        {
+            memcpy(data, &m_ring[pos], bytes);
+        }
+
+        offset  += bytes;
+        data    += bytes;
+        length  -= bytes;
+    }
+}
+
+bool Buffer::keep_in_ram()
+{
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    if (m_ram_fill == nullptr)
+    {
+        return false;
+    }
+
+    size_t size = m_buffer_watermark;
+
+    if (!size || size > ramcache->max_file_size() || !is_filled(0, size))
+    {
+        spill_ram();
+        return false;
+    }
+
+    int fd = dup(m_fd);
+    if (fd == -1)
+    {
+        Logging::error(m_cachefile, "Error opening cache file: (%1) %2", errno, strerror(errno));
+        spill_ram();
+        return false;
+    }
+
+    // The RAM cache keeps the file locked until it has been written
+    int lock_fd = (m_lock_fd != -1) ? dup(m_lock_fd) : -1;
+
+    // Drop what has been reserved but not used
+    m_ram_fill->resize(size);
+
+    ramcache->insert(m_cachefile, m_ram_fill, fd, lock_fd, m_ram_reserved);
+
+    m_raw_fd = m_fd;
+    m_fd = -1;
+    m_ram = m_ram_fill;
+    m_ram_fill = nullptr;
+    m_ram_reserved = 0;
+
+    Logging::debug(m_cachefile, "Keeping %1 in memory.", format_size(size).c_str());
+
+    return true;
+}
+
+bool Buffer::start_ram_fill(size_t size)
+{
+    if (ramcache == nullptr || !size || size > ramcache->max_file_size())
+    {
+        return false;
+    }
+
+    if (!ramcache->reserve(size))
+    {
+        Logging::debug(m_cachefile, "No room in the RAM cache, writing %1 to disk.", format_size(size).c_str());
+        return false;
+    }
+
+    m_ram_reserved = size;
+
+    try
+    {
+        m_ram_fill = std::make_shared<std::vector<uint8_t>>();
+        m_ram_fill->reserve(size);
+    }
+    catch (std::bad_alloc &)
+    {
+        end_ram_fill();
+        return false;
+    }
+
+    // Index without ranges: If ffmpegfs ends before the file has been written, it is known to be empty
+    if (!save_index(true))
+    {
+        end_ram_fill();
+        return false;
+    }
+
+    Logging::debug(m_cachefile, "Expected to fit into the RAM cache, writing %1 to memory.", format_size(size).c_str());
+
+    return true;
+}
+
+void Buffer::end_ram_fill()
+{
+    m_ram_fill = nullptr;
+
+    if (m_ram_reserved && ramcache != nullptr)
+    {
+        ramcache->unreserve(m_ram_reserved);
+        m_ram_reserved = 0;
+    }
+}
+
+bool Buffer::spill_ram()
+{
+    std::shared_ptr<std::vector<uint8_t>> data = m_ram_fill;
+    size_t size = m_buffer_size;
+
+    end_ram_fill();
+
+    if (ftruncate(m_fd, static_cast<off_t>(size)) == -1)
+    {
+        Logging::error(m_cachefile, "Error calling ftruncate() to resize the file: (%1) %2 (fd = %3)", errno, strerror(errno), m_fd);
+        return false;
+    }
+
+    if (!copy_extents(0, data->data(), std::min(data->size(), size), true))
+    {
+        return false;
+    }
+
+    Logging::debug(m_cachefile, "Writing %1 from memory to the cache file.", format_size(data->size()).c_str());
+
+    publish(SHARED_STATE_RUNNING);
+
+    return true;
+}
+
+bool Buffer::write_back(const std::string & cachefile, const RAM_DATA & data, int fd, int lock_fd)
+{
+    bool success = pwrite_all(fd, data->data(), data->size(), 0) &&
+            ftruncate(fd, static_cast<off_t>(data->size())) != -1 &&
+            fdatasync(fd) != -1;
+
+    if (success)
+    {
+        // The file is complete, so it has no index
+        remove_file(cachefile + ".idx");
+    }
+    else
+    {
+        Logging::error(cachefile, "Could not write back cache file: (%1) %2", errno, strerror(errno));
+    }
+
+    if (lock_fd != -1)
+    {
+        if (success)
+        {
+            SHARED_PROGRESS progress;
+
+            memcpy(progress.m_magic, CACHE_LOCK_MAGIC, sizeof(progress.m_magic));
+            progress.m_state    = static_cast<uint32_t>(SHARED_STATE_FINISHED);
+            progress.m_filled   = data->size();
+            progress.m_size     = data->size();
+            progress.m_pid      = getpid();
+
+            if (pwrite(lock_fd, &progress, sizeof(progress), 0) != static_cast<ssize_t>(sizeof(progress)))
+            {
+                Logging::warning(cachefile + ".lock", "Could not publish progress to other instances: (%1) %2", errno, strerror(errno));
+            }
+        }
+
+        // Closing the file releases the lock. If the file could not be written, another instance takes over.
+        ::close(lock_fd);
+    }
+
+    ::close(fd);
+
+    return success;
+}
+
+bool Buffer::open_compressed()
+{
+    std::lock_guard<std::mutex> block_lck (m_block_mutex);
+    COMPRESSED_HEADER header;
+    struct stat sb;
+
+    if (fstat(m_fd, &sb) == -1 ||
+            static_cast<size_t>(sb.st_size) < sizeof(header) ||
+            !pread_all(m_fd, &header, sizeof(header), 0) ||
+            memcmp(header.m_magic, CACHE_COMPRESS_MAGIC, sizeof(header.m_magic)))
+    {
+        // Not compressed
+        errno = 0;
+        return false;
+    }
+
+    try
+    {
+#ifdef USE_LIBZSTD
+        uint64_t blocks = header.m_block_size ? (header.m_size + header.m_block_size - 1) / header.m_block_size : 0;
+
+        if (header.m_version != CACHE_COMPRESS_VERSION || !header.m_block_size || header.m_blocks != blocks ||
+                header.m_index_offset + (blocks + 1) * sizeof(uint64_t) > static_cast<uint64_t>(sb.st_size))
+        {
+            Logging::error(m_cachefile, "Compressed cache file is damaged.");
+            errno = EIO;
+            throw false;
+        }
+
+        m_block_offsets.resize(static_cast<size_t>(blocks + 1));
+
+        if (!pread_all(m_fd, m_block_offsets.data(), m_block_offsets.size() * sizeof(uint64_t), static_cast<size_t>(header.m_index_offset)))
+        {
+            Logging::error(m_cachefile, "Error reading block index: (%1) %2", errno, strerror(errno));
+            throw false;
+        }
+
+        if (m_dctx == nullptr)
+        {
+            m_dctx = ZSTD_createDCtx();
+            if (m_dctx == nullptr)
+            {
+                Logging::error(m_cachefile, "Error opening compressed cache file: Out of memory");
+                errno = ENOMEM;
+                throw false;
+            }
+        }
+
+        m_compressed        = true;
+        m_block_fd          = m_fd;
+        m_uncompressed_size = static_cast<size_t>(header.m_size);
+        m_block_size        = header.m_block_size;
+        m_blocks.clear();
+
+        m_buffer_size       = static_cast<size_t>(header.m_size);
+        m_buffer_watermark  = m_buffer_size;
+        m_buffer_pos        = m_buffer_size;
+        m_ranges.clear();
+        add_range(0, m_buffer_size);
+#else
+        Logging::error(m_cachefile, "Cache file is compressed, but ffmpegfs has been built without libzstd.");
+        errno = ENOTSUP;
+        throw false;
+#endif // !USE_LIBZSTD
+    }
+    catch (bool _success)
+    {
+        m_block_offsets.clear();
+        return _success;
+    }
+
+    return true;
+}
+
+void Buffer::close_compressed()
+{
+    // Wait for copy() to finish reading blocks
+    std::lock_guard<std::mutex> block_lck (m_block_mutex);
+
+    if (m_raw_fd != -1)
+    {
+        ::close(m_raw_fd);
+        m_raw_fd = -1;
+    }
+
+    m_compressed = false;
+    m_block_fd = -1;
+    m_uncompressed_size = 0;
+    m_block_size = 0;
+    m_block_offsets.clear();
+    m_blocks.clear();
+    m_block_data.clear();
+}
+
+bool Buffer::write_compressed(int in_fd, size_t size, int out_fd)
+{
+#ifdef USE_LIBZSTD
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (cctx == nullptr)
+    {
+        Logging::error(m_cachefile, "Error compressing cache file: Out of memory");
+        errno = ENOMEM;
+        return false;
+    }
+
+    COMPRESSED_HEADER header;
+    std::vector<uint8_t> in(CACHE_COMPRESS_BLOCK_SIZE);
+    std::vector<uint8_t> out(ZSTD_compressBound(CACHE_COMPRESS_BLOCK_SIZE));
+    std::vector<uint64_t> offsets;
+    size_t pos = sizeof(header);
+    bool success = true;
+
+    offsets.reserve(size / CACHE_COMPRESS_BLOCK_SIZE + 2);
+
+    for (size_t offset = 0; offset < size && success; offset += CACHE_COMPRESS_BLOCK_SIZE)
+    {
+        size_t length = std::min(size - offset, static_cast<size_t>(CACHE_COMPRESS_BLOCK_SIZE));
+
+        if (!pread_all(in_fd, in.data(), length, offset))
+        {
+            Logging::error(m_cachefile, "Error reading cache file: (%1) %2", errno, strerror(errno));
+            success = false;
+            break;
+        }
+
+        size_t stored = ZSTD_compressCCtx(cctx, out.data(), out.size(), in.data(), length, CACHE_COMPRESS_LEVEL);
+        const uint8_t *data = out.data();
+
+        if (ZSTD_isError(stored))
+        {
+            Logging::error(m_cachefile, "Error compressing cache file: %1", ZSTD_getErrorName(stored));
+            errno = EIO;
+            success = false;
+            break;
+        }
+
+        if (stored >= length)
+        {
+            // Does not get smaller, store as it is. Only these blocks have their uncompressed size.
+            data    = in.data();
+            stored  = length;
+        }
+
+        offsets.push_back(pos);
+
+        if (!pwrite_all(out_fd, data, stored, pos))
+        {
+            Logging::error(m_cachefile, "Error writing compressed cache file: (%1) %2", errno, strerror(errno));
+            success = false;
+            break;
+        }
+
+        pos += stored;
+    }
+
+    ZSTD_freeCCtx(cctx);
+
+    if (!success)
+    {
+        return false;
+    }
+
+    offsets.push_back(pos);
+
+    memcpy(header.m_magic, CACHE_COMPRESS_MAGIC, sizeof(header.m_magic));
+    header.m_version        = CACHE_COMPRESS_VERSION;
+    header.m_size           = size;
+    header.m_block_size     = CACHE_COMPRESS_BLOCK_SIZE;
+    header.m_blocks         = static_cast<uint32_t>(offsets.size() - 1);
+    header.m_index_offset   = pos;
+
+    // Header last, so that an incomplete file is not taken for a compressed one
+    if (!pwrite_all(out_fd, offsets.data(), offsets.size() * sizeof(uint64_t), pos) ||
+            fdatasync(out_fd) == -1 ||
+            !pwrite_all(out_fd, &header, sizeof(header), 0) ||
+            fdatasync(out_fd) == -1)
+    {
+        Logging::error(m_cachefile, "Error writing compressed cache file: (%1) %2", errno, strerror(errno));
+        return false;
+    }
+
+    return true;
+#else
+    (void)in_fd;
+    (void)size;
+    (void)out_fd;
+    errno = ENOTSUP;
+    return false;
+#endif // !USE_LIBZSTD
+}
+
+bool Buffer::copy_compressed(size_t offset, uint8_t *data, size_t length)
+{
+    while (length)
+    {
+        size_t block_offset = offset % m_block_size;
+        const std::vector<uint8_t> *block = decompress_block(offset / m_block_size);
+
+        if (block == nullptr || block_offset >= block->size())
+        {
+            return false;
+        }
+
+        size_t bytes = std::min(length, block->size() - block_offset);
+
+        memcpy(data, block->data() + block_offset, bytes);
+
+        offset  += bytes;
+        data    += bytes;
+        length  -= bytes;
+    }
+
+    return true;
+}
+
+const std::vector<uint8_t> * Buffer::decompress_block(size_t block)
+{
+    for (std::list<std::pair<size_t, std::vector<uint8_t>>>::iterator it = m_blocks.begin(); it != m_blocks.end(); ++it)
+    {
+        if (it->first == block)
+        {
+            m_blocks.splice(m_blocks.begin(), m_blocks, it);
+            return &m_blocks.front().second;
+        }
+    }
+
+    if (block + 1 >= m_block_offsets.size())
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    size_t length = std::min(m_block_size, m_uncompressed_size - block * m_block_size);
+    size_t start = static_cast<size_t>(m_block_offsets[block]);
+    size_t stored = static_cast<size_t>(m_block_offsets[block + 1] - m_block_offsets[block]);
+
+    if (m_blocks.size() >= CACHE_COMPRESS_BLOCKS)
+    {
+        // Reuse memory of the least recently used block
+        m_blocks.splice(m_blocks.begin(), m_blocks, std::prev(m_blocks.end()));
+    }
+    else
+    {
+        m_blocks.emplace_front();
+    }
+
+    std::pair<size_t, std::vector<uint8_t>> & entry = m_blocks.front();
+
+    entry.first = SIZE_MAX;     // Not valid until decompressed
+    entry.second.resize(length);
+
+    if (stored == length)
+    {
+        // Stored uncompressed
+        if (!pread_all(m_block_fd, entry.second.data(), length, start))
+        {
+            Logging::error(m_cachefile, "Error reading cache file: (%1) %2", errno, strerror(errno));
+            return nullptr;
+        }
+    }
+    else
+    {
+#ifdef USE_LIBZSTD
+        m_block_data.resize(stored);
+
+        if (!pread_all(m_block_fd, m_block_data.data(), stored, start))
+        {
+            Logging::error(m_cachefile, "Error reading cache file: (%1) %2", errno, strerror(errno));
+            return nullptr;
+        }
+
+        size_t res = ZSTD_decompressDCtx(m_dctx, entry.second.data(), length, m_block_data.data(), stored);
+
+        if (ZSTD_isError(res) || res != length)
+        {
+            Logging::error(m_cachefile, "Error decompressing block %1: %2", block, ZSTD_isError(res) ? ZSTD_getErrorName(res) : "Size mismatch");
+            errno = EIO;
+            return nullptr;
+        }
+#else
+        errno = ENOTSUP;
+        return nullptr;
+#endif // !USE_LIBZSTD
+    }
+
+    entry.first = block;
+
+    return &entry.second;
+}
+
+bool Buffer::reallocate(size_t newsize)
+{
+    if (newsize > size())
+    {
+        size_t oldsize = size();
+
+        if (!reserve(newsize))
+        {
+            return false;
+        }
+
+        Logging::trace(m_filename, "Buffer reallocate: %1 -> %2.", oldsize, newsize);
+    }
+    return true;
+}
+
+const std::string & Buffer::filename() const
+{
+    return m_filename;
+}
+
+const std::string & Buffer::cachefile() const
+{
+    return m_cachefile;
+}
+
+const std::string & Buffer::make_cachefile_name(std::string & cachefile, const std::string & filename, const std::string & desttype, const std::string & content_key, const std::string & settings_key)
+{
+    transcoder_cache_path(cachefile);
+
+    if (!content_key.empty())
+    {
+        // Spread over 256 directories
+        cachefile += "content/";
+        cachefile += content_key.substr(0, 2);
+        cachefile += "/";
+        cachefile += content_key;
+    }
+    else
+    {
+        // Not by mount point: Instances serving the same files share the cache files like they share the cache index.
+        cachefile += filename;
+    }
+
+    cachefile += ".cache.";
+    if (!settings_key.empty())
+    {
+        // Instances with different settings must not share files
+        cachefile += settings_key;
+        cachefile += ".";
+    }
+    cachefile += desttype;
 
     return cachefile;
 }
@@ -524,6 +2441,37 @@ bool Buffer::remove_file(const std::string & filename)
     }
 }
 
+bool Buffer::remove_unused(const std::string & cachefile)
+{
+    std::string lockfile(cachefile + ".lock");
+    int fd = ::open(lockfile.c_str(), O_RDWR);
+
+    if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == -1)
+    {
+        Logging::debug(cachefile, "Cache file is in use by another instance, not removed.");
+        ::close(fd);
+        return false;
+    }
+
+    if (ramcache != nullptr)
+    {
+        ramcache->remove(cachefile);
+    }
+
+    remove_file(cachefile + ".idx");
+
+    bool success = remove_file(cachefile);
+
+    if (fd != -1)
+    {
+        // Still holding the lock, nobody else can be using the lock file
+        remove_file(lockfile);
+        ::close(fd);
+    }
+
+    return success;
+}
+
 size_t Buffer::read(void * /*data*/, size_t /*size*/)
 {
     // Not implemented
@@ -30,26 +30,109 @@
 #pragma once
 
 #include "fileio.h"
+#include "ram_cache.h"
 
+#include <map>
+#include <list>
+#include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <stddef.h>
 
+#ifdef USE_LIBZSTD
+#include <zstd.h>
+#endif // USE_LIBZSTD
+
 #define CACHE_CHECK_BIT(mask, var)  ((mask) == (mask & (var)))  /**< @brief Check bit in bitmask */
 
 #define CLOSE_CACHE_NOOPT   0x00                                /**< @brief Dummy, do nothing special */
 #define CLOSE_CACHE_FREE    0x01                                /**< @brief Free memory for cache entry */
 #define CLOSE_CACHE_DELETE  (0x02 | CLOSE_CACHE_FREE)           /**< @brief Delete cache entry, will unlink cached file! Implies CLOSE_CACHE_FREE. */
 
+#define CACHE_EXTENT_SIZE   (8 * 1024 * 1024)                   /**< @brief Size of one memory mapped extent of the cache file */
+#define CACHE_MAX_EXTENTS   8                                   /**< @brief Max. number of extents mapped at the same time per cache file */
+#define CACHE_SHARE_INTERVAL (256 * 1024)                       /**< @brief Publish progress to other instances every time this many bytes have been written */
+#define CACHE_COMPRESS_BLOCK_SIZE (256 * 1024)                  /**< @brief Uncompressed size of the blocks of a compressed cache file */
+#define CACHE_COMPRESS_BLOCKS 8                                 /**< @brief Max. number of decompressed blocks kept in memory per cache file */
+#define CACHE_COMPRESS_LEVEL 3                                  /**< @brief zstd compression level */
+#define STREAM_BACKLOG_SHARE 4                                  /**< @brief In streaming mode, this fraction of the ring buffer is kept behind the slowest reader */
+#define STREAM_READER_IDLE  10                                  /**< @brief Seconds after which a stream reader that has not read anything no longer holds up the others */
+#define STREAM_MAX_READ     (128 * 1024)                        /**< @brief Largest read request FUSE sends */
+#define STREAM_MAX_PACKET   (1024 * 1024)                       /**< @brief Largest packet expected to be written to a stream at once */
+#define STREAM_MIN_BUFFER_SIZE (4 * 1024 * 1024)                /**< @brief Smallest ring buffer in streaming mode */
+
+// Room for a few reads behind the slowest reader and one packet in front of it
+static_assert(STREAM_MIN_BUFFER_SIZE >= STREAM_BACKLOG_SHARE * STREAM_MAX_READ + STREAM_MAX_PACKET, "STREAM_MIN_BUFFER_SIZE too small");
+
+/**
+  * @brief State of a cache file shared with other ffmpegfs instances
+  */
+typedef enum SHARED_STATE
+{
+    SHARED_STATE_NONE = 0,  /**< @brief Not following: This instance owns the cache file. */
+    SHARED_STATE_RUNNING,   /**< @brief Another instance is transcoding the file. */
+    SHARED_STATE_FINISHED,  /**< @brief The file has been transcoded completely. */
+    SHARED_STATE_ABORTED,   /**< @brief Transcoding failed. */
+    SHARED_STATE_ORPHANED,  /**< @brief The owner has gone away before finishing the file, this instance has taken over. */
+} SHARED_STATE;
+
+/**
+  * @brief Reader of a buffer in streaming mode
+  */
+typedef struct STREAM_READER
+{
+    size_t                  m_pos;                      /**< @brief Offset of last read */
+    time_t                  m_time;                     /**< @brief Time of last read */
+} STREAM_READER;
+
 /**
  * @brief The #Buffer class
+ *
+ * The cache file is not mapped as a whole, but in fixed size extents of
+ * #CACHE_EXTENT_SIZE bytes that are mapped on demand. Growing the file never
+ * remaps data already written, and at most #CACHE_MAX_EXTENTS extents are
+ * mapped at a time, least recently used extents are unmapped first.
+ *
+ * The ranges filled so far are saved to an index file next to the cache file
+ * on flush, so partially written files can be picked up again after a restart.
+ *
+ * Several ffmpegfs instances may share the same cache directory. The instance
+ * that holds the exclusive flock() on the lock file next to the cache file owns
+ * it and is the only one to write to it. Other instances open the file as
+ * followers: they read what the owner has written so far, the owner publishes
+ * its progress in the lock file. If the owner goes away before the file is
+ * complete, the lock is released and a follower takes over.
+ *
+ * Complete files can be replaced by a compressed copy, see compress(). The
+ * compressed file consists of blocks of #CACHE_COMPRESS_BLOCK_SIZE bytes that
+ * are compressed separately and a block index, so any range can be read without
+ * decompressing the file from the start. The most recently used blocks are
+ * kept decompressed in memory to serve sequential reads.
+ *
+ * If the RAM cache is enabled and the file is expected to fit into it (see
+ * reserve()), the file is written to memory instead of the cache file. When
+ * finished, it is handed to the RAM cache, see keep_in_ram(). The cache file
+ * is written when the RAM cache drops the file, or right away if the file
+ * turns out too large or is not finished.
+ *
+ * In streaming mode, nothing is written to disk. The buffer is a ring of fixed
+ * size that holds the most recently written part of the file. The transcoder
+ * waits while the ring is full, i.e. until the slowest reader has moved on,
+ * see stream_full(). Data that has dropped out of the ring cannot be read again.
  */
 class Buffer : public FileIO
 {
 public:
     /**
      * @brief Create #Buffer object
+     * @param[in] content_key - Key of the source file content as made by make_content_key().
+     * If empty, the cache file is named after the source file.
+     * @param[in] settings_key - Key of the transcoding settings as made by make_settings_key().
+     * @param[in] stream_size - If not 0, do not cache the file but stream it through a ring buffer of this size.
      */
-    explicit Buffer();
+    explicit Buffer(const std::string & content_key = "", const std::string & settings_key = "", size_t stream_size = 0);
     /**
      * @brief Free #Buffer object
      *
@@ -134,18 +217,54 @@ public:
      * @return Returns the bytes written to the buffer. If less than length this indicates an error.
      */
     size_t                  write(const uint8_t* data, size_t length);
+    /**
+     * @brief Write data to a position in the Buffer. The position pointer will not be changed.
+     *
+     * Used to write to several positions of the same file from different threads.
+     *
+     * @param[in] offset - Position to write to.
+     * @param[in] data - Buffer with data to write.
+     * @param[in] length - Length of buffer to write.
+     * @return Returns the bytes written to the buffer. If less than length this indicates an error.
+     */
+    size_t                  write_at(size_t offset, const uint8_t* data, size_t length);
     /**
      * @brief Flush buffer to disk
      * @return Returns true on success; false on error. Check errno for details.
      */
     bool                    flush();
+    /**
+     * @brief Set if the file can be resumed after an interruption.
+     *
+     * Only then flush() makes sure that data and index are on disk, so that the
+     * index never claims data that has been lost in a crash.
+     * @param[in] resumable - true if the file can be resumed.
+     */
+    void                    set_resumable(bool resumable);
+    /**
+     * @brief Mark the file as completely written.
+     *
+     * The index of filled ranges is removed and not written again, the file size tells all.
+     * @return Returns true on success; false on error.
+     */
+    bool                    finish();
     /**
      * @brief Clear (delete) buffer.
      * @return Returns true on success; false on error. Check errno for details.
      */
     bool                    clear();
+    /**
+     * @brief Discard all data from an offset to the end.
+     *
+     * The file size remains, but the data at and after offset will be considered not written.
+     * @param[in] offset - Offset to discard data from.
+     */
+    void                    discard(size_t offset);
     /**
      * @brief Reserve memory without changing size to reduce re-allocations.
+     *
+     * If nothing has been written yet and size fits into the RAM cache, the file
+     * is written to memory from now on.
      * @param[in] size - Size of buffer to reserve.
      * @return Returns true on success; false on error.
      */
@@ -166,6 +285,162 @@ public:
      * @return Returns true on success; false on error.
      */
     bool                    copy(uint8_t* out_data, size_t offset, size_t bufsize);
+    /**
+     * @brief Replace the cache file by a compressed copy.
+     *
+     * The file must be complete, it cannot be written to once compressed. Readers
+     * go on using the uncompressed file while the copy is made.
+     * @return Returns true on success; false on error or if the buffer has changed in the meantime.
+     */
+    bool                    compress();
+    /**
+     * @brief Check if the cache file is compressed.
+     * @return Returns true if the cache file is compressed.
+     */
+    bool                    is_compressed() const;
+    /**
+     * @brief Get the size the cache file takes on disk.
+     * @return Returns the size of the compressed file if the cache file is compressed, the size of the data otherwise.
+     */
+    size_t                  disk_size();
+    /**
+     * @brief Keep a complete file that has been written to memory in the RAM cache.
+     *
+     * The file is served from memory from now on, and also to later opens
+     * while it stays in the RAM cache. Instead of writing it to disk now, this
+     * is done when the RAM cache drops it. If the file cannot be kept, it is
+     * written to the cache file now.
+     * @return Returns true if the file is kept in memory; false if the RAM
+     * cache is disabled, the file has not been written to memory or is not complete.
+     */
+    bool                    keep_in_ram();
+    /**
+     * @brief Write a file dropped by the RAM cache to its cache file.
+     *
+     * Called by the write back thread of the RAM cache. Syncs the file to
+     * disk, removes its index and tells other instances it is finished.
+     * @param[in] cachefile - Name of cache file.
+     * @param[in] data - Contents of file.
+     * @param[in] fd - Handle of cache file, will be closed.
+     * @param[in] lock_fd - Handle of lock file, will be closed. May be -1.
+     * @return Returns true on success; false on error.
+     */
+    static bool             write_back(const std::string & cachefile, const RAM_DATA & data, int fd, int lock_fd);
+    /**
+     * @brief Get the file descriptor of the cache file.
+     *
+     * Can be used to pass data to the kernel without copying it first.
+     *
+     * @return Returns the file descriptor, or -1 if the cache file is not open or compressed.
+     */
+    int                     fd() const;
+    /**
+     * @brief Check if a range of the buffer has already been written.
+     *
+     * Normally the buffer is filled from start to end, but after a seek ahead
+     * it may contain holes that will be filled in later.
+     *
+     * @param[in] offset - Start of range.
+     * @param[in] len - Length of range.
+     * @return Returns true if the range is completely filled, false if not.
+     */
+    bool                    is_filled(size_t offset, size_t len);
+    /**
+     * @brief Find the first hole in the buffer.
+     * @param[in] offset - Start searching at this offset.
+     * @param[out] hole_end - End of the hole (start of the next filled range), or SIZE_MAX if no data follows.
+     * @return Returns the start offset of the hole.
+     */
+    size_t                  find_hole(size_t offset, size_t *hole_end);
+    /**
+     * @brief Get the current progress sequence number.
+     *
+     * The number changes whenever data is written to the buffer. Take a snapshot
+     * before checking the wait condition and pass it to wait_progress(), so that
+     * a write that happens in between is not missed.
+     *
+     * @return Returns the current progress sequence number.
+     */
+    unsigned int            progress_seq() const;
+    /**
+     * @brief Wake up all readers waiting for buffer progress.
+     *
+     * Called by write(), seek() and release(). The transcoder calls it directly
+     * after it has finished or failed so that waiting readers re-check their state.
+     */
+    void                    notify_progress();
+    /**
+     * @brief Wait until the buffer progresses or the timeout expires.
+     * @param[in] seq - Progress sequence number as returned by progress_seq().
+     * @param[in] timeout - Maximum time to wait.
+     * @param[out] latency - If not nullptr, receives the time in microseconds
+     * between the notification and the wake-up. Set to 0 on timeout.
+     * @return Returns true if the buffer has progressed, false on timeout.
+     */
+    bool                    wait_progress(unsigned int seq, std::chrono::milliseconds timeout, int64_t *latency = nullptr);
+    /**
+     * @brief Check if another instance owns the cache file.
+     * @return Returns true if the cache file is written by another instance and this buffer only follows it.
+     */
+    bool                    is_follower() const;
+    /**
+     * @brief Check if the buffer is in streaming mode.
+     * @return Returns true if the file is streamed through a ring buffer.
+     */
+    bool                    is_stream() const;
+    /**
+     * @brief Get the lowest offset that is still in the ring buffer.
+     * @return Returns the start of the data that can be read, 0 if not in streaming mode.
+     */
+    size_t                  stream_start() const;
+    /**
+     * @brief Record the position of a reader in streaming mode.
+     *
+     * Wakes up the transcoder if it is waiting for room in the ring buffer.
+     * @param[in] reader - Identifies the reader, e.g. the file handle.
+     * @param[in] offset - Offset the reader is reading at.
+     */
+    void                    stream_read(const void *reader, size_t offset);
+    /**
+     * @brief Forget a reader in streaming mode.
+     * @param[in] reader - Identifies the reader, as passed to stream_read().
+     */
+    void                    stream_detach(const void *reader);
+    /**
+     * @brief Check if a reader is the only one reading a stream.
+     * @param[in] reader - Reader to check, e.g. the file handle.
+     * @return Returns true if no other reader is registered; false if there are others.
+     */
+    bool                    stream_sole_reader(const void *reader);
+    /**
+     * @brief Check if the ring buffer is full.
+     *
+     * The ring is full if less than 1/#STREAM_BACKLOG_SHARE of it could be written
+     * without dropping data the slowest reader has not yet read, or the backlog
+     * kept behind it. Readers that have been idle for #STREAM_READER_IDLE
+     * seconds are ignored as long as others are reading.
+     * @return Returns true if the transcoder should wait.
+     */
+    bool                    stream_full();
+    /**
+     * @brief Pick up the progress the owner of the cache file has published.
+     *
+     * If the owner has gone away before the file was completed, the lock is
+     * taken over and the buffer becomes writeable. The caller must then
+     * restart transcoding.
+     *
+     * @return Returns the state of the shared file, SHARED_STATE_NONE if this instance owns it.
+     */
+    SHARED_STATE            follow();
+    /**
+     * @brief Publish the progress of the cache file to instances following it.
+     *
+     * Called by write() every #CACHE_SHARE_INTERVAL bytes. The transcoder calls it
+     * directly when it has finished or failed.
+     *
+     * @param[in] state - State of the file, one of SHARED_STATE_RUNNING, SHARED_STATE_FINISHED or SHARED_STATE_ABORTED.
+     */
+    void                    publish(SHARED_STATE state);
     /**
      * @brief Get source filename.
      * @return Returns source filename.
@@ -178,18 +453,31 @@ public:
     const std::string &     cachefile() const;
     /**
      * @brief Make up a cache file name including full path
+     *
+     * The name depends on the source file, the transcoding settings and the destination
+     * type only, so that all instances with the same settings using the same cache
+     * directory find the same file. With a content key, the source file name is replaced
+     * by the content: Source files with the same content share the cache file.
      * @param[out] cachefile - Name of cache file.
      * @param[in] filename - Source file name.
      * @param[in] desttype - Destination type (MP4, WEBM etc.).
+     * @param[in] content_key - Key of the source file content, may be empty.
+     * @param[in] settings_key - Key of the transcoding settings, empty for files of earlier releases.
      * @return Returns the name of the cache file.
      */
-    static const std::string & make_cachefile_name(std::string &cachefile, const std::string & filename, const std::string &desttype);
+    static const std::string & make_cachefile_name(std::string &cachefile, const std::string & filename, const std::string &desttype, const std::string & content_key = "", const std::string & settings_key = "");
     /**
      * @brief Remove (unlink) file.
      * @param[in] filename - Name of file to remove.
      * @return Returns true on success; false on error.
      */
     static bool             remove_file(const std::string & filename);
+    /**
+     * @brief Remove a cache file unless another instance owns it.
+     * @param[in] cachefile - Name of cache file.
+     * @return Returns true on success; false on error or if the file is in use.
+     */
+    static bool             remove_unused(const std::string & cachefile);
 
 protected:
     /**
@@ -206,15 +494,54 @@ protected:
 
 private:
     /**
-     * @brief Prepare write operation.
+     * @brief Get memory of an extent, map it if necessary.
      *
-     * Ensure the Buffer has sufficient space for a quantity of data and
-     * return a pointer where the data may be written. The position pointer
-     * should be updated afterward with increment_pos().
-     * @param[in] length - Length of buffer to prepare.
-     * @return Returns a pointer to the memory to write.
+     * If too many extents are mapped, the least recently used one is unmapped.
+     * @param[in] extent - Number of extent.
+     * @return Returns a pointer to the start of the extent, or nullptr on error.
      */
-    uint8_t*                write_prepare(size_t length);
+    uint8_t*                map_extent(size_t extent);
+    /**
+     * @brief Unmap all extents.
+     * @return Returns true on success; false on error.
+     */
+    bool                    unmap_extents();
+    /**
+     * @brief Copy data from or to the cache file, crossing extent boundaries as necessary.
+     * @param[in] offset - Offset in cache file.
+     * @param[in, out] data - Data to copy.
+     * @param[in] length - Number of bytes to copy.
+     * @param[in] to_cache - If true, copy data to the cache file; if false copy from it.
+     * @return Returns true on success; false on error.
+     */
+    bool                    copy_extents(size_t offset, uint8_t *data, size_t length, bool to_cache);
+    /**
+     * @brief Start writing the file to memory instead of the cache file.
+     * @param[in] size - Expected file size.
+     * @return Returns true if the file is written to memory; false if not.
+     */
+    bool                    start_ram_fill(size_t size);
+    /**
+     * @brief Stop writing the file to memory and give back the memory reserved for it.
+     */
+    void                    end_ram_fill();
+    /**
+     * @brief Write the data written to memory so far to the cache file and continue there.
+     * @return Returns true on success; false on error.
+     */
+    bool                    spill_ram();
+    /**
+     * @brief Save the filled ranges to the index file, or remove it if the file is complete.
+     * @param[in] sync - If true, the index is synced to disk.
+     * @return Returns true on success; false on error.
+     */
+    bool                    save_index(bool sync);
+    /**
+     * @brief Load the filled ranges from the index file.
+     * @param[in] filesize - Size of cache file.
+     * @return Returns true if the index file was loaded, false if it does not exist or is invalid.
+     */
+    bool                    load_index(size_t filesize);
     /**
      * @brief Increment buffer position.
      *
@@ -234,17 +561,127 @@ private:
      * @return Returns true on success; false on error.
      */
     bool                    reallocate(size_t newsize);
+    /**
+     * @brief Mark a range of the buffer as filled.
+     *
+     * Adjacent or overlapping ranges are merged.
+     * @param[in] start - Start of range.
+     * @param[in] end - End of range (exclusive).
+     */
+    void                    add_range(size_t start, size_t end);
+    /**
+     * @brief Get the number of bytes filled from the start of the buffer without a hole.
+     * @return Returns the length of the first filled range, if it starts at 0.
+     */
+    size_t                  filled() const;
+    /**
+     * @brief Load the block index of a compressed cache file.
+     * @return Returns true if the cache file is compressed and valid, false if it is not compressed.
+     * Returns false and sets errno if the file is damaged.
+     */
+    bool                    open_compressed();
+    /**
+     * @brief Forget the block index and decompressed blocks of a compressed cache file.
+     *
+     * Also closes the file replaced by compress() or keep_in_ram().
+     */
+    void                    close_compressed();
+    /**
+     * @brief Write a compressed copy of the cache file.
+     * @param[in] in_fd - File handle to read uncompressed data from.
+     * @param[in] size - Number of bytes to compress.
+     * @param[in] out_fd - File handle to write compressed data to.
+     * @return Returns true on success; false on error.
+     */
+    bool                    write_compressed(int in_fd, size_t size, int out_fd);
+    /**
+     * @brief Copy data from a compressed cache file.
+     * @note m_block_mutex must be locked by caller, m_mutex need not be.
+     * @param[in] offset - Offset in uncompressed data.
+     * @param[out] data - Buffer to copy data to.
+     * @param[in] length - Number of bytes to copy.
+     * @return Returns true on success; false on error.
+     */
+    bool                    copy_compressed(size_t offset, uint8_t *data, size_t length);
+    /**
+     * @brief Copy data from or to the ring buffer in streaming mode.
+     * @param[in] offset - Offset in file, the data must be in the ring.
+     * @param[in, out] data - Buffer to copy data from or to.
+     * @param[in] length - Number of bytes to copy, not more than the ring size.
+     * @param[in] to_ring - If true copy from data to the ring, if false from the ring to data.
+     */
+    void                    copy_ring(size_t offset, uint8_t *data, size_t length, bool to_ring);
+    /**
+     * @brief Get a decompressed block, decompress it if it is not in memory.
+     *
+     * If too many blocks are in memory, the least recently used one is reused.
+     * @note m_block_mutex must be locked by caller, m_mutex need not be.
+     * @param[in] block - Number of block.
+     * @return Returns the decompressed data, or nullptr on error.
+     */
+    const std::vector<uint8_t> * decompress_block(size_t block);
+    /**
+     * @brief Try to become the owner of the cache file.
+     *
+     * If the lock is held by another instance, the lock file is kept open so
+     * that the follower can check later if the owner is still there.
+     * @return Returns true if this instance owns the cache file, false if another instance does.
+     */
+    bool                    lock_cachefile();
+    /**
+     * @brief Release the lock, other instances may take over the cache file.
+     */
+    void                    unlock_cachefile();
+    /**
+     * @brief Become owner of a cache file abandoned by another instance.
+     * @return Returns true if the lock could be taken, false if some other instance was quicker.
+     */
+    bool                    take_over();
 
 private:
     std::recursive_mutex    m_mutex;                        /**< @brief Access mutex */
     std::string             m_filename;                     /**< @brief Source file name */
     std::string             m_cachefile;                    /**< @brief Cache file name */
+    std::string             m_content_key;                  /**< @brief Key of source file content, empty if cached by file name */
+    std::string             m_settings_key;                 /**< @brief Key of the transcoding settings */
     size_t                  m_buffer_pos;                   /**< @brief Read/write position */
     size_t                  m_buffer_watermark;             /**< @brief Number of bytes in buffer */
     volatile bool           m_is_open;                      /**< @brief true if cache file is open */
     size_t                  m_buffer_size;                  /**< @brief Current buffer size */
-    uint8_t *               m_buffer;                       /**< @brief Pointer to buffer memory */
+    std::vector<uint8_t *>  m_extents;                      /**< @brief Mapped extents, nullptr if not mapped */
+    std::list<size_t>       m_extent_lru;                   /**< @brief Numbers of mapped extents, most recently used first */
+    std::string             m_indexfile;                    /**< @brief Name of index file of filled ranges */
     int                     m_fd;                           /**< @brief File handle for buffer */
+    std::map<size_t, size_t> m_ranges;                      /**< @brief Filled ranges of the buffer, start offset -> end offset */
+    std::string             m_lockfile;                     /**< @brief Name of lock file, holds the progress shared with other instances */
+    int                     m_lock_fd;                      /**< @brief File handle of lock file */
+    bool                    m_follower;                     /**< @brief true if another instance owns the cache file */
+    size_t                  m_shared_filled;                /**< @brief Number of bytes last published to other instances */
+    bool                    m_resumable;                    /**< @brief true if the file can be resumed, flush() then syncs data and index */
+    bool                    m_finished;                     /**< @brief true if the file is complete and has no index */
+    std::mutex              m_progress_mutex;               /**< @brief Mutex for m_progress_cond */
+    std::condition_variable m_progress_cond;                /**< @brief Signalled when the buffer progresses */
+    std::atomic_uint        m_progress_seq;                 /**< @brief Progress sequence number, incremented on each notification */
+    unsigned int            m_progress_waiters;             /**< @brief Number of readers waiting on m_progress_cond */
+    std::chrono::steady_clock::time_point m_progress_time;  /**< @brief Time of last notification, for latency statistics */
+    bool                    m_compressed;                   /**< @brief true if cache file is compressed */
+    std::mutex              m_block_mutex;                  /**< @brief Protects the members below up to m_block_data and m_dctx, locked after m_mutex */
+    int                     m_block_fd;                     /**< @brief File handle the compressed blocks are read from */
+    size_t                  m_uncompressed_size;            /**< @brief Uncompressed size of a compressed file */
+    size_t                  m_block_size;                   /**< @brief Uncompressed size of the blocks of a compressed file */
+    std::vector<uint64_t>   m_block_offsets;                /**< @brief File offsets of compressed blocks, followed by the end of the last block */
+    std::list<std::pair<size_t, std::vector<uint8_t>>> m_blocks;    /**< @brief Decompressed blocks by number, most recently used first */
+    std::vector<uint8_t>    m_block_data;                   /**< @brief Compressed data of block being read */
+    int                     m_raw_fd;                       /**< @brief Handle of the file replaced by compress() or keep_in_ram(), kept open for reads passed to the kernel */
+    RAM_DATA                m_ram;                          /**< @brief Contents of file if served from the RAM cache, nullptr if not */
+    std::shared_ptr<std::vector<uint8_t>> m_ram_fill;       /**< @brief File is being written here instead of the cache file, nullptr if not */
+    size_t                  m_ram_reserved;                 /**< @brief Bytes reserved in the RAM cache for m_ram_fill */
+    size_t                  m_stream_size;                  /**< @brief Size of ring buffer in streaming mode, 0 if the file is cached */
+    std::vector<uint8_t>    m_ring;                         /**< @brief Ring buffer in streaming mode */
+    std::map<const void *, STREAM_READER> m_readers;        /**< @brief Readers in streaming mode */
+#ifdef USE_LIBZSTD
+    ZSTD_DCtx *             m_dctx;                         /**< @brief zstd decompression context */
+#endif // USE_LIBZSTD
 };
 
 #endif
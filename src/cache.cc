@@ -33,17 +33,129 @@
 #include "logging.h"
 
 #include <vector>
+#include <chrono>
 #include <assert.h>
 
 #ifndef HAVE_SQLITE_ERRSTR
 #define sqlite3_errstr(rc)  ""              /**< @brief If our version of SQLite hasn't go this function */
 #endif // HAVE_SQLITE_ERRSTR
 
+/**
+  * @brief Cache index upgrade steps
+  *
+  * Entry n upgrades the cache index from version n to n + 1. Databases of releases
+  * before versioning was introduced have version 0. Steps must never be changed
+  * once released, add a new step instead and increase #CACHE_INDEX_VERSION.
+  */
+static const char * const cache_index_upgrade[CACHE_INDEX_VERSION] =
+{
+    // Version 1: Statistics for scheduling and eviction, indexes for pruning
+    "ALTER TABLE `cache_entry` ADD COLUMN `duration`        BIG INT NOT NULL DEFAULT 0;\n"
+    "ALTER TABLE `cache_entry` ADD COLUMN `transcode_time`  UNSIGNED BIG INT NOT NULL DEFAULT 0;\n"
+    "ALTER TABLE `cache_entry` ADD COLUMN `cpu_time`        UNSIGNED BIG INT NOT NULL DEFAULT 0;\n"
+    "ALTER TABLE `cache_entry` ADD COLUMN `output_bitrate`  UNSIGNED BIG INT NOT NULL DEFAULT 0;\n"
+    "ALTER TABLE `cache_entry` ADD COLUMN `hit_count`       UNSIGNED INT NOT NULL DEFAULT 0;\n"
+    "CREATE INDEX IF NOT EXISTS `idx_cache_entry_access_time` ON `cache_entry` (`access_time`);\n"
+    "CREATE INDEX IF NOT EXISTS `idx_cache_entry_encoded_filesize` ON `cache_entry` (`encoded_filesize`);\n",
+    // Version 2: Source files with the same content share a cache file
+    "ALTER TABLE `cache_entry` ADD COLUMN `content_key`     TEXT NOT NULL DEFAULT '';\n"
+    "CREATE INDEX IF NOT EXISTS `idx_cache_entry_content_key` ON `cache_entry` (`content_key`, `desttype`);\n",
+    // Version 3: Instances with different settings keep separate entries. SQLite cannot change
+    // the primary key of a table, so copy it. Entries of earlier versions get an empty settings
+    // key, Cache::adopt_legacy_entries() hands them to the instance with matching settings.
+    "CREATE TABLE `cache_entry_v3` (\n"
+    "    `filename`             TEXT NOT NULL,\n"
+    "    `desttype`             CHAR ( 10 ) NOT NULL,\n"
+    "    `enable_ismv`          BOOLEAN NOT NULL,\n"
+    "    `audiobitrate`         UNSIGNED INT NOT NULL,\n"
+    "    `audiosamplerate`      UNSIGNED INT NOT NULL,\n"
+    "    `videobitrate`         UNSIGNED INT NOT NULL,\n"
+    "    `videowidth`           UNSIGNED INT NOT NULL,\n"
+    "    `videoheight`          UNSIGNED INT NOT NULL,\n"
+    "    `deinterlace`          BOOLEAN NOT NULL,\n"
+    "    `predicted_filesize`   UNSIGNED BIG INT NOT NULL,\n"
+    "    `encoded_filesize`     UNSIGNED BIG INT NOT NULL,\n"
+    "    `finished`             BOOLEAN NOT NULL,\n"
+    "    `error`                BOOLEAN NOT NULL,\n"
+    "    `errno`                INT NOT NULL,\n"
+    "    `averror`              INT NOT NULL,\n"
+    "    `creation_time`        DATETIME NOT NULL,\n"
+    "    `access_time`          DATETIME NOT NULL,\n"
+    "    `file_time`            DATETIME NOT NULL,\n"
+    "    `file_size`            UNSIGNED BIG INT NOT NULL,\n"
+    "    `duration`             BIG INT NOT NULL DEFAULT 0,\n"
+    "    `transcode_time`       UNSIGNED BIG INT NOT NULL DEFAULT 0,\n"
+    "    `cpu_time`             UNSIGNED BIG INT NOT NULL DEFAULT 0,\n"
+    "    `output_bitrate`       UNSIGNED BIG INT NOT NULL DEFAULT 0,\n"
+    "    `hit_count`            UNSIGNED INT NOT NULL DEFAULT 0,\n"
+    "    `content_key`          TEXT NOT NULL DEFAULT '',\n"
+    "    `settings_key`         TEXT NOT NULL DEFAULT '',\n"
+    "    PRIMARY KEY(`filename`,`desttype`,`settings_key`)\n"
+    ");\n"
+    "INSERT INTO `cache_entry_v3` SELECT `filename`, `desttype`, `enable_ismv`, `audiobitrate`, `audiosamplerate`, `videobitrate`, `videowidth`, `videoheight`, `deinterlace`, `predicted_filesize`, `encoded_filesize`, `finished`, `error`, `errno`, `averror`, `creation_time`, `access_time`, `file_time`, `file_size`, `duration`, `transcode_time`, `cpu_time`, `output_bitrate`, `hit_count`, `content_key`, '' FROM `cache_entry`;\n"
+    "DROP TABLE `cache_entry`;\n"
+    "ALTER TABLE `cache_entry_v3` RENAME TO `cache_entry`;\n"
+    "CREATE INDEX IF NOT EXISTS `idx_cache_entry_access_time` ON `cache_entry` (`access_time`);\n"
+    "CREATE INDEX IF NOT EXISTS `idx_cache_entry_encoded_filesize` ON `cache_entry` (`encoded_filesize`);\n"
+    "CREATE INDEX IF NOT EXISTS `idx_cache_entry_content_key` ON `cache_entry` (`content_key`, `desttype`, `settings_key`);\n",
+    // Version 4: Compressed cache files take less space than the encoded size, prune by the size on disk
+    "ALTER TABLE `cache_entry` ADD COLUMN `disk_size`       UNSIGNED BIG INT NOT NULL DEFAULT 0;\n"
+    "UPDATE `cache_entry` SET `disk_size` = `encoded_filesize`;\n"
+    "CREATE INDEX IF NOT EXISTS `idx_cache_entry_disk_size` ON `cache_entry` (`disk_size`);\n",
+};
+
+#define CACHE_INFO_COLUMNS  "desttype, enable_ismv, audiobitrate, audiosamplerate, videobitrate, videowidth, videoheight, deinterlace, predicted_filesize, encoded_filesize, finished, error, errno, averror, strftime('%s', creation_time), strftime('%s', access_time), strftime('%s', file_time), file_size, duration, transcode_time, cpu_time, output_bitrate, hit_count, disk_size" /**< @brief Columns read into CACHE_INFO */
+
+/**
+ * @brief Copy the columns of a select statement into a cache info structure.
+ * @param[in] stmt - Select statement, must select the columns in the order of #CACHE_INFO_COLUMNS.
+ * @param[out] cache_info - Structure to fill in.
+ */
+static void fetch_info(sqlite3_stmt * stmt, LPCACHE_INFO cache_info)
+{
+    const char *text                = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+    if (text != nullptr)
+    {
+        cache_info->m_desttype[0] = '\0';
+        strncat(cache_info->m_desttype, text, sizeof(cache_info->m_desttype) - 1);
+    }
+
+    //cache_info->m_enable_ismv        = sqlite3_column_int(stmt, 1);
+    cache_info->m_audiobitrate       = sqlite3_column_int(stmt, 2);
+    cache_info->m_audiosamplerate    = sqlite3_column_int(stmt, 3);
+    cache_info->m_videobitrate       = sqlite3_column_int(stmt, 4);
+    cache_info->m_videowidth         = sqlite3_column_int(stmt, 5);
+    cache_info->m_videoheight        = sqlite3_column_int(stmt, 6);
+    cache_info->m_deinterlace        = sqlite3_column_int(stmt, 7);
+    cache_info->m_predicted_filesize = static_cast<size_t>(sqlite3_column_int64(stmt, 8));
+    cache_info->m_encoded_filesize   = static_cast<size_t>(sqlite3_column_int64(stmt, 9));
+    cache_info->m_finished           = sqlite3_column_int(stmt, 10);
+    cache_info->m_error              = sqlite3_column_int(stmt, 11);
+    cache_info->m_errno              = sqlite3_column_int(stmt, 12);
+    cache_info->m_averror            = sqlite3_column_int(stmt, 13);
+    cache_info->m_creation_time      = static_cast<time_t>(sqlite3_column_int64(stmt, 14));
+    cache_info->m_access_time        = static_cast<time_t>(sqlite3_column_int64(stmt, 15));
+    cache_info->m_file_time          = static_cast<time_t>(sqlite3_column_int64(stmt, 16));
+    cache_info->m_file_size          = static_cast<size_t>(sqlite3_column_int64(stmt, 17));
+    cache_info->m_duration           = sqlite3_column_int64(stmt, 18);
+    cache_info->m_transcode_time     = sqlite3_column_int64(stmt, 19);
+    cache_info->m_cpu_time           = sqlite3_column_int64(stmt, 20);
+    cache_info->m_output_bitrate     = sqlite3_column_int64(stmt, 21);
+    cache_info->m_hit_count          = static_cast<unsigned int>(sqlite3_column_int(stmt, 22));
+    cache_info->m_disk_size          = static_cast<size_t>(sqlite3_column_int64(stmt, 23));
+}
+
 Cache::Cache()
     : m_cacheidx_db(nullptr)
     , m_cacheidx_select_stmt(nullptr)
+    , m_cacheidx_select_content_stmt(nullptr)
     , m_cacheidx_insert_stmt(nullptr)
     , m_cacheidx_delete_stmt(nullptr)
+    , m_policy(nullptr)
+    , m_writer_exit(false)
+    , m_rows_queued(0)
+    , m_rows_coalesced(0)
+    , m_rows_committed(0)
 {
 }
 
@@ -58,9 +170,11 @@ Cache::~Cache()
     m_cache.clear();
 
     close_index();
+
+    delete m_policy;
 }
 
-bool Cache::load_index()    /**< @todo Implement versioning + auto-update of DB structures */
+bool Cache::load_index()
 {
     bool success = true;
 
@@ -70,6 +184,16 @@ bool Cache::load_index()    /**< @todo Implement versioning + auto-update of DB
         const char * sql;
         int ret;
 
+        if (m_policy == nullptr)
+        {
+            m_policy = Cache_Policy::create(params.m_cache_policy);
+            if (m_policy == nullptr)
+            {
+                Logging::error(m_cacheidx_file, "Out of memory creating cache policy.");
+                throw false;
+            }
+        }
+
         transcoder_cache_path(m_cacheidx_file);
 
         if (mktree(m_cacheidx_file.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) && errno != EEXIST)
@@ -108,9 +232,10 @@ bool Cache::load_index()    /**< @todo Implement versioning + auto-update of DB
             throw false;
         }
 
-        // Create cache_entry table not already existing
+        // Create cache_entry table not already existing. This is the structure of version 0,
+        // upgrade_index() adds everything else.
         sql =
-                "CREATE TABLE IF NOT EXISTS `cache_entry` (\n"      /**< @todo Add duration to list */
+                "CREATE TABLE IF NOT EXISTS `cache_entry` (\n"
                 //
                 // Primary key: filename + desttype
                 //
@@ -150,6 +275,16 @@ bool Cache::load_index()    /**< @todo Implement versioning + auto-update of DB
             throw false;
         }
 
+        if (!upgrade_index())
+        {
+            throw false;
+        }
+
+        if (!adopt_legacy_entries())
+        {
+            throw false;
+        }
+
 #ifdef HAVE_SQLITE_CACHEFLUSH
         if (!flush_index())
         {
@@ -160,8 +295,8 @@ bool Cache::load_index()    /**< @todo Implement versioning + auto-update of DB
         // prepare the statements
 
         sql =   "INSERT OR REPLACE INTO cache_entry\n"
-                "(filename, desttype, enable_ismv, audiobitrate, audiosamplerate, videobitrate, videowidth, videoheight, deinterlace, predicted_filesize, encoded_filesize, finished, error, errno, averror, creation_time, access_time, file_time, file_size) VALUES\n"
-                "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?);\n";
+                "(filename, desttype, enable_ismv, audiobitrate, audiosamplerate, videobitrate, videowidth, videoheight, deinterlace, predicted_filesize, encoded_filesize, finished, error, errno, averror, creation_time, access_time, file_time, file_size, duration, transcode_time, cpu_time, output_bitrate, hit_count, content_key, settings_key, disk_size) VALUES\n"
+                "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), datetime(?, 'unixepoch'), ?, ?, ?, ?, ?, ?, ?, ?, ?);\n";
 
         if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, sql, -1, &m_cacheidx_insert_stmt, nullptr)))
         {
@@ -169,7 +304,7 @@ bool Cache::load_index()    /**< @todo Implement versioning + auto-update of DB
             throw false;
         }
 
-        sql =   "SELECT desttype, enable_ismv, audiobitrate, audiosamplerate, videobitrate, videowidth, videoheight, deinterlace, predicted_filesize, encoded_filesize, finished, error, errno, averror, strftime('%s', creation_time), strftime('%s', access_time), strftime('%s', file_time), file_size FROM cache_entry WHERE filename = ? AND desttype = ?;\n";
+        sql =   "SELECT " CACHE_INFO_COLUMNS " FROM cache_entry WHERE filename = ? AND desttype = ? AND settings_key = ?;\n";
 
         if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, sql, -1, &m_cacheidx_select_stmt, nullptr)))
         {
@@ -177,7 +312,16 @@ bool Cache::load_index()    /**< @todo Implement versioning + auto-update of DB
             throw false;
         }
 
-        sql =   "DELETE FROM cache_entry WHERE filename = ? AND desttype = ?;\n";
+        // Prefer a completely transcoded file
+        sql =   "SELECT " CACHE_INFO_COLUMNS " FROM cache_entry WHERE content_key = ? AND desttype = ? AND settings_key = ? ORDER BY finished DESC, access_time DESC LIMIT 1;\n";
+
+        if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, sql, -1, &m_cacheidx_select_content_stmt, nullptr)))
+        {
+            Logging::error(m_cacheidx_file, "Failed to prepare select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), sql);
+            throw false;
+        }
+
+        sql =   "DELETE FROM cache_entry WHERE filename = ? AND desttype = ? AND settings_key = ?;\n";
 
         if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, sql, -1, &m_cacheidx_delete_stmt, nullptr)))
         {
@@ -224,9 +368,35 @@ bool Cache::read_info(LPCACHE_INFO cache_info)
 
     std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
+    {
+        // A queued info is newer than what is in the database
+        std::lock_guard<std::mutex> lock_pending(m_pending_mutex);
+
+        cache_key_t key(cache_info->m_origfile, cache_info->m_desttype);
+        std::map<cache_key_t, CACHE_INFO>::const_iterator it = m_pending.find(key);
+        bool found = (it != m_pending.end());
+
+        if (!found)
+        {
+            it = m_committing.find(key);
+            found = (it != m_committing.end());
+        }
+
+        if (found)
+        {
+            unsigned int access_count = cache_info->m_access_count;
+
+            *cache_info = it->second;
+            cache_info->m_access_count = access_count;
+
+            errno = 0;
+            return true;
+        }
+    }
+
     try
     {
-        assert(sqlite3_bind_parameter_count(m_cacheidx_select_stmt) == 2);
+        assert(sqlite3_bind_parameter_count(m_cacheidx_select_stmt) == 3);
 
         if (SQLITE_OK != (ret = sqlite3_bind_text(m_cacheidx_select_stmt, 1, cache_info->m_origfile.c_str(), -1, nullptr)))
         {
@@ -240,40 +410,29 @@ bool Cache::read_info(LPCACHE_INFO cache_info)
             throw false;
         }
 
+        if (SQLITE_OK != (ret = sqlite3_bind_text(m_cacheidx_select_stmt, 3, cache_info->m_settings_key.c_str(), -1, nullptr)))
+        {
+            Logging::error(m_cacheidx_file, "SQLite3 select error binding 'settings_key': (%1) %2", ret, sqlite3_errstr(ret));
+            throw false;
+        }
+
         ret = sqlite3_step(m_cacheidx_select_stmt);
 
         if (ret == SQLITE_ROW)
         {
-            const char *text                = reinterpret_cast<const char *>(sqlite3_column_text(m_cacheidx_select_stmt, 0));
-            if (text != nullptr)
-            {
-                cache_info->m_desttype[0] = '\0';
-                strncat(cache_info->m_desttype, text, sizeof(cache_info->m_desttype) - 1);
-            }
-            
-            //cache_info->m_enable_ismv        = sqlite3_column_int(m_cacheidx_select_stmt, 1);
-            cache_info->m_audiobitrate       = sqlite3_column_int(m_cacheidx_select_stmt, 2);
-            cache_info->m_audiosamplerate    = sqlite3_column_int(m_cacheidx_select_stmt, 3);
-            cache_info->m_videobitrate       = sqlite3_column_int(m_cacheidx_select_stmt, 4);
-            cache_info->m_videowidth         = sqlite3_column_int(m_cacheidx_select_stmt, 5);
-            cache_info->m_videoheight        = sqlite3_column_int(m_cacheidx_select_stmt, 6);
-            cache_info->m_deinterlace        = sqlite3_column_int(m_cacheidx_select_stmt, 7);
-            cache_info->m_predicted_filesize = static_cast<size_t>(sqlite3_column_int64(m_cacheidx_select_stmt, 8));
-            cache_info->m_encoded_filesize   = static_cast<size_t>(sqlite3_column_int64(m_cacheidx_select_stmt, 9));
-            cache_info->m_finished           = sqlite3_column_int(m_cacheidx_select_stmt, 10);
-            cache_info->m_error              = sqlite3_column_int(m_cacheidx_select_stmt, 11);
-            cache_info->m_errno              = sqlite3_column_int(m_cacheidx_select_stmt, 12);
-            cache_info->m_averror            = sqlite3_column_int(m_cacheidx_select_stmt, 13);
-            cache_info->m_creation_time      = static_cast<time_t>(sqlite3_column_int64(m_cacheidx_select_stmt, 14));
-            cache_info->m_access_time        = static_cast<time_t>(sqlite3_column_int64(m_cacheidx_select_stmt, 15));
-            cache_info->m_file_time          = static_cast<time_t>(sqlite3_column_int64(m_cacheidx_select_stmt, 16));
-            cache_info->m_file_size          = static_cast<size_t>(sqlite3_column_int64(m_cacheidx_select_stmt, 17));
+            fetch_info(m_cacheidx_select_stmt, cache_info);
         }
         else if (ret != SQLITE_DONE)
         {
             Logging::error(m_cacheidx_file, "Sqlite 3 could not step (execute) select statement: (%1) %2", ret, sqlite3_errstr(ret));
             throw false;
         }
+        else if (!cache_info->m_content_key.empty())
+        {
+            // Not known by this name, but a file with the same content may have been transcoded already
+            sqlite3_reset(m_cacheidx_select_stmt);
+            read_shared_info(cache_info);
+        }
     }
     catch (bool _success)
     {
@@ -304,7 +463,137 @@ bool Cache::read_info(LPCACHE_INFO cache_info)
     throw false; \
     }       /**< @brief Bind numeric column to SQLite statement */
 
+bool Cache::read_shared_info(LPCACHE_INFO cache_info)
+{
+    int ret;
+    bool found = false;
+
+    if (m_cacheidx_select_content_stmt == nullptr)
+    {
+        Logging::error(m_cacheidx_file, "SQLite3 select statement not open.");
+        return false;
+    }
+
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    assert(sqlite3_bind_parameter_count(m_cacheidx_select_content_stmt) == 3);
+
+    if (SQLITE_OK != (ret = sqlite3_bind_text(m_cacheidx_select_content_stmt, 1, cache_info->m_content_key.c_str(), -1, nullptr)) ||
+            SQLITE_OK != (ret = sqlite3_bind_text(m_cacheidx_select_content_stmt, 2, cache_info->m_desttype, -1, nullptr)) ||
+            SQLITE_OK != (ret = sqlite3_bind_text(m_cacheidx_select_content_stmt, 3, cache_info->m_settings_key.c_str(), -1, nullptr)))
+    {
+        Logging::error(m_cacheidx_file, "SQLite3 select error binding 'content_key': (%1) %2", ret, sqlite3_errstr(ret));
+    }
+    else if ((ret = sqlite3_step(m_cacheidx_select_content_stmt)) == SQLITE_ROW)
+    {
+        struct stat sb;
+
+        fetch_info(m_cacheidx_select_content_stmt, cache_info);
+
+        // The entry belongs to another file, this one is not older than the transcoded result
+        if (stat(cache_info->m_origfile.c_str(), &sb) != -1)
+        {
+            cache_info->m_file_time = sb.st_mtime;
+            cache_info->m_file_size = static_cast<size_t>(sb.st_size);
+        }
+        cache_info->m_access_time   = time(nullptr);
+        cache_info->m_hit_count     = 0;
+
+        Logging::debug(cache_info->m_origfile, "Sharing cache file with source of same content, key %1.", cache_info->m_content_key.c_str());
+
+        found = true;
+    }
+    else if (ret != SQLITE_DONE)
+    {
+        Logging::error(m_cacheidx_file, "Sqlite 3 could not step (execute) select statement: (%1) %2", ret, sqlite3_errstr(ret));
+    }
+
+    sqlite3_reset(m_cacheidx_select_content_stmt);
+
+    errno = 0;
+
+    return found;
+}
+
+unsigned int Cache::content_refs(const std::string & filename, const std::string & desttype, const std::string & settings_key, std::string *content_key)
+{
+    sqlite3_stmt * stmt;
+    const char * sql;
+    unsigned int refs = 1;
+    int ret;
+
+    content_key->clear();
+
+    // Queued rows may use the same cache file, or be the entry itself
+    if (!flush_pending())
+    {
+        Logging::warning(m_cacheidx_file, "Cannot write queued cache index updates, keeping the cache file of '%1'.", filename.c_str());
+        return 2;   // Cannot tell, so the file counts as shared
+    }
+
+    sql = "SELECT content_key, (SELECT COUNT(*) FROM cache_entry c WHERE c.content_key = e.content_key AND c.desttype = e.desttype AND c.settings_key = e.settings_key) FROM cache_entry e WHERE filename = ? AND desttype = ? AND settings_key = ?;\n";
+
+    if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, sql, -1, &stmt, nullptr)))
+    {
+        Logging::error(m_cacheidx_file, "Failed to prepare select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), sql);
+        return refs;
+    }
+
+    sqlite3_bind_text(stmt, 1, filename.c_str(), -1, nullptr);
+    sqlite3_bind_text(stmt, 2, desttype.c_str(), -1, nullptr);
+    sqlite3_bind_text(stmt, 3, settings_key.c_str(), -1, nullptr);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const char *text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+
+        if (text != nullptr && *text)
+        {
+            *content_key = text;
+            refs = static_cast<unsigned int>(sqlite3_column_int(stmt, 1));
+        }
+    }
+
+    sqlite3_finalize(stmt);
+
+    return refs;
+}
+
 bool Cache::write_info(LPCCACHE_INFO cache_info)
+{
+    if (!params.m_db_write_delay)
+    {
+        return insert_info(cache_info);
+    }
+
+    std::lock_guard<std::mutex> lock_pending(m_pending_mutex);
+
+    std::pair<std::map<cache_key_t, CACHE_INFO>::iterator, bool> res = m_pending.insert(std::make_pair(cache_key_t(cache_info->m_origfile, cache_info->m_desttype), *cache_info));
+
+    if (!res.second)
+    {
+        // Replace older update of the same entry
+        res.first->second = *cache_info;
+        m_rows_coalesced++;
+    }
+
+    m_rows_queued++;
+
+    if (!m_writer.joinable())
+    {
+        m_writer_exit = false;
+        m_writer = std::thread(&Cache::writer_thread, this);
+    }
+
+    if (params.m_db_write_batch && m_pending.size() >= params.m_db_write_batch)
+    {
+        m_writer_cond.notify_one();
+    }
+
+    return true;
+}
+
+bool Cache::insert_info(LPCCACHE_INFO cache_info)
 {
     int ret;
     bool success = true;
@@ -321,7 +610,7 @@ bool Cache::write_info(LPCCACHE_INFO cache_info)
     {
         bool enable_ismv_dummy = 0;
 
-        assert(sqlite3_bind_parameter_count(m_cacheidx_insert_stmt) == 19);
+        assert(sqlite3_bind_parameter_count(m_cacheidx_insert_stmt) == 27);
 
         SQLBINDTXT(1, cache_info->m_origfile.c_str());
         SQLBINDTXT(2, cache_info->m_desttype);
@@ -343,6 +632,14 @@ bool Cache::write_info(LPCCACHE_INFO cache_info)
         SQLBINDNUM(sqlite3_bind_int64,  17, cache_info->m_access_time);
         SQLBINDNUM(sqlite3_bind_int64,  18, cache_info->m_file_time);
         SQLBINDNUM(sqlite3_bind_int64,  19, static_cast<sqlite3_int64>(cache_info->m_file_size));
+        SQLBINDNUM(sqlite3_bind_int64,  20, cache_info->m_duration);
+        SQLBINDNUM(sqlite3_bind_int64,  21, cache_info->m_transcode_time);
+        SQLBINDNUM(sqlite3_bind_int64,  22, cache_info->m_cpu_time);
+        SQLBINDNUM(sqlite3_bind_int64,  23, cache_info->m_output_bitrate);
+        SQLBINDNUM(sqlite3_bind_int,    24, static_cast<int>(cache_info->m_hit_count));
+        SQLBINDTXT(25, cache_info->m_content_key.c_str());
+        SQLBINDTXT(26, cache_info->m_settings_key.c_str());
+        SQLBINDNUM(sqlite3_bind_int64,  27, static_cast<sqlite3_int64>(cache_info->m_disk_size));
 
         ret = sqlite3_step(m_cacheidx_insert_stmt);
 
@@ -367,7 +664,119 @@ bool Cache::write_info(LPCCACHE_INFO cache_info)
     return success;
 }
 
-bool Cache::delete_info(const std::string & filename, const std::string & desttype)
+bool Cache::flush_pending()
+{
+    bool success = true;
+    char *errmsg = nullptr;
+    int ret;
+
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    {
+        std::lock_guard<std::mutex> lock_pending(m_pending_mutex);
+
+        if (m_pending.empty())
+        {
+            return true;
+        }
+
+        // Rows stay visible to read_info() while being written
+        m_committing.swap(m_pending);
+    }
+
+    if (SQLITE_OK != (ret = sqlite3_exec(m_cacheidx_db, "BEGIN TRANSACTION;", nullptr, nullptr, &errmsg)))
+    {
+        Logging::error(m_cacheidx_file, "SQLite3 begin transaction error: (%1) %2", ret, errmsg);
+        sqlite3_free(errmsg);
+        errmsg = nullptr;
+        success = false;
+    }
+
+    if (success)
+    {
+        for (std::map<cache_key_t, CACHE_INFO>::const_iterator it = m_committing.begin(); it != m_committing.end(); ++it)
+        {
+            if (!insert_info(&it->second))
+            {
+                // Error has been logged by insert_info()
+                success = false;
+                break;
+            }
+        }
+
+        if (!success)
+        {
+            sqlite3_exec(m_cacheidx_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        }
+        else if (SQLITE_OK != (ret = sqlite3_exec(m_cacheidx_db, "COMMIT;", nullptr, nullptr, &errmsg)))
+        {
+            Logging::error(m_cacheidx_file, "SQLite3 commit error: (%1) %2", ret, errmsg);
+            sqlite3_free(errmsg);
+            sqlite3_exec(m_cacheidx_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            success = false;
+        }
+    }
+
+    if (!success)
+    {
+        Logging::error(m_cacheidx_file, "Could not write %1 queued cache index update(s), keeping them queued to try again.", m_committing.size());
+    }
+
+    std::lock_guard<std::mutex> lock_pending(m_pending_mutex);
+
+    if (success)
+    {
+        m_rows_committed += m_committing.size();
+    }
+    else
+    {
+        // Try again later, but do not overwrite newer updates
+        m_pending.insert(m_committing.begin(), m_committing.end());
+    }
+
+    m_committing.clear();
+
+    return success;
+}
+
+void Cache::writer_thread()
+{
+    std::unique_lock<std::mutex> lock_pending(m_pending_mutex);
+
+    while (!m_writer_exit)
+    {
+        m_writer_cond.wait_for(lock_pending, std::chrono::milliseconds(params.m_db_write_delay), [this]() { return m_writer_exit || (params.m_db_write_batch && m_pending.size() >= params.m_db_write_batch); });
+
+        lock_pending.unlock();
+        flush_pending();
+        lock_pending.lock();
+    }
+}
+
+void Cache::stop_writer()
+{
+    {
+        std::lock_guard<std::mutex> lock_pending(m_pending_mutex);
+        m_writer_exit = true;
+    }
+
+    m_writer_cond.notify_all();
+
+    if (m_writer.joinable())
+    {
+        m_writer.join();
+    }
+
+    // Write what is left
+    flush_pending();
+
+    if (m_rows_queued)
+    {
+        Logging::debug(m_cacheidx_file, "Cache index writes: %1 queued, %2 coalesced, %3 committed.", m_rows_queued, m_rows_coalesced, m_rows_committed);
+    }
+}
+
+bool Cache::delete_info(const std::string & filename, const std::string & desttype, const std::string & settings_key)
 {
     int ret;
     bool success = true;
@@ -380,9 +789,20 @@ bool Cache::delete_info(const std::string & filename, const std::string & destty
 
     std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
+    {
+        // Drop queued update, it would bring the entry back
+        std::lock_guard<std::mutex> lock_pending(m_pending_mutex);
+
+        std::map<cache_key_t, CACHE_INFO>::iterator it = m_pending.find(cache_key_t(filename, desttype));
+        if (it != m_pending.end() && it->second.m_settings_key == settings_key)
+        {
+            m_pending.erase(it);
+        }
+    }
+
     try
     {
-        assert(sqlite3_bind_parameter_count(m_cacheidx_delete_stmt) == 2);
+        assert(sqlite3_bind_parameter_count(m_cacheidx_delete_stmt) == 3);
 
         if (SQLITE_OK != (ret = sqlite3_bind_text(m_cacheidx_delete_stmt, 1, filename.c_str(), -1, nullptr)))
         {
@@ -396,6 +816,12 @@ bool Cache::delete_info(const std::string & filename, const std::string & destty
             throw false;
         }
 
+        if (SQLITE_OK != (ret = sqlite3_bind_text(m_cacheidx_delete_stmt, 3, settings_key.c_str(), -1, nullptr)))
+        {
+            Logging::error(m_cacheidx_file, "SQLite3 select error binding 'settings_key': (%1) %2", ret, sqlite3_errstr(ret));
+            throw false;
+        }
+
         ret = sqlite3_step(m_cacheidx_delete_stmt);
 
         if (ret != SQLITE_DONE)
@@ -419,81 +845,385 @@ bool Cache::delete_info(const std::string & filename, const std::string & destty
     return success;
 }
 
-void Cache::close_index()
+bool Cache::index_version(int *version)
 {
-    if (m_cacheidx_db != nullptr)
-    {
-#ifdef HAVE_SQLITE_CACHEFLUSH
-        flush_index();
-#endif // HAVE_SQLITE_CACHEFLUSH
+    sqlite3_stmt * stmt = nullptr;
+    int ret;
 
-        sqlite3_finalize(m_cacheidx_select_stmt);
-        sqlite3_finalize(m_cacheidx_insert_stmt);
-        sqlite3_finalize(m_cacheidx_delete_stmt);
+    *version = 0;
 
-        sqlite3_close(m_cacheidx_db);
+    if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, "PRAGMA user_version;", -1, &stmt, nullptr)))
+    {
+        Logging::error(m_cacheidx_file, "Failed to prepare version query: (%1) %2", ret, sqlite3_errmsg(m_cacheidx_db));
+        return false;
     }
-    sqlite3_shutdown();
-}
 
-Cache_Entry* Cache::create_entry(LPVIRTUALFILE virtualfile, const std::string & desttype)
-{
-    //Cache_Entry* cache_entry = new(std::nothrow) Cache_Entry(this, filename);
-    Cache_Entry* cache_entry = Cache_Entry::create(this, virtualfile);
-    if (cache_entry == nullptr)
+    ret = sqlite3_step(stmt);
+
+    if (ret == SQLITE_ROW)
     {
-        Logging::error(m_cacheidx_file, "Out of memory creating cache entry.");
-        return nullptr;
+        *version = sqlite3_column_int(stmt, 0);
     }
 
-    m_cache.insert(make_pair(make_pair(virtualfile->m_origfile, desttype), cache_entry));
+    sqlite3_finalize(stmt);
 
-    return cache_entry;
+    if (ret != SQLITE_ROW)
+    {
+        Logging::error(m_cacheidx_file, "Sqlite 3 could not step (execute) version query: (%1) %2", ret, sqlite3_errstr(ret));
+        return false;
+    }
+
+    return true;
 }
 
-bool Cache::delete_entry(Cache_Entry ** cache_entry, int flags)
+bool Cache::upgrade_index()
 {
-    if (*cache_entry == nullptr)
-    {
-        return true;
-    }
-	
-	bool deleted = false;
+    bool success = true;
 
-    if ((*cache_entry)->close(flags))
+    // Copying the table may take a while, wait for an instance upgrading the same index
+    sqlite3_busy_timeout(m_cacheidx_db, 60000);
+
+    for (;;)
     {
-        // If CLOSE_CACHE_FREE is set, also free memory
-        if (CACHE_CHECK_BIT(CLOSE_CACHE_FREE, flags))
+        std::string sql;
+        char *errmsg = nullptr;
+        int version;
+        int ret;
+
+        // Take the write lock before looking at the version: Another instance sharing the
+        // cache directory may be upgrading the index at the same time.
+        if (SQLITE_OK != (ret = sqlite3_exec(m_cacheidx_db, "BEGIN IMMEDIATE TRANSACTION;", nullptr, nullptr, nullptr)))
         {
-            m_cache.erase(make_pair((*cache_entry)->m_cache_info.m_origfile, (*cache_entry)->m_cache_info.m_desttype));
+            Logging::error(m_cacheidx_file, "SQLite3 begin transaction failed: (%1) %2", ret, sqlite3_errmsg(m_cacheidx_db));
+            success = false;
+            break;
+        }
 
-            deleted = (*cache_entry)->destroy();
-            *cache_entry = nullptr;
+        if (!index_version(&version))
+        {
+            sqlite3_exec(m_cacheidx_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            success = false;
+            break;
         }
-    }
 
-    return deleted;
-}
+        if (version >= CACHE_INDEX_VERSION)
+        {
+            sqlite3_exec(m_cacheidx_db, "COMMIT;", nullptr, nullptr, nullptr);
 
-Cache_Entry *Cache::open(LPVIRTUALFILE virtualfile)
-{
-    Cache_Entry* cache_entry = nullptr;
-    cache_t::iterator p = m_cache.find(make_pair(virtualfile->m_origfile, params.current_format(virtualfile)->desttype()));
-    if (p == m_cache.end())
-    {
-        // Logging::trace(sanitised_name, "Created new transcoder.");
-        Logging::trace(virtualfile->m_origfile, "Created new transcoder.");
-        cache_entry = create_entry(virtualfile, params.current_format(virtualfile)->desttype());
+            if (version > CACHE_INDEX_VERSION)
+            {
+                // Upgrades only add columns and indexes, statements of older versions still work.
+                Logging::warning(m_cacheidx_file, "Cache index version %1 is newer than supported version %2.", version, CACHE_INDEX_VERSION);
+            }
+            break;
+        }
+
+        Logging::info(m_cacheidx_file, "Upgrading cache index from version %1 to %2.", version, version + 1);
+
+        sql = cache_index_upgrade[version];
+        sql += "PRAGMA user_version = " + std::to_string(version + 1) + ";\n";
+        sql += "COMMIT;\n";
+
+        if (SQLITE_OK != (ret = sqlite3_exec(m_cacheidx_db, sql.c_str(), nullptr, nullptr, &errmsg)))
+        {
+            Logging::error(m_cacheidx_file, "SQLite3 exec error upgrading cache index: (%1) %2\n%3", ret, errmsg, sql.c_str());
+            sqlite3_free(errmsg);
+            sqlite3_exec(m_cacheidx_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            success = false;
+            break;
+        }
     }
-    else
+
+    sqlite3_busy_timeout(m_cacheidx_db, 1000);
+
+    return success;
+}
+
+/**
+ * @brief Make the name of a cache file of a release before settings keys.
+ *
+ * Those stored files below the mount point, except for content keyed ones that
+ * already used the current scheme.
+ *
+ * @param[out] cachefile - Name of the cache file.
+ * @param[in] filename - Source file name.
+ * @param[in] desttype - Destination type (MP4, WEBM etc.).
+ * @param[in] content_key - Key of source file content, may be empty.
+ * @return Returns the name of the cache file.
+ */
+static const std::string & legacy_cachefile_name(std::string & cachefile, const std::string & filename, const std::string & desttype, const std::string & content_key)
+{
+    if (!content_key.empty())
+    {
+        return Buffer::make_cachefile_name(cachefile, filename, desttype, content_key);
+    }
+
+    transcoder_cache_path(cachefile);
+
+    cachefile += params.m_mountpath;
+    cachefile += filename;
+    cachefile += ".cache.";
+    cachefile += desttype;
+
+    return cachefile;
+}
+
+bool Cache::adopt_legacy_entries()
+{
+    std::vector<std::pair<std::string, std::string>> adopted;
+    std::string settings_key(make_settings_key());
+    sqlite3_stmt * stmt = nullptr;
+    const char * sql;
+    int ret;
+
+    if (settings_key.empty() || params.m_exact_size)
+    {
+        // Earlier releases did not pad files to the predicted size
+        return true;
+    }
+
+    if (SQLITE_OK != (ret = sqlite3_exec(m_cacheidx_db, "BEGIN IMMEDIATE TRANSACTION;", nullptr, nullptr, nullptr)))
+    {
+        Logging::error(m_cacheidx_file, "SQLite3 begin transaction failed: (%1) %2", ret, sqlite3_errmsg(m_cacheidx_db));
+        return false;
+    }
+
+    try
+    {
+        // Profile, level and the like were not recorded, so the encoding columns must do
+        sql = "SELECT filename, desttype, content_key FROM cache_entry WHERE settings_key = '' AND audiobitrate = ? AND audiosamplerate = ? AND videobitrate = ? AND videowidth = ? AND videoheight = ? AND deinterlace = ?;\n";
+
+        if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, sql, -1, &stmt, nullptr)))
+        {
+            Logging::error(m_cacheidx_file, "Failed to prepare select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), sql);
+            throw false;
+        }
+
+        sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(params.m_audiobitrate));
+        sqlite3_bind_int(stmt, 2, params.m_audiosamplerate);
+        sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(params.m_videobitrate));
+        sqlite3_bind_int(stmt, 4, params.m_videowidth);
+        sqlite3_bind_int(stmt, 5, params.m_videoheight);
+        sqlite3_bind_int(stmt, 6, params.m_deinterlace);
+
+        std::vector<std::vector<std::string>> rows;
+
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            std::vector<std::string> row;
+
+            for (int col = 0; col < 3; col++)
+            {
+                const char *text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, col));
+                row.push_back(text != nullptr ? text : "");
+            }
+            rows.push_back(row);
+        }
+
+        sqlite3_finalize(stmt);
+        stmt = nullptr;
+
+        if (ret != SQLITE_DONE)
+        {
+            Logging::error(m_cacheidx_file, "Failed to read cache entries of earlier releases: (%1) %2", ret, sqlite3_errstr(ret));
+            throw false;
+        }
+
+        if (rows.empty())
+        {
+            throw true;
+        }
+
+        // An entry this instance made in the meantime wins, the old one is pruned later.
+        sql = "UPDATE cache_entry SET settings_key = ?1 WHERE filename = ?2 AND desttype = ?3 AND settings_key = '' AND NOT EXISTS (SELECT 1 FROM cache_entry c WHERE c.filename = ?2 AND c.desttype = ?3 AND c.settings_key = ?1);\n";
+
+        if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, sql, -1, &stmt, nullptr)))
+        {
+            Logging::error(m_cacheidx_file, "Failed to prepare update: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), sql);
+            throw false;
+        }
+
+        for (const std::vector<std::string> & row : rows)
+        {
+            sqlite3_bind_text(stmt, 1, settings_key.c_str(), -1, nullptr);
+            sqlite3_bind_text(stmt, 2, row[0].c_str(), -1, nullptr);
+            sqlite3_bind_text(stmt, 3, row[1].c_str(), -1, nullptr);
+
+            if ((ret = sqlite3_step(stmt)) != SQLITE_DONE)
+            {
+                Logging::error(m_cacheidx_file, "Failed to update cache entry of an earlier release: (%1) %2", ret, sqlite3_errstr(ret));
+                throw false;
+            }
+
+            if (sqlite3_changes(m_cacheidx_db) > 0)
+            {
+                std::string oldfile;
+                std::string newfile;
+
+                legacy_cachefile_name(oldfile, row[0], row[1], row[2]);
+                Buffer::make_cachefile_name(newfile, row[0], row[1], row[2], settings_key);
+
+                adopted.push_back(std::make_pair(oldfile, newfile));
+            }
+
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+
+        sqlite3_finalize(stmt);
+        stmt = nullptr;
+
+        if (SQLITE_OK != (ret = sqlite3_exec(m_cacheidx_db, "COMMIT;", nullptr, nullptr, nullptr)))
+        {
+            Logging::error(m_cacheidx_file, "SQLite3 commit failed: (%1) %2", ret, sqlite3_errmsg(m_cacheidx_db));
+            throw false;
+        }
+
+        // Entries with the same content key share one file, it is only renamed once. A file
+        // that cannot be renamed is transcoded again.
+        for (const std::pair<std::string, std::string> & files : adopted)
+        {
+            std::string dir(files.second);
+
+            remove_filename(&dir);
+            if (mktree(dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) && errno != EEXIST)
+            {
+                Logging::warning(dir, "Error creating cache directory: (%1) %2", errno, strerror(errno));
+            }
+            if (rename(files.first.c_str(), files.second.c_str()) && errno != ENOENT)
+            {
+                Logging::warning(files.first, "Cannot rename cache file to '%1': (%2) %3", files.second.c_str(), errno, strerror(errno));
+            }
+            if (rename((files.first + ".idx").c_str(), (files.second + ".idx").c_str()) && errno != ENOENT)
+            {
+                Logging::warning(files.first, "Cannot rename cache file index: (%1) %2", errno, strerror(errno));
+            }
+        }
+
+        if (!adopted.empty())
+        {
+            Logging::info(m_cacheidx_file, "Took over %1 cache entries of an earlier release.", adopted.size());
+        }
+    }
+    catch (bool _success)
+    {
+        sqlite3_finalize(stmt);
+        sqlite3_exec(m_cacheidx_db, _success ? "COMMIT;" : "ROLLBACK;", nullptr, nullptr, nullptr);
+        return _success;
+    }
+
+    return true;
+}
+
+void Cache::close_index()
+{
+    if (m_cacheidx_db != nullptr)
+    {
+        stop_writer();
+
+#ifdef HAVE_SQLITE_CACHEFLUSH
+        flush_index();
+#endif // HAVE_SQLITE_CACHEFLUSH
+
+        sqlite3_finalize(m_cacheidx_select_stmt);
+        sqlite3_finalize(m_cacheidx_select_content_stmt);
+        sqlite3_finalize(m_cacheidx_insert_stmt);
+        sqlite3_finalize(m_cacheidx_delete_stmt);
+
+        sqlite3_close(m_cacheidx_db);
+    }
+    sqlite3_shutdown();
+}
+
+Cache_Entry* Cache::create_entry(LPVIRTUALFILE virtualfile, const std::string & desttype, const std::string & content_key, time_t content_time, size_t content_size)
+{
+    //Cache_Entry* cache_entry = new(std::nothrow) Cache_Entry(this, filename);
+    Cache_Entry* cache_entry = Cache_Entry::create(this, virtualfile, content_key, content_time, content_size);
+    if (cache_entry == nullptr)
     {
-        // Logging::trace(sanitised_name, "Reusing cached transcoder.");
-        cache_entry = p->second;
+        Logging::error(m_cacheidx_file, "Out of memory creating cache entry.");
+        return nullptr;
     }
 
+    m_cache.insert(make_pair(make_pair(virtualfile->m_origfile, desttype), cache_entry));
+
     return cache_entry;
 }
 
+bool Cache::delete_entry(Cache_Entry ** cache_entry, int flags)
+{
+    if (*cache_entry == nullptr)
+    {
+        return true;
+    }
+	
+	bool deleted = false;
+
+    if ((*cache_entry)->close(flags))
+    {
+        // If CLOSE_CACHE_FREE is set, also free memory
+        if (CACHE_CHECK_BIT(CLOSE_CACHE_FREE, flags))
+        {
+            m_cache.erase(make_pair((*cache_entry)->m_cache_info.m_origfile, (*cache_entry)->m_cache_info.m_desttype));
+
+            deleted = (*cache_entry)->destroy();
+            *cache_entry = nullptr;
+        }
+    }
+
+    return deleted;
+}
+
+Cache_Entry *Cache::open(LPVIRTUALFILE virtualfile)
+{
+    std::string desttype(params.current_format(virtualfile)->desttype());
+    cache_key_t key(virtualfile->m_origfile, desttype);
+
+    {
+        std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+        cache_t::iterator p = m_cache.find(key);
+        if (p != m_cache.end() && (p->second->ref_count() || !p->second->content_changed()))
+        {
+            // Logging::trace(sanitised_name, "Reusing cached transcoder.");
+            return p->second;
+        }
+    }
+
+    // Reads the source file, do not hold up other opens meanwhile
+    std::string content_key;
+    time_t content_time;
+    size_t content_size;
+
+    Cache_Entry::make_key(virtualfile, &content_key, &content_time, &content_size);
+
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+    cache_t::iterator p = m_cache.find(key);
+    if (p == m_cache.end())
+    {
+        // Logging::trace(sanitised_name, "Created new transcoder.");
+        Logging::trace(virtualfile->m_origfile, "Created new transcoder.");
+    }
+    else
+    {
+        Cache_Entry* cache_entry = p->second;
+
+        if (cache_entry->ref_count() || !cache_entry->content_changed())
+        {
+            // Opened by another thread in the meantime
+            return cache_entry;
+        }
+
+        // Source has been replaced, the content key is stale
+        Logging::trace(virtualfile->m_origfile, "Source file changed, recreating transcoder.");
+        m_cache.erase(p);
+        cache_entry->destroy();
+    }
+
+    return create_entry(virtualfile, desttype, content_key, content_time, content_size);
+}
+
 bool Cache::close(Cache_Entry **cache_entry, int flags /*= CLOSE_CACHE_NOOPT*/)
 {
     if ((*cache_entry) == nullptr)
@@ -503,6 +1233,8 @@ bool Cache::close(Cache_Entry **cache_entry, int flags /*= CLOSE_CACHE_NOOPT*/)
 
     bool deleted;
 
+    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
     std::string filename((*cache_entry)->filename());
     if (delete_entry(cache_entry, flags))
     {
@@ -526,61 +1258,166 @@ bool Cache::prune_expired()
         return true;
     }
 
-    std::vector<cache_key_t> keys;
+    std::vector<CACHE_CANDIDATE> keys;
     sqlite3_stmt * stmt;
     time_t now = time(nullptr);
     char sql[1024];
 
     Logging::trace(m_cacheidx_file, "Pruning expired cache entries older than %1...", format_time(params.m_expiry_time).c_str());
+
+    flush_pending();
     
-    sprintf(sql, "SELECT filename, desttype, strftime('%%s', access_time) FROM cache_entry WHERE strftime('%%s', access_time) + %" FFMPEGFS_FORMAT_TIME_T " < %" FFMPEGFS_FORMAT_TIME_T ";\n", params.m_expiry_time, now);
+    // Compare the column itself, not a function of it, so that the access_time index can be used
+    sprintf(sql, "SELECT filename, desttype, settings_key, strftime('%%s', access_time) FROM cache_entry WHERE access_time < datetime(%" FFMPEGFS_FORMAT_TIME_T ", 'unixepoch');\n", now - params.m_expiry_time);
 
-    std::lock_guard<std::recursive_mutex> lck (m_mutex);
+    {
+        std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-    sqlite3_prepare(m_cacheidx_db, sql, -1, &stmt, nullptr);
+        sqlite3_prepare(m_cacheidx_db, sql, -1, &stmt, nullptr);
 
-    int ret = 0;
-    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
-    {
-        const char *filename = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-        const char *desttype = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        int ret = 0;
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            CACHE_CANDIDATE key;
+
+            key.m_filename      = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            key.m_desttype      = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            key.m_settings_key  = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
 
-        keys.push_back(std::make_pair(filename, desttype));
+            keys.push_back(key);
+
+            Logging::trace(key.m_filename, "Found %1 old entries.", format_time(now - static_cast<time_t>(sqlite3_column_int64(stmt, 3))).c_str());
+        }
+
+        if (ret != SQLITE_DONE)
+        {
+            Logging::error(m_cacheidx_file, "Failed to execute select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), expanded_sql(stmt).c_str());
+            keys.clear();
+        }
 
-        Logging::trace(filename, "Found %1 old entries.", format_time(now - static_cast<time_t>(sqlite3_column_int64(stmt, 2))).c_str());
+        sqlite3_finalize(stmt);
     }
 
     Logging::trace(m_cacheidx_file, "%1 expired cache entries found.", keys.size());
 
-    if (ret == SQLITE_DONE)
+    for (size_t n = 0; n < keys.size();)
     {
-        for (std::vector<cache_key_t>::const_iterator it = keys.begin(); it != keys.end(); it++)
-        {
-            const cache_key_t & key = *it;
-            Logging::trace(m_cacheidx_file, "Pruning '%1' - Type: %2", key.first.c_str(), key.second.c_str());
+        // Release the lock after each batch so that opening files is not blocked for long
+        std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-            cache_t::iterator p = m_cache.find(key);
-            if (p != m_cache.end())
-            {
-                delete_entry(&p->second, CLOSE_CACHE_DELETE);
-            }
+        for (size_t batch = 0; batch < CACHE_PRUNE_BATCH && n < keys.size(); batch++, n++)
+        {
+            const CACHE_CANDIDATE & key = keys[n];
+            Logging::trace(m_cacheidx_file, "Pruning '%1' - Type: %2", key.m_filename.c_str(), key.m_desttype.c_str());
 
-            if (delete_info(key.first, key.second))
-            {
-                remove_cachefile(key.first, key.second);
-            }
+            remove_entry(key.m_filename, key.m_desttype, key.m_settings_key);
         }
     }
-    else
+
+    return true;
+}
+
+bool Cache::eviction_candidates(std::vector<CACHE_CANDIDATE> *candidates, size_t *total_size)
+{
+    const char * sql;
+    sqlite3_int64 last_rowid = 0;
+    size_t rows;
+
+    candidates->clear();
+    *total_size = 0;
+
+    // Page by rowid so that the cache lock is released between pages. Entries
+    // added meanwhile may be missed, which only delays their eviction to the
+    // next run.
+    sql = "SELECT rowid, filename, desttype, disk_size, strftime('%s', access_time), hit_count, cpu_time, transcode_time, settings_key FROM cache_entry WHERE rowid > ? ORDER BY rowid LIMIT ?;\n";
+
+    do
     {
-        Logging::error(m_cacheidx_file, "Failed to execute select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), expanded_sql(stmt).c_str());
+        std::lock_guard<std::recursive_mutex> lck (m_mutex);
+        sqlite3_stmt * stmt;
+        int ret;
+
+        flush_pending();
+
+        if (SQLITE_OK != (ret = sqlite3_prepare_v2(m_cacheidx_db, sql, -1, &stmt, nullptr)))
+        {
+            Logging::error(m_cacheidx_file, "Failed to prepare select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), sql);
+            return false;
+        }
+
+        sqlite3_bind_int64(stmt, 1, last_rowid);
+        sqlite3_bind_int(stmt, 2, CACHE_SELECT_PAGE);
+
+        rows = 0;
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            CACHE_CANDIDATE candidate;
+            int64_t cpu_time = sqlite3_column_int64(stmt, 6);
+
+            last_rowid              = sqlite3_column_int64(stmt, 0);
+            candidate.m_filename    = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+            candidate.m_desttype    = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+            candidate.m_size        = static_cast<size_t>(sqlite3_column_int64(stmt, 3));
+            candidate.m_access_time = static_cast<time_t>(sqlite3_column_int64(stmt, 4));
+            candidate.m_hit_count   = static_cast<unsigned int>(sqlite3_column_int(stmt, 5));
+            candidate.m_cost        = cpu_time ? cpu_time : sqlite3_column_int64(stmt, 7);
+            candidate.m_settings_key = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 8));
+
+            *total_size += candidate.m_size;
+
+            candidates->push_back(candidate);
+            rows++;
+        }
+
+        if (ret != SQLITE_DONE)
+        {
+            Logging::error(m_cacheidx_file, "Failed to execute select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), expanded_sql(stmt).c_str());
+            sqlite3_finalize(stmt);
+            return false;
+        }
+
+        sqlite3_finalize(stmt);
     }
+    while (rows == CACHE_SELECT_PAGE);
 
-    sqlite3_finalize(stmt);
+    // Sorting is the expensive part for large caches, and needs no lock
+    m_policy->sort(candidates);
 
     return true;
 }
 
+void Cache::evict(const CACHE_CANDIDATE & candidate)
+{
+    Logging::trace(m_cacheidx_file, "Pruning: %1 Type: %2", candidate.m_filename.c_str(), candidate.m_desttype.c_str());
+
+    m_policy->evicted(candidate, time(nullptr));
+
+    remove_entry(candidate.m_filename, candidate.m_desttype, candidate.m_settings_key);
+}
+
+void Cache::remove_entry(const std::string & filename, const std::string & desttype, const std::string & settings_key)
+{
+    cache_key_t key(filename, desttype);
+    std::string content_key;
+    bool shared = (content_refs(filename, desttype, settings_key, &content_key) > 1);
+
+    if (shared)
+    {
+        Logging::trace(filename, "Cache file is still used by other files of the same content, keeping it.");
+    }
+
+    cache_t::iterator p = m_cache.find(key);
+    if (p != m_cache.end() && p->second->m_cache_info.m_settings_key == settings_key)
+    {
+        delete_entry(&p->second, shared ? CLOSE_CACHE_FREE : CLOSE_CACHE_DELETE);
+    }
+
+    if (delete_info(filename, desttype, settings_key) && !shared)
+    {
+        remove_cachefile(filename, desttype, content_key, settings_key);
+    }
+}
+
 bool Cache::prune_cache_size()
 {
     if (!params.m_max_cache_size)
@@ -589,74 +1426,37 @@ bool Cache::prune_cache_size()
         return true;
     }
 
-    std::vector<cache_key_t> keys;
-    std::vector<size_t> filesizes;
-    sqlite3_stmt * stmt;
-    const char * sql;
-
-    Logging::trace(m_cacheidx_file, "Pruning oldest cache entries exceeding %1 cache size...", format_size(params.m_max_cache_size).c_str());
+    std::vector<CACHE_CANDIDATE> candidates;
+    size_t total_size;
 
-    sql = "SELECT filename, desttype, encoded_filesize FROM cache_entry ORDER BY access_time ASC;\n";
+    Logging::trace(m_cacheidx_file, "Pruning cache entries exceeding %1 cache size (%2 policy)...", format_size(params.m_max_cache_size).c_str(), m_policy->name());
 
-    std::lock_guard<std::recursive_mutex> lck (m_mutex);
-
-    sqlite3_prepare(m_cacheidx_db, sql, -1, &stmt, nullptr);
-
-    int ret = 0;
-    size_t total_size = 0;
-    while((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    if (!eviction_candidates(&candidates, &total_size))
     {
-        const char *filename = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-        const char *desttype = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-        size_t size = static_cast<size_t>(sqlite3_column_int64(stmt, 2));
-
-        keys.push_back(std::make_pair(filename, desttype));
-        filesizes.push_back(size);
-        total_size += size;
+        return true;
     }
 
     Logging::trace(m_cacheidx_file, "%1 in cache.", format_size(total_size).c_str());
 
     if (total_size > params.m_max_cache_size)
     {
-        Logging::trace(m_cacheidx_file, "Pruning %1 of oldest cache entries to limit cache size.", format_size(total_size - params.m_max_cache_size).c_str());
-        if (ret == SQLITE_DONE)
-        {
-            size_t n = 0;
-            for (std::vector<cache_key_t>::const_iterator it = keys.begin(); it != keys.end(); it++)
-            {
-                const cache_key_t & key = *it;
-
-                Logging::trace(m_cacheidx_file, "Pruning: %1 Type: %2", key.first.c_str(), key.second.c_str());
+        Logging::trace(m_cacheidx_file, "Pruning %1 of cache entries to limit cache size.", format_size(total_size - params.m_max_cache_size).c_str());
 
-                cache_t::iterator p = m_cache.find(key);
-                if (p != m_cache.end())
-                {
-                    delete_entry(&p->second, CLOSE_CACHE_DELETE);
-                }
-
-                if (delete_info(key.first, key.second))
-                {
-                    remove_cachefile(key.first, key.second);
-                }
+        for (size_t n = 0; n < candidates.size() && total_size > params.m_max_cache_size;)
+        {
+            // Release the lock after each batch so that opening files is not blocked for long
+            std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-                total_size -= filesizes[n++];
+            for (size_t batch = 0; batch < CACHE_PRUNE_BATCH && n < candidates.size() && total_size > params.m_max_cache_size; batch++, n++)
+            {
+                evict(candidates[n]);
 
-                if (total_size <= params.m_max_cache_size)
-                {
-                    break;
-                }
+                total_size -= candidates[n].m_size;
             }
-
-            Logging::trace(m_cacheidx_file, "%1 left in cache.", format_size(total_size).c_str());
         }
-        else
-        {
-            Logging::error(m_cacheidx_file, "Failed to execute select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), expanded_sql(stmt).c_str());
-        }
-    }
 
-    sqlite3_finalize(stmt);
+        Logging::trace(m_cacheidx_file, "%1 left in cache.", format_size(total_size).c_str());
+    }
 
     return true;
 }
@@ -682,68 +1482,32 @@ bool Cache::prune_disk_space(size_t predicted_filesize)
         return false;
     }
 
-    std::lock_guard<std::recursive_mutex> lck (m_mutex);
-
     Logging::trace(cachepath, "%1 disk space before prune.", format_size(free_bytes).c_str());
     if (free_bytes < params.m_min_diskspace + predicted_filesize)
     {
-        std::vector<cache_key_t> keys;
-        std::vector<size_t> filesizes;
-        sqlite3_stmt * stmt;
-        const char * sql;
-
-        sql = "SELECT filename, desttype, encoded_filesize FROM cache_entry ORDER BY access_time ASC;\n";
-
-        sqlite3_prepare(m_cacheidx_db, sql, -1, &stmt, nullptr);
+        std::vector<CACHE_CANDIDATE> candidates;
+        size_t total_size;
 
-        int ret = 0;
-        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        if (!eviction_candidates(&candidates, &total_size))
         {
-            const char *filename = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-            const char *desttype = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-            size_t size = static_cast<size_t>(sqlite3_column_int64(stmt, 2));
-
-            keys.push_back(std::make_pair(filename, desttype));
-            filesizes.push_back(size);
+            return true;
         }
 
-        Logging::trace(cachepath, "Pruning %1 of oldest cache entries to keep disk space above %2 limit...", format_size(params.m_min_diskspace + predicted_filesize - free_bytes).c_str(), format_size(params.m_min_diskspace).c_str());
+        Logging::trace(cachepath, "Pruning %1 of cache entries to keep disk space above %2 limit (%3 policy)...", format_size(params.m_min_diskspace + predicted_filesize - free_bytes).c_str(), format_size(params.m_min_diskspace).c_str(), m_policy->name());
 
-        if (ret == SQLITE_DONE)
+        for (size_t n = 0; n < candidates.size() && free_bytes < params.m_min_diskspace + predicted_filesize;)
         {
-            size_t n = 0;
-            for (std::vector<cache_key_t>::const_iterator it = keys.begin(); it != keys.end(); it++)
-            {
-                const cache_key_t & key = *it;
-
-                Logging::trace(cachepath, "Pruning: %1 Type: %2", key.first.c_str(), key.second.c_str());
-
-                cache_t::iterator p = m_cache.find(key);
-                if (p != m_cache.end())
-                {
-                    delete_entry(&p->second, CLOSE_CACHE_DELETE);
-                }
+            // Release the lock after each batch so that opening files is not blocked for long
+            std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-                if (delete_info(key.first, key.second))
-                {
-                    remove_cachefile(key.first, key.second);
-                }
-
-                free_bytes += filesizes[n++];
+            for (size_t batch = 0; batch < CACHE_PRUNE_BATCH && n < candidates.size() && free_bytes < params.m_min_diskspace + predicted_filesize; batch++, n++)
+            {
+                evict(candidates[n]);
 
-                if (free_bytes >= params.m_min_diskspace + predicted_filesize)
-                {
-                    break;
-                }
+                free_bytes += candidates[n].m_size;
             }
-            Logging::trace(cachepath, "Disk space after prune: %1", format_size(free_bytes).c_str());
         }
-        else
-        {
-            Logging::error(cachepath, "Failed to execute select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), expanded_sql(stmt).c_str());
-        }
-
-        sqlite3_finalize(stmt);
+        Logging::trace(cachepath, "Disk space after prune: %1", format_size(free_bytes).c_str());
     }
 
     return true;
@@ -753,6 +1517,9 @@ bool Cache::maintenance(size_t predicted_filesize)
 {
     bool success = true;
 
+    // The cache lock is released between batches, do not let two runs remove the same entries
+    std::lock_guard<std::mutex> lock_maintenance(m_maintenance_mutex);
+
     // Find and remove expired cache entries
     success &= prune_expired();
 
@@ -765,49 +1532,99 @@ bool Cache::maintenance(size_t predicted_filesize)
     return success;
 }
 
+bool Cache::has_room(size_t predicted_filesize)
+{
+    if (params.m_max_cache_size)
+    {
+        sqlite3_stmt * stmt;
+        const char * sql = "SELECT SUM(disk_size) FROM cache_entry;\n";
+        size_t total_size = 0;
+
+        std::lock_guard<std::recursive_mutex> lck (m_mutex);
+
+        flush_pending();
+
+        sqlite3_prepare(m_cacheidx_db, sql, -1, &stmt, nullptr);
+
+        int ret = sqlite3_step(stmt);
+        if (ret == SQLITE_ROW)
+        {
+            total_size = static_cast<size_t>(sqlite3_column_int64(stmt, 0));
+        }
+        else if (ret != SQLITE_DONE)
+        {
+            Logging::error(m_cacheidx_file, "Failed to execute select: (%1) %2\n%3", ret, sqlite3_errmsg(m_cacheidx_db), expanded_sql(stmt).c_str());
+        }
+
+        sqlite3_finalize(stmt);
+
+        if (total_size + predicted_filesize > params.m_max_cache_size)
+        {
+            Logging::trace(m_cacheidx_file, "No room in cache: %1 used, %2 required, limit is %3.", format_size(total_size).c_str(), format_size(predicted_filesize).c_str(), format_size(params.m_max_cache_size).c_str());
+            return false;
+        }
+    }
+
+    std::string cachepath;
+
+    transcoder_cache_path(cachepath);
+
+    size_t free_bytes = get_disk_free(cachepath);
+
+    if (!free_bytes && errno)
+    {
+        Logging::error(cachepath, "has_room() cannot determine free disk space: (%1) %2", errno, strerror(errno));
+        return false;
+    }
+
+    if (free_bytes < params.m_min_diskspace + predicted_filesize)
+    {
+        Logging::trace(cachepath, "No room on cache drive: %1 free, %2 required.", format_size(free_bytes).c_str(), format_size(params.m_min_diskspace + predicted_filesize).c_str());
+        return false;
+    }
+
+    return true;
+}
+
 bool Cache::clear()
 {
     bool success = true;
 
     std::lock_guard<std::recursive_mutex> lck (m_mutex);
 
-    std::vector<cache_key_t> keys;
+    std::vector<CACHE_CANDIDATE> keys;
     sqlite3_stmt * stmt;
     const char * sql;
 
-    sql = "SELECT filename, desttype FROM cache_entry;\n";
+    sql = "SELECT filename, desttype, settings_key FROM cache_entry;\n";
+
+    flush_pending();
 
     sqlite3_prepare(m_cacheidx_db, sql, -1, &stmt, nullptr);
 
     int ret = 0;
     while((ret = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-        const char *filename = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-        const char *desttype = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        CACHE_CANDIDATE key;
 
-        keys.push_back(std::make_pair(filename, desttype));
+        key.m_filename      = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+        key.m_desttype      = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        key.m_settings_key  = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+
+        keys.push_back(key);
     }
 
     Logging::trace(m_cacheidx_file, "Clearing all %1 entries from cache...", keys.size());
 
     if (ret == SQLITE_DONE)
     {
-        for (std::vector<cache_key_t>::const_iterator it = keys.begin(); it != keys.end(); it++)
+        for (std::vector<CACHE_CANDIDATE>::const_iterator it = keys.begin(); it != keys.end(); it++)
         {
-            const cache_key_t & key = *it;
-
-            Logging::trace(m_cacheidx_file, "Pruning: %1 Type: %2", key.first.c_str(), key.second.c_str());
+            const CACHE_CANDIDATE & key = *it;
 
-            cache_t::iterator p = m_cache.find(key);
-            if (p != m_cache.end())
-            {
-                delete_entry(&p->second, CLOSE_CACHE_DELETE);
-            }
+            Logging::trace(m_cacheidx_file, "Pruning: %1 Type: %2", key.m_filename.c_str(), key.m_desttype.c_str());
 
-            if (delete_info(key.first, key.second))
-            {
-                remove_cachefile(key.first, key.second);
-            }
+            remove_entry(key.m_filename, key.m_desttype, key.m_settings_key);
         }
     }
     else
@@ -820,13 +1637,20 @@ bool Cache::clear()
     return success;
 }
 
-bool Cache::remove_cachefile(const std::string & filename, const std::string & desttype)
+bool Cache::remove_cachefile(const std::string & filename, const std::string & desttype, const std::string & content_key, const std::string & settings_key)
 {
     std::string cachefile;
 
-    Buffer::make_cachefile_name(cachefile, filename, desttype);
+    if (settings_key.empty())
+    {
+        legacy_cachefile_name(cachefile, filename, desttype, content_key);
+    }
+    else
+    {
+        Buffer::make_cachefile_name(cachefile, filename, desttype, content_key, settings_key);
+    }
 
-    return Buffer::remove_file(cachefile);
+    return Buffer::remove_unused(cachefile);
 }
 
 std::string Cache::expanded_sql(sqlite3_stmt *pStmt)
@@ -30,9 +30,18 @@
 #pragma once
 
 #include "buffer.h"
+#include "cache_policy.h"
 
 #include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <sqlite3.h>
+
+#define CACHE_INDEX_VERSION     4               /**< @brief Current version of the cache index structure, see Cache::upgrade_index() */
+#define CACHE_PRUNE_BATCH       32              /**< @brief Max. number of entries pruned while holding the cache lock */
+#define CACHE_SELECT_PAGE       256             /**< @brief Max. number of index rows read while holding the cache lock */
+
 /**
   * @brief Cache information block
   */
@@ -49,6 +58,7 @@ typedef struct CACHE_INFO
     bool            m_deinterlace;              /**< @brief true if video was deinterlaced */
     size_t          m_predicted_filesize;       /**< @brief Predicted file size */
     size_t          m_encoded_filesize;         /**< @brief Actual file size after encode */
+    size_t          m_disk_size;                /**< @brief Size of the cache file on disk, less than m_encoded_filesize if compressed */
     bool            m_finished;                 /**< @brief true if decode has finished */
     bool            m_error;                    /**< @brief true if encode failed */
     int             m_errno;                    /**< @brief errno if encode failed */
@@ -58,6 +68,13 @@ typedef struct CACHE_INFO
     time_t          m_file_time;                /**< @brief Source file file time */
     size_t          m_file_size;                /**< @brief Source file file size */
     unsigned int    m_access_count;             /**< @brief Read access counter */
+    int64_t         m_duration;                 /**< @brief Duration of source file in AV_TIME_BASE fractional seconds, 0 if unknown */
+    int64_t         m_transcode_time;           /**< @brief Wall clock time the transcode took in ms */
+    int64_t         m_cpu_time;                 /**< @brief Share of process CPU time the transcode took in ms, including codec and helper threads */
+    int64_t         m_output_bitrate;           /**< @brief Average bitrate of transcoded file in bit/s */
+    unsigned int    m_hit_count;                /**< @brief Number of times the file has been opened */
+    std::string     m_content_key;              /**< @brief Key of source file content if cache files are shared by content, empty otherwise */
+    std::string     m_settings_key;             /**< @brief Key of the settings the file was transcoded with, see make_settings_key() */
 } CACHE_INFO;
 typedef CACHE_INFO const *LPCCACHE_INFO;        /**< @brief Pointer version of CACHE_INFO */
 typedef CACHE_INFO *LPCACHE_INFO;               /**< @brief Pointer to const version of CACHE_INFO */
@@ -124,6 +141,16 @@ public:
      * @return Returns true on success; false on error.
      */
     bool                    maintenance(size_t predicted_filesize = 0);
+    /**
+     * @brief Check if a file fits into the cache without pruning other entries.
+     *
+     * Checks the max. cache size and min. disk space limits, but unlike maintenance()
+     * never removes anything.
+     *
+     * @param[in] predicted_filesize - Size of the file to be added.
+     * @return Returns true if the file fits, false if not.
+     */
+    bool                    has_room(size_t predicted_filesize);
     /**
      * @brief Clear cache: deletes all entries.
      * @return Returns true on success; false on error.
@@ -146,11 +173,16 @@ public:
     bool                    prune_disk_space(size_t predicted_filesize);
     /**
      * @brief Remove a cache file from disk.
+     *
+     * Files another instance is transcoding are kept.
      * @param[in] filename - Source file name.
      * @param[in] desttype - Destination type (MP4, WEBM etc.).
+     * @param[in] content_key - Key of source file content, may be empty.
+     * @param[in] settings_key - Key of the settings the file was transcoded with, empty for files of earlier releases
+     * stored below the mount point.
      * @return Returns true on success; false on error.
      */
-    bool                    remove_cachefile(const std::string & filename, const std::string &desttype);
+    bool                    remove_cachefile(const std::string & filename, const std::string &desttype, const std::string & content_key, const std::string & settings_key);
 
 protected:
     /**
@@ -159,26 +191,87 @@ protected:
      * @return Returns true on success; false on error.
      */
     bool                    read_info(LPCACHE_INFO cache_info);
+    /**
+     * @brief Read cache file info of another source file with the same content.
+     *
+     * Used if a file is not known by its name yet, but a file with the same
+     * content has already been transcoded. The source file time and size are
+     * taken from the file itself.
+     * @param[in, out] cache_info - Structure with cache info data, m_content_key must be set.
+     * @return Returns true if an entry was found; false if not or on error.
+     */
+    bool                    read_shared_info(LPCACHE_INFO cache_info);
+    /**
+     * @brief Count the entries sharing the cache file of an entry.
+     * @note m_mutex must be locked by caller.
+     * @param[in] filename - Source file name.
+     * @param[in] desttype - Destination type (MP4, WEBM etc.).
+     * @param[in] settings_key - Key of the settings the entry was transcoded with.
+     * @param[out] content_key - Content key of the entry, empty if it is cached by file name.
+     * @return Returns the number of entries using the cache file, including the entry itself.
+     * Queued updates are written first. If that fails, 2 is returned so that the file is kept.
+     */
+    unsigned int            content_refs(const std::string & filename, const std::string & desttype, const std::string & settings_key, std::string *content_key);
+    /**
+     * @brief Remove a cache entry, its info and its cache file.
+     *
+     * A cache file shared by source files with the same content is only removed
+     * together with the last entry using it.
+     * @note m_mutex must be locked by caller.
+     * @param[in] filename - Source file name.
+     * @param[in] desttype - Destination type (MP4, WEBM etc.).
+     * @param[in] settings_key - Key of the settings the entry was transcoded with.
+     */
+    void                    remove_entry(const std::string & filename, const std::string & desttype, const std::string & settings_key);
     /**
      * @brief Write cache file info.
+     *
+     * If delayed writes are enabled (see FFMPEGFS_PARAMS::m_db_write_delay), the row is
+     * only queued and written later together with others in one transaction. Repeated
+     * updates of the same entry are merged.
+     *
      * @param[in] cache_info - Structure with cache info data.
      * @return Returns true on success; false on error.
      */
     bool                    write_info(LPCCACHE_INFO cache_info);
+    /**
+     * @brief Write cache file info to the database immediately.
+     * @note m_mutex must be locked by caller.
+     * @param[in] cache_info - Structure with cache info data.
+     * @return Returns true on success; false on error.
+     */
+    bool                    insert_info(LPCCACHE_INFO cache_info);
+    /**
+     * @brief Write all queued cache file infos in one transaction.
+     * @return Returns true on success; false on error.
+     */
+    bool                    flush_pending();
+    /**
+     * @brief Thread that writes queued cache file infos.
+     */
+    void                    writer_thread();
+    /**
+     * @brief Stop the writer thread and write all queued cache file infos.
+     */
+    void                    stop_writer();
     /**
      * @brief Delete cache file info.
      * @param[in] filename - Source file name.
      * @param[in] desttype - Destination type (MP4, WEBM etc.).
+     * @param[in] settings_key - Key of the settings the entry was transcoded with.
      * @return Returns true on success; false on error.
      */
-    bool                    delete_info(const std::string & filename, const std::string & desttype);
+    bool                    delete_info(const std::string & filename, const std::string & desttype, const std::string & settings_key);
     /**
      * @brief Create cache entry object for a VIRTUALFILE.
      * @param[in] virtualfile - virtualfile struct of a file.
      * @param[in] desttype - Destination type (MP4, WEBM etc.).
+     * @param[in] content_key - Content key as made by Cache_Entry::make_key(), empty to cache by file name.
+     * @param[in] content_time - Modification time of the source file when the content key was made.
+     * @param[in] content_size - Size of the source file when the content key was made.
      * @return On success, returns pointer to a Cache_Entry. On error, returns nullptr.
      */
-    Cache_Entry*            create_entry(LPVIRTUALFILE virtualfile, const std::string & desttype);
+    Cache_Entry*            create_entry(LPVIRTUALFILE virtualfile, const std::string & desttype, const std::string & content_key, time_t content_time, size_t content_size);
     /**
      * @brief Delete cache entry object.
      * @param[in, out] cache_entry - Cache entry object to be closed.
@@ -186,6 +279,50 @@ protected:
      * @return Returns true if the object was deleted; false if not.
      */
     bool                    delete_entry(Cache_Entry **cache_entry, int flags);
+    /**
+     * @brief Get all cache entries in the order they should be pruned.
+     * @note m_mutex must NOT be locked by caller. The index is read in pages of
+     * CACHE_SELECT_PAGE rows, locking m_mutex for each page only, and the
+     * policy sort runs without the lock.
+     * @param[out] candidates - Cache entries, sorted by the eviction policy.
+     * @param[out] total_size - Size of all entries.
+     * @return Returns true on success; false on error.
+     */
+    bool                    eviction_candidates(std::vector<CACHE_CANDIDATE> *candidates, size_t *total_size);
+    /**
+     * @brief Remove an entry chosen by the eviction policy.
+     * @note m_mutex must be locked by caller.
+     * @param[in] candidate - Cache entry to remove.
+     */
+    void                    evict(const CACHE_CANDIDATE & candidate);
+    /**
+     * @brief Get version of the cache index structure.
+     * @param[out] version - Version stored in the database, 0 for databases of earlier releases.
+     * @return Returns true on success; false on error.
+     */
+    bool                    index_version(int *version);
+    /**
+     * @brief Upgrade cache index structure to the current version.
+     *
+     * Runs all upgrade steps from the version stored in the database up to
+     * #CACHE_INDEX_VERSION, each one in an immediate transaction of its own.
+     * The version is read again within every transaction, so instances started
+     * at the same time do not run a step twice. Existing entries are kept.
+     *
+     * @return Returns true on success; false on error.
+     */
+    bool                    upgrade_index();
+    /**
+     * @brief Take over entries of releases before settings keys.
+     *
+     * Entries of earlier releases have an empty settings key. Those transcoded with the
+     * bit rates, sample rate, video size and deinterlace setting of this instance get its
+     * settings key, and their cache files are renamed accordingly. Other entries are
+     * left alone until they expire.
+     *
+     * @return Returns true on success; false on error.
+     */
+    bool                    adopt_legacy_entries();
     /**
      * @brief Close cache index.
      */
@@ -202,9 +339,22 @@ private:
     std::string             m_cacheidx_file;                /**< @brief Name of SQLite cache index database */
     sqlite3*                m_cacheidx_db;                  /**< @brief SQLite handle of cache index database */
     sqlite3_stmt *          m_cacheidx_select_stmt;         /**< @brief Prepared select statement */
+    sqlite3_stmt *          m_cacheidx_select_content_stmt; /**< @brief Prepared select statement by content key */
     sqlite3_stmt *          m_cacheidx_insert_stmt;         /**< @brief Prepared insert statement */
     sqlite3_stmt *          m_cacheidx_delete_stmt;         /**< @brief Prepared delete statement */
     cache_t                 m_cache;                        /**< @brief Cache file (memory mapped file) */
+    Cache_Policy *          m_policy;                       /**< @brief Decides which entries are pruned first */
+    std::mutex              m_maintenance_mutex;            /**< @brief Only one maintenance run at a time */
+
+    std::mutex              m_pending_mutex;                /**< @brief Protects m_pending, m_committing and the counters */
+    std::map<cache_key_t, CACHE_INFO> m_pending;            /**< @brief Cache infos waiting to be written */
+    std::map<cache_key_t, CACHE_INFO> m_committing;         /**< @brief Cache infos currently being written */
+    std::thread             m_writer;                       /**< @brief Writer thread, started with the first delayed write */
+    std::condition_variable m_writer_cond;                  /**< @brief Wakes up the writer thread */
+    bool                    m_writer_exit;                  /**< @brief If true, the writer thread ends */
+    uint64_t                m_rows_queued;                  /**< @brief Number of cache infos queued */
+    uint64_t                m_rows_coalesced;               /**< @brief Number of cache infos merged with a queued one */
+    uint64_t                m_rows_committed;               /**< @brief Number of cache infos written by the writer */
 };
 
 #endif
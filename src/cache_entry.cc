@@ -33,10 +33,14 @@
 
 #include <string.h>
 
-Cache_Entry::Cache_Entry(Cache *owner, LPVIRTUALFILE virtualfile)
+Cache_Entry::Cache_Entry(Cache *owner, LPVIRTUALFILE virtualfile, const std::string & content_key, time_t content_time, size_t content_size)
     : m_owner(owner)
     , m_ref_count(0)
     , m_virtualfile(virtualfile)
+    , m_content_time(content_time)
+    , m_content_size(content_size)
+    , m_seek_to(0)
+    , m_restart(false)
 {
     m_cache_info.m_origfile = virtualfile->m_origfile;
 
@@ -45,7 +49,14 @@ Cache_Entry::Cache_Entry(Cache *owner, LPVIRTUALFILE virtualfile)
     m_cache_info.m_desttype[0] = '\0';
     strncat(m_cache_info.m_desttype, params.current_format(virtualfile)->desttype().c_str(), sizeof(m_cache_info.m_desttype) - 1);
 
-    m_buffer = new(std::nothrow) Buffer;
+    m_cache_info.m_hit_count = 0;   // Not reset by clear(), counts for the life time of the entry
+
+    // Instances with other settings use their own cache file and entry
+    m_cache_info.m_settings_key = make_settings_key();
+
+    m_cache_info.m_content_key = content_key;
+
+    m_buffer = new(std::nothrow) Buffer(m_cache_info.m_content_key, m_cache_info.m_settings_key, streamable() ? params.m_stream_buffer_size : 0);
 
     if (m_buffer != nullptr)
     {
@@ -68,9 +79,34 @@ Cache_Entry::~Cache_Entry()
     Logging::trace(filename(), "Deleted buffer.");
 }
 
-Cache_Entry * Cache_Entry::create(Cache *owner, LPVIRTUALFILE virtualfile)
+Cache_Entry * Cache_Entry::create(Cache *owner, LPVIRTUALFILE virtualfile, const std::string & content_key, time_t content_time, size_t content_size)
 {
-    return new(std::nothrow) Cache_Entry(owner, virtualfile);
+    return new(std::nothrow) Cache_Entry(owner, virtualfile, content_key, content_time, content_size);
+}
+
+void Cache_Entry::make_key(LPVIRTUALFILE virtualfile, std::string *content_key, time_t *content_time, size_t *content_size)
+{
+    struct stat sb;
+
+    content_key->clear();
+    *content_time = 0;
+    *content_size = 0;
+
+    if (params.m_cache_key != CACHE_KEY_CONTENT || virtualfile->m_type != VIRTUALTYPE_REGULAR)
+    {
+        return;
+    }
+
+    if (stat(virtualfile->m_origfile.c_str(), &sb) == 0 && make_content_key(virtualfile->m_origfile, content_key))
+    {
+        *content_time = sb.st_mtime;
+        *content_size = static_cast<size_t>(sb.st_size);
+    }
+    else
+    {
+        Logging::warning(virtualfile->m_origfile, "Could not make content key, caching by file name: (%1) %2", errno, strerror(errno));
+        content_key->clear();
+    }
 }
 
 bool Cache_Entry::destroy()
@@ -85,6 +121,8 @@ bool Cache_Entry::destroy()
 void Cache_Entry::clear(bool fetch_file_time /*= true*/)
 {
     m_is_decoding = false;
+    m_seek_to = 0;
+    m_restart = false;
 
     // Initialise ID3v1.1 tag structure
     init_id3v1(&m_id3v1);
@@ -102,12 +140,17 @@ void Cache_Entry::clear(bool fetch_file_time /*= true*/)
 #endif  // USING_LIBAV
     m_cache_info.m_predicted_filesize   = 0;
     m_cache_info.m_encoded_filesize     = 0;
+    m_cache_info.m_disk_size            = 0;
     m_cache_info.m_finished             = false;
     m_cache_info.m_error                = false;
     m_cache_info.m_errno                = 0;
     m_cache_info.m_averror              = 0;
     m_cache_info.m_access_time          = m_cache_info.m_creation_time = time(nullptr);
     m_cache_info.m_access_count         = 0;
+    m_cache_info.m_duration             = 0;
+    m_cache_info.m_transcode_time       = 0;
+    m_cache_info.m_cpu_time             = 0;
+    m_cache_info.m_output_bitrate       = 0;
 
     if (fetch_file_time)
     {
@@ -131,6 +174,95 @@ void Cache_Entry::clear(bool fetch_file_time /*= true*/)
     }
 }
 
+bool Cache_Entry::resumable() const
+{
+    switch (params.current_format(m_virtualfile)->filetype())
+    {
+    case FILETYPE_WAV:
+    case FILETYPE_AIFF:
+    {
+        return true;
+    }
+    default:
+    {
+        return false;
+    }
+    }
+}
+
+bool Cache_Entry::compressible() const
+{
+    if (!params.m_compress_cache || (m_buffer != nullptr && m_buffer->is_stream()))
+    {
+        return false;
+    }
+
+    switch (params.current_format(m_virtualfile)->filetype())
+    {
+    case FILETYPE_WAV:
+    case FILETYPE_AIFF:
+    case FILETYPE_PRORES:
+    {
+        return true;
+    }
+    default:
+    {
+        return false;
+    }
+    }
+}
+
+bool Cache_Entry::stream_format(const FFmpegfs_Format *format)
+{
+    switch (format->filetype())
+    {
+    case FILETYPE_MP3:
+    case FILETYPE_OGG:
+    case FILETYPE_OPUS:
+    case FILETYPE_WEBM:
+    {
+        return true;
+    }
+    case FILETYPE_MP4:
+    {
+        // Only the fragmented profiles write the moov atom first and never go back
+        return (params.m_profile == PROFILE_MP4_FF || params.m_profile == PROFILE_MP4_EDGE);
+    }
+    default:
+    {
+        return false;
+    }
+    }
+}
+
+bool Cache_Entry::streamable() const
+{
+    if (!params.m_stream_buffer_size || !stream_format(params.current_format(m_virtualfile)))
+    {
+        return false;
+    }
+
+    switch (m_virtualfile->m_type)
+    {
+#ifdef USE_LIBVCD
+    case VIRTUALTYPE_VCD:
+#endif // USE_LIBVCD
+#ifdef USE_LIBDVD
+    case VIRTUALTYPE_DVD:
+#endif // USE_LIBDVD
+#ifdef USE_LIBBLURAY
+    case VIRTUALTYPE_BLURAY:
+#endif // USE_LIBBLURAY
+    {
+        return true;
+    }
+    default:
+    {
+        return false;
+    }
+    }
+}
+
 bool Cache_Entry::read_info()
 {
     return m_owner->read_info(&m_cache_info);
@@ -138,19 +270,37 @@ bool Cache_Entry::read_info()
 
 bool Cache_Entry::write_info()
 {
+    if (m_buffer != nullptr && m_buffer->is_follower())
+    {
+        // The instance transcoding the file keeps the index up to date
+        return true;
+    }
+
+    if (m_buffer != nullptr && m_buffer->is_stream())
+    {
+        // Streams are not cached, nothing to remember
+        return true;
+    }
+
     return m_owner->write_info(&m_cache_info);
 }
 
 bool Cache_Entry::delete_info()
 {
-    return m_owner->delete_info(filename(), m_cache_info.m_desttype);
+    if (m_buffer != nullptr && m_buffer->is_follower())
+    {
+        // The entry belongs to the instance transcoding the file
+        return true;
+    }
+
+    return m_owner->delete_info(filename(), m_cache_info.m_desttype, m_cache_info.m_settings_key);
 }
 
 bool Cache_Entry::update_access(bool update_database /*= false*/)
 {
     m_cache_info.m_access_time = time(nullptr);
 
-    if (update_database)
+    if (update_database && !m_buffer->is_stream())
     {
         return m_owner->write_info(&m_cache_info);
     }
@@ -173,6 +323,13 @@ bool Cache_Entry::open(bool create_cache /*= true*/)
         return true;
     }
 
+    if (m_buffer->is_stream())
+    {
+        // Nothing is kept from earlier runs, start from scratch
+        clear(false);
+        return (!create_cache || m_buffer->init());
+    }
+
     bool erase_cache = !read_info();    // If read_info fails, rebuild cache entry
 
     if (!create_cache)
@@ -180,11 +337,14 @@ bool Cache_Entry::open(bool create_cache /*= true*/)
         return true;
     }
 
-    if (!m_cache_info.m_finished)
+    m_cache_info.m_hit_count++;
+
+    if (!m_cache_info.m_finished && (m_cache_info.m_error || !resumable()))
     {
         // If no database entry found (database is not consistent),
         // or file was not completely transcoded last time,
-        // simply create a new file.
+        // simply create a new file. Only uncompressed audio
+        // can be resumed where it was left.
         erase_cache = true;
     }
 
@@ -196,6 +356,13 @@ bool Cache_Entry::open(bool create_cache /*= true*/)
     // Open the cache
     if (m_buffer->init(erase_cache))
     {
+        if (m_cache_info.m_finished && !m_buffer->is_follower() && m_buffer->buffer_watermark() < m_cache_info.m_encoded_filesize)
+        {
+            // E.g. kept in memory and not written back before ffmpegfs ended
+            Logging::warning(filename(), "Cache file is incomplete, transcoding it again.");
+            m_cache_info.m_finished = false;
+            m_buffer->clear();
+        }
         return true;
     }
     else
@@ -385,6 +552,18 @@ bool Cache_Entry::outdated() const
     return false;
 }
 
+bool Cache_Entry::content_changed() const
+{
+    struct stat sb;
+
+    if (m_cache_info.m_content_key.empty() || stat(filename().c_str(), &sb) == -1)
+    {
+        return false;
+    }
+
+    return (sb.st_mtime != m_content_time || static_cast<size_t>(sb.st_size) != m_content_size);
+}
+
 LPVIRTUALFILE Cache_Entry::virtualfile()
 {
     return m_virtualfile;
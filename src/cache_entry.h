@@ -33,7 +33,10 @@
 
 #include "id3v1tag.h"
 
+#include <atomic>
+
 class Buffer;
+class FFmpegfs_Format;
 
 /**
  * @brief The #Cache_Entry class
@@ -45,8 +48,11 @@ private:
      * @brief Create Cache_Entry object.
      * @param[in] owner - Cache object of owner.
      * @param[in] virtualfile - Requesting virtual file.
+     * @param[in] content_key - Content key as made by make_key(), empty to cache by file name.
+     * @param[in] content_time - Modification time of the source file when the content key was made.
+     * @param[in] content_size - Size of the source file when the content key was made.
      */
-    explicit Cache_Entry(Cache *owner, LPVIRTUALFILE virtualfile);
+    explicit Cache_Entry(Cache *owner, LPVIRTUALFILE virtualfile, const std::string & content_key, time_t content_time, size_t content_size);
     /**
      * @brief Destroy Cache_Entry object.
      */
@@ -57,9 +63,22 @@ public:
      * @brief Create a new Cache_Entry object.
      * @param[in] owner - Cache object of owner.
      * @param[in] virtualfile - Requesting virtual file.
+     * @param[in] content_key - Content key as made by make_key(), empty to cache by file name.
+     * @param[in] content_time - Modification time of the source file when the content key was made.
+     * @param[in] content_size - Size of the source file when the content key was made.
      * @return On success, returns a Cache_Entry object; on error (out of memory) returns a nullptr
      */
-    static Cache_Entry *    create(Cache *owner, LPVIRTUALFILE virtualfile);
+    static Cache_Entry *    create(Cache *owner, LPVIRTUALFILE virtualfile, const std::string & content_key = "", time_t content_time = 0, size_t content_size = 0);
+    /**
+     * @brief Make the content key of a source file if cache files are shared by content.
+     *
+     * Reads parts of the source file, so do not call it while the cache is locked.
+     * @param[in] virtualfile - Requesting virtual file.
+     * @param[out] content_key - Content key, empty if the file is cached by file name.
+     * @param[out] content_time - Modification time of the source file when the key was made.
+     * @param[out] content_size - Size of the source file when the key was made.
+     */
+    static void             make_key(LPVIRTUALFILE virtualfile, std::string *content_key, time_t *content_time, size_t *content_size);
     /**
      * @brief Destroy this Cache_Entry object.
      * @return true if object was destroyed right away; false if it will be destroyed later (NOT IMPLEMENTED, WILL BE DESTROYED AT ONCE).
@@ -152,6 +171,59 @@ public:
      * @brief Check if cache entry needs to be recoded
      */
     bool                    outdated() const;
+    /**
+     * @brief Check if the source file has changed since its content key was made.
+     * @return Returns true if the content key is no longer valid, false if it is or no content key is used.
+     */
+    bool                    content_changed() const;
+    /**
+     * @brief Check if an interrupted transcode can be resumed.
+     *
+     * Only possible for formats where an output position can be exactly
+     * mapped to a play time, i.e. uncompressed audio.
+     *
+     * @todo Video targets always start over. Resuming them needs the muxer
+     * state at the checkpoint (fragment sequence numbers, time stamps, index
+     * entries written so far) and an encoder restarted at a key frame.
+     *
+     * @return Returns true if the destination format can be resumed.
+     */
+    bool                    resumable() const;
+    /**
+     * @brief Check if the cache file should be compressed once complete.
+     *
+     * Only worthwhile for uncompressed formats, and only if enabled by the
+     * --compress_cache option.
+     *
+     * @return Returns true if the cache file should be compressed.
+     */
+    bool                    compressible() const;
+    /**
+     * @brief Check if the file should be streamed instead of cached.
+     *
+     * DVD, Blu-ray and Video CD titles are usually played once from start to
+     * end. If enabled by the --stream_buffer_size option, they are streamed
+     * through a ring buffer and not written to the cache. Only done for
+     * destination formats that never go back to update data already written,
+     * see stream_format().
+     *
+     * @return Returns true if the file should be streamed.
+     */
+    bool                    streamable() const;
+    /**
+     * @brief Check if a destination format can be streamed through a ring buffer.
+     *
+     * The ring buffer cannot take writes before its start. The output is
+     * therefore not seekable when streaming, and only formats whose muxers
+     * then write the file strictly from start to end can be used: MP3, Ogg,
+     * Opus, WebM and fragmented MP4 (profiles with empty_moov). WAV and AIFF
+     * (RIFF/FORM sizes), MOV, ProRes and plain MP4 (mdat size, moov atom)
+     * update their headers when finished.
+     *
+     * @param[in] format - Destination format.
+     * @return Returns true if the format can be streamed.
+     */
+    static bool             stream_format(const FFmpegfs_Format *format);
 
     /**
      * @brief Get the underlying VIRTUALFILE object.
@@ -207,9 +279,14 @@ protected:
 
     LPVIRTUALFILE           m_virtualfile;                  /**< @brief Underlying virtual file object */
 
+    time_t                  m_content_time;                 /**< @brief Modification time of source file when the content key was made */
+    size_t                  m_content_size;                 /**< @brief Size of source file when the content key was made */
+
 public:
     Buffer *                m_buffer;                       /**< @brief Buffer object */
     bool                    m_is_decoding;                  /**< @brief true while file is decoding */
+    std::atomic<size_t>     m_seek_to;                      /**< @brief If not 0, reader requests transcoder to seek ahead to this offset */
+    std::atomic_bool        m_restart;                      /**< @brief If true, reader requests transcoder to stop so that the stream can start over */
     std::recursive_mutex    m_active_mutex;                 /**< @brief Mutex while thread is active */
 
     CACHE_INFO              m_cache_info;                   /**< @brief Info about cached object */
@@ -31,136 +31,121 @@
 #include "ffmpeg_utils.h"
 #include "logging.h"
 
-#include <signal.h>
 #include <unistd.h>
 #include <sys/shm.h>        /* shmat(), IPC_RMID        */
+#include <sys/resource.h>   /* setpriority()            */
+#include <sys/syscall.h>    /* SYS_gettid               */
 #include <semaphore.h>      /* sem_open(), sem_destroy(), sem_wait().. */
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-#define CLOCKID         CLOCK_REALTIME          /**< @brief Use real time clock here. */
-#define SIGMAINT        SIGRTMIN                /**< @brief Map maintenance signal. */
+#define MAINTENANCE_NICE    10                  /**< @brief Nice value of the maintenance thread, so that it does not slow down transcoding and reading */
 
 #define SEM_OPEN_FILE   "/" PACKAGE_NAME "_04806785-b5fb-4615-ba56-b30a2946e80b"    /**< @brief Shared semaphore name, should be unique system wide. */
 
-static sigset_t mask;           /**< @brief Process mask for timer */
-static timer_t  timerid;        /**< @brief Timer id */
+static std::thread              maint_thread;   /**< @brief Maintenance thread */
+static std::mutex               maint_mutex;    /**< @brief Mutex for maint_cond */
+static std::condition_variable  maint_cond;     /**< @brief Signalled to end the maintenance thread */
+static bool                     maint_exit;     /**< @brief If true, the maintenance thread ends */
 
 static sem_t *  sem;            /**< @brief Semaphore used to synchronise between master and slave processes */
 static int      shmid;          /**< @brief Shared memory segment ID */
 static pid_t *  pid_master;     /**< @brief PID of master process */
 static bool     master;         /**< @brief If true, we are master */
 
-static void maintenance_handler(int sig, __attribute__((unused)) siginfo_t *si, __attribute__((unused)) void *uc);
-static bool start_timer(time_t interval);
-static bool stop_timer();
+static void maintenance_thread(time_t interval);
+static bool start_thread(time_t interval);
+static void stop_thread();
 static bool link_up();
 static void master_check();
 static bool link_down();
 
 /**
-  * @brief Run maintenance handler
-  * @param[in] sig - Signal, must be SIGMAINT.
-  * @param[in] si
-  * @param[in] uc
+  * @brief Maintenance thread
+  *
+  * Runs the maintenance every interval seconds, if we are master. Runs with
+  * lowered priority. The cache prunes in small batches, so FUSE requests are
+  * not blocked for long. Every instance logs its statistics each interval.
+  *
+  * @param[in] interval - Interval in seconds.
   */
-static void maintenance_handler(int sig, __attribute__((unused)) siginfo_t *si, __attribute__((unused)) void *uc)
+static void maintenance_thread(time_t interval)
 {
-    if (sig != SIGMAINT)
+#ifdef SYS_gettid
+    // On Linux, each thread has a nice value of its own
+    if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), MAINTENANCE_NICE) == -1)
     {
-        // Wrong signal. Should never happen.
-        return;
+        Logging::debug(nullptr, "Unable to lower priority of maintenance thread: (%1) %2", errno, strerror(errno));
     }
+#endif
 
-    master_check();
+    std::unique_lock<std::mutex> lock(maint_mutex);
 
-    if (master)
+    while (!maint_cond.wait_for(lock, std::chrono::seconds(interval), [] { return maint_exit; }))
     {
-        Logging::info(nullptr, "Running periodic cache maintenance.");
-        transcoder_cache_maintenance();
+        // Do not keep stop_thread() waiting for the lock while we are busy
+        lock.unlock();
+
+        master_check();
+
+        if (master)
+        {
+            Logging::info(nullptr, "Running periodic cache maintenance.");
+            transcoder_cache_maintenance();
+        }
+
+        log_statistics();
+
+        lock.lock();
     }
 }
 
 /**
- * @brief Start the maintenance timer at predefined interval.
- * @param[in] interval - Timer interval in seconds.
- * @return On success, returns true. On error, returns false. Check errno for details.
+ * @brief Start the maintenance thread.
+ * @param[in] interval - Interval in seconds.
+ * @return On success, returns true. On error, returns false.
  */
-static bool start_timer(time_t interval)
+static bool start_thread(time_t interval)
 {
-    struct sigevent sev;
-    struct itimerspec its;
-    long long freq_nanosecs;
-    struct sigaction sa;
+    Logging::trace(nullptr, "Starting maintenance thread with %1period.", format_time(interval).c_str());
 
-    freq_nanosecs = interval * 1000000000LL;
-
-    Logging::trace(nullptr, "Starting maintenance timer with %1period.", format_time(interval).c_str());
-
-    // Establish maintenance_handler for timer signal
-    sa.sa_flags = SA_SIGINFO;
-    sa.sa_sigaction = maintenance_handler;
-    sigemptyset(&sa.sa_mask);
-    if (sigaction(SIGMAINT, &sa, nullptr) == -1)
-    {
-        Logging::error(nullptr, "start_timer(): sigaction failed: (%1) %2", errno, strerror(errno));
-        return false;
-    }
-
-    // Block timer signal temporarily
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGMAINT);
-    if (sigprocmask(SIG_SETMASK, &mask, nullptr) == -1)
-    {
-        Logging::error(nullptr, "start_timer(): sigprocmask(SIG_SETMASK) failed: (%1) %2", errno, strerror(errno));
-        return false;
-    }
+    maint_exit = false;
 
-    // Create the timer
-    sev.sigev_notify = SIGEV_SIGNAL;
-    sev.sigev_signo = SIGMAINT;
-    sev.sigev_value.sival_ptr = &timerid;
-    if (timer_create(CLOCKID, &sev, &timerid) == -1)
+    try
     {
-        Logging::error(nullptr, "start_timer(): timer_create failed: (%1) %2", errno, strerror(errno));
-        return false;
+        maint_thread = std::thread(maintenance_thread, interval);
     }
-
-    // Start the timer
-    its.it_value.tv_sec = freq_nanosecs / 1000000000;
-    its.it_value.tv_nsec = freq_nanosecs % 1000000000;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
-
-    if (timer_settime(timerid, 0, &its, nullptr) == -1)
+    catch (const std::system_error & e)
     {
-        Logging::error(nullptr, "start_timer(): timer_settime failed: (%1) %2", errno, strerror(errno));
+        Logging::error(nullptr, "start_thread(): Unable to start maintenance thread: (%1) %2", e.code().value(), e.what());
         return false;
     }
 
-    if (sigprocmask(SIG_UNBLOCK, &mask, nullptr) == -1)
-    {
-        Logging::error(nullptr, "start_timer(): sigprocmask(SIG_UNBLOCK) failed: (%1) %2", errno, strerror(errno));
-    }
-
-    Logging::trace(nullptr, "Maintenance timer started successfully.");
+    Logging::trace(nullptr, "Maintenance thread started successfully.");
 
     return true;
 }
 
 /**
- * @brief Stop the maintenance timer.
- * @return On success, returns true. On error, returns false. Check errno for details.
+ * @brief Stop the maintenance thread. Waits for a running maintenance to complete.
  */
-static bool stop_timer()
+static void stop_thread()
 {
-    Logging::info(nullptr, "Stopping maintenance timer.");
+    if (!maint_thread.joinable())
+    {
+        return;
+    }
+
+    Logging::info(nullptr, "Stopping maintenance thread.");
 
-    if (timer_delete(timerid) == -1)
     {
-        Logging::error(nullptr, "stop_timer(): timer_delete failed: (%1) %2", errno, strerror(errno));
-        return false;
+        std::lock_guard<std::mutex> lock(maint_mutex);
+        maint_exit = true;
     }
+    maint_cond.notify_all();
 
-    return true;
+    maint_thread.join();
 }
 
 /**
@@ -332,19 +317,16 @@ bool start_cache_maintenance(time_t interval)
         return false;
     }
 
-    // Now start timer
-    return start_timer(interval);
+    // Now start thread
+    return start_thread(interval);
 }
 
 bool stop_cache_maintenance()
 {
     bool success = true;
 
-    // Stop timer first
-    if (!stop_timer())
-    {
-        success = false;
-    }
+    // Stop thread first
+    stop_thread();
 
     // Now shut down link
     if (!link_down())
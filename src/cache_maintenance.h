@@ -18,7 +18,7 @@
  * @file
  * @brief %Cache maintenance
  *
- * Creates a POSIX timer that starts the cache maintenance in preset
+ * Starts a thread that runs the cache maintenance in preset
  * intervals. To ensure that only one instance of FFmpegfs cleans up
  * the cache a shared memory area and a named semaphore is also created.
  *
@@ -40,13 +40,13 @@
 #include <time.h>
 
 /**
- * @brief Start cache maintenance timer.
- * @param[in] interval - Interval in seconds to run timer at.
+ * @brief Start cache maintenance thread.
+ * @param[in] interval - Interval in seconds to run maintenance at.
  * @return On success, returns true. On error, returns false. Check errno for details.
  */
 bool start_cache_maintenance(time_t interval);
 /**
- * @brief Stop cache maintenance timer.
+ * @brief Stop cache maintenance thread.
  * @return On success, returns true. On error, returns false. Check errno for details.
  */
 bool stop_cache_maintenance();
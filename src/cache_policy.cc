@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Cache_Policy class implementation
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#include "cache_policy.h"
+
+#include <algorithm>
+#include <new>
+
+Cache_Policy::Cache_Policy()
+{
+}
+
+Cache_Policy::~Cache_Policy()
+{
+}
+
+Cache_Policy * Cache_Policy::create(CACHE_POLICY policy)
+{
+    switch (policy)
+    {
+    case CACHE_POLICY_LFU:
+    {
+        return new(std::nothrow) Cache_Policy_LFU;
+    }
+    case CACHE_POLICY_GDSF:
+    {
+        return new(std::nothrow) Cache_Policy_GDSF;
+    }
+    case CACHE_POLICY_LRU:
+    default:
+    {
+        return new(std::nothrow) Cache_Policy_LRU;
+    }
+    }
+}
+
+void Cache_Policy::evicted(const CACHE_CANDIDATE & /*candidate*/, time_t /*now*/)
+{
+}
+
+void Cache_Policy::sort(std::vector<CACHE_CANDIDATE> *candidates) const
+{
+    std::vector<std::pair<double, size_t>> order;
+    std::vector<CACHE_CANDIDATE> sorted;
+
+    // Calculate each priority once, not in every comparison
+    order.reserve(candidates->size());
+    for (size_t n = 0; n < candidates->size(); n++)
+    {
+        order.push_back(std::make_pair(priority((*candidates)[n]), n));
+    }
+
+    std::sort(order.begin(), order.end(), [candidates](const std::pair<double, size_t> & a, const std::pair<double, size_t> & b)
+    {
+        if (a.first != b.first)
+        {
+            return a.first < b.first;
+        }
+        // Same priority: least recently used first
+        return (*candidates)[a.second].m_access_time < (*candidates)[b.second].m_access_time;
+    });
+
+    sorted.reserve(candidates->size());
+    for (const std::pair<double, size_t> & o : order)
+    {
+        sorted.push_back((*candidates)[o.second]);
+    }
+
+    candidates->swap(sorted);
+}
+
+const char * Cache_Policy_LRU::name() const
+{
+    return "LRU";
+}
+
+double Cache_Policy_LRU::priority(const CACHE_CANDIDATE & candidate) const
+{
+    return static_cast<double>(candidate.m_access_time);
+}
+
+const char * Cache_Policy_LFU::name() const
+{
+    return "LFU";
+}
+
+double Cache_Policy_LFU::priority(const CACHE_CANDIDATE & candidate) const
+{
+    return static_cast<double>(candidate.m_hit_count);
+}
+
+Cache_Policy_GDSF::Cache_Policy_GDSF()
+    : m_inflation(0)
+{
+}
+
+const char * Cache_Policy_GDSF::name() const
+{
+    return "GDSF";
+}
+
+double Cache_Policy_GDSF::priority(const CACHE_CANDIDATE & candidate) const
+{
+    double size = static_cast<double>(std::max(candidate.m_size, static_cast<size_t>(1)));
+    double cost = candidate.m_cost > 0 ? static_cast<double>(candidate.m_cost) : size / GDSF_DEFAULT_BYTES_PER_MS;
+    double hits = static_cast<double>(std::max(candidate.m_hit_count, 1u));
+
+    return inflation_at(candidate.m_access_time) + hits * cost / size;
+}
+
+void Cache_Policy_GDSF::evicted(const CACHE_CANDIDATE & candidate, time_t now)
+{
+    double prio = priority(candidate);
+    std::lock_guard<std::mutex> lck (m_mutex);
+
+    if (prio <= m_inflation)
+    {
+        return;
+    }
+
+    m_inflation = prio;
+    m_history[now] = m_inflation;
+
+    if (m_history.size() > GDSF_HISTORY_MAX)
+    {
+        m_history.erase(m_history.begin());
+    }
+}
+
+double Cache_Policy_GDSF::inflation_at(time_t t) const
+{
+    std::lock_guard<std::mutex> lck (m_mutex);
+
+    // Value set last at or before t
+    std::map<time_t, double>::const_iterator it = m_history.upper_bound(t);
+
+    if (it == m_history.begin())
+    {
+        return 0;
+    }
+
+    return (--it)->second;
+}
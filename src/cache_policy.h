@@ -0,0 +1,178 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Cache eviction policies
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <time.h>
+#include <stdint.h>
+
+#define GDSF_DEFAULT_BYTES_PER_MS   1024                                /**< @brief Assumed transcoding speed if the cost of an entry is unknown: 1 MB per second */
+#define GDSF_HISTORY_MAX            4096                                /**< @brief Max. number of inflation values remembered */
+
+/**
+  * @brief Cache eviction policies
+  */
+typedef enum CACHE_POLICY
+{
+    CACHE_POLICY_LRU = 0,   /**< @brief Least recently used entries go first. */
+    CACHE_POLICY_LFU,       /**< @brief Least frequently used entries go first, least recently used of these first. */
+    CACHE_POLICY_GDSF,      /**< @brief GreedyDual-Size-Frequency: Cheap to transcode, large and rarely used entries go first. */
+} CACHE_POLICY;
+
+/**
+  * @brief Cache entry considered for eviction
+  */
+typedef struct CACHE_CANDIDATE
+{
+    std::string     m_filename;                 /**< @brief Source file name */
+    std::string     m_desttype;                 /**< @brief Destination type */
+    std::string     m_settings_key;             /**< @brief Key of the settings the file was transcoded with */
+    size_t          m_size;                     /**< @brief Size of the cache file on disk */
+    time_t          m_access_time;              /**< @brief Last access time */
+    unsigned int    m_hit_count;                /**< @brief Number of times the file has been opened */
+    int64_t         m_cost;                     /**< @brief Time in ms needed to transcode the file again, 0 if unknown */
+} CACHE_CANDIDATE;
+
+/**
+ * @brief The #Cache_Policy class
+ *
+ * Decides which cache entries are removed first when the cache runs out of space.
+ * Each entry gets a priority, entries with the lowest priority are removed first.
+ * Not thread safe, callers must serialise access.
+ */
+class Cache_Policy
+{
+public:
+    /**
+     * @brief Construct Cache_Policy object.
+     */
+    explicit Cache_Policy();
+    /**
+     * @brief Destroy Cache_Policy object.
+     */
+    virtual ~Cache_Policy();
+
+    /**
+     * @brief Create policy object.
+     * @param[in] policy - Policy to create.
+     * @return On success, returns the new object. On error (out of memory), returns nullptr.
+     */
+    static Cache_Policy *   create(CACHE_POLICY policy);
+    /**
+     * @brief Get name of policy.
+     * @return Returns the policy name.
+     */
+    virtual const char *    name() const = 0;
+    /**
+     * @brief Get eviction priority of an entry.
+     * @param[in] candidate - Cache entry.
+     * @return Returns the priority, entries with lower priorities are removed first.
+     */
+    virtual double          priority(const CACHE_CANDIDATE & candidate) const = 0;
+    /**
+     * @brief Tell the policy that an entry has been removed.
+     * @param[in] candidate - Cache entry removed.
+     * @param[in] now - Current time.
+     */
+    virtual void            evicted(const CACHE_CANDIDATE & candidate, time_t now);
+    /**
+     * @brief Sort entries in the order they should be removed.
+     * @param[in, out] candidates - Cache entries to sort.
+     */
+    void                    sort(std::vector<CACHE_CANDIDATE> *candidates) const;
+};
+
+/**
+ * @brief The #Cache_Policy_LRU class
+ *
+ * Removes the least recently used entries first.
+ */
+class Cache_Policy_LRU : public Cache_Policy
+{
+public:
+    virtual const char *    name() const;
+    virtual double          priority(const CACHE_CANDIDATE & candidate) const;
+};
+
+/**
+ * @brief The #Cache_Policy_LFU class
+ *
+ * Removes the least frequently used entries first. Of entries used equally often,
+ * the least recently used is removed first.
+ */
+class Cache_Policy_LFU : public Cache_Policy
+{
+public:
+    virtual const char *    name() const;
+    virtual double          priority(const CACHE_CANDIDATE & candidate) const;
+};
+
+/**
+ * @brief The #Cache_Policy_GDSF class
+ *
+ * GreedyDual-Size-Frequency: The priority of an entry is L + hits * cost / size.
+ * Large files that are quick to transcode and rarely used are removed first.
+ *
+ * L is an inflation value that is raised to the priority of every entry removed,
+ * so that entries that have not been used for a long time eventually go even if they
+ * once were popular. L is taken at the time an entry was last accessed. As the
+ * cache index only stores the access time, the values of L over time are remembered
+ * here. They start again at 0 after a restart.
+ */
+class Cache_Policy_GDSF : public Cache_Policy
+{
+public:
+    /**
+     * @brief Construct Cache_Policy_GDSF object.
+     */
+    explicit Cache_Policy_GDSF();
+
+    virtual const char *    name() const;
+    virtual double          priority(const CACHE_CANDIDATE & candidate) const;
+    virtual void            evicted(const CACHE_CANDIDATE & candidate, time_t now);
+
+protected:
+    /**
+     * @brief Get inflation value at a certain time.
+     * @param[in] t - Time.
+     * @return Returns the value of L at time t.
+     */
+    double                  inflation_at(time_t t) const;
+
+protected:
+    mutable std::mutex      m_mutex;            /**< @brief Protects m_inflation and m_history, priorities are calculated without the cache lock */
+    double                  m_inflation;        /**< @brief Current inflation value L */
+    std::map<time_t, double> m_history;         /**< @brief Inflation values by time they were set */
+};
+
+#endif // CACHE_POLICY_H
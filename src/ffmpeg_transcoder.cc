@@ -67,6 +67,85 @@ extern "C" {
 #endif
 #pragma GCC diagnostic pop
 
+#define EXACT_SIZE_RESERVE          (64 * 1024)                         /**< @brief Fixed extra room per stream in exact size mode */
+#define EXACT_SIZE_RESERVE_PERCENT  2                                   /**< @brief Extra room per stream in exact size mode, in percent of the stream size */
+#define MP3_ENCODER_DELAY           576                                 /**< @brief Samples LAME adds in front of the audio */
+#define MP3_MIN_PADDING             576                                 /**< @brief Min. number of samples LAME adds after the audio */
+
+/**
+ * @brief Position and size of the output of a muxer dry run
+ */
+typedef struct HEADER_COUNT
+{
+    int64_t m_pos;                                                      /**< @brief Current write position */
+    int64_t m_size;                                                     /**< @brief Number of bytes written */
+} HEADER_COUNT;
+
+/**
+ * @brief Write function for a muxer dry run, only counts the bytes.
+ * @param[in] opaque - HEADER_COUNT object
+ * @param[in] data - Data to be written, ignored.
+ * @param[in] size - Size of data block.
+ * @return Returns size.
+ */
+static int count_write(void * opaque, unsigned char * /*data*/, int size)
+{
+    HEADER_COUNT * count = static_cast<HEADER_COUNT *>(opaque);
+
+    count->m_pos += size;
+    count->m_size = std::max(count->m_size, count->m_pos);
+
+    return size;
+}
+
+/**
+ * @brief Seek function for a muxer dry run.
+ * @param[in] opaque - HEADER_COUNT object
+ * @param[in] offset - Offset to seek to.
+ * @param[in] whence - SEEK_SET, SEEK_CUR, SEEK_END or AVSEEK_SIZE.
+ * @return On success returns the new position. On error returns a negative AVERROR value.
+ */
+static int64_t count_seek(void * opaque, int64_t offset, int whence)
+{
+    HEADER_COUNT * count = static_cast<HEADER_COUNT *>(opaque);
+
+    if (whence & AVSEEK_SIZE)
+    {
+        return count->m_size;
+    }
+
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case SEEK_SET:
+    {
+        break;
+    }
+    case SEEK_CUR:
+    {
+        offset += count->m_pos;
+        break;
+    }
+    case SEEK_END:
+    {
+        offset += count->m_size;
+        break;
+    }
+    default:
+    {
+        return AVERROR(EINVAL);
+    }
+    }
+
+    if (offset < 0)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    count->m_pos = offset;
+
+    return offset;
+}
+
 const FFmpeg_Transcoder::PRORES_BITRATE FFmpeg_Transcoder::m_prores_bitrate[] =
 {
     // SD
@@ -151,11 +230,15 @@ FFmpeg_Transcoder::FFmpeg_Transcoder()
     : m_fileio(nullptr)
     , m_close_fileio(true)
     , m_predicted_size(0)
+    , m_size_exact(false)
+    , m_exact_samples(0)
+    , m_samples_encoded(0)
     , m_is_video(false)
     , m_cur_sample_fmt(AV_SAMPLE_FMT_NONE)
     , m_cur_sample_rate(-1)
     , m_cur_channel_layout(0)
     , m_audio_resample_ctx(nullptr)
+    , m_sample_convert(nullptr)
     , m_audio_fifo(nullptr)
     , m_sws_ctx(nullptr)
     #ifndef USING_LIBAV
@@ -165,6 +248,10 @@ FFmpeg_Transcoder::FFmpeg_Transcoder()
     #endif
     , m_pts(AV_NOPTS_VALUE)
     , m_pos(AV_NOPTS_VALUE)
+    , m_demux_queue(nullptr)
+    , m_buffer(nullptr)
+    , m_segment_mode(false)
+    , m_segment_pos(0)
     , m_copy_audio(false)
     , m_copy_video(false)
     , m_current_format(nullptr)
@@ -488,7 +575,8 @@ int FFmpeg_Transcoder::open_input_file(LPVIRTUALFILE virtualfile, FileIO *fio)
         return AVERROR(EINVAL);
     }
 
-    m_predicted_size = calculate_predicted_filesize();
+    m_predicted_size = calculate_predicted_filesize(&m_size_exact, &m_exact_samples);
+    m_samples_encoded = 0;
 
     // Make sure this is set, although should already have happened
     virtualfile->m_format_idx = params.guess_format_idx(filename());
@@ -548,6 +636,14 @@ int FFmpeg_Transcoder::open_input_file(LPVIRTUALFILE virtualfile, FileIO *fio)
                 streamref.m_stream_idx = input_stream->index;
 
                 m_in.m_album_art.push_back(streamref);
+
+                if (params.m_exact_size)
+                {
+                    // Album arts are copied as they are, reserve room for them. Their
+                    // tag frames are not part of the calculation, so padding is required.
+                    m_predicted_size += static_cast<size_t>(input_stream->attached_pic.size);
+                    m_size_exact = false;
+                }
             }
         }
     }
@@ -604,10 +700,14 @@ bool FFmpeg_Transcoder::can_copy_stream(const AVStream *stream) const
     return true;
 }
 
-int FFmpeg_Transcoder::open_output_file(Buffer *buffer)
+int FFmpeg_Transcoder::open_output_file(Buffer *buffer, bool segment)
 {
     int ret = 0;
 
+    m_buffer        = buffer;
+    m_segment_mode  = segment;
+    m_segment_pos   = 0;
+
     get_destname(&m_out.m_filename, m_in.m_filename);
 
     Logging::info(destname(), "Opening output file.");
@@ -669,6 +769,13 @@ int FFmpeg_Transcoder::open_output_file(Buffer *buffer)
         return ret;
     }
 
+    if (m_out.m_audio.m_codec_ctx != nullptr && (m_out.m_filetype == FILETYPE_WAV || m_out.m_filetype == FILETYPE_AIFF))
+    {
+        // Uncompressed audio: Output positions can be mapped to a play time, so seek ahead is possible.
+        m_seek_ahead.m_data_offset = static_cast<size_t>(avio_tell(m_out.m_format_ctx->pb));
+        m_seek_ahead.m_block_align = static_cast<size_t>(av_get_bits_per_sample(m_out.m_audio.m_codec_ctx->codec_id) / 8 * m_out.m_audio.m_codec_ctx->channels);
+    }
+
     // Process album arts: copy all from source file to target.
     ret = process_albumarts();
     if (ret)
@@ -1747,15 +1854,16 @@ int FFmpeg_Transcoder::open_output_filestreams(Buffer *buffer)
         return AVERROR(ENOMEM);
     }
 
-    // open the output file
+    // open the output file. A stream cannot go back, without seek function the
+    // muxer knows that and never tries to update data already written.
     m_out.m_format_ctx->pb = avio_alloc_context(
                 iobuffer,
                 buf_size,
                 1,
-                static_cast<void *>(buffer),
+                m_segment_mode ? static_cast<void *>(this) : static_cast<void *>(buffer),
                 nullptr,        // read not required
-                output_write,   // write
-                (m_current_format->audio_codec_id() != AV_CODEC_ID_OPUS) ? seek : nullptr);          // seek
+                m_segment_mode ? segment_write : output_write,   // write
+                m_segment_mode ? segment_seek : ((m_current_format->audio_codec_id() != AV_CODEC_ID_OPUS && !buffer->is_stream()) ? seek : nullptr));          // seek
 
     // Some formats require the time stamps to start at 0, so if there is a difference between
     // the streams we need to drop audio or video until we are in sync.
@@ -1788,9 +1896,36 @@ int FFmpeg_Transcoder::init_resampler()
     {
         // Formats are same
         close_resample();
+        m_sample_convert = nullptr;
         return 0;
     }
 
+    // Sample rate and channel layout are the same, and only the sample format
+    // differs, e.g. planar float to 16 bit: no need for the resampler.
+    if (m_in.m_audio.m_codec_ctx->sample_rate == m_out.m_audio.m_codec_ctx->sample_rate &&
+            m_in.m_audio.m_codec_ctx->channel_layout == m_out.m_audio.m_codec_ctx->channel_layout &&
+            m_in.m_audio.m_codec_ctx->channels == m_out.m_audio.m_codec_ctx->channels)
+    {
+        SAMPLE_CONVERT_FUNC sample_convert = get_sample_converter(m_in.m_audio.m_codec_ctx->sample_fmt, m_out.m_audio.m_codec_ctx->sample_fmt);
+
+        if (sample_convert != nullptr)
+        {
+            if (m_sample_convert != sample_convert)
+            {
+                Logging::info(destname(), "Converting audio samples with %1: %2 -> %3.",
+                              get_sample_converter_name(),
+                              get_sample_fmt_name(m_in.m_audio.m_codec_ctx->sample_fmt).c_str(),
+                              get_sample_fmt_name(m_out.m_audio.m_codec_ctx->sample_fmt).c_str());
+            }
+
+            close_resample();
+            m_sample_convert = sample_convert;
+            return 0;
+        }
+    }
+
+    m_sample_convert = nullptr;
+
     if (m_audio_resample_ctx == nullptr ||
             m_cur_sample_fmt != m_in.m_audio.m_codec_ctx->sample_fmt ||
             m_cur_sample_rate != m_in.m_audio.m_codec_ctx->sample_rate ||
@@ -1939,6 +2074,12 @@ int FFmpeg_Transcoder::prepare_format(AVDictionary** dict,  FILETYPE filetype) c
         av_dict_set_with_check(dict, "flags:v", "+global_header", 0, destname());
     }
 
+    if (filetype == FILETYPE_MP3 && params.m_exact_size)
+    {
+        // The ID3v1 tag is part of the calculated size
+        av_dict_set_with_check(dict, "write_id3v1", "1", 0, destname());
+    }
+
     return ret;
 }
 
@@ -1960,11 +2101,10 @@ int FFmpeg_Transcoder::write_output_file_header()
         return ret;
     }
 
-    if (m_out.m_filetype == FILETYPE_WAV)
+    if (m_out.m_filetype == FILETYPE_WAV && !m_segment_mode)
     {
         // Insert fake WAV header (fill in size fields with estimated values instead of setting to -1)
-        AVIOContext * output_io_context = static_cast<AVIOContext *>(m_out.m_format_ctx->pb);
-        Buffer *buffer = static_cast<Buffer *>(output_io_context->opaque);
+        Buffer *buffer = m_buffer;
         size_t pos = buffer->tell();
         WAV_HEADER wav_header;
         WAV_LIST_HEADER list_header;
@@ -1992,8 +2132,8 @@ AVFrame *FFmpeg_Transcoder::alloc_picture(AVPixelFormat pix_fmt, int width, int
     AVFrame *picture;
     int ret;
 
-    picture = av_frame_alloc();
-    if (picture == nullptr)
+    ret = m_frame_pool.alloc_frame(&picture, destname());
+    if (ret < 0)
     {
         return nullptr;
     }
@@ -2003,11 +2143,11 @@ AVFrame *FFmpeg_Transcoder::alloc_picture(AVPixelFormat pix_fmt, int width, int
     picture->height = height;
 
     // allocate the buffers for the frame data
-    ret = av_frame_get_buffer(picture, 32);
+    ret = m_frame_pool.get_video_buffer(picture);
     if (ret < 0)
     {
         Logging::error(destname(), "Could not allocate frame data.");
-        av_frame_free(&picture);
+        m_frame_pool.free_frame(&picture);
         return nullptr;
     }
 
@@ -2063,7 +2203,7 @@ int FFmpeg_Transcoder::decode_audio_frame(AVPacket *pkt, int *decoded)
     AVFrame *frame = nullptr;
 
     // Initialise temporary storage for one input frame.
-    ret = init_frame(&frame, filename());
+    ret = m_frame_pool.alloc_frame(&frame, filename());
     if (ret < 0)
     {
         return ret;
@@ -2075,7 +2215,7 @@ int FFmpeg_Transcoder::decode_audio_frame(AVPacket *pkt, int *decoded)
     {
         Logging::error(filename(), "Could not decode audio frame (error '%1').", ffmpeg_geterror(ret).c_str());
         // unused frame
-        av_frame_free(&frame);
+        m_frame_pool.free_frame(&frame);
         return ret;
     }
 
@@ -2094,7 +2234,7 @@ int FFmpeg_Transcoder::decode_audio_frame(AVPacket *pkt, int *decoded)
         AVFrame *frame = nullptr;
 
         // Initialise temporary storage for one input frame.
-        ret = init_frame(&frame, filename());
+        ret = m_frame_pool.alloc_frame(&frame, filename());
         if (ret < 0)
         {
             return ret;
@@ -2104,7 +2244,7 @@ int FFmpeg_Transcoder::decode_audio_frame(AVPacket *pkt, int *decoded)
         if (!data_present)
         {
             // unused frame
-            av_frame_free(&frame);
+            m_frame_pool.free_frame(&frame);
             break;
         }
         if (ret < 0)
@@ -2112,7 +2252,7 @@ int FFmpeg_Transcoder::decode_audio_frame(AVPacket *pkt, int *decoded)
             // Anything else is an error, report it!
             Logging::error(filename(), "Could not decode audio frame (error '%1').", ffmpeg_geterror(ret).c_str());
             // unused frame
-            av_frame_free(&frame);
+            m_frame_pool.free_frame(&frame);
             break;
         }
 
@@ -2120,11 +2260,23 @@ int FFmpeg_Transcoder::decode_audio_frame(AVPacket *pkt, int *decoded)
 
         *decoded += pkt->size;
 #endif
+        // After a seek ahead, the first frame tells us where we actually are
+        if (data_present && m_seek_ahead.m_reposition)
+        {
+            ret = seek_ahead_check_frame(frame);
+            if (ret)
+            {
+                // Drop frame
+                data_present = 0;
+                ret = ret < 0 ? ret : 0;
+            }
+        }
+
         // If there is decoded data, convert and store it
         if (data_present && frame->nb_samples)
         {
             // Temporary storage for the converted input samples.
-            uint8_t **converted_input_samples = nullptr;
+            AVFrame *converted_frame = nullptr;
             int nb_output_samples;
 #if LAVR_DEPRECATE
             nb_output_samples = (m_audio_resample_ctx != nullptr) ? swr_get_out_samples(m_audio_resample_ctx, frame->nb_samples) : frame->nb_samples;
@@ -2145,26 +2297,35 @@ int FFmpeg_Transcoder::decode_audio_frame(AVPacket *pkt, int *decoded)
 
                 // Store audio frame
                 // Initialise the temporary storage for the converted input samples.
-                ret = init_converted_samples(&converted_input_samples, nb_output_samples);
+                ret = init_converted_samples(&converted_frame, nb_output_samples);
                 if (ret < 0)
                 {
                     throw ret;
                 }
 
                 // Convert the input samples to the desired output sample format.
-                // This requires a temporary storage provided by converted_input_samples.
-                ret = convert_samples(frame->extended_data, frame->nb_samples, converted_input_samples, &nb_output_samples);
+                // This requires a temporary storage provided by converted_frame.
+                ret = convert_samples(frame->extended_data, frame->nb_samples, converted_frame->extended_data, &nb_output_samples);
                 if (ret < 0)
                 {
                     throw ret;
                 }
 
                 // Add the converted input samples to the FIFO buffer for later processing.
-                ret = add_samples_to_fifo(converted_input_samples, nb_output_samples);
+                ret = add_samples_to_fifo(converted_frame->extended_data, nb_output_samples);
                 if (ret < 0)
                 {
                     throw ret;
                 }
+
+                if (m_seek_ahead.m_reposition)
+                {
+                    ret = seek_ahead_reposition();
+                    if (ret < 0)
+                    {
+                        throw ret;
+                    }
+                }
                 ret = 0;
             }
             catch (int _ret)
@@ -2172,13 +2333,9 @@ int FFmpeg_Transcoder::decode_audio_frame(AVPacket *pkt, int *decoded)
                 ret = _ret;
             }
 
-            if (converted_input_samples != nullptr)
-            {
-                av_freep(&converted_input_samples[0]);
-                av_free(converted_input_samples);
-            }
+            m_frame_pool.free_frame(&converted_frame);
         }
-        av_frame_free(&frame);
+        m_frame_pool.free_frame(&frame);
     }
     return ret;
 }
@@ -2209,7 +2366,7 @@ int FFmpeg_Transcoder::decode_video_frame(AVPacket *pkt, int *decoded)
     AVFrame *frame = nullptr;
 
     // Initialise temporary storage for one input frame.
-    ret = init_frame(&frame, filename());
+    ret = m_frame_pool.alloc_frame(&frame, filename());
     if (ret < 0)
     {
         return ret;
@@ -2221,7 +2378,7 @@ int FFmpeg_Transcoder::decode_video_frame(AVPacket *pkt, int *decoded)
     {
         Logging::error(filename(), "Could not decode video frame (error '%1').", ffmpeg_geterror(ret).c_str());
         // unused frame
-        av_frame_free(&frame);
+        m_frame_pool.free_frame(&frame);
         return ret;
     }
 
@@ -2240,7 +2397,7 @@ int FFmpeg_Transcoder::decode_video_frame(AVPacket *pkt, int *decoded)
         AVFrame *frame = nullptr;
 
         // Initialise temporary storage for one input frame.
-        ret = init_frame(&frame, filename());
+        ret = m_frame_pool.alloc_frame(&frame, filename());
         if (ret < 0)
         {
             return ret;
@@ -2250,7 +2407,7 @@ int FFmpeg_Transcoder::decode_video_frame(AVPacket *pkt, int *decoded)
         if (!data_present)
         {
             // unused frame
-            av_frame_free(&frame);
+            m_frame_pool.free_frame(&frame);
             break;
         }
         if (ret < 0)
@@ -2258,7 +2415,7 @@ int FFmpeg_Transcoder::decode_video_frame(AVPacket *pkt, int *decoded)
             // Anything else is an error, report it!
             Logging::error(filename(), "Could not decode audio frame (error '%1').", ffmpeg_geterror(ret).c_str());
             // unused frame
-            av_frame_free(&frame);
+            m_frame_pool.free_frame(&frame);
             break;
         }
 
@@ -2311,7 +2468,7 @@ int FFmpeg_Transcoder::decode_video_frame(AVPacket *pkt, int *decoded)
                 tmp_frame->best_effort_timestamp = frame->best_effort_timestamp;
 #endif
 
-                av_frame_free(&frame);
+                m_frame_pool.free_frame(&frame);
 
                 frame = tmp_frame;
             }
@@ -2356,7 +2513,7 @@ int FFmpeg_Transcoder::decode_video_frame(AVPacket *pkt, int *decoded)
         else
         {
             // unused frame
-            av_frame_free(&frame);
+            m_frame_pool.free_frame(&frame);
         }
     }
 
@@ -2499,38 +2656,28 @@ int FFmpeg_Transcoder::decode_frame(AVPacket *pkt)
     return ret;
 }
 
-int FFmpeg_Transcoder::init_converted_samples(uint8_t ***converted_input_samples, int frame_size)
+int FFmpeg_Transcoder::init_converted_samples(AVFrame **converted_frame, int frame_size)
 {
     int ret;
 
-    // Allocate as many pointers as there are audio channels.
-    // Each pointer will later point to the audio samples of the corresponding
-    // channels (although it may be nullptr for interleaved formats).
-
-#ifndef USING_LIBAV
-    *converted_input_samples = static_cast<uint8_t **>(av_calloc(static_cast<size_t>(m_out.m_audio.m_codec_ctx->channels), sizeof(**converted_input_samples)));
-#else
-    // Libav does not provide av_calloc
-    *converted_input_samples = static_cast<uint8_t **>(av_malloc(m_out.m_audio.m_codec_ctx->channels * sizeof(**converted_input_samples)));
-#endif  // !USING_LIBAV
-
-    if (*converted_input_samples == nullptr)
+    // Pooled frame buffers are reused, so this does not allocate memory for each frame.
+    ret = m_frame_pool.alloc_frame(converted_frame, destname());
+    if (ret < 0)
     {
-        Logging::error(destname(), "Could not allocate converted input sample pointers.");
-        return AVERROR(ENOMEM);
+        return ret;
     }
 
+    (*converted_frame)->nb_samples      = frame_size;
+    (*converted_frame)->channel_layout  = m_out.m_audio.m_codec_ctx->channel_layout;
+    (*converted_frame)->format          = m_out.m_audio.m_codec_ctx->sample_fmt;
+
     // Allocate memory for the samples of all channels in one consecutive
     // block for convenience.
-    ret = av_samples_alloc(*converted_input_samples, nullptr,
-                           m_out.m_audio.m_codec_ctx->channels,
-                           frame_size,
-                           m_out.m_audio.m_codec_ctx->sample_fmt, 0);
+    ret = m_frame_pool.get_audio_buffer(*converted_frame, m_out.m_audio.m_codec_ctx->channels);
     if (ret < 0)
     {
         Logging::error(destname(), "Could not allocate converted input samples (error '%1').", ffmpeg_geterror(ret).c_str());
-        av_freep(&(*converted_input_samples)[0]);
-        av_free(*converted_input_samples);
+        m_frame_pool.free_frame(converted_frame);
         return ret;
     }
     return 0;
@@ -2553,6 +2700,11 @@ int FFmpeg_Transcoder::convert_samples(uint8_t **input_data, int in_samples, uin
 
         *out_samples = ret;
     }
+    else if (m_sample_convert != nullptr)
+    {
+        // No resampling, only the sample format differs
+        m_sample_convert(converted_data, input_data, m_in.m_audio.m_codec_ctx->channels, in_samples);
+    }
     else
     {
         // No resampling, just copy samples
@@ -2598,6 +2750,11 @@ int FFmpeg_Transcoder::convert_samples(uint8_t **input_data, const int in_sample
             return AVERROR_EXIT;
         }
     }
+    else if (m_sample_convert != nullptr)
+    {
+        // No resampling, only the sample format differs
+        m_sample_convert(converted_data, input_data, m_in.m_audio.m_codec_ctx->channels, in_samples);
+    }
     else
     {
         // No resampling, just copy samples
@@ -2729,6 +2886,89 @@ int FFmpeg_Transcoder::flush_frames_single(int stream_index, bool use_flush_pack
     return ret;
 }
 
+int FFmpeg_Transcoder::read_packet(AVPacket *pkt)
+{
+    if (params.m_demux_queue && m_demux_queue == nullptr)
+    {
+        m_demux_queue = new(std::nothrow) Packet_Queue(params.m_demux_queue);
+        if (m_demux_queue == nullptr)
+        {
+            Logging::warning(destname(), "Out of memory creating demuxer queue, reading on the transcoder thread.");
+        }
+    }
+
+    if (m_demux_queue == nullptr)
+    {
+        return av_read_frame(m_in.m_format_ctx, pkt);
+    }
+
+    start_demuxer();
+
+    return m_demux_queue->pop(pkt);
+}
+
+void FFmpeg_Transcoder::start_demuxer()
+{
+    if (m_demux_thread.joinable())
+    {
+        // Already running, or stopped at end of file
+        return;
+    }
+
+    try
+    {
+        m_demux_thread = std::thread(&FFmpeg_Transcoder::demux_thread, this);
+    }
+    catch (const std::system_error & e)
+    {
+        Logging::error(destname(), "Could not start demuxer thread (%1).", e.what());
+        m_demux_queue->push_end(AVERROR(EAGAIN));
+    }
+}
+
+void FFmpeg_Transcoder::stop_demuxer()
+{
+    if (m_demux_queue == nullptr)
+    {
+        return;
+    }
+
+    m_demux_queue->abort();
+
+    if (m_demux_thread.joinable())
+    {
+        m_demux_thread.join();
+    }
+
+    m_demux_queue->reset();
+}
+
+void FFmpeg_Transcoder::demux_thread()
+{
+    for (;;)
+    {
+        AVPacket pkt;
+
+        int ret = av_read_frame(m_in.m_format_ctx, &pkt);
+        if (ret < 0)
+        {
+            m_demux_queue->push_end(ret);
+            break;
+        }
+
+        ret = m_demux_queue->push(&pkt);
+        if (ret < 0)
+        {
+            av_packet_unref(&pkt);
+            if (ret != AVERROR_EXIT)
+            {
+                m_demux_queue->push_end(ret);
+            }
+            break;
+        }
+    }
+}
+
 int FFmpeg_Transcoder::read_decode_convert_and_store(int *finished)
 {
     // Packet used for temporary storage.
@@ -2738,7 +2978,7 @@ int FFmpeg_Transcoder::read_decode_convert_and_store(int *finished)
     try
     {
         // Read one frame from the input file into a temporary packet.
-        ret = av_read_frame(m_in.m_format_ctx, &pkt);
+        ret = read_packet(&pkt);
 
         if (ret < 0)
         {
@@ -2789,11 +3029,10 @@ int FFmpeg_Transcoder::init_audio_output_frame(AVFrame **frame, int frame_size)
     int ret;
 
     // Create a new frame to store the audio samples.
-    *frame = av_frame_alloc();
-    if (*frame == nullptr)
+    ret = m_frame_pool.alloc_frame(frame, destname());
+    if (ret < 0)
     {
-        Logging::error(destname(), "Could not allocate output frame.");
-        return AVERROR_EXIT;
+        return ret;
     }
 
     //
@@ -2810,11 +3049,11 @@ int FFmpeg_Transcoder::init_audio_output_frame(AVFrame **frame, int frame_size)
     // Allocate the samples of the created frame. This call will make
     // sure that the audio frame can hold as many samples as specified.
 
-    ret = av_frame_get_buffer(*frame, 32);
+    ret = m_frame_pool.get_audio_buffer(*frame, m_out.m_audio.m_codec_ctx->channels);
     if (ret < 0)
     {
         Logging::error(destname(), "Could allocate output frame samples (error '%1').", ffmpeg_geterror(ret).c_str());
-        av_frame_free(frame);
+        m_frame_pool.free_frame(frame);
         return ret;
     }
 
@@ -3086,9 +3325,23 @@ int FFmpeg_Transcoder::load_encode_and_write(int frame_size)
     // If there is less than the maximum possible frame size in the FIFO
     // buffer use this number. Otherwise, use the maximum possible frame size
 
-    frame_size = FFMIN(av_audio_fifo_size(m_audio_fifo), frame_size);
+    frame_size = FFMIN(av_audio_fifo_size(m_audio_fifo), seek_ahead_frame_size(frame_size));
     int data_written;
 
+    if (m_exact_samples)
+    {
+        // The exact size is based on this number of samples, drop what the source has in excess
+        int64_t remaining = m_exact_samples - m_samples_encoded;
+
+        if (remaining <= 0)
+        {
+            av_audio_fifo_drain(m_audio_fifo, av_audio_fifo_size(m_audio_fifo));
+            return 0;
+        }
+
+        frame_size = static_cast<int>(FFMIN(static_cast<int64_t>(frame_size), remaining));
+    }
+
     // Initialise temporary storage for one output frame.
     ret = init_audio_output_frame(&output_frame, frame_size);
     if (ret < 0)
@@ -3111,10 +3364,12 @@ int FFmpeg_Transcoder::load_encode_and_write(int frame_size)
             Logging::error(destname(), "Could not read data from FIFO.");
             ret = AVERROR_EXIT;
         }
-        av_frame_free(&output_frame);
+        m_frame_pool.free_frame(&output_frame);
         return ret;
     }
 
+    m_samples_encoded += frame_size;
+
     // Encode one frame worth of audio samples.
     ret = encode_audio_frame(output_frame, &data_written);
 #if !LAVC_NEW_PACKET_INTERFACE
@@ -3123,10 +3378,51 @@ int FFmpeg_Transcoder::load_encode_and_write(int frame_size)
     if (ret < 0 && ret != AVERROR(EAGAIN))
 #endif
     {
-        av_frame_free(&output_frame);
+        m_frame_pool.free_frame(&output_frame);
         return ret;
     }
-    av_frame_free(&output_frame);
+    m_frame_pool.free_frame(&output_frame);
+    return 0;
+}
+
+int FFmpeg_Transcoder::pad_exact_samples()
+{
+    int64_t missing = m_exact_samples - m_samples_encoded - av_audio_fifo_size(m_audio_fifo);
+
+    if (missing <= 0)
+    {
+        return 0;
+    }
+
+    Logging::debug(destname(), "Exact size: Source is %1 samples short, adding silence.", missing);
+
+    while (missing > 0)
+    {
+        AVFrame *silence;
+        int frame_size = static_cast<int>(FFMIN(missing, static_cast<int64_t>(4096)));
+        int ret;
+
+        ret = init_audio_output_frame(&silence, frame_size);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        av_samples_set_silence(silence->extended_data, 0, frame_size, m_out.m_audio.m_codec_ctx->channels, m_out.m_audio.m_codec_ctx->sample_fmt);
+
+        ret = av_audio_fifo_write(m_audio_fifo, reinterpret_cast<void **>(silence->extended_data), frame_size);
+
+        m_frame_pool.free_frame(&silence);
+
+        if (ret < frame_size)
+        {
+            Logging::error(destname(), "Could not write data to FIFO.");
+            return (ret < 0 ? ret : AVERROR_EXIT);
+        }
+
+        missing -= frame_size;
+    }
+
     return 0;
 }
 
@@ -3275,13 +3571,31 @@ int FFmpeg_Transcoder::process_single_fr(int &status)
                 output_frame_size = m_out.m_audio.m_codec_ctx->frame_size;
             }
 
+            if (seek_ahead_limit_reached())
+            {
+                if (m_seek_ahead.m_segment_end != SIZE_MAX)
+                {
+                    // End of segment: Leave the rest to others.
+                    avio_flush(m_out.m_format_ctx->pb);
+                    m_seek_ahead.m_segment_done = true;
+                    return 0;
+                }
+
+                // Ran into data of a previous seek ahead, continue with the next hole.
+                ret = seek_ahead_next_hole(&finished);
+                if (ret < 0)
+                {
+                    throw ret;
+                }
+            }
+
             // Make sure that there is one frame worth of samples in the FIFO
             // buffer so that the encoder can do its work.
             // Since the decoder's and the encoder's frame size may differ, we
             // need to FIFO buffer to store as many frames worth of input samples
             // that they make up at least one frame worth of output samples.
 
-            while (av_audio_fifo_size(m_audio_fifo) < output_frame_size)
+            while (!finished && av_audio_fifo_size(m_audio_fifo) < output_frame_size)
             {
                 // Decode one frame worth of audio samples, convert it to the
                 // output sample format and put it into the FIFO buffer.
@@ -3301,11 +3615,21 @@ int FFmpeg_Transcoder::process_single_fr(int &status)
                 }
             }
 
+            if (finished && m_exact_samples && !m_seek_ahead.m_active && m_seek_ahead.m_segment_end == SIZE_MAX)
+            {
+                // Source is shorter than its duration said, make up for it
+                ret = pad_exact_samples();
+                if (ret < 0)
+                {
+                    throw ret;
+                }
+            }
+
             // If we have enough samples for the encoder, we encode them.
             // At the end of the file, we pass the remaining samples to
             // the encoder.
 
-            while (av_audio_fifo_size(m_audio_fifo) >= output_frame_size || (finished && av_audio_fifo_size(m_audio_fifo) > 0))
+            while ((av_audio_fifo_size(m_audio_fifo) >= output_frame_size || (finished && av_audio_fifo_size(m_audio_fifo) > 0)) && !seek_ahead_limit_reached())
             {
                 // Take one frame worth of audio samples from the FIFO buffer,
                 // encode it and write it to the output file.
@@ -3317,6 +3641,28 @@ int FFmpeg_Transcoder::process_single_fr(int &status)
                 }
             }
 
+            if (finished && m_seek_ahead.m_segment_end != SIZE_MAX)
+            {
+                // End of input reached while transcoding a segment
+                if (!m_seek_ahead.m_reposition)
+                {
+                    m_seek_ahead.m_eof_pos = static_cast<size_t>(avio_tell(m_out.m_format_ctx->pb));
+                }
+                avio_flush(m_out.m_format_ctx->pb);
+                m_seek_ahead.m_segment_done = true;
+                // Do not flush the encoder, there may be more segments to go.
+                return 0;
+            }
+            else if (finished && m_seek_ahead.m_active)
+            {
+                // End of input reached, but there may be holes left from seeking ahead.
+                ret = seek_ahead_next_hole(&finished);
+                if (ret < 0)
+                {
+                    throw ret;
+                }
+            }
+
             // If we are at the end of the input file and have encoded
             // all remaining samples, we can exit this loop and finish.
 
@@ -3388,10 +3734,10 @@ int FFmpeg_Transcoder::process_single_fr(int &status)
                 if (ret < 0 && ret != AVERROR(EAGAIN))
 #endif
                 {
-                    av_frame_free(&output_frame);
+                    m_frame_pool.free_frame(&output_frame);
                     throw ret;
                 }
-                av_frame_free(&output_frame);
+                m_frame_pool.free_frame(&output_frame);
             }
 
 #if LAVC_NEW_PACKET_INTERFACE
@@ -3520,6 +3866,8 @@ bool FFmpeg_Transcoder::audio_size(size_t *filesize, AVCodecID codec_id, BITRATE
     int output_sample_rate;
     bool success = true;
 
+    size_t start_size = *filesize;
+
     get_output_bit_rate(bit_rate, params.m_audiobitrate, &output_audio_bit_rate);
     get_output_sample_rate(sample_rate, params.m_audiosamplerate, &output_sample_rate);
 
@@ -3582,6 +3930,13 @@ bool FFmpeg_Transcoder::audio_size(size_t *filesize, AVCodecID codec_id, BITRATE
         break;
     }
     }
+
+    if (success && params.m_exact_size && codec_id != AV_CODEC_ID_NONE && codec_id != AV_CODEC_ID_PCM_S16LE && codec_id != AV_CODEC_ID_PCM_S16BE)
+    {
+        // Compressed audio: The file will be padded to the predicted size, so better err on the large side.
+        *filesize += exact_size_reserve(*filesize - start_size);
+    }
+
     return success;
 }
 
@@ -3590,6 +3945,8 @@ bool FFmpeg_Transcoder::video_size(size_t *filesize, AVCodecID codec_id, BITRATE
     BITRATE out_video_bit_rate;
     bool success = true;
 
+    size_t start_size = *filesize;
+
     get_output_bit_rate(bit_rate, params.m_videobitrate, &out_video_bit_rate);
 
     switch (codec_id)
@@ -3632,11 +3989,26 @@ bool FFmpeg_Transcoder::video_size(size_t *filesize, AVCodecID codec_id, BITRATE
         break;
     }
     }
+
+    if (success && params.m_exact_size && codec_id != AV_CODEC_ID_NONE)
+    {
+        // The file will be padded to the predicted size, so better err on the large side.
+        *filesize += exact_size_reserve(*filesize - start_size);
+    }
+
     return success;
 }
 
-size_t FFmpeg_Transcoder::calculate_predicted_filesize() const
+size_t FFmpeg_Transcoder::exact_size_reserve(size_t stream_size)
+{
+    return stream_size * EXACT_SIZE_RESERVE_PERCENT / 100 + EXACT_SIZE_RESERVE;
+}
+
+size_t FFmpeg_Transcoder::calculate_predicted_filesize(bool *exact, int64_t *exact_samples) const
 {
+    *exact = false;
+    *exact_samples = 0;
+
     if (m_in.m_format_ctx == nullptr)
     {
         return 0;
@@ -3671,6 +4043,18 @@ size_t FFmpeg_Transcoder::calculate_predicted_filesize() const
         input_video_bit_rate = (CODECPAR(m_in.m_video.m_stream)->bit_rate != 0) ? CODECPAR(m_in.m_video.m_stream)->bit_rate : m_in.m_format_ctx->bit_rate;
     }
 
+    if (input_audio_bit_rate && params.m_exact_size &&
+            (!m_is_video || m_current_format->video_codec_id() == AV_CODEC_ID_NONE) &&
+            !can_copy_stream(m_in.m_audio.m_stream))
+    {
+        // Audio only target: size can be calculated if the bit rate is constant
+        *exact = exact_audio_size(&filesize, m_current_format->audio_codec_id(), input_audio_bit_rate, input_audio_samples(duration, input_sample_rate), m_in.m_audio.m_codec_ctx->channels, input_sample_rate, exact_samples);
+        if (*exact)
+        {
+            return filesize;
+        }
+    }
+
     if (input_audio_bit_rate)
     {
         int channels = m_in.m_audio.m_codec_ctx->channels;
@@ -3710,42 +4094,807 @@ size_t FFmpeg_Transcoder::calculate_predicted_filesize() const
     return filesize;
 }
 
-size_t FFmpeg_Transcoder::predicted_filesize()
+int64_t FFmpeg_Transcoder::input_audio_samples(int64_t duration, int sample_rate) const
 {
-    return m_predicted_size;
-}
+    const AVStream *stream = m_in.m_audio.m_stream;
 
-int FFmpeg_Transcoder::encode_finish()
-{
-    int ret = 0;
+    if (sample_rate <= 0)
+    {
+        return 0;
+    }
 
-    // Write the trailer of the output file container.
-    ret = write_output_file_trailer();
-    if (ret < 0)
+    if (stream->duration != AV_NOPTS_VALUE && stream->duration > 0 && stream->time_base.num > 0)
     {
-        Logging::error(destname(), "Error writing trailer (error '%1').", ffmpeg_geterror(ret).c_str());
+        AVRational sample_time_base = { 1, sample_rate };
+
+        return av_rescale_q(stream->duration, stream->time_base, sample_time_base);
     }
 
-    return ret;
+    return av_rescale(duration, sample_rate, AV_TIME_BASE);
 }
 
-const ID3v1 * FFmpeg_Transcoder::id3v1tag() const
+bool FFmpeg_Transcoder::exact_audio_size(size_t *filesize, AVCodecID codec_id, BITRATE bit_rate, int64_t input_samples, int channels, int sample_rate, int64_t *output_samples) const
 {
-    return &m_out.m_id3v1;
-}
+    BITRATE output_audio_bit_rate;
+    int output_sample_rate;
+    int output_channels = channels > 2 ? 2 : channels;
+    size_t header_size = 0;
+    int64_t nb_samples;
 
-int FFmpeg_Transcoder::input_read(void * opaque, unsigned char * data, int size)
-{
-    FileIO * io = static_cast<FileIO *>(opaque);
+    get_output_bit_rate(bit_rate, params.m_audiobitrate, &output_audio_bit_rate);
+    get_output_sample_rate(sample_rate, params.m_audiosamplerate, &output_sample_rate);
 
-    if (io == nullptr)
+    if (input_samples <= 0 || sample_rate <= 0 || output_sample_rate <= 0 || output_channels <= 0)
     {
-        Logging::error(nullptr, "input_read(): Internal error: FileIO is NULL!");
-        return AVERROR(EINVAL);
+        return false;
     }
 
-    if (io->eof())
-    {
+    // Number of samples per channel after resampling
+    nb_samples = av_rescale(input_samples, output_sample_rate, sample_rate);
+    *output_samples = nb_samples;
+
+    switch (codec_id)
+    {
+    case AV_CODEC_ID_PCM_S16LE:
+    case AV_CODEC_ID_PCM_S16BE:
+    {
+        if (predict_header_size(&header_size, codec_id, output_channels, output_sample_rate, 0) < 0)
+        {
+            return false;
+        }
+
+        // Sample data is always an even number of bytes, so no pad byte and no trailer follows
+        *filesize += header_size + static_cast<size_t>(nb_samples) * static_cast<size_t>(output_channels) * static_cast<size_t>(av_get_bytes_per_sample(AV_SAMPLE_FMT_S16));
+        return true;
+    }
+    case AV_CODEC_ID_MP3:
+    {
+        // Layer III bit rates in kbit/s
+        static const int mpeg1_bit_rates[] = { 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 };
+        static const int mpeg2_bit_rates[] = { 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 };
+        static const int sample_rates[] = { 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 0 };
+        bool mpeg1 = output_sample_rate >= 32000;
+        const int *bit_rates = mpeg1 ? mpeg1_bit_rates : mpeg2_bit_rates;
+        int64_t kbps = output_audio_bit_rate / 1000;
+        int64_t nearest = bit_rates[0];
+        int64_t frame_samples = mpeg1 ? 1152 : 576;
+        int n;
+
+        for (n = 0; sample_rates[n] && sample_rates[n] != output_sample_rate; n++)
+        {
+        }
+
+        if (!sample_rates[n])
+        {
+            // Encoder will pick another sample rate
+            return false;
+        }
+
+        // Same as LAME: nearest bit rate, the lower one if two are equally near
+        for (n = 1; bit_rates[n]; n++)
+        {
+            if (std::abs(bit_rates[n] - kbps) < std::abs(nearest - kbps))
+            {
+                nearest = bit_rates[n];
+            }
+        }
+
+        if (predict_header_size(&header_size, codec_id, output_channels, output_sample_rate, static_cast<BITRATE>(nearest * 1000)) < 0)
+        {
+            return false;
+        }
+
+        // LAME delays the audio by MP3_ENCODER_DELAY samples and fills up the last frame, adding
+        // another frame if less than MP3_MIN_PADDING samples are left for the decoder to flush.
+        int64_t samples_to_encode = nb_samples + MP3_ENCODER_DELAY;
+        int64_t padding = frame_samples - samples_to_encode % frame_samples;
+
+        if (padding < MP3_MIN_PADDING)
+        {
+            padding += frame_samples;
+        }
+
+        int64_t frames = (samples_to_encode + padding) / frame_samples;
+
+        // Frame size is (MPEG-1) 144 or (MPEG-2/2.5) 72 bytes * bit rate / sample rate. If that is not
+        // a whole number, LAME adds a padding byte to some frames, none to the first, so that the
+        // average matches the bit rate.
+        int64_t frame_bytes = (mpeg1 ? 144000 : 72000) * nearest;
+        int64_t audio_bytes = frames * (frame_bytes / output_sample_rate) + ((frames - 1) * (frame_bytes % output_sample_rate) + output_sample_rate - 1) / output_sample_rate;
+
+        *filesize += header_size + static_cast<size_t>(audio_bytes) + ID3V1_TAG_LENGTH;
+        return true;
+    }
+    default:
+    {
+        // Variable bit rate
+        return false;
+    }
+    }
+}
+
+int FFmpeg_Transcoder::predict_header_size(size_t *header_size, AVCodecID codec_id, int channels, int sample_rate, BITRATE bit_rate) const
+{
+    AVFormatContext *format_ctx = nullptr;
+    AVStream *stream;
+    AVDictionary *dict = nullptr;
+    HEADER_COUNT count = { 0, 0 };
+    const int buf_size = 4096;
+    unsigned char *iobuffer;
+    int ret;
+
+    avformat_alloc_output_context2(&format_ctx, nullptr, m_current_format->format_name().c_str(), nullptr);
+    if (format_ctx == nullptr)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    iobuffer = static_cast<unsigned char *>(av_malloc(buf_size));
+    if (iobuffer == nullptr)
+    {
+        avformat_free_context(format_ctx);
+        return AVERROR(ENOMEM);
+    }
+
+    // Seekable like the real output, some muxers (e.g. the Xing frame of MP3) depend on it
+    format_ctx->pb = avio_alloc_context(iobuffer, buf_size, 1, &count, nullptr, count_write, count_seek);
+    if (format_ctx->pb == nullptr)
+    {
+        av_free(iobuffer);
+        avformat_free_context(format_ctx);
+        return AVERROR(ENOMEM);
+    }
+
+    stream = avformat_new_stream(format_ctx, nullptr);
+    if (stream == nullptr)
+    {
+        ret = AVERROR(ENOMEM);
+    }
+    else
+    {
+        CODECPAR(stream)->codec_type      = AVMEDIA_TYPE_AUDIO;
+        CODECPAR(stream)->codec_id        = codec_id;
+        CODECPAR(stream)->channels        = channels;
+        CODECPAR(stream)->channel_layout  = static_cast<uint64_t>(av_get_default_channel_layout(channels));
+        CODECPAR(stream)->sample_rate     = sample_rate;
+        CODECPAR(stream)->bit_rate        = bit_rate;
+        stream->time_base                 = { 1, sample_rate };
+
+        // Same tags as process_metadata() will copy
+        if (m_in.m_audio.m_stream != nullptr && CODECPAR(m_in.m_audio.m_stream)->codec_id == AV_CODEC_ID_VORBIS)
+        {
+            av_dict_copy(&format_ctx->metadata, m_in.m_audio.m_stream->metadata, 0);
+        }
+        av_dict_copy(&format_ctx->metadata, m_in.m_format_ctx->metadata, 0);
+        if (m_in.m_audio.m_stream != nullptr)
+        {
+            av_dict_copy(&stream->metadata, m_in.m_audio.m_stream->metadata, 0);
+        }
+
+        ret = prepare_format(&dict, m_current_format->filetype());
+        if (ret >= 0)
+        {
+            ret = avformat_write_header(format_ctx, &dict);
+        }
+        av_dict_free(&dict);
+    }
+
+    if (ret >= 0)
+    {
+        avio_flush(format_ctx->pb);
+        *header_size = static_cast<size_t>(count.m_size);
+        ret = 0;
+    }
+    else
+    {
+        Logging::debug(filename(), "Could not predict output file header size (error '%1').", ffmpeg_geterror(ret).c_str());
+    }
+
+#if (LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 80, 0))
+    av_freep(&format_ctx->pb->buffer);
+    avio_context_free(&format_ctx->pb);
+#else
+    av_freep(format_ctx->pb);
+#endif
+    format_ctx->pb = nullptr;
+    avformat_free_context(format_ctx);
+
+    return ret;
+}
+
+size_t FFmpeg_Transcoder::predicted_filesize()
+{
+    return m_predicted_size;
+}
+
+bool FFmpeg_Transcoder::can_seek_ahead() const
+{
+    return (m_seek_ahead.m_block_align &&
+            !m_copy_audio &&
+            m_in.m_audio.m_stream_idx != INVALID_STREAM &&
+            m_out.m_video.m_stream_idx == INVALID_STREAM &&
+            m_out.m_album_art.empty() &&
+            m_in.m_format_ctx != nullptr &&
+            m_in.m_format_ctx->pb != nullptr &&
+            m_in.m_format_ctx->pb->seekable);
+}
+
+int FFmpeg_Transcoder::seek_ahead(size_t pos)
+{
+    if (!can_seek_ahead())
+    {
+        return 0;
+    }
+
+    Buffer *buffer = m_buffer;
+
+    // Make sure everything encoded so far is in the buffer
+    avio_flush(m_out.m_format_ctx->pb);
+
+    if (pos < m_seek_ahead.m_data_offset ||
+            buffer->is_filled(pos, m_seek_ahead.m_block_align) ||
+            (m_seek_ahead.m_eof_pos && pos >= m_seek_ahead.m_eof_pos))
+    {
+        // Already there or beyond end of file
+        return 0;
+    }
+
+    Logging::debug(destname(), "Seeking ahead to offset %1.", pos);
+
+    int ret = seek_input(pos);
+    if (ret < 0 && !m_seek_ahead.m_active)
+    {
+        // No holes so far, simply go on sequentially
+        Logging::warning(destname(), "Seek ahead not possible, disabled for this file.");
+        m_seek_ahead.m_block_align = 0;
+        ret = 0;
+    }
+
+    return ret;
+}
+
+int FFmpeg_Transcoder::resume()
+{
+    Buffer *buffer = m_buffer;
+
+    // Header must be in the buffer
+    avio_flush(m_out.m_format_ctx->pb);
+
+    size_t header_size = static_cast<size_t>(avio_tell(m_out.m_format_ctx->pb));
+
+    if (buffer->buffer_watermark() <= header_size)
+    {
+        // Nothing to resume
+        return 0;
+    }
+
+    if (!can_seek_ahead())
+    {
+        Logging::info(destname(), "Transcoding cannot be resumed for this file, starting over.");
+        buffer->discard(header_size);
+        return 0;
+    }
+
+    size_t hole_end;
+    size_t hole = buffer->find_hole(m_seek_ahead.m_data_offset, &hole_end);
+
+    if (hole == m_seek_ahead.m_data_offset)
+    {
+        // Holes at the start will be filled in sequentially
+        return 0;
+    }
+
+    Logging::info(destname(), "Resuming transcoding at offset %1.", hole);
+
+    return seek_ahead(hole);
+}
+
+size_t FFmpeg_Transcoder::split_segments(unsigned int count, size_t min_size, std::vector<size_t> *starts) const
+{
+    starts->clear();
+
+    if (!can_seek_ahead() || count < 2 || m_predicted_size <= m_seek_ahead.m_data_offset)
+    {
+        return 0;
+    }
+
+    size_t data_size = m_predicted_size - m_seek_ahead.m_data_offset;
+    size_t segments = std::min(static_cast<size_t>(count), data_size / std::max(min_size, static_cast<size_t>(1)));
+
+    if (segments < 2)
+    {
+        // Too short to be worth it
+        return 0;
+    }
+
+    size_t segment_size = data_size / segments;
+
+    // Segments must start at sample boundaries
+    segment_size -= segment_size % m_seek_ahead.m_block_align;
+
+    for (size_t n = 0; n < segments; n++)
+    {
+        starts->push_back(m_seek_ahead.m_data_offset + n * segment_size);
+    }
+
+    return segments;
+}
+
+int FFmpeg_Transcoder::seek_segment(size_t start, size_t end)
+{
+    if (!can_seek_ahead())
+    {
+        return AVERROR(EINVAL);
+    }
+
+    // Finish the previous segment
+    avio_flush(m_out.m_format_ctx->pb);
+
+    m_seek_ahead.m_segment_end  = end;
+    m_seek_ahead.m_segment_done = false;
+
+    if (m_buffer->is_filled(start, m_seek_ahead.m_block_align) ||
+            (m_seek_ahead.m_eof_pos && start >= m_seek_ahead.m_eof_pos))
+    {
+        // Already transcoded, or beyond end of file
+        m_seek_ahead.m_segment_done = true;
+        return 0;
+    }
+
+    Logging::debug(destname(), "Transcoding segment from offset %1 to %2.", start, end);
+
+    return seek_input(start);
+}
+
+bool FFmpeg_Transcoder::segment_done() const
+{
+    return m_seek_ahead.m_segment_done;
+}
+
+int FFmpeg_Transcoder::end_segments()
+{
+    size_t hole_end;
+    size_t hole;
+
+    avio_flush(m_out.m_format_ctx->pb);
+
+    m_seek_ahead.m_segment_end  = SIZE_MAX;
+    m_seek_ahead.m_segment_done = false;
+
+    // Go on at the first part that has not been filled. If all segments succeeded, this
+    // is the end of file, and transcoding finishes right away.
+    hole = m_buffer->find_hole(m_seek_ahead.m_data_offset, &hole_end);
+
+    Logging::debug(destname(), "All segments done, continuing at offset %1.", hole);
+
+    return seek_input(hole);
+}
+
+int FFmpeg_Transcoder::seek_input(size_t pos)
+{
+    AVStream *input_stream = m_in.m_audio.m_stream;
+    AVRational sample_time_base = { 1, m_out.m_audio.m_codec_ctx->sample_rate };
+    int64_t sample = static_cast<int64_t>((pos - m_seek_ahead.m_data_offset) / m_seek_ahead.m_block_align);
+    int64_t ts = av_rescale_q(sample, sample_time_base, input_stream->time_base);
+    int ret;
+
+    if (input_stream->start_time != AV_NOPTS_VALUE)
+    {
+        ts += input_stream->start_time;
+    }
+
+    avio_flush(m_out.m_format_ctx->pb);
+
+    // Packets read ahead are from the old position
+    stop_demuxer();
+
+    ret = av_seek_frame(m_in.m_format_ctx, m_in.m_audio.m_stream_idx, ts, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0)
+    {
+        Logging::error(filename(), "Could not seek to %1 (error '%2').", format_duration(av_rescale_q(sample, sample_time_base, av_get_time_base_q())).c_str(), ffmpeg_geterror(ret).c_str());
+        return ret;
+    }
+
+    // Drop everything that is still in the pipeline from the old position
+    avcodec_flush_buffers(m_in.m_audio.m_codec_ctx);
+    av_audio_fifo_reset(m_audio_fifo);
+    close_resample();
+#ifdef USING_LIBAV
+    ret = init_resampler();
+    if (ret)
+    {
+        return ret;
+    }
+#endif
+
+    m_seek_ahead.m_active       = true;
+    m_seek_ahead.m_target       = m_seek_ahead.m_data_offset + static_cast<size_t>(sample) * m_seek_ahead.m_block_align;
+    // Output is placed by position from now on, samples can no longer be counted
+    m_exact_samples             = 0;
+    m_seek_ahead.m_skip_samples = -1;
+    m_seek_ahead.m_reposition   = true;
+    m_seek_ahead.m_rewound      = false;
+    m_seek_ahead.m_limit        = SIZE_MAX;
+
+    return 0;
+}
+
+int FFmpeg_Transcoder::seek_ahead_check_frame(const AVFrame *frame)
+{
+    if (m_seek_ahead.m_skip_samples >= 0)
+    {
+        // Already checked
+        return 0;
+    }
+
+    AVStream *input_stream = m_in.m_audio.m_stream;
+    AVRational sample_time_base = { 1, m_out.m_audio.m_codec_ctx->sample_rate };
+    int64_t target = static_cast<int64_t>((m_seek_ahead.m_target - m_seek_ahead.m_data_offset) / m_seek_ahead.m_block_align);
+#ifndef USING_LIBAV
+#if LAVF_DEP_AVSTREAM_CODEC
+    int64_t pts = frame->best_effort_timestamp;
+#else
+    int64_t pts = av_frame_get_best_effort_timestamp(frame);
+#endif
+    if (pts == AV_NOPTS_VALUE)
+    {
+        pts = frame->pts;
+    }
+#else
+    int64_t pts = frame->pts;
+#endif
+
+    if (pts == AV_NOPTS_VALUE)
+    {
+        // No idea where we are, assume we hit the target
+        m_seek_ahead.m_skip_samples = 0;
+        return 0;
+    }
+
+    if (input_stream->start_time != AV_NOPTS_VALUE)
+    {
+        pts -= input_stream->start_time;
+    }
+
+    int64_t sample = av_rescale_q(pts, input_stream->time_base, sample_time_base);
+
+    if (sample > target)
+    {
+        if (!m_seek_ahead.m_rewound)
+        {
+            // Seek went too far (inaccurate index or bit rate estimation). Start over
+            // at the beginning and skip samples up to the target, slow but safe.
+            Logging::debug(destname(), "Seek ahead landed behind target, restarting from the beginning.");
+
+            stop_demuxer();
+
+            int ret = av_seek_frame(m_in.m_format_ctx, m_in.m_audio.m_stream_idx, input_stream->start_time != AV_NOPTS_VALUE ? input_stream->start_time : 0, AVSEEK_FLAG_BACKWARD);
+            if (ret < 0)
+            {
+                Logging::error(filename(), "Could not seek to start of file (error '%1').", ffmpeg_geterror(ret).c_str());
+                return ret;
+            }
+            avcodec_flush_buffers(m_in.m_audio.m_codec_ctx);
+            m_seek_ahead.m_rewound = true;
+            return 1;
+        }
+
+        // Time stamps are unreliable, go on at the target
+        sample = target;
+    }
+
+    m_seek_ahead.m_skip_samples = target - sample;
+
+    return 0;
+}
+
+int FFmpeg_Transcoder::seek_ahead_reposition()
+{
+    int available = av_audio_fifo_size(m_audio_fifo);
+
+    if (m_seek_ahead.m_skip_samples > 0)
+    {
+        int drain = static_cast<int>(FFMIN(m_seek_ahead.m_skip_samples, static_cast<int64_t>(available)));
+
+        av_audio_fifo_drain(m_audio_fifo, drain);
+
+        m_seek_ahead.m_skip_samples -= drain;
+        available -= drain;
+    }
+
+    if (m_seek_ahead.m_skip_samples || !available)
+    {
+        // Not yet reached target
+        return 0;
+    }
+
+    // The first sample in the FIFO belongs to the target position, continue output there
+    Buffer *buffer = m_buffer;
+    size_t hole_end;
+
+    if (m_seek_ahead.m_target > buffer->size() && !buffer->reserve(m_seek_ahead.m_target))
+    {
+        Logging::error(destname(), "Out of memory seeking ahead in buffer.");
+        return AVERROR(ENOMEM);
+    }
+
+    int64_t ret = avio_seek(m_out.m_format_ctx->pb, static_cast<int64_t>(m_seek_ahead.m_target), SEEK_SET);
+    if (ret < 0)
+    {
+        Logging::error(destname(), "Could not seek in output file (error '%1').", ffmpeg_geterror(static_cast<int>(ret)).c_str());
+        return static_cast<int>(ret);
+    }
+
+    // Stop before running into data that is already present
+    if (buffer->find_hole(m_seek_ahead.m_target, &hole_end) == m_seek_ahead.m_target)
+    {
+        m_seek_ahead.m_limit = hole_end;
+    }
+    else
+    {
+        m_seek_ahead.m_limit = m_seek_ahead.m_target;
+    }
+
+    if (m_seek_ahead.m_limit > m_seek_ahead.m_segment_end)
+    {
+        // Do not run into the next segment
+        m_seek_ahead.m_limit = m_seek_ahead.m_segment_end;
+    }
+
+    m_seek_ahead.m_reposition = false;
+
+    Logging::debug(destname(), "Seek ahead: Continuing at offset %1.", m_seek_ahead.m_target);
+
+    return 0;
+}
+
+int FFmpeg_Transcoder::seek_ahead_next_hole(int *finished)
+{
+    Buffer *buffer = m_buffer;
+    size_t hole_end;
+    size_t hole;
+
+    // Make sure all data is in the buffer before looking for holes
+    avio_flush(m_out.m_format_ctx->pb);
+
+    hole = buffer->find_hole(m_seek_ahead.m_data_offset, &hole_end);
+
+    if (*finished && !m_seek_ahead.m_eof_pos)
+    {
+        if (!m_seek_ahead.m_reposition)
+        {
+            // Reached end of input while writing, so this is the end of file
+            m_seek_ahead.m_eof_pos = static_cast<size_t>(avio_tell(m_out.m_format_ctx->pb));
+        }
+        else if (m_seek_ahead.m_target == hole)
+        {
+            // Nothing left behind the hole: End of file
+            m_seek_ahead.m_eof_pos = hole;
+        }
+    }
+
+    if (m_seek_ahead.m_eof_pos && hole >= m_seek_ahead.m_eof_pos)
+    {
+        // All holes are filled. Move to the end so the trailer goes to the right place.
+        int64_t ret = avio_seek(m_out.m_format_ctx->pb, static_cast<int64_t>(m_seek_ahead.m_eof_pos), SEEK_SET);
+        if (ret < 0)
+        {
+            Logging::error(destname(), "Could not seek in output file (error '%1').", ffmpeg_geterror(static_cast<int>(ret)).c_str());
+            return static_cast<int>(ret);
+        }
+
+        av_audio_fifo_reset(m_audio_fifo);
+
+        m_seek_ahead.m_active = false;
+        *finished = 1;
+        return 0;
+    }
+
+    Logging::debug(destname(), "Seek ahead: Filling hole at offset %1.", hole);
+
+    *finished = 0;
+
+    return seek_input(hole);
+}
+
+bool FFmpeg_Transcoder::seek_ahead_limit_reached() const
+{
+    if (!m_seek_ahead.m_active || m_seek_ahead.m_reposition || m_seek_ahead.m_limit == SIZE_MAX)
+    {
+        return false;
+    }
+
+    return (static_cast<size_t>(avio_tell(m_out.m_format_ctx->pb)) >= m_seek_ahead.m_limit);
+}
+
+int FFmpeg_Transcoder::seek_ahead_frame_size(int frame_size) const
+{
+    if (!m_seek_ahead.m_active || m_seek_ahead.m_reposition || m_seek_ahead.m_limit == SIZE_MAX)
+    {
+        return frame_size;
+    }
+
+    size_t pos = static_cast<size_t>(avio_tell(m_out.m_format_ctx->pb));
+    size_t remaining = pos < m_seek_ahead.m_limit ? (m_seek_ahead.m_limit - pos) / m_seek_ahead.m_block_align : 0;
+
+    return static_cast<int>(FFMIN(static_cast<size_t>(frame_size), remaining));
+}
+
+int FFmpeg_Transcoder::encode_finish(size_t exact_size)
+{
+    int ret = 0;
+
+    // Write the trailer of the output file container.
+    ret = write_output_file_trailer();
+    if (ret < 0)
+    {
+        Logging::error(destname(), "Error writing trailer (error '%1').", ffmpeg_geterror(ret).c_str());
+        return ret;
+    }
+
+    if (exact_size && m_buffer != nullptr)
+    {
+        avio_flush(m_out.m_format_ctx->pb);
+
+        if (m_size_exact)
+        {
+            // Size has been calculated from the number of samples, never drop or add any.
+            size_t size = m_buffer->buffer_watermark();
+
+            if (size != exact_size)
+            {
+                Logging::warning(destname(), "Exact size: File is %1 bytes instead of %2 bytes.", size, exact_size);
+            }
+        }
+        else
+        {
+            ret = pad_output(exact_size);
+        }
+    }
+
+    return ret;
+}
+
+int FFmpeg_Transcoder::pad_output(size_t exact_size)
+{
+    size_t size = m_buffer->buffer_watermark();
+    std::vector<uint8_t> header;
+    std::vector<uint8_t> tail;
+
+    if (size > exact_size)
+    {
+        Logging::warning(destname(), "Exact size: File is %1 bytes larger than predicted, size cannot be kept.", size - exact_size);
+        return 0;
+    }
+
+    size_t pad = exact_size - size;
+    size_t min_pad = 1;
+
+    if (!pad)
+    {
+        return 0;
+    }
+
+    switch (m_out.m_filetype)
+    {
+    case FILETYPE_MP3:
+    {
+        // Insert padding before the ID3v1 tag, players skip the zeros while looking for the next frame
+        if (size >= ID3V1_TAG_LENGTH)
+        {
+            tail.resize(ID3V1_TAG_LENGTH);
+            if (m_buffer->copy(tail.data(), size - ID3V1_TAG_LENGTH, ID3V1_TAG_LENGTH) && !memcmp(tail.data(), "TAG", 3))
+            {
+                size -= ID3V1_TAG_LENGTH;
+            }
+            else
+            {
+                tail.clear();
+            }
+        }
+        break;
+    }
+    case FILETYPE_MP4:
+    case FILETYPE_MOV:
+    case FILETYPE_PRORES:
+    {
+        // Top level 'free' box
+        if (pad <= UINT32_MAX)
+        {
+            uint32_t box_size = static_cast<uint32_t>(pad);
+            header = { static_cast<uint8_t>(box_size >> 24), static_cast<uint8_t>(box_size >> 16), static_cast<uint8_t>(box_size >> 8), static_cast<uint8_t>(box_size), 'f', 'r', 'e', 'e' };
+        }
+        else
+        {
+            // Size 1: 64 bit size follows the box type
+            uint64_t box_size = pad;
+            header = { 0, 0, 0, 1, 'f', 'r', 'e', 'e' };
+            for (int shift = 56; shift >= 0; shift -= 8)
+            {
+                header.push_back(static_cast<uint8_t>(box_size >> shift));
+            }
+        }
+        min_pad = 8;
+        break;
+    }
+    case FILETYPE_WEBM:
+    {
+        // EBML Void element, with 1 byte size field if possible, 8 bytes otherwise
+        if (pad - 2 < 0x7F)
+        {
+            header = { 0xEC, static_cast<uint8_t>(0x80 | (pad - 2)) };
+        }
+        else
+        {
+            uint64_t void_size = pad - 9;
+            header = { 0xEC, 0x01 };
+            for (int shift = 48; shift >= 0; shift -= 8)
+            {
+                header.push_back(static_cast<uint8_t>(void_size >> shift));
+            }
+        }
+        min_pad = 2;
+        break;
+    }
+    default:
+    {
+        // Zero bytes after the end of the container
+        break;
+    }
+    }
+
+    if (pad < min_pad)
+    {
+        // No room for the smallest box or element, raw zeros would break the container
+        Logging::warning(destname(), "Exact size: File is only %1 bytes smaller than predicted, size cannot be kept.", pad);
+        return 0;
+    }
+
+    Logging::debug(destname(), "Exact size: Padding file with %1 bytes.", pad);
+
+    if (m_buffer->seek(static_cast<long>(size), SEEK_SET))
+    {
+        Logging::error(destname(), "Exact size: Could not seek in output file.");
+        return AVERROR(errno);
+    }
+
+    if (!header.empty() && m_buffer->write(header.data(), header.size()) != header.size())
+    {
+        return AVERROR(errno);
+    }
+
+    std::vector<uint8_t> zeros(pad - header.size(), 0);
+
+    if (!zeros.empty() && m_buffer->write(zeros.data(), zeros.size()) != zeros.size())
+    {
+        return AVERROR(errno);
+    }
+
+    if (!tail.empty() && m_buffer->write(tail.data(), tail.size()) != tail.size())
+    {
+        return AVERROR(errno);
+    }
+
+    return 0;
+}
+
+const ID3v1 * FFmpeg_Transcoder::id3v1tag() const
+{
+    return &m_out.m_id3v1;
+}
+
+int FFmpeg_Transcoder::input_read(void * opaque, unsigned char * data, int size)
+{
+    FileIO * io = static_cast<FileIO *>(opaque);
+
+    if (io == nullptr)
+    {
+        Logging::error(nullptr, "input_read(): Internal error: FileIO is NULL!");
+        return AVERROR(EINVAL);
+    }
+
+    if (io->eof())
+    {
         // At EOF
         return AVERROR_EOF;
     }
@@ -3780,6 +4929,81 @@ int FFmpeg_Transcoder::output_write(void * opaque, unsigned char * data, int siz
     return written;
 }
 
+int FFmpeg_Transcoder::segment_write(void * opaque, unsigned char * data, int size)
+{
+    FFmpeg_Transcoder * transcoder = static_cast<FFmpeg_Transcoder *>(opaque);
+    size_t pos = transcoder->m_segment_pos;
+    size_t length = static_cast<size_t>(size);
+
+    transcoder->m_segment_pos += length;
+
+    if (!transcoder->m_seek_ahead.m_active || transcoder->m_seek_ahead.m_reposition)
+    {
+        // Header or samples before the start of the segment
+        return size;
+    }
+
+    if (pos < transcoder->m_seek_ahead.m_data_offset)
+    {
+        // Never touch the header
+        size_t skip = std::min(length, transcoder->m_seek_ahead.m_data_offset - pos);
+
+        pos     += skip;
+        data    += skip;
+        length  -= skip;
+    }
+
+    if (length && transcoder->m_buffer->write_at(pos, data, length) != length)
+    {
+        // Write error
+        return (AVERROR(errno));
+    }
+
+    return size;
+}
+
+int64_t FFmpeg_Transcoder::segment_seek(void * opaque, int64_t offset, int whence)
+{
+    FFmpeg_Transcoder * transcoder = static_cast<FFmpeg_Transcoder *>(opaque);
+
+    if (whence & AVSEEK_SIZE)
+    {
+        // Return file size
+        return static_cast<int64_t>(transcoder->m_buffer->size());
+    }
+
+    switch (whence & ~(AVSEEK_SIZE | AVSEEK_FORCE))
+    {
+    case SEEK_SET:
+    {
+        break;
+    }
+    case SEEK_CUR:
+    {
+        offset += static_cast<int64_t>(transcoder->m_segment_pos);
+        break;
+    }
+    case SEEK_END:
+    {
+        offset += static_cast<int64_t>(transcoder->m_buffer->size());
+        break;
+    }
+    default:
+    {
+        return AVERROR(EINVAL);
+    }
+    }
+
+    if (offset < 0)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    transcoder->m_segment_pos = static_cast<size_t>(offset);
+
+    return offset;
+}
+
 int64_t FFmpeg_Transcoder::seek(void * opaque, int64_t offset, int whence)
 {
     FileIO * io = static_cast<FileIO *>(opaque);
@@ -3840,6 +5064,26 @@ void FFmpeg_Transcoder::close()
     std::string outfile;
     bool closed = false;
 
+    if (m_demux_queue != nullptr)
+    {
+        uint64_t packets;
+        double avg_fill;
+        size_t max_fill;
+        uint64_t empty_waits;
+        uint64_t full_waits;
+
+        // Must be stopped before the input file is closed
+        stop_demuxer();
+
+        m_demux_queue->stats(&packets, &avg_fill, &max_fill, &empty_waits, &full_waits);
+
+        Logging::debug(destname(), "Demuxer queue: %1 packets, %<%.1f>2 queued on average, %3 max. Transcoder waited for the demuxer %4 times, demuxer waited for the transcoder %5 times.", packets, avg_fill, max_fill, empty_waits, full_waits);
+
+        delete m_demux_queue;
+        m_demux_queue = nullptr;
+        closed = true;
+    }
+
     if (m_audio_fifo)
     {
         audio_samples_left = av_audio_fifo_size(m_audio_fifo);
@@ -3854,10 +5098,24 @@ void FFmpeg_Transcoder::close()
         AVFrame *output_frame = m_video_fifo.front();
         m_video_fifo.pop();
 
-        av_frame_free(&output_frame);
+        m_frame_pool.free_frame(&output_frame);
         closed = true;
     }
 
+    {
+        uint64_t frames_requested;
+        uint64_t frames_allocated;
+        uint64_t buffers_requested;
+        uint64_t buffers_allocated;
+
+        m_frame_pool.stats(&frames_requested, &frames_allocated, &buffers_requested, &buffers_allocated);
+
+        if (frames_requested)
+        {
+            Logging::debug(destname(), "Frame pool: %1 of %2 frames and %3 of %4 buffers had to be allocated.", frames_allocated, frames_requested, buffers_allocated, buffers_requested);
+        }
+    }
+
     if (close_resample())
     {
         closed = true;
@@ -4237,11 +5495,9 @@ AVFrame *FFmpeg_Transcoder::send_filters(AVFrame * srcframe, int & ret)
                 throw ret;
             }
 
-            filterframe = ::av_frame_alloc();
-            if (filterframe == nullptr)
+            ret = m_frame_pool.alloc_frame(&filterframe, destname());
+            if (ret < 0)
             {
-                ret = AVERROR(ENOMEM);
-                Logging::error(destname(), "Unable to allocate filter frame (error '%1').", ffmpeg_geterror(ret).c_str());
                 throw ret;
             }
 
@@ -4250,13 +5506,13 @@ AVFrame *FFmpeg_Transcoder::send_filters(AVFrame * srcframe, int & ret)
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
             {
                 // Not an error, go on
-                ::av_frame_free(&filterframe);
+                m_frame_pool.free_frame(&filterframe);
                 ret = 0;
             }
             else if (ret < 0)
             {
                 Logging::error(destname(), "Error while getting frame from filtergraph (error '%1').", ffmpeg_geterror(ret).c_str());
-                ::av_frame_free(&filterframe);
+                m_frame_pool.free_frame(&filterframe);
                 throw ret;
             }
             else
@@ -4270,7 +5526,7 @@ AVFrame *FFmpeg_Transcoder::send_filters(AVFrame * srcframe, int & ret)
 #else
                 tgtframe->best_effort_timestamp = av_frame_get_best_effort_timestamp(srcframe);
 #endif
-                ::av_frame_free(&srcframe);
+                m_frame_pool.free_frame(&srcframe);
             }
         }
         catch (int _ret)
@@ -34,8 +34,12 @@
 #include "ffmpegfs.h"
 #include "fileio.h"
 #include "ffmpeg_profiles.h"
+#include "packet_queue.h"
+#include "frame_pool.h"
+#include "sample_convert.h"
 
 #include <queue>
+#include <thread>
 
 class Buffer;
 #if LAVR_DEPRECATE
@@ -139,6 +143,35 @@ public:
         ID3v1                   m_id3v1;                /**< @brief mp3 only, can be referenced at any time */
     };
 
+    struct SEEKAHEAD                                    /**< @brief Seek ahead state */
+    {
+        SEEKAHEAD() :
+            m_data_offset(0),
+            m_block_align(0),
+            m_active(false),
+            m_target(0),
+            m_skip_samples(0),
+            m_reposition(false),
+            m_rewound(false),
+            m_limit(SIZE_MAX),
+            m_eof_pos(0),
+            m_segment_end(SIZE_MAX),
+            m_segment_done(false)
+        {}
+
+        size_t                  m_data_offset;          /**< @brief Start of sample data in output file */
+        size_t                  m_block_align;          /**< @brief Bytes per sample (all channels) in output file, 0 if seek ahead is not possible */
+        bool                    m_active;               /**< @brief true after the first seek, output may contain holes */
+        size_t                  m_target;               /**< @brief Output position the current segment starts at */
+        int64_t                 m_skip_samples;         /**< @brief Samples to drop until m_target is reached, -1 if not yet known */
+        bool                    m_reposition;           /**< @brief Move output to m_target as soon as samples are available */
+        bool                    m_rewound;              /**< @brief Input seek landed behind target and was restarted from the beginning */
+        size_t                  m_limit;                /**< @brief End of current segment (start of data already present) */
+        size_t                  m_eof_pos;              /**< @brief End of sample data in output file, 0 if not yet known */
+        size_t                  m_segment_end;          /**< @brief End of segment being transcoded, SIZE_MAX if not in segment mode */
+        bool                    m_segment_done;         /**< @brief true if the end of the segment or input has been reached */
+    };
+
 public:
     /**
      * Construct FFmpeg_Transcoder object
@@ -169,10 +202,16 @@ public:
     int                         open_input_file(LPVIRTUALFILE virtualfile, FileIO * fio = nullptr);
     /**
      * @brief Open output file. Data will actually be written to buffer and copied by FUSE when accessed.
+     *
+     * In segment mode, only sample data is written to the buffer, at the position given by
+     * seek_segment(). The header is left to the transcoder that owns the file, so several
+     * transcoders can work on the same buffer at the same time.
+     *
      * @param[in] buffer - Cache buffer to be written.
+     * @param[in] segment - If true, open in segment mode.
      * @return On success returns 0; on error negative AVERROR.
      */
-    int                         open_output_file(Buffer* buffer);
+    int                         open_output_file(Buffer* buffer, bool segment = false);
     /**
      * Process a single frame of audio data. The encode_pcm_data() method
      * of the Encoder will be used to process the resulting audio data, with the
@@ -184,9 +223,16 @@ public:
     /**
      * Encode any remaining PCM data to the given Buffer. This should be called
      * after all input data has already been passed to encode_pcm_data().
+     *
+     * If exact_size is set, the file is made exactly that size. Files whose size has been
+     * calculated exactly (uncompressed audio, MP3 without album art) are never padded or cut,
+     * other formats are padded in a way the container ignores. Files larger than exact_size
+     * are left as they are.
+     *
+     * @param[in] exact_size - Size to make the file, 0 to leave it as it is.
      * @return On success returns 0; on error negative AVERROR.
      */
-    int                         encode_finish();
+    int                         encode_finish(size_t exact_size = 0);
     /**
      * @brief Close transcoder, free all ressources.
      */
@@ -201,6 +247,83 @@ public:
      * @return Predicted file size in bytes.
      */
     size_t                      predicted_filesize();
+    /**
+     * @brief Check if seek ahead is possible for this file.
+     *
+     * Only possible if an output byte position can be exactly mapped to a play
+     * time, i.e. for uncompressed audio (WAV, AIFF) without video.
+     *
+     * @todo Video containers (fragmented MP4, WebM) are not supported yet. Fragments
+     * transcoded out of order would need byte offsets that are only known once
+     * everything before them has been written, plus a sidx/Cues index rewritten
+     * at the end.
+     *
+     * @return Returns true if seek ahead is supported, false if not.
+     */
+    bool                        can_seek_ahead() const;
+    /**
+     * @brief Continue transcoding at another output position.
+     *
+     * Seeks the input to the play time that matches the output position. The data
+     * skipped will be filled in after the end of the input has been reached.
+     *
+     * @param[in] pos - Byte offset in output file.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                         seek_ahead(size_t pos);
+    /**
+     * @brief Resume an interrupted transcode.
+     *
+     * Must be called after open_output_file(). If the output buffer contains data from a
+     * previous run, transcoding continues at the first part not yet written. If the file
+     * cannot be resumed, the old data is discarded and transcoding starts from the beginning.
+     *
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                         resume();
+    /**
+     * @brief Split the output file into segments that can be transcoded in parallel.
+     *
+     * Only possible if can_seek_ahead() is true. Segments start at sample boundaries.
+     *
+     * @todo Compressed targets are not supported yet. CBR MP3 needs the bit reservoir
+     * turned off, a pre-roll of the encoder delay dropped at every joint and the frame
+     * padding of each segment taken into account for the offsets. Transport streams
+     * need closed GOPs and continuous time stamps and continuity counters.
+     *
+     * @param[in] count - Desired number of segments.
+     * @param[in] min_size - Minimum segment size in bytes.
+     * @param[out] starts - Start offsets of the segments. Each segment ends where the next
+     * one starts, the last one at the end of the file.
+     * @return Returns the number of segments, 0 if the file cannot be split.
+     */
+    size_t                      split_segments(unsigned int count, size_t min_size, std::vector<size_t> *starts) const;
+    /**
+     * @brief Start transcoding a segment.
+     *
+     * Seeks to the start of the segment. process_single_fr() stops when the end of the
+     * segment, data already present in the buffer or the end of input is reached;
+     * segment_done() will then return true. No trailer is written.
+     *
+     * @param[in] start - Start offset of the segment in the output file.
+     * @param[in] end - End offset of the segment, SIZE_MAX for end of file.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                         seek_segment(size_t start, size_t end);
+    /**
+     * @brief Check if the current segment is complete.
+     * @return Returns true if the segment is complete, false if not.
+     */
+    bool                        segment_done() const;
+    /**
+     * @brief Leave segment mode.
+     *
+     * Parts left over by segments that failed are filled in now, then the file
+     * is finished as usual.
+     *
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                         end_segments();
     /**
      * @brief Assemble an ID3v1 file tag
      * @return Returns an ID3v1 file tag.
@@ -240,6 +363,12 @@ public:
      * @return On success, returns true; on failure, returns false.
      */
     static bool                 video_size(size_t *filesize, AVCodecID codec_id, BITRATE bit_rate, int64_t duration, int width, int height, int interleaved, const AVRational & framerate);
+    /**
+     * @brief Get the extra room to reserve for a stream in exact size mode.
+     * @param[in] stream_size - Predicted size of the stream.
+     * @return Number of bytes to add to the predicted size.
+     */
+    static size_t               exact_size_reserve(size_t stream_size);
 
 protected:
     /**
@@ -375,11 +504,11 @@ protected:
      * @brief Initialise a temporary storage for the specified number of audio samples.
      * The conversion requires temporary storage due to the different format.
      * The number of audio samples to be allocated is specified in frame_size.
-     * @param[out] converted_input_samples - Memory for input samples.
+     * @param[out] converted_frame - Frame holding the memory for input samples, to be freed with m_frame_pool.free_frame().
      * @param[in] frame_size - Size of one frame.
      * @return On success returns 0; on error negative AVERROR.
      */
-    int                         init_converted_samples(uint8_t ***converted_input_samples, int frame_size);
+    int                         init_converted_samples(AVFrame **converted_frame, int frame_size);
     /**
      * @brief Convert the input audio samples into the output sample format.
      * The conversion happens on a per-frame basis, the size of which is
@@ -410,6 +539,26 @@ protected:
      * @return On success returns 0; on error negative AVERROR.
      */
     int                         flush_frames_single(int stream_index, bool use_flush_packet);
+    /**
+     * @brief Read the next packet from the input file.
+     * With a demuxer queue, takes it from there, and starts the demuxer thread if necessary.
+     * @param[out] pkt - Packet read.
+     * @return On success returns 0; on error negative AVERROR, AVERROR_EOF at end of file.
+     */
+    int                         read_packet(AVPacket *pkt);
+    /**
+     * @brief Start the demuxer thread, unless already running.
+     */
+    void                        start_demuxer();
+    /**
+     * @brief Stop the demuxer thread and drop all packets read ahead.
+     * Must be called before the input file is sought or closed.
+     */
+    void                        stop_demuxer();
+    /**
+     * @brief Demuxer thread: read packets into the demuxer queue until end of file or stopped.
+     */
+    void                        demux_thread();
     /**
      * @brief Read frame from source file, decode and store in FIFO.
      * @param[in] finished - 1 if at EOF.
@@ -469,6 +618,11 @@ protected:
      * @return On success returns 0. On error, returns a negative AVERROR value.
      */
     int                         load_encode_and_write(int frame_size);
+    /**
+     * @brief Fill the FIFO buffer up with silence to the number of samples the exact size was calculated for.
+     * @return On success returns 0. On error, returns a negative AVERROR value.
+     */
+    int                         pad_exact_samples();
     /**
      * @brief Write the trailer of the output file container.
      * @return On success returns 0. On error, returns a negative AVERROR value.
@@ -504,6 +658,27 @@ protected:
      * @return On successs returns 0. On error returns -1 and sets errno accordingly.
      */
     static int64_t              seek(void * opaque, int64_t offset, int whence);
+    /**
+     * @brief Custom write function for FFmpeg in segment mode.
+     *
+     * Writes sample data to its position in the output buffer without moving the buffer's
+     * file position, which belongs to the transcoder writing the header. Everything else is
+     * dropped.
+     *
+     * @param[in] opaque - Payload given to FFmpeg, the FFmpeg_Transcoder object
+     * @param[in] data - Data to be written
+     * @param[in] size - Size of data block.
+     * @return On success returns bytes written. On error, returns a negative AVERROR value.
+     */
+    static int                  segment_write(void * opaque, unsigned char * data, int size);
+    /**
+     * @brief Custom seek function for FFmpeg in segment mode.
+     * @param[in] opaque - Payload given to FFmpeg, the FFmpeg_Transcoder object
+     * @param[in] offset - Offset to seek to.
+     * @param[in] whence - One of the regular seek() constants like SEEK_SET/SEEK_END. Additionally FFmpeg constants like AVSEEK_SIZE are supported.
+     * @return On successs returns the new position. On error returns a negative AVERROR value.
+     */
+    static int64_t              segment_seek(void * opaque, int64_t offset, int whence);
 
     /**
      * @brief Calculate the appropriate bitrate for a ProRes file given several parameters.
@@ -517,8 +692,49 @@ protected:
     static BITRATE              get_prores_bitrate(int width, int height, const AVRational &framerate, int interleaved, int profile);
     /**
      * @brief Try to predict final file size.
+     * @param[out] exact - Set to true if the size has been calculated exactly, false if it has been estimated.
+     * @param[out] exact_samples - Number of samples per channel the exact size is based on, 0 if none.
+     */
+    size_t                      calculate_predicted_filesize(bool *exact, int64_t *exact_samples) const;
+    /**
+     * @brief Get the number of samples per channel of the input audio stream.
+     *
+     * Taken from the duration of the stream in its own time base, which is exact for
+     * most audio formats (1 / sample rate). Falls back to the file duration.
+     *
+     * @param[in] duration - File duration in AV_TIME_BASE units.
+     * @param[in] sample_rate - Sample rate of source file.
+     * @return Returns the number of samples.
+     */
+    int64_t                     input_audio_samples(int64_t duration, int sample_rate) const;
+    /**
+     * @brief Calculate the exact size of an audio only file with constant bit rate.
+     *
+     * Uncompressed audio is header plus sample data. MP3 is header and Xing frame plus
+     * the frames LAME creates for the samples, including encoder delay and padding,
+     * plus the ID3v1 tag. The header is created by a dry run of the muxer, so that it
+     * contains the same meta tags as the real file.
+     *
+     * @param[out] filesize - Exact file size in bytes.
+     * @param[in] codec_id - Target codec ID
+     * @param[in] bit_rate - Bit rate of source file.
+     * @param[in] input_samples - Number of samples per channel in source file, see input_audio_samples().
+     * @param[in] channels - Number of channels in source file.
+     * @param[in] sample_rate - Sample rate of source file.
+     * @param[out] output_samples - Number of samples per channel after resampling. The encoder must get exactly this many.
+     * @return Returns true if the size could be calculated, false if the target has no constant bit rate.
+     */
+    bool                        exact_audio_size(size_t *filesize, AVCodecID codec_id, BITRATE bit_rate, int64_t input_samples, int channels, int sample_rate, int64_t *output_samples) const;
+    /**
+     * @brief Get the size of the header the muxer writes for an audio only file.
+     * @param[out] header_size - Size of header in bytes.
+     * @param[in] codec_id - Target codec ID
+     * @param[in] channels - Number of channels in target file.
+     * @param[in] sample_rate - Sample rate of target file.
+     * @param[in] bit_rate - Bit rate of target file.
+     * @return On success returns 0; on error negative AVERROR.
      */
-    size_t                      calculate_predicted_filesize() const;
+    int                         predict_header_size(size_t *header_size, AVCodecID codec_id, int channels, int sample_rate, BITRATE bit_rate) const;
     /**
      * @brief Get the size of the output video based on user selection and apsect ratio.
      * @param[in] output_width - Output video width.
@@ -585,6 +801,59 @@ protected:
      * @return If an open context was closed, returns true; if nothing had been done returns false.
      */
     bool                        close_resample();
+    /**
+     * @brief Seek input to the play time that corresponds to an output position.
+     *
+     * Drops all pending samples and resets decoder and resampler. The output
+     * position will be set when the first samples are decoded.
+     *
+     * @param[in] pos - Byte offset in output file.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                         seek_input(size_t pos);
+    /**
+     * @brief Check time stamp of the first frame decoded after a seek.
+     *
+     * Calculates how many samples must be skipped to reach the target. If the
+     * seek went too far, the input is restarted from the beginning.
+     *
+     * @param[in] frame - Decoded audio frame.
+     * @return Returns 0 if the frame can be used, 1 if it must be dropped, or negative AVERROR.
+     */
+    int                         seek_ahead_check_frame(const AVFrame *frame);
+    /**
+     * @brief Drop samples before the target and move output to the target position.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                         seek_ahead_reposition();
+    /**
+     * @brief Continue transcoding with the next hole in the output file.
+     * @param[in, out] finished - In: 1 if end of input was reached. Out: 1 if no holes are left, 0 if not.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                         seek_ahead_next_hole(int *finished);
+    /**
+     * @brief Check if current segment has run into data already present.
+     * @return Returns true if end of segment has been reached, false if not.
+     */
+    bool                        seek_ahead_limit_reached() const;
+    /**
+     * @brief Limit frame size so the current segment does not overwrite data already present.
+     * @param[in] frame_size - Desired frame size.
+     * @return Returns frame_size or less.
+     */
+    int                         seek_ahead_frame_size(int frame_size) const;
+    /**
+     * @brief Pad the output file to a size.
+     *
+     * The padding is never shorter than the smallest box or element the container
+     * can ignore. If less room is left, the file keeps its size.
+     *
+     * @note Must be called after the trailer has been written.
+     * @param[in] exact_size - Desired file size.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                         pad_output(size_t exact_size);
     /**
      * @brief Init image size rescaler and pixel format converter.
      * @param[in] in_pix_fmt - Input pixel format
@@ -602,6 +871,9 @@ private:
     bool                        m_close_fileio;             /**< @brief If we own the FileIO object, we may close it in the end. */
     time_t                      m_mtime;                    /**< @brief Modified time of input file */
     size_t                      m_predicted_size;           /**< @brief Use this as the size instead of computing it over and over. */
+    bool                        m_size_exact;               /**< @brief m_predicted_size has been calculated exactly, the file need not be padded. */
+    int64_t                     m_exact_samples;            /**< @brief Number of samples per channel to encode for the exact size, surplus samples are dropped, missing ones filled with silence. 0 if not limited. */
+    int64_t                     m_samples_encoded;          /**< @brief Number of samples per channel passed to the encoder so far */
     bool                        m_is_video;                 /**< @brief true if input is a video file */
 
     // Audio conversion and buffering
@@ -613,6 +885,7 @@ private:
 #else
     AVAudioResampleContext *    m_audio_resample_ctx;       /**< @brief AVResample context for audio resampling */
 #endif
+    SAMPLE_CONVERT_FUNC         m_sample_convert;           /**< @brief Fast sample format conversion used instead of the resampler, nullptr if not possible */
     AVAudioFifo *               m_audio_fifo;               /**< @brief Audio sample FIFO */
 
     // Video conversion and buffering
@@ -623,11 +896,18 @@ private:
     AVFilterGraph *             m_filter_graph;             /**< @brief Video filter graph */
 #endif
     std::queue<AVFrame*>        m_video_fifo;               /**< @brief Video frame FIFO */
+    Frame_Pool                  m_frame_pool;               /**< @brief Frames and frame buffers for reuse */
     int64_t                     m_pts;                      /**< @brief Generated PTS */
     int64_t                     m_pos;                      /**< @brief Generated position */
 
     INPUTFILE                   m_in;                       /**< @brief Input file information */
     OUTPUTFILE                  m_out;                      /**< @brief Output file information */
+    SEEKAHEAD                   m_seek_ahead;               /**< @brief Seek ahead state */
+    Packet_Queue *              m_demux_queue;              /**< @brief Packets read ahead by the demuxer thread, nullptr to read on the transcoder thread */
+    std::thread                 m_demux_thread;             /**< @brief Demuxer thread */
+    Buffer *                    m_buffer;                   /**< @brief Output buffer */
+    bool                        m_segment_mode;             /**< @brief If true, only write sample data of segments, see open_output_file() */
+    size_t                      m_segment_pos;              /**< @brief Output position in segment mode */
 
     // If the audio and/or video stream is copied, packets will be stuffed into the packet queue.
     bool                        m_copy_audio;               /**< @brief If true, copy audio stream from source to target (just remux, no recode). */
@@ -32,6 +32,7 @@
 
 #include <libgen.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <algorithm>
 #include <regex.h>
 #include <wordexp.h>
@@ -57,6 +58,7 @@
 extern "C" {
 #endif
 #include <libswscale/swscale.h>
+#include <libavutil/sha.h>
 #if LAVR_DEPRECATE
 #include <libswresample/swresample.h>
 #else
@@ -1301,3 +1303,147 @@ bool check_ignore(size_t size, size_t offset)
     return ignore;
 }
 
+bool make_content_key(const std::string & filename, std::string *key)
+{
+    struct stat st;
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    if (fstat(fd, &st) == -1)
+    {
+        int _errno = errno;
+        close(fd);
+        errno = _errno;
+        return false;
+    }
+
+    struct AVSHA *sha = av_sha_alloc();
+    if (sha == nullptr)
+    {
+        close(fd);
+        errno = ENOMEM;
+        return false;
+    }
+
+    av_sha_init(sha, 160);
+
+    uint64_t header[2] = { static_cast<uint64_t>(st.st_size), static_cast<uint64_t>(st.st_mtime) };
+
+    av_sha_update(sha, reinterpret_cast<const uint8_t*>(header), sizeof(header));
+
+    std::vector<uint8_t> block(CONTENT_KEY_BLOCK_SIZE);
+    size_t size = static_cast<size_t>(st.st_size);
+    bool success = true;
+
+    for (size_t n = 0; n < CONTENT_KEY_SAMPLES && success; n++)
+    {
+        // Blocks at start, end and evenly in between. Overlap for small files, read each part only once.
+        size_t offset = (size > CONTENT_KEY_BLOCK_SIZE) ? (size - CONTENT_KEY_BLOCK_SIZE) / (CONTENT_KEY_SAMPLES - 1) * n : 0;
+        size_t end = std::min(offset + CONTENT_KEY_BLOCK_SIZE, size);
+        static_assert(CONTENT_KEY_SAMPLES > 1, "CONTENT_KEY_SAMPLES must be at least 2");
+
+        if (size <= CONTENT_KEY_SAMPLES * CONTENT_KEY_BLOCK_SIZE)
+        {
+            // Small file: Hash it all
+            offset  = n * CONTENT_KEY_BLOCK_SIZE;
+            end     = std::min(offset + CONTENT_KEY_BLOCK_SIZE, size);
+        }
+
+        while (offset < end)
+        {
+            ssize_t bytes = pread(fd, block.data(), end - offset, static_cast<off_t>(offset));
+
+            if (bytes <= 0)
+            {
+                if (bytes == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (!bytes)
+                {
+                    errno = EIO;    // File has shrunk
+                }
+                success = false;
+                break;
+            }
+
+            av_sha_update(sha, block.data(), static_cast<unsigned int>(bytes));
+
+            offset += static_cast<size_t>(bytes);
+        }
+    }
+
+    uint8_t digest[20];
+
+    av_sha_final(sha, digest);
+    av_free(sha);
+
+    int _errno = errno;
+    close(fd);
+    errno = _errno;
+
+    if (!success)
+    {
+        return false;
+    }
+
+    key->clear();
+    for (uint8_t c : digest)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        *key += hex[c >> 4];
+        *key += hex[c & 0x0F];
+    }
+
+    errno = 0;
+
+    return true;
+}
+
+std::string make_settings_key()
+{
+    std::string settings;
+    uint8_t digest[20];
+    std::string key;
+
+    // Everything that changes the transcoded file. Keep the order, or all cache files become invalid.
+    settings += "audiobitrate=" + std::to_string(params.m_audiobitrate);
+    settings += ";audiosamplerate=" + std::to_string(params.m_audiosamplerate);
+    settings += ";videobitrate=" + std::to_string(params.m_videobitrate);
+    settings += ";videowidth=" + std::to_string(params.m_videowidth);
+    settings += ";videoheight=" + std::to_string(params.m_videoheight);
+#ifndef USING_LIBAV
+    settings += ";deinterlace=" + std::to_string(params.m_deinterlace);
+#endif  // !USING_LIBAV
+    settings += ";autocopy=" + std::to_string(params.m_autocopy);
+    settings += ";profile=" + std::to_string(params.m_profile);
+    settings += ";level=" + std::to_string(params.m_level);
+    settings += ";noalbumarts=" + std::to_string(params.m_noalbumarts);
+    settings += ";exact_size=" + std::to_string(params.m_exact_size);
+
+    struct AVSHA *sha = av_sha_alloc();
+    if (sha == nullptr)
+    {
+        return key;
+    }
+
+    av_sha_init(sha, 160);
+    av_sha_update(sha, reinterpret_cast<const uint8_t*>(settings.c_str()), static_cast<unsigned int>(settings.size()));
+    av_sha_final(sha, digest);
+    av_free(sha);
+
+    for (size_t n = 0; n < SETTINGS_KEY_LENGTH / 2; n++)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        key += hex[digest[n] >> 4];
+        key += hex[digest[n] & 0x0F];
+    }
+
+    return key;
+}
@@ -228,6 +228,19 @@ typedef enum AUTOCOPY
      AUTOCOPY_STRICTLIMIT,  /**< @brief Same as STRICT, only copy if target not larger, transcode otherwise. */
 } AUTOCOPY;
 
+#define CONTENT_KEY_SAMPLES     4                       /**< @brief Number of blocks sampled for a content key */
+#define CONTENT_KEY_BLOCK_SIZE  (64 * 1024)             /**< @brief Size of a block sampled for a content key */
+#define SETTINGS_KEY_LENGTH     16                      /**< @brief Number of hex digits of a settings key */
+
+/**
+  * Cache key options
+  */
+typedef enum CACHE_KEY
+{
+     CACHE_KEY_PATH = 0,    /**< @brief Cache files by source file path. */
+     CACHE_KEY_CONTENT,     /**< @brief Cache files by source file content, files with the same content share a cache file. */
+} CACHE_KEY;
+
 /**
  * @brief The #FFmpegfs_Format class
  */
@@ -653,4 +666,26 @@ size_t              get_disk_free(std::string & path);
  */
 bool                check_ignore(size_t size, size_t offset);
 
+/**
+ * @brief Make up a key for the content of a file.
+ *
+ * The key is a SHA-1 hash of file size, modification time and #CONTENT_KEY_SAMPLES
+ * blocks of #CONTENT_KEY_BLOCK_SIZE bytes spread evenly over the file. Files with
+ * the same key are considered identical, so a renamed or copied file need not be
+ * transcoded again. Small files are hashed completely.
+ * @param[in] filename - Name of file.
+ * @param[out] key - Key as hex string.
+ * @return Returns true on success; false on error. Check errno for details.
+ */
+bool                make_content_key(const std::string & filename, std::string *key);
+/**
+ * @brief Make up a key for the settings that change the transcoded file.
+ *
+ * Bit rates, sample rate, video size, deinterlacing, autocopy, profile, level,
+ * album arts and exact size. Instances with different settings must not use the
+ * same cache files.
+ * @return Returns the key as hex string of #SETTINGS_KEY_LENGTH digits, empty if out of memory.
+ */
+std::string         make_settings_key();
+
 #endif
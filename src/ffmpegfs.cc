@@ -70,6 +70,8 @@ extern "C" {
 #pragma GCC diagnostic pop
 
 #include "ffmpeg_utils.h"
+#include "buffer.h"
+#include "cache_entry.h"
 
 FFMPEGFS_PARAMS     params;                     /**< @brief FFmpegfs command line parameters */
 
@@ -108,14 +110,28 @@ FFMPEGFS_PARAMS::FFMPEGFS_PARAMS()
     , m_max_inactive_suspend(15)                // default: 15 seconds
     , m_max_inactive_abort(30)                  // default: 30 seconds
     , m_prebuffer_size(100 /* KB */ * 1024)     // default: 100 KB
+    , m_seek_ahead(0)                           // default: disabled
     , m_max_cache_size(0)                       // default: no limit
     , m_min_diskspace(0)                        // default: no minimum
+    , m_cache_policy(CACHE_POLICY_LRU)          // default: least recently used first
+    , m_cache_key(CACHE_KEY_PATH)               // default: cache files by source path
+    , m_compress_cache(0)                       // default: do not compress
+    , m_ram_cache_size(0)                       // default: disabled
+    , m_stream_buffer_size(0)                   // default: cache disc titles like other files
     , m_cachepath("")                           // default: /tmp
     , m_disable_cache(0)                        // default: enabled
     , m_cache_maintenance((60*60))              // default: prune every 60 minutes
     , m_prune_cache(0)                          // default: Do not prune cache immediately
     , m_clear_cache(0)                          // default: Do not clear cache on startup
+    , m_warm_cache(0)                           // default: Do not warm cache
+    , m_warm_cache_jobs(1)                      // default: 1 job at a time
+    , m_db_write_delay(0)                       // default: disabled, write immediately
+    , m_db_write_batch(100)                     // default: 100 updates
     , m_max_threads(0)                          // default: 16 * CPU cores (this value here is overwritten later)
+    , m_split_encode(0)                         // default: disabled
+    , m_demux_queue(32)                         // default: 32 packets
+    , m_exact_size(0)                           // default: disabled
+    , m_attr_cache_timeout(0)                   // default: disabled
     , m_decoding_errors(0)                      // default: ignore errors
     , m_min_dvd_chapter_duration(1)             // default: 1 second
     , m_win_smb_fix(0)                          // default: no fix
@@ -204,10 +220,16 @@ enum
     KEY_MAX_INACTIVE_SUSPEND_TIME,
     KEY_MAX_INACTIVE_ABORT_TIME,
     KEY_PREBUFFER_SIZE,
+    KEY_SEEK_AHEAD,
     KEY_MAX_CACHE_SIZE,
     KEY_MIN_DISKSPACE_SIZE,
     KEY_CACHEPATH,
     KEY_CACHE_MAINTENANCE,
+    KEY_CACHE_POLICY,
+    KEY_CACHE_KEY,
+    KEY_RAM_CACHE_SIZE,
+    KEY_STREAM_BUFFER_SIZE,
+    KEY_ATTR_CACHE_TIMEOUT,
     KEY_AUTOCOPY,
     KEY_PROFILE,
     KEY_LEVEL,
@@ -272,23 +294,51 @@ static struct fuse_opt ffmpegfs_opts[] =
     FUSE_OPT_KEY("max_inactive_abort=%s",           KEY_MAX_INACTIVE_ABORT_TIME),
     FUSE_OPT_KEY("--prebuffer_size=%s",             KEY_PREBUFFER_SIZE),
     FUSE_OPT_KEY("prebuffer_size=%s",               KEY_PREBUFFER_SIZE),
+    FUSE_OPT_KEY("--seek_ahead=%s",                 KEY_SEEK_AHEAD),
+    FUSE_OPT_KEY("seek_ahead=%s",                   KEY_SEEK_AHEAD),
     FUSE_OPT_KEY("--max_cache_size=%s",             KEY_MAX_CACHE_SIZE),
     FUSE_OPT_KEY("max_cache_size=%s",               KEY_MAX_CACHE_SIZE),
     FUSE_OPT_KEY("--min_diskspace=%s",              KEY_MIN_DISKSPACE_SIZE),
     FUSE_OPT_KEY("min_diskspace=%s",                KEY_MIN_DISKSPACE_SIZE),
+    FUSE_OPT_KEY("--cache_policy=%s",               KEY_CACHE_POLICY),
+    FUSE_OPT_KEY("cache_policy=%s",                 KEY_CACHE_POLICY),
+    FUSE_OPT_KEY("--cache_key=%s",                  KEY_CACHE_KEY),
+    FUSE_OPT_KEY("cache_key=%s",                    KEY_CACHE_KEY),
+    FFMPEGFS_OPT("--compress_cache",                m_compress_cache, 1),
+    FFMPEGFS_OPT("compress_cache",                  m_compress_cache, 1),
+    FUSE_OPT_KEY("--ram_cache_size=%s",             KEY_RAM_CACHE_SIZE),
+    FUSE_OPT_KEY("ram_cache_size=%s",               KEY_RAM_CACHE_SIZE),
+    FUSE_OPT_KEY("--stream_buffer_size=%s",         KEY_STREAM_BUFFER_SIZE),
+    FUSE_OPT_KEY("stream_buffer_size=%s",           KEY_STREAM_BUFFER_SIZE),
     FUSE_OPT_KEY("--cachepath=%s",                  KEY_CACHEPATH),
     FUSE_OPT_KEY("cachepath=%s",                    KEY_CACHEPATH),
     FFMPEGFS_OPT("--disable_cache",                 m_disable_cache, 1),
     FFMPEGFS_OPT("disable_cache",                   m_disable_cache, 1),
     FUSE_OPT_KEY("--cache_maintenance=%s",          KEY_CACHE_MAINTENANCE),
     FUSE_OPT_KEY("cache_maintenance=%s",            KEY_CACHE_MAINTENANCE),
+    FUSE_OPT_KEY("--attr_cache_timeout=%s",         KEY_ATTR_CACHE_TIMEOUT),
+    FUSE_OPT_KEY("attr_cache_timeout=%s",           KEY_ATTR_CACHE_TIMEOUT),
     FFMPEGFS_OPT("--prune_cache",                   m_prune_cache, 1),
     FFMPEGFS_OPT("--clear_cache",                   m_clear_cache, 1),
     FFMPEGFS_OPT("clear_cache",                     m_clear_cache, 1),
+    FFMPEGFS_OPT("--warm_cache",                    m_warm_cache, 1),
+    FFMPEGFS_OPT("warm_cache",                      m_warm_cache, 1),
+    FFMPEGFS_OPT("--warm_cache_jobs=%u",            m_warm_cache_jobs, 0),
+    FFMPEGFS_OPT("warm_cache_jobs=%u",              m_warm_cache_jobs, 0),
+    FFMPEGFS_OPT("--db_write_delay=%u",             m_db_write_delay, 0),
+    FFMPEGFS_OPT("db_write_delay=%u",               m_db_write_delay, 0),
+    FFMPEGFS_OPT("--db_write_batch=%u",             m_db_write_batch, 0),
+    FFMPEGFS_OPT("db_write_batch=%u",               m_db_write_batch, 0),
 
     // Other
     FFMPEGFS_OPT("--max_threads=%u",                m_max_threads, 0),
     FFMPEGFS_OPT("max_threads=%u",                  m_max_threads, 0),
+    FFMPEGFS_OPT("--split_encode=%u",               m_split_encode, 0),
+    FFMPEGFS_OPT("split_encode=%u",                 m_split_encode, 0),
+    FFMPEGFS_OPT("--demux_queue=%u",                m_demux_queue, 0),
+    FFMPEGFS_OPT("demux_queue=%u",                  m_demux_queue, 0),
+    FFMPEGFS_OPT("--exact_size",                    m_exact_size, 1),
+    FFMPEGFS_OPT("exact_size",                      m_exact_size, 1),
     FFMPEGFS_OPT("--decoding_errors=%u",            m_decoding_errors, 0),
     FFMPEGFS_OPT("decoding_errors=%u",              m_decoding_errors, 0),
     FFMPEGFS_OPT("--min_dvd_chapter_duration=%u",   m_min_dvd_chapter_duration, 0),
@@ -319,6 +369,8 @@ static struct fuse_opt ffmpegfs_opts[] =
 typedef std::map<std::string, AUTOCOPY, comp> AUTOCOPY_MAP;     /**< @brief Map command line option to AUTOCOPY enum */
 typedef std::map<std::string, PROFILE, comp> PROFILE_MAP;       /**< @brief Map command line option to PROFILE enum  */
 typedef std::map<std::string, PRORESLEVEL, comp> LEVEL_MAP;     /**< @brief Map command line option to LEVEL enum  */
+typedef std::map<std::string, CACHE_POLICY, comp> CACHE_POLICY_MAP; /**< @brief Map command line option to CACHE_POLICY enum  */
+typedef std::map<std::string, CACHE_KEY, comp> CACHE_KEY_MAP;       /**< @brief Map command line option to CACHE_KEY enum  */
 
 /**
   * List of AUTOCOPY options
@@ -364,6 +416,25 @@ static const LEVEL_MAP level_map =
     { "HQ",             PRORESLEVEL_PRORES_HQ },
 };
 
+/**
+  * List of cache eviction policies.
+  */
+static const CACHE_POLICY_MAP cache_policy_map =
+{
+    { "LRU",            CACHE_POLICY_LRU },
+    { "LFU",            CACHE_POLICY_LFU },
+    { "GDSF",           CACHE_POLICY_GDSF },
+};
+
+/**
+  * List of cache key types.
+  */
+static const CACHE_KEY_MAP cache_key_map =
+{
+    { "PATH",           CACHE_KEY_PATH },
+    { "CONTENT",        CACHE_KEY_CONTENT },
+};
+
 static int          get_bitrate(const std::string & arg, BITRATE *bitrate);
 static int          get_samplerate(const std::string & arg, int *samplerate);
 static int          get_time(const std::string & arg, time_t *time);
@@ -375,10 +446,15 @@ static int          get_profile(const std::string & arg, PROFILE *profile);
 static std::string  get_profile_text(PROFILE profile);
 static int          get_level(const std::string & arg, PRORESLEVEL *level);
 static std::string  get_level_text(PRORESLEVEL level);
+static int          get_cache_policy(const std::string & arg, CACHE_POLICY *cache_policy);
+static std::string  get_cache_policy_text(CACHE_POLICY cache_policy);
+static int          get_cache_key(const std::string & arg, CACHE_KEY *cache_key);
+static std::string  get_cache_key_text(CACHE_KEY cache_key);
 static int          get_value(const std::string & arg, std::string *value);
 
 static int          ffmpegfs_opt_proc(void* data, const char* arg, int key, struct fuse_args *outargs);
 static bool         set_defaults(void);
+static void         check_unsupported(void);
 static void         print_params(void);
 static void         usage();
 
@@ -926,6 +1002,100 @@ static std::string get_level_text(PRORESLEVEL level)
     return "INVALID";
 }
 
+/**
+ * @brief Get cache eviction policy option.
+ * @param[in] arg - One of the cache policy options.
+ * @param[out] cache_policy - Upon return contains selected CACHE_POLICY enum.
+ * @return Returns 0 if found; if not found returns -1.
+ */
+static int get_cache_policy(const std::string & arg, CACHE_POLICY *cache_policy)
+{
+    size_t pos = arg.find('=');
+
+    if (pos != std::string::npos)
+    {
+        std::string data(arg.substr(pos + 1));
+
+        auto it = cache_policy_map.find(data);
+
+        if (it == cache_policy_map.end())
+        {
+            std::fprintf(stderr, "INVALID PARAMETER: Invalid cache policy: %s\n", data.c_str());
+            return -1;
+        }
+
+        *cache_policy = it->second;
+
+        return 0;
+    }
+
+    std::fprintf(stderr, "INVALID PARAMETER: Missing cache policy string\n");
+
+    return -1;
+}
+
+/**
+ * @brief Convert CACHE_POLICY enum to human readable text.
+ * @param[in] cache_policy - CACHE_POLICY enum value to convert.
+ * @return CACHE_POLICY enum as text or "INVALID" if not known.
+ */
+static std::string get_cache_policy_text(CACHE_POLICY cache_policy)
+{
+    CACHE_POLICY_MAP::const_iterator it = search_by_value(cache_policy_map, cache_policy);
+    if (it != cache_policy_map.end())
+    {
+        return it->first;
+    }
+    return "INVALID";
+}
+
+/**
+ * @brief Get cache key option.
+ * @param[in] arg - One of the cache key options.
+ * @param[out] cache_key - Upon return contains selected CACHE_KEY enum.
+ * @return Returns 0 if found; if not found returns -1.
+ */
+static int get_cache_key(const std::string & arg, CACHE_KEY *cache_key)
+{
+    size_t pos = arg.find('=');
+
+    if (pos != std::string::npos)
+    {
+        std::string data(arg.substr(pos + 1));
+
+        auto it = cache_key_map.find(data);
+
+        if (it == cache_key_map.end())
+        {
+            std::fprintf(stderr, "INVALID PARAMETER: Invalid cache key: %s\n", data.c_str());
+            return -1;
+        }
+
+        *cache_key = it->second;
+
+        return 0;
+    }
+
+    std::fprintf(stderr, "INVALID PARAMETER: Missing cache key string\n");
+
+    return -1;
+}
+
+/**
+ * @brief Convert CACHE_KEY enum to human readable text.
+ * @param[in] cache_key - CACHE_KEY enum value to convert.
+ * @return CACHE_KEY enum as text or "INVALID" if not known.
+ */
+static std::string get_cache_key_text(CACHE_KEY cache_key)
+{
+    CACHE_KEY_MAP::const_iterator it = search_by_value(cache_key_map, cache_key);
+    if (it != cache_key_map.end())
+    {
+        return it->first;
+    }
+    return "INVALID";
+}
+
 /**
  * @brief Get value form command line string.
  * Finds whatever is after the "=" sign.
@@ -1062,6 +1232,33 @@ static int ffmpegfs_opt_proc(void* data, const char* arg, int key, struct fuse_a
     {
         return get_level(arg, &params.m_level);
     }
+    case KEY_CACHE_POLICY:
+    {
+        return get_cache_policy(arg, &params.m_cache_policy);
+    }
+    case KEY_CACHE_KEY:
+    {
+        return get_cache_key(arg, &params.m_cache_key);
+    }
+    case KEY_RAM_CACHE_SIZE:
+    {
+        return get_size(arg, &params.m_ram_cache_size);
+    }
+    case KEY_STREAM_BUFFER_SIZE:
+    {
+        if (get_size(arg, &params.m_stream_buffer_size))
+        {
+            return -1;
+        }
+
+        if (params.m_stream_buffer_size && params.m_stream_buffer_size < STREAM_MIN_BUFFER_SIZE)
+        {
+            std::fprintf(stderr, "INVALID PARAMETER: Stream buffer size %s is too small, must be at least %s\n", format_size(params.m_stream_buffer_size).c_str(), format_size(STREAM_MIN_BUFFER_SIZE).c_str());
+            return -1;
+        }
+
+        return 0;
+    }
     case KEY_AUDIO_BITRATE:
     {
         return get_bitrate(arg, &params.m_audiobitrate);
@@ -1098,6 +1295,10 @@ static int ffmpegfs_opt_proc(void* data, const char* arg, int key, struct fuse_a
     {
         return get_size(arg, &params.m_prebuffer_size);
     }
+    case KEY_SEEK_AHEAD:
+    {
+        return get_size(arg, &params.m_seek_ahead);
+    }
     case KEY_MAX_CACHE_SIZE:
     {
         return get_size(arg, &params.m_max_cache_size);
@@ -1114,6 +1315,10 @@ static int ffmpegfs_opt_proc(void* data, const char* arg, int key, struct fuse_a
     {
         return get_time(arg, &params.m_cache_maintenance);
     }
+    case KEY_ATTR_CACHE_TIMEOUT:
+    {
+        return get_time(arg, &params.m_attr_cache_timeout);
+    }
     case KEY_LOG_MAXLEVEL:
     {
         return get_value(arg, &params.m_log_maxlevel);
@@ -1144,6 +1349,48 @@ static bool set_defaults(void)
     return true;
 }
 
+/**
+ * @brief Warn about options that have no effect for the selected destination types.
+ *
+ * Seeking ahead writes parts of a file independently. That needs a fixed mapping
+ * of file position to play time, which only WAV and AIFF have. Compressed formats
+ * have none, and MP4 and WebM also write index data whose size depends on the
+ * whole file, so independently written parts cannot be placed in the file.
+ * Split encoding joins independently transcoded segments and has the same
+ * restriction. Streaming needs formats that never go back to update data
+ * already written, see Cache_Entry::stream_format().
+ */
+static void check_unsupported(void)
+{
+    for (int n = 0; n < 2; n++)
+    {
+        FILETYPE filetype = params.m_format[n].filetype();
+
+        if (filetype == FILETYPE_UNKNOWN || filetype == FILETYPE_WAV || filetype == FILETYPE_AIFF)
+        {
+            continue;
+        }
+
+        if (params.m_seek_ahead)
+        {
+            Logging::warning(nullptr, "--seek_ahead has no effect for %1 files, only WAV and AIFF are supported.", params.m_format[n].desttype().c_str());
+        }
+
+        if (params.m_split_encode > 1)
+        {
+            Logging::warning(nullptr, "--split_encode has no effect for %1 files, only WAV and AIFF are supported.", params.m_format[n].desttype().c_str());
+        }
+    }
+
+    for (int n = 0; n < 2; n++)
+    {
+        if (params.m_stream_buffer_size && params.m_format[n].filetype() != FILETYPE_UNKNOWN && !Cache_Entry::stream_format(&params.m_format[n]))
+        {
+            Logging::warning(nullptr, "--stream_buffer_size has no effect for %1 files, they update data already written and are cached instead.", params.m_format[n].desttype().c_str());
+        }
+    }
+}
+
 /**
  * @brief Print currently selected parameters.
  */
@@ -1186,18 +1433,30 @@ static void print_params(void)
                                          "Inactivity Suspend: %27\n"
                                          "Inactivity Abort  : %28\n"
                                          "Pre-buffer size   : %29\n"
-                                         "Max. Cache Size   : %20\n"
-                                         "Min. Disk Space   : %31\n"
-                                         "Cache Path        : %32\n"
-                                         "Disable Cache     : %33\n"
-                                         "Maintenance Timer : %34\n"
-                                         "Clear Cache       : %35\n"
+                                         "Seek Ahead        : %30\n"
+                                         "Max. Cache Size   : %31\n"
+                                         "Min. Disk Space   : %32\n"
+                                         "Cache Policy      : %33\n"
+                                         "Cache Key         : %34\n"
+                                         "Compress Cache    : %35\n"
+                                         "RAM Cache Size    : %36\n"
+                                         "Stream Buffer     : %37\n"
+                                         "Cache Path        : %38\n"
+                                         "Disable Cache     : %39\n"
+                                         "Maintenance Timer : %40\n"
+                                         "Clear Cache       : %41\n"
+                                         "Warm Cache        : %42\n"
+                                         "Attribute Cache   : %43\n"
+                                         "Index Write Delay : %44\n"
                                          "\nVarious Options\n\n"
-                                         "Max. Threads      : %36\n"
-                                         "Decoding Errors   : %37\n"
-                                         "Min. DVD chapter  : %38\n"
+                                         "Max. Threads      : %45\n"
+                                         "Split Encode      : %46\n"
+                                         "Demuxer Queue     : %47\n"
+                                         "Exact Size        : %48\n"
+                                         "Decoding Errors   : %49\n"
+                                         "Min. DVD chapter  : %50\n"
                                          "\nExperimental Options\n\n"
-                                         "Windows 10 Fix    : %39\n",
+                                         "Windows 10 Fix    : %51\n",
                    params.m_basepath.c_str(),
                    params.m_mountpath.c_str(),
                    params.smart_transcode() ? "yes" : "no",
@@ -1231,13 +1490,25 @@ static void print_params(void)
             format_time(params.m_max_inactive_suspend).c_str(),
             format_time(params.m_max_inactive_abort).c_str(),
             format_size(params.m_prebuffer_size).c_str(),
+            params.m_seek_ahead ? format_size(params.m_seek_ahead).c_str() : "disabled",
             format_size(params.m_max_cache_size).c_str(),
             format_size(params.m_min_diskspace).c_str(),
+            get_cache_policy_text(params.m_cache_policy).c_str(),
+            get_cache_key_text(params.m_cache_key).c_str(),
+            params.m_compress_cache ? "WAV, AIFF and ProRes" : "no",
+            params.m_ram_cache_size ? format_size(params.m_ram_cache_size).c_str() : "disabled",
+            params.m_stream_buffer_size ? format_size(params.m_stream_buffer_size).c_str() : "disabled",
             cachepath.c_str(),
             params.m_disable_cache ? "yes" : "no",
             params.m_cache_maintenance ? format_time(params.m_cache_maintenance).c_str() : "inactive",
             params.m_clear_cache ? "yes" : "no",
+            params.m_warm_cache ? ("yes, " + format_number(params.m_warm_cache_jobs) + " job(s)").c_str() : "no",
+            params.m_attr_cache_timeout ? format_time(params.m_attr_cache_timeout).c_str() : "disabled",
+            params.m_db_write_delay ? (format_number(params.m_db_write_delay) + " ms or " + format_number(params.m_db_write_batch) + " updates").c_str() : "disabled",
             format_number(params.m_max_threads).c_str(),
+            params.m_split_encode > 1 ? (format_number(params.m_split_encode) + " segments").c_str() : "disabled",
+            params.m_demux_queue ? (format_number(params.m_demux_queue) + " packets").c_str() : "disabled",
+            params.m_exact_size ? "yes" : "no",
             params.m_decoding_errors ? "break transcode" : "ignore",
             format_duration(params.m_min_dvd_chapter_duration * AV_TIME_BASE).c_str(),
             params.m_win_smb_fix ? "inactive" : "SMB Lockup Fix Active");
@@ -1383,6 +1654,14 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+#ifndef USE_LIBZSTD
+    if (params.m_compress_cache)
+    {
+        std::fprintf(stderr, "INVALID PARAMETER: --compress_cache is not supported, ffmpegfs has been built without libzstd.\n\n");
+        return 1;
+    }
+#endif // !USE_LIBZSTD
+
     if (!transcoder_init())
     {
         return 1;
@@ -1390,6 +1669,8 @@ int main(int argc, char *argv[])
 
     print_params();
 
+    check_unsupported();
+
     if (params.m_clear_cache)
     {
         // Prune cache and exit
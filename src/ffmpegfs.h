@@ -82,6 +82,7 @@
 
 #include "ffmpeg_utils.h"
 #include "fileio.h"
+#include "cache_policy.h"
 
 /**
  * @brief Global program parameters
@@ -150,14 +151,28 @@ extern struct FFMPEGFS_PARAMS
     time_t              m_max_inactive_suspend;     /**< @brief Time (seconds) that must elapse without access until transcoding is suspended */
     time_t              m_max_inactive_abort;       /**< @brief Time (seconds) that must elapse without access until transcoding is aborted */
     size_t              m_prebuffer_size;           /**< @brief Number of bytes that will be decoded before it can be accessed */
+    size_t              m_seek_ahead;               /**< @brief Reads more than this number of bytes ahead of the transcoder cause a seek, 0 to disable */
     size_t              m_max_cache_size;           /**< @brief Max. cache size in MB. When exceeded, oldest entries will be pruned */
     size_t              m_min_diskspace;            /**< @brief Min. diskspace required for cache */
+    CACHE_POLICY        m_cache_policy;             /**< @brief Decides which entries are pruned first when the cache is full */
+    CACHE_KEY           m_cache_key;                /**< @brief Key cache files by source path or content */
+    int                 m_compress_cache;           /**< @brief Compress cache files of uncompressed formats (WAV, AIFF, ProRes) */
+    size_t              m_ram_cache_size;           /**< @brief Max. number of bytes of finished files kept in memory, 0 to disable */
+    size_t              m_stream_buffer_size;       /**< @brief Size of ring buffer DVD, Blu-ray and Video CD titles are streamed through, 0 to cache them */
     std::string         m_cachepath;                /**< @brief Disk cache path, defaults to /tmp */
     int                 m_disable_cache;            /**< @brief Disable cache */
     time_t              m_cache_maintenance;        /**< @brief Prune timer interval */
     int                 m_prune_cache;              /**< @brief Prune cache immediately */
     int                 m_clear_cache;              /**< @brief Clear cache on start up */
+    int                 m_warm_cache;               /**< @brief Transcode files in the background to fill the cache */
+    unsigned int        m_warm_cache_jobs;          /**< @brief Max. number of cache warming jobs at a time */
+    unsigned int        m_db_write_delay;           /**< @brief Time (milliseconds) cache index updates may be delayed to write them together, 0 to write immediately */
+    unsigned int        m_db_write_batch;           /**< @brief Number of queued cache index updates that causes an immediate write */
     unsigned int        m_max_threads;              /**< @brief Max. number of recoder threads */
+    unsigned int        m_split_encode;             /**< @brief Number of segments to transcode in parallel, 0 or 1 to disable */
+    unsigned int        m_demux_queue;              /**< @brief Number of packets a separate demuxer thread reads ahead, 0 to read on the transcoder thread */
+    int                 m_exact_size;               /**< @brief Make transcoded files exactly the predicted size */
+    time_t              m_attr_cache_timeout;       /**< @brief Time (seconds) file attributes are cached, 0 to disable */
     // Miscellanous options
     int                 m_decoding_errors;          /**< @brief Break transcoding on decoding error */
     int                 m_min_dvd_chapter_duration; /**< @brief Min. DVD chapter duration. Shorter chapters will be ignored. */
@@ -178,6 +193,12 @@ class thread_pool;
  */
 extern thread_pool*         tp;
 
+class Ram_Cache;
+/**
+ * @brief In-memory cache of complete files, nullptr if disabled
+ */
+extern Ram_Cache*           ramcache;
+
 /**
  * @brief Initialise FUSE operation structure.
  */
@@ -222,6 +243,10 @@ void            transcoder_free(void);
  * @return Returns true on success; false on error. Check errno for details.
  */
 bool            transcoder_cache_maintenance(void);
+/**
+ * @brief Log thread pool queue wait, reader wake-up latency, RAM cache and demuxer queue statistics at info level.
+ */
+void            transcoder_log_stats(void);
 /**
  * @brief Clear transcoder cache.
  * @return Returns true on success; false on error. Check errno for details.
@@ -253,6 +278,16 @@ LPVIRTUALFILE   insert_file(VIRTUALTYPE type, const std::string &virtfilepath, c
  * @return If found, returns VIRTUALFILE object, if not found returns nullptr.
  */
 LPVIRTUALFILE   find_file(const std::string &virtfilepath);
+/**
+ * @brief Drop cached attributes of a virtual file, e.g. because its size has changed.
+ * @param[in] virtualfile - Virtual file object.
+ */
+void            invalidate_attr(LPCVIRTUALFILE virtualfile);
+/**
+ * @brief Log run time statistics at info level: attribute cache and everything transcoder_log_stats() logs.
+ * Called after each cache maintenance run and on exit.
+ */
+void            log_statistics(void);
 /**
  * @brief Check if path has already been parsed.
  * Only useful if for DVD, Bluray or VCD where it is guaranteed that all files have been parsed whenever the directory is in the hash.
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief File_Index class implementation
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#include "file_index.h"
+
+File_Index::File_Index()
+{
+}
+
+File_Index::~File_Index()
+{
+}
+
+void File_Index::split(const std::string & virtfilepath, std::string *dir, std::string *name)
+{
+    size_t pos = virtfilepath.rfind('/');
+
+    if (pos == std::string::npos)
+    {
+        dir->clear();
+        *name = virtfilepath;
+        return;
+    }
+
+    dir->assign(virtfilepath, 0, pos + 1);
+    name->assign(virtfilepath, pos + 1, std::string::npos);
+}
+
+LPVIRTUALFILE File_Index::insert(const std::string & virtfilepath, const VIRTUALFILE & virtualfile)
+{
+    std::string dir;
+    FILE_KEY key;
+
+    split(virtfilepath, &dir, &key.m_name);
+
+    DIR_SHARD & ds = m_dir_shards[std::hash<std::string>()(dir) % FILE_INDEX_SHARDS];
+
+    // Lock order is directory before file shard, no one else takes both
+    std::lock_guard<std::mutex> dir_lock(ds.m_mutex);
+
+    DIRMAP::iterator dir_it = ds.m_dirs.find(dir);
+
+    if (dir_it == ds.m_dirs.end())
+    {
+        dir_it = ds.m_dirs.insert(std::make_pair(dir, std::vector<LPVIRTUALFILE>())).first;
+    }
+
+    // Keys of an unordered_map never move, the file index can point to the name
+    key.m_dir = &dir_it->first;
+
+    FILE_SHARD & fs = m_file_shards[FILE_KEY_HASH()(key) % FILE_INDEX_SHARDS];
+
+    std::lock_guard<std::mutex> lock(fs.m_mutex);
+
+    std::pair<FILEMAP::iterator, bool> res = fs.m_files.insert(std::make_pair(key, virtualfile));
+
+    if (!res.second)
+    {
+        // Already known
+        return &res.first->second;
+    }
+
+    // Elements of an unordered_map never move, the pointer remains valid
+    LPVIRTUALFILE newfile = &res.first->second;
+
+    dir_it->second.push_back(newfile);
+
+    return newfile;
+}
+
+LPVIRTUALFILE File_Index::find(const std::string & virtfilepath)
+{
+    std::string dir;
+    FILE_KEY key;
+
+    split(virtfilepath, &dir, &key.m_name);
+
+    key.m_dir = &dir;
+
+    FILE_SHARD & fs = m_file_shards[FILE_KEY_HASH()(key) % FILE_INDEX_SHARDS];
+
+    std::lock_guard<std::mutex> lock(fs.m_mutex);
+
+    FILEMAP::iterator it = fs.m_files.find(key);
+
+    if (it != fs.m_files.end())
+    {
+        return &it->second;
+    }
+    return nullptr;
+}
+
+bool File_Index::has_dir(const std::string & path)
+{
+    DIR_SHARD & ds = m_dir_shards[std::hash<std::string>()(path) % FILE_INDEX_SHARDS];
+
+    std::lock_guard<std::mutex> lock(ds.m_mutex);
+
+    return (ds.m_dirs.find(path) != ds.m_dirs.end());
+}
+
+size_t File_Index::list_dir(const std::string & path, std::vector<LPVIRTUALFILE> *files)
+{
+    DIR_SHARD & ds = m_dir_shards[std::hash<std::string>()(path) % FILE_INDEX_SHARDS];
+
+    std::lock_guard<std::mutex> lock(ds.m_mutex);
+
+    DIRMAP::const_iterator it = ds.m_dirs.find(path);
+
+    if (it == ds.m_dirs.end())
+    {
+        files->clear();
+        return 0;
+    }
+
+    *files = it->second;
+
+    return files->size();
+}
+
+size_t File_Index::size()
+{
+    size_t count = 0;
+
+    for (FILE_SHARD & fs : m_file_shards)
+    {
+        std::lock_guard<std::mutex> lock(fs.m_mutex);
+
+        count += fs.m_files.size();
+    }
+
+    return count;
+}
@@ -0,0 +1,157 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Index of virtual files
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#pragma once
+
+#include "fileio.h"
+
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+
+#define FILE_INDEX_SHARDS       64                                      /**< @brief Number of independently locked parts of the index */
+
+/**
+ * @brief The #File_Index class
+ *
+ * Holds all virtual files by their virtual path. Files are found by hash, the index is
+ * split into #FILE_INDEX_SHARDS parts with separate locks so that parallel lookups
+ * rarely wait for each other. A second index lists the files in each directory, so that
+ * a directory can be enumerated without scanning all files.
+ *
+ * Directory names are stored once, in the directory index. The file index is keyed by
+ * a pointer to that name and the file name only.
+ *
+ * Files are never removed, pointers returned remain valid for the life time of the index.
+ */
+class File_Index
+{
+    typedef struct FILE_KEY                         /**< @brief Key of a virtual file */
+    {
+        const std::string * m_dir;                  /**< @brief Directory, points to the name in the directory index (or to a temporary for lookups) */
+        std::string     m_name;                     /**< @brief File name without directory */
+
+        /**
+         * @brief Compare two keys by contents.
+         * @param[in] key - Key to compare with.
+         * @return Returns true if both keys name the same file.
+         */
+        bool operator==(const FILE_KEY & key) const
+        {
+            return (m_name == key.m_name && *m_dir == *key.m_dir);
+        }
+    } FILE_KEY;
+
+    typedef struct FILE_KEY_HASH                    /**< @brief Hash of a FILE_KEY, computed from contents */
+    {
+        /**
+         * @brief Get hash of a key.
+         * @param[in] key - Key to hash.
+         * @return Returns hash value.
+         */
+        size_t operator()(const FILE_KEY & key) const
+        {
+            size_t hash = std::hash<std::string>()(*key.m_dir);
+
+            return hash ^ (std::hash<std::string>()(key.m_name) + 0x9e3779b9 + (hash << 6) + (hash >> 2));
+        }
+    } FILE_KEY_HASH;
+
+    typedef std::unordered_map<FILE_KEY, VIRTUALFILE, FILE_KEY_HASH> FILEMAP;  /**< @brief Virtual files by directory and name */
+    typedef std::unordered_map<std::string, std::vector<LPVIRTUALFILE>> DIRMAP; /**< @brief Virtual files by directory */
+
+    typedef struct FILE_SHARD                       /**< @brief Independently locked part of the file index */
+    {
+        std::mutex      m_mutex;                    /**< @brief Protects this part of the index */
+        FILEMAP         m_files;                    /**< @brief Virtual files */
+    } FILE_SHARD;
+
+    typedef struct DIR_SHARD                        /**< @brief Independently locked part of the directory index */
+    {
+        std::mutex      m_mutex;                    /**< @brief Protects this part of the index */
+        DIRMAP          m_dirs;                     /**< @brief Files per directory. Directory names are stored once here, the file index points to them. */
+    } DIR_SHARD;
+
+public:
+    /**
+     * @brief Construct File_Index object.
+     */
+    explicit File_Index();
+    /**
+     * @brief Destroy File_Index object.
+     */
+    virtual ~File_Index();
+
+    /**
+     * @brief Add a virtual file. If a file with this path exists, it is kept and returned.
+     * @param[in] virtfilepath - Sanitised virtual file path.
+     * @param[in] virtualfile - Virtual file object to add.
+     * @return Returns pointer to the virtual file in the index.
+     */
+    LPVIRTUALFILE   insert(const std::string & virtfilepath, const VIRTUALFILE & virtualfile);
+    /**
+     * @brief Find a virtual file.
+     * @param[in] virtfilepath - Sanitised virtual file path.
+     * @return If found, returns VIRTUALFILE object, if not found returns nullptr.
+     */
+    LPVIRTUALFILE   find(const std::string & virtfilepath);
+    /**
+     * @brief Check if a directory contains any virtual files.
+     * @param[in] path - Directory including trailing separator.
+     * @return Returns true if files were found, false if not.
+     */
+    bool            has_dir(const std::string & path);
+    /**
+     * @brief Get all virtual files in a directory. Sub directories are not included.
+     * @param[in] path - Directory including trailing separator.
+     * @param[out] files - Virtual files in this directory.
+     * @return Returns number of files found.
+     */
+    size_t          list_dir(const std::string & path, std::vector<LPVIRTUALFILE> *files);
+    /**
+     * @brief Get number of virtual files.
+     * @return Returns number of virtual files.
+     */
+    size_t          size();
+
+protected:
+    /**
+     * @brief Split a path into directory and file name.
+     * @param[in] virtfilepath - Virtual file path.
+     * @param[out] dir - Directory including trailing separator, empty if the path has no directory.
+     * @param[out] name - File name without directory.
+     */
+    static void     split(const std::string & virtfilepath, std::string *dir, std::string *name);
+
+protected:
+    FILE_SHARD      m_file_shards[FILE_INDEX_SHARDS];   /**< @brief File index parts */
+    DIR_SHARD       m_dir_shards[FILE_INDEX_SHARDS];    /**< @brief Directory index parts */
+};
+
+#endif // FILE_INDEX_H
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Frame_Pool class implementation
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#include "frame_pool.h"
+#include "logging.h"
+
+// Disable annoying warnings outside our code
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wconversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+#pragma GCC diagnostic pop
+
+/**
+ * @brief Pool that is getting a buffer on this thread, to count allocations.
+ * Set around av_buffer_pool_get(), which calls alloc_buffer() on the same thread.
+ */
+static thread_local Frame_Pool * current_pool = nullptr;
+
+Frame_Pool::Frame_Pool()
+    : m_frames_requested(0)
+    , m_frames_allocated(0)
+    , m_buffers_requested(0)
+    , m_buffers_allocated(0)
+{
+}
+
+Frame_Pool::~Frame_Pool()
+{
+    for (AVFrame *frame : m_frames)
+    {
+        av_frame_free(&frame);
+    }
+    m_frames.clear();
+
+    for (std::map<POOL_KEY, AVBufferPool*>::iterator it = m_pools.begin(); it != m_pools.end(); ++it)
+    {
+        // Pool is freed as soon as all its buffers are returned
+        av_buffer_pool_uninit(&it->second);
+    }
+    m_pools.clear();
+}
+
+int Frame_Pool::alloc_frame(AVFrame **frame, const char *filename)
+{
+    m_frames_requested++;
+
+    if (!m_frames.empty())
+    {
+        *frame = m_frames.back();
+        m_frames.pop_back();
+        return 0;
+    }
+
+    *frame = av_frame_alloc();
+    if (*frame == nullptr)
+    {
+        Logging::error(filename, "Could not allocate frame.");
+        return AVERROR(ENOMEM);
+    }
+
+    m_frames_allocated++;
+
+    return 0;
+}
+
+void Frame_Pool::free_frame(AVFrame **frame)
+{
+    if (*frame == nullptr)
+    {
+        return;
+    }
+
+    if (m_frames.size() >= FRAME_POOL_MAX_FRAMES)
+    {
+        av_frame_free(frame);
+        return;
+    }
+
+    // Returns the buffers to their pools and resets all fields
+    av_frame_unref(*frame);
+
+    m_frames.push_back(*frame);
+    *frame = nullptr;
+}
+
+int Frame_Pool::get_video_buffer(AVFrame *frame)
+{
+    AVPixelFormat pix_fmt = static_cast<AVPixelFormat>(frame->format);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    int linesize[4] = { 0 };
+    uint8_t *data[4] = { nullptr };
+    int height = FFALIGN(frame->height, FRAME_POOL_ALIGN);
+    int size;
+    int ret;
+
+    if (desc == nullptr || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+    {
+        // Palette and hardware frames are rare, let FFmpeg handle them
+        return av_frame_get_buffer(frame, FRAME_POOL_ALIGN);
+    }
+
+    ret = av_image_fill_linesizes(linesize, pix_fmt, FFALIGN(frame->width, FRAME_POOL_ALIGN));
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        linesize[i] = FFALIGN(linesize[i], FRAME_POOL_ALIGN);
+    }
+
+    size = av_image_fill_pointers(data, pix_fmt, height, nullptr, linesize);
+    if (size < 0)
+    {
+        return size;
+    }
+
+    // Same padding as av_frame_get_buffer(), some SIMD code reads past the end
+    size += 16 + FRAME_POOL_ALIGN - 1;
+
+    frame->buf[0] = get_buffer(POOL_KEY(AVMEDIA_TYPE_VIDEO, frame->format, frame->width, frame->height), size);
+    if (frame->buf[0] == nullptr)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    av_image_fill_pointers(frame->data, pix_fmt, height, frame->buf[0]->data, linesize);
+    for (int i = 0; i < 4; i++)
+    {
+        frame->linesize[i] = linesize[i];
+    }
+    frame->extended_data = frame->data;
+
+    return 0;
+}
+
+int Frame_Pool::get_audio_buffer(AVFrame *frame, int channels)
+{
+    AVSampleFormat sample_fmt = static_cast<AVSampleFormat>(frame->format);
+    int samples = FRAME_POOL_MIN_SAMPLES;
+    int linesize;
+    int size;
+
+    if (av_sample_fmt_is_planar(sample_fmt) && channels > AV_NUM_DATA_POINTERS)
+    {
+        // Needs extended_data to be allocated separately, let FFmpeg handle this
+        if (!frame->channel_layout)
+        {
+            frame->channel_layout = static_cast<uint64_t>(av_get_default_channel_layout(channels));
+        }
+        return av_frame_get_buffer(frame, FRAME_POOL_ALIGN);
+    }
+
+    while (samples < frame->nb_samples)
+    {
+        samples *= 2;
+    }
+
+    size = av_samples_get_buffer_size(&linesize, channels, samples, sample_fmt, FRAME_POOL_ALIGN);
+    if (size < 0)
+    {
+        return size;
+    }
+
+    frame->buf[0] = get_buffer(POOL_KEY(AVMEDIA_TYPE_AUDIO, frame->format, channels, samples), size);
+    if (frame->buf[0] == nullptr)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    av_samples_fill_arrays(frame->data, &frame->linesize[0], frame->buf[0]->data, channels, samples, sample_fmt, FRAME_POOL_ALIGN);
+    frame->extended_data = frame->data;
+
+    return 0;
+}
+
+void Frame_Pool::stats(uint64_t *frames_requested, uint64_t *frames_allocated, uint64_t *buffers_requested, uint64_t *buffers_allocated) const
+{
+    *frames_requested   = m_frames_requested;
+    *frames_allocated   = m_frames_allocated;
+    *buffers_requested  = m_buffers_requested;
+    *buffers_allocated  = m_buffers_allocated;
+}
+
+AVBufferRef * Frame_Pool::get_buffer(const POOL_KEY & key, int size)
+{
+    std::map<POOL_KEY, AVBufferPool*>::iterator it = m_pools.find(key);
+    AVBufferPool *pool;
+    AVBufferRef *buffer;
+
+    if (it != m_pools.end())
+    {
+        pool = it->second;
+    }
+    else
+    {
+        pool = av_buffer_pool_init(size, &Frame_Pool::alloc_buffer);
+        if (pool == nullptr)
+        {
+            return nullptr;
+        }
+        m_pools[key] = pool;
+    }
+
+    m_buffers_requested++;
+
+    current_pool = this;
+    buffer = av_buffer_pool_get(pool);
+    current_pool = nullptr;
+
+    return buffer;
+}
+
+AVBufferRef * Frame_Pool::alloc_buffer(int size)
+{
+    if (current_pool != nullptr)
+    {
+        current_pool->m_buffers_allocated++;
+    }
+
+    return av_buffer_alloc(size);
+}
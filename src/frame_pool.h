@@ -0,0 +1,133 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Pool of frames and frame buffers
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#pragma once
+
+#include "ffmpeg_utils.h"
+
+#include <vector>
+#include <map>
+#include <tuple>
+#include <stdint.h>
+
+#define FRAME_POOL_MAX_FRAMES   64                                      /**< @brief Max. number of unused frames kept for reuse */
+#define FRAME_POOL_ALIGN        32                                      /**< @brief Alignment of lines and planes in pooled buffers */
+#define FRAME_POOL_MIN_SAMPLES  1024                                    /**< @brief Min. number of samples an audio buffer is allocated for */
+
+struct AVBufferPool;
+
+/**
+ * @brief The #Frame_Pool class
+ *
+ * Recycles frames and frame buffers, so that transcoding does not allocate
+ * them for each frame. Unused frames are kept in a free list. Buffers come
+ * from one AVBufferPool per format and size: video by pixel format, width
+ * and height, audio by sample format, channels and number of samples,
+ * rounded up to the next power of two so that slightly different frame
+ * sizes share a pool.
+ *
+ * Buffers are reference counted, they go back to their pool when the last
+ * frame using them is freed, even if that happens inside a codec after the
+ * pool is gone.
+ *
+ * Not thread safe, to be used by one transcoder thread.
+ */
+class Frame_Pool
+{
+    typedef std::tuple<int, int, int, int> POOL_KEY;                    /**< @brief Media type, format, width or channels, height or samples */
+
+public:
+    /**
+     * @brief Construct Frame_Pool object.
+     */
+    Frame_Pool();
+    /**
+     * @brief Destroy Frame_Pool object. Frees all unused frames and releases the buffer pools.
+     */
+    virtual ~Frame_Pool();
+
+    /**
+     * @brief Get a blank frame, reusing a freed one if available.
+     * @param[out] frame - Blank frame.
+     * @param[in] filename - Filename the frame is allocated for. Used for logging only, may be nullptr.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                     alloc_frame(AVFrame **frame, const char *filename);
+    /**
+     * @brief Unreference a frame and keep it for reuse.
+     * @param[in, out] frame - Frame to free, set to nullptr. May be nullptr.
+     */
+    void                    free_frame(AVFrame **frame);
+    /**
+     * @brief Get a pooled buffer for a video frame.
+     * @param[in, out] frame - Frame with format, width and height set.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                     get_video_buffer(AVFrame *frame);
+    /**
+     * @brief Get a pooled buffer for an audio frame.
+     * @param[in, out] frame - Frame with format, nb_samples and channel_layout set.
+     * @param[in] channels - Number of channels.
+     * @return On success returns 0; on error negative AVERROR.
+     */
+    int                     get_audio_buffer(AVFrame *frame, int channels);
+    /**
+     * @brief Get statistics.
+     * @param[out] frames_requested - Number of frames requested.
+     * @param[out] frames_allocated - Number of frames that had to be allocated.
+     * @param[out] buffers_requested - Number of buffers requested.
+     * @param[out] buffers_allocated - Number of buffers that had to be allocated.
+     */
+    void                    stats(uint64_t *frames_requested, uint64_t *frames_allocated, uint64_t *buffers_requested, uint64_t *buffers_allocated) const;
+
+protected:
+    /**
+     * @brief Get a buffer from the pool for key, create the pool if necessary.
+     * @param[in] key - Pool key.
+     * @param[in] size - Buffer size of pool.
+     * @return Returns the buffer, or nullptr if out of memory.
+     */
+    AVBufferRef *           get_buffer(const POOL_KEY & key, int size);
+    /**
+     * @brief Allocate a new buffer for a pool and count it.
+     * @param[in] size - Buffer size.
+     * @return Returns the buffer, or nullptr if out of memory.
+     */
+    static AVBufferRef *    alloc_buffer(int size);
+
+protected:
+    std::vector<AVFrame*>   m_frames;                                   /**< @brief Unused frames */
+    std::map<POOL_KEY, AVBufferPool*> m_pools;                          /**< @brief Buffer pools by format and size */
+    uint64_t                m_frames_requested;                         /**< @brief Number of frames requested */
+    uint64_t                m_frames_allocated;                         /**< @brief Number of frames allocated */
+    uint64_t                m_buffers_requested;                        /**< @brief Number of buffers requested */
+    uint64_t                m_buffers_allocated;                        /**< @brief Number of buffers allocated */
+};
+
+#endif // FRAME_POOL_H
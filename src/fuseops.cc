@@ -44,26 +44,50 @@
 #include "blurayparser.h"
 #endif // USE_LIBBLURAY
 #include "thread_pool.h"
+#include "attr_cache.h"
+#include "file_index.h"
 
 #include <dirent.h>
 #include <unistd.h>
-#include <map>
 #include <vector>
-#include <regex>
+#include <unordered_map>
+#include <algorithm>
 #include <list>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
 #include <assert.h>
 #include <signal.h>
 
 /**
- * @brief Map source file names to virtual file objects.
+ * @brief Open file handle, stored in fuse_file_info::fh.
+ *
+ * Made once on open, so that reads need not look up the file again.
+ */
+typedef struct FILEHANDLE
+{
+    int                 m_fd;                       /**< @brief File descriptor of a passthrough file, -1 for virtual files */
+    LPVIRTUALFILE       m_virtualfile;              /**< @brief Virtual file object, nullptr for passthrough files */
+    Cache_Entry*        m_cache_entry;              /**< @brief Cache entry of a file being transcoded, nullptr otherwise */
+} FILEHANDLE;
+typedef FILEHANDLE *LPFILEHANDLE;                   /**< @brief Pointer version of FILEHANDLE */
+
+/**
+ * @brief Source files of a directory by name, used to find the source of a virtual file.
  */
-typedef std::map<std::string, VIRTUALFILE> filenamemap;
+typedef struct DIRINDEX
+{
+    struct timespec     m_mtime;                    /**< @brief Modification time of the directory when the index was built */
+    std::unordered_map<std::string, std::string> m_files; /**< @brief Source file names by lower case name without extension */
+} DIRINDEX;
+
+#define DIRINDEX_MAX        1024                    /**< @brief Max. number of directory indexes kept */
 
 static void init_stat(struct stat *st, size_t size, bool directory);
 static void prepare_script();
 static void translate_path(std::string *origpath, const char* path);
 static bool transcoded_name(std::string *filepath, FFmpegfs_Format **current_format = nullptr);
-static filenamemap::const_iterator find_prefix(const filenamemap & map, const std::string & search_for);
 
 static int ffmpegfs_readlink(const char *path, char *buf, size_t size);
 static int ffmpegfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
@@ -71,17 +95,36 @@ static int ffmpegfs_getattr(const char *path, struct stat *stbuf);
 static int ffmpegfs_fgetattr(const char *path, struct stat * stbuf, struct fuse_file_info *fi);
 static int ffmpegfs_open(const char *path, struct fuse_file_info *fi);
 static int ffmpegfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+#if FUSE_VERSION >= 29
+static int ffmpegfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+#endif // FUSE_VERSION >= 29
 static int ffmpegfs_statfs(const char *path, struct statvfs *stbuf);
 static int ffmpegfs_release(const char *path, struct fuse_file_info *fi);
 static void sighandler(int signum);
+static int negative_attr(const std::string & virtfilepath, int result);
+static int selector(const struct dirent * de);
+static std::string source_key(const std::string & filename);
+static bool find_source(const std::string & dir, const std::string & filename, std::string *sourcefile);
+static bool warm_cache_dir(const std::string & origpath, unsigned int *found, unsigned int *queued);
+static void warm_cache_thread();
 static void *ffmpegfs_init(struct fuse_conn_info *conn);
 static void ffmpegfs_destroy(__attribute__((unused)) void * p);
 
-static filenamemap          filenames;          /**< @brief Map files to virtual files */
+static File_Index           filenames;          /**< @brief Map files to virtual files */
 static std::vector<char>    index_buffer;       /**< @brief Buffer for the virtual script if enabled */
 
 static struct sigaction     oldHandler;         /**< @brief Saves old SIGINT handler to restore on shutdown */
 
+static std::thread          warm_thread;        /**< @brief Cache warming thread */
+static std::mutex           warm_mutex;         /**< @brief Mutex for warm_cond */
+static std::condition_variable warm_cond;       /**< @brief Signalled to end the cache warming thread */
+static std::atomic_bool     warm_exit;          /**< @brief If true, the cache warming thread ends */
+
+static Attr_Cache           attrcache;          /**< @brief Attributes of virtual files */
+
+static std::unordered_map<std::string, DIRINDEX> dirindex; /**< @brief Source files by directory, for files accessed directly */
+static std::mutex           dirindex_mutex;     /**< @brief Protects dirindex against parallel access */
+
 fuse_operations             ffmpegfs_ops;       /**< @brief FUSE file system operations */
 
 thread_pool*                tp;                 /**< @brief Thread pool object */
@@ -232,6 +275,9 @@ void init_fuse_ops(void)
     ffmpegfs_ops.readdir  = ffmpegfs_readdir;
     ffmpegfs_ops.open     = ffmpegfs_open;
     ffmpegfs_ops.read     = ffmpegfs_read;
+#if FUSE_VERSION >= 29
+    ffmpegfs_ops.read_buf = ffmpegfs_read_buf;
+#endif // FUSE_VERSION >= 29
     ffmpegfs_ops.statfs   = ffmpegfs_statfs;
     ffmpegfs_ops.release  = ffmpegfs_release;
     ffmpegfs_ops.init     = ffmpegfs_init;
@@ -367,26 +413,6 @@ static bool transcoded_name(std::string * filepath, FFmpegfs_Format **current_fo
     return false;
 }
 
-/**
- * @brief Find mapped file by prefix. Normally used to find a path.
- * @param[in] map - File map with virtual files.
- * @param[in] search_for - Prefix (path) to search for.
- * @return If found, returns const_iterator to map entry. Returns map.end() if not found.
- */
-static filenamemap::const_iterator find_prefix(const filenamemap & map, const std::string & search_for)
-{
-    filenamemap::const_iterator it = map.lower_bound(search_for);
-    if (it != map.end())
-    {
-        const std::string & key = it->first;
-        if (key.compare(0, search_for.size(), search_for) == 0) // Really a prefix?
-        {
-            return it;
-        }
-    }
-    return map.end();
-}
-
 LPVIRTUALFILE insert_file(VIRTUALTYPE type, const std::string & virtfilepath, const struct stat *st)
 {
     return insert_file(type, virtfilepath, virtfilepath, st);
@@ -403,69 +429,92 @@ LPVIRTUALFILE insert_file(VIRTUALTYPE type, const std::string & virtfilepath, co
 
     memcpy(&virtualfile.m_st, st, sizeof(struct stat));
 
-    filenames.insert(make_pair(sanitised_filepath, virtualfile));
+    // File may have been reported missing before
+    attrcache.invalidate(sanitised_filepath);
 
-    filenamemap::iterator it    = filenames.find(sanitised_filepath);
-    return &it->second;
+    return filenames.insert(sanitised_filepath, virtualfile);
 }
 
 LPVIRTUALFILE find_file(const std::string & virtfilepath)
 {
-    filenamemap::iterator it = filenames.find(sanitise_filepath(virtfilepath));
+    LPVIRTUALFILE virtualfile = filenames.find(sanitise_filepath(virtfilepath));
 
     errno = 0;
 
-    if (it != filenames.end())
+    return virtualfile;
+}
+
+void invalidate_attr(LPCVIRTUALFILE virtualfile)
+{
+    std::string virtfilepath(virtualfile->m_origfile);
+
+    if (virtualfile->m_type == VIRTUALTYPE_REGULAR)
     {
-        return &it->second;
+        replace_ext(&virtfilepath, params.current_format(virtualfile)->format_name());
     }
-    return nullptr;
+
+    attrcache.invalidate(virtfilepath);
 }
 
-bool check_path(const std::string & path)
+void log_statistics(void)
 {
-    filenamemap::const_iterator it = find_prefix(filenames, path);
+    if (attrcache.enabled())
+    {
+        uint64_t hits;
+        uint64_t negative_hits;
+        uint64_t misses;
+        size_t entries;
+
+        attrcache.stats(&hits, &negative_hits, &misses, &entries);
+
+        uint64_t lookups = hits + negative_hits + misses;
 
-    return (it != filenames.end());
+        Logging::info(nullptr, "Attribute cache: %1 lookups, %2 hits, %3 negative hits, %4 misses (%5% hit rate), %6 entries.",
+                      lookups, hits, negative_hits, misses, lookups ? (hits + negative_hits) * 100 / lookups : 0, entries);
+    }
+
+    transcoder_log_stats();
+}
+
+bool check_path(const std::string & path)
+{
+    return filenames.has_dir(path);
 }
 
 int load_path(const std::string & path, const struct stat *statbuf, void *buf, fuse_fill_dir_t filler)
 {
     int title_count = 0;
+    std::vector<LPVIRTUALFILE> files;
+
+    // Works on a copy of the list, the index is not locked while calling filler
+    filenames.list_dir(path, &files);
 
-    filenamemap::const_iterator it = filenames.lower_bound(path);
-    while (it != filenames.end())
+    for (LPCVIRTUALFILE virtualfile : files)
     {
-        const std::string & key = it->first;
-        if (key.compare(0, path.size(), path) == 0) // Really a prefix?
-        {
-            LPCVIRTUALFILE virtualfile = &it->second;
-            struct stat stbuf;
-            std::string destfile;
+        struct stat stbuf;
+        std::string destfile;
 
-            get_destname(&destfile, virtualfile->m_origfile);
-            remove_path(&destfile);
+        get_destname(&destfile, virtualfile->m_origfile);
+        remove_path(&destfile);
 
-            title_count++;
+        title_count++;
 
-            memcpy(&stbuf, statbuf, sizeof(struct stat));
+        memcpy(&stbuf, statbuf, sizeof(struct stat));
 
-            stbuf.st_size   = virtualfile->m_st.st_size;
-            stbuf.st_blocks = (stbuf.st_size + 512 - 1) / 512;
+        stbuf.st_size   = virtualfile->m_st.st_size;
+        stbuf.st_blocks = (stbuf.st_size + 512 - 1) / 512;
 
-            if (buf != nullptr && filler(buf, destfile.c_str(), &stbuf, 0))
-            {
-                // break;
-            }
+        if (buf != nullptr && filler(buf, destfile.c_str(), &stbuf, 0))
+        {
+            // break;
         }
-        it++;
     }
 
     return title_count;
 }
 
 /**
- * @brief Filter function used for scandir.
+ * @brief Filter function used for directory indexes.
  *
  * Selects files that can be processed with FFmpeg API.
  *
@@ -484,6 +533,113 @@ static int selector(const struct dirent * de)
     }
 }
 
+/**
+ * @brief Get the key of a file in a directory index.
+ * @param[in] filename - Name of the file without path.
+ * @return Returns the name without extension in lower case.
+ */
+static std::string source_key(const std::string & filename)
+{
+    std::string key(filename);
+
+    remove_ext(&key);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+    return key;
+}
+
+/**
+ * @brief Find the source file for a virtual file name.
+ *
+ * Looks up a file with the same name but any extension supported by FFmpeg. An index
+ * is made once for each directory and made again when the directory is changed.
+ *
+ * @param[in] dir - Directory of the source file, including trailing separator.
+ * @param[in] filename - Name of the virtual file without path.
+ * @param[out] sourcefile - Full path of the source file if found.
+ * @return Returns true if found, false if not.
+ */
+static bool find_source(const std::string & dir, const std::string & filename, std::string *sourcefile)
+{
+    std::string key(source_key(filename));
+    struct stat st;
+
+    if (stat(dir.c_str(), &st) == -1)
+    {
+        if (errno != ENOTDIR)   // If not a directory, simply ignore error
+        {
+            Logging::error(dir, "Error scanning directory: (%1) %2", errno, strerror(errno));
+        }
+        return false;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(dirindex_mutex);
+
+        std::unordered_map<std::string, DIRINDEX>::const_iterator it = dirindex.find(dir);
+        if (it != dirindex.end() && it->second.m_mtime.tv_sec == st.st_mtim.tv_sec && it->second.m_mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            std::unordered_map<std::string, std::string>::const_iterator it2 = it->second.m_files.find(key);
+            if (it2 == it->second.m_files.end())
+            {
+                return false;
+            }
+            *sourcefile = dir + it2->second;
+            return true;
+        }
+    }
+
+    // Unknown or changed directory: Index it without holding the lock.
+    DIRINDEX index;
+    DIR *dp;
+    struct dirent *de;
+
+    index.m_mtime = st.st_mtim;
+
+    dp = opendir(dir.c_str());
+    if (dp == nullptr)
+    {
+        Logging::error(dir, "Error scanning directory: (%1) %2", errno, strerror(errno));
+        return false;
+    }
+
+    while ((de = readdir(dp)) != nullptr)
+    {
+        if (selector(de))
+        {
+            // If several files only differ by extension, the first one wins
+            index.m_files.emplace(source_key(de->d_name), de->d_name);
+        }
+    }
+
+    closedir(dp);
+
+    std::unordered_map<std::string, std::string>::const_iterator it = index.m_files.find(key);
+    bool found = (it != index.m_files.end());
+
+    if (found)
+    {
+        *sourcefile = dir + it->second;
+    }
+
+    std::lock_guard<std::mutex> lock(dirindex_mutex);
+
+    if (dirindex.size() >= DIRINDEX_MAX && dirindex.find(dir) == dirindex.end())
+    {
+        // Not worth an LRU list, files are normally found through readdir anyway
+        dirindex.clear();
+    }
+
+    dirindex[dir] = std::move(index);
+
+    return found;
+}
+
 LPVIRTUALFILE find_original(std::string * filepath)
 {
     sanitise_filepath(filepath);
@@ -506,41 +662,17 @@ LPVIRTUALFILE find_original(std::string * filepath)
             std::string dir(*filepath);
             std::string filename(*filepath);
             std::string tmppath;
-            struct dirent **namelist;
             struct stat st;
-            int count;
-            int found = 0;
+            bool found;
 
             remove_filename(&dir);
-            tmppath = dir;
-
-            count = scandir(dir.c_str(), &namelist, selector, nullptr);
-            if (count == -1)
-            {
-                if (errno != ENOTDIR)   // If not a directory, simply ignore error
-                {
-                    Logging::error(dir, "Error scanning directory: (%1) %2", errno, strerror(errno));
-                }
-                return nullptr;
-            }
-
             remove_path(&filename);
-            std::regex specialChars { R"([-[\]{}()*+?.,\^$|#\s])" };
-            filename = std::regex_replace(filename, specialChars, R"(\$&)");
-            replace_ext(&filename, "*");
 
-            for (int n = 0; n < count; n++)
+            found = find_source(dir, filename, &tmppath);
+            if (found)
             {
-                if (!found && !compare(namelist[n]->d_name, filename))
-                {
-                    append_filename(&tmppath, namelist[n]->d_name);
-                    found = 1;
-                }
-                free(namelist[n]);
+                sanitise_filepath(&tmppath);
             }
-            free(namelist);
-
-            sanitise_filepath(&tmppath);
 
             if (found && lstat(tmppath.c_str(), &st) == 0)
             {
@@ -705,6 +837,21 @@ static int ffmpegfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     return -errno;
 }
 
+/**
+ * @brief Remember a missing file in the attribute cache.
+ * @param[in] virtfilepath - Virtual file path.
+ * @param[in] result - Result of getattr, negative errno.
+ * @return Returns result.
+ */
+static int negative_attr(const std::string & virtfilepath, int result)
+{
+    if (result == -ENOENT)
+    {
+        attrcache.insert_negative(virtfilepath, result);
+    }
+    return result;
+}
+
 /**
  * @brief Get file attributes.
  * @param[in] path - Path of virtual file.
@@ -714,11 +861,21 @@ static int ffmpegfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int ffmpegfs_getattr(const char *path, struct stat *stbuf)
 {
     std::string origpath;
+    std::string virtfilepath;
+    int result;
 
     Logging::trace(path, "getattr");
 
     translate_path(&origpath, path);
 
+    virtfilepath = origpath;
+
+    if (attrcache.lookup(virtfilepath, stbuf, &result))
+    {
+        errno = 0;
+        return result;
+    }
+
     if (lstat(origpath.c_str(), stbuf) == 0)
     {
         // pass-through for regular files
@@ -803,7 +960,7 @@ static int ffmpegfs_getattr(const char *path, struct stat *stbuf)
                     if (res <= 0)
                     {
                         // No Bluray/DVD/VCD found or error reading disk
-                        return (!res ?  error : res);
+                        return negative_attr(virtfilepath, !res ?  error : res);
                     }
                 }
 
@@ -812,12 +969,13 @@ static int ffmpegfs_getattr(const char *path, struct stat *stbuf)
                 if (virtualfile == nullptr)
                 {
                     // Not a DVD/VCD/Bluray file
-                    return -ENOENT;
+                    return negative_attr(virtfilepath, -ENOENT);
                 }
 
                 mempcpy(stbuf, &virtualfile->m_st, sizeof(struct stat));
+                no_check = true;
 #else
-                return error;
+                return negative_attr(virtfilepath, error);
 #endif
             }
         }
@@ -827,8 +985,12 @@ static int ffmpegfs_getattr(const char *path, struct stat *stbuf)
         {
             if (virtualfile != nullptr)
             {
+                struct stat src_st;
+
                 assert(virtualfile->m_origfile == origpath);
 
+                memcpy(&src_st, stbuf, sizeof(struct stat));
+
                 if (!transcoder_cached_filesize(virtualfile, stbuf))
                 {
                     Cache_Entry* cache_entry = transcoder_new(virtualfile, false);
@@ -846,6 +1008,9 @@ static int ffmpegfs_getattr(const char *path, struct stat *stbuf)
 
                     transcoder_delete(cache_entry);
                 }
+
+                // Disc titles have no source file of their own, they only expire
+                attrcache.insert(virtfilepath, stbuf, virtualfile->m_type, !no_check ? origpath : "", &src_st);
             }
             else
             {
@@ -878,30 +1043,32 @@ static int ffmpegfs_getattr(const char *path, struct stat *stbuf)
  */
 static int ffmpegfs_fgetattr(const char *path, struct stat * stbuf, struct fuse_file_info *fi)
 {
-    std::string origpath;
+    LPFILEHANDLE filehandle = reinterpret_cast<LPFILEHANDLE>(fi->fh);
 
     Logging::trace(path, "fgetattr");
 
     errno = 0;
 
-    translate_path(&origpath, path);
+    if (filehandle == nullptr)
+    {
+        Logging::error(path, "Tried to stat unopen file.");
+        errno = EBADF;
+        return -errno;
+    }
 
-    if (lstat(origpath.c_str(), stbuf) == 0)
+    if (filehandle->m_fd != -1)
     {
         // pass-through for regular files
-        errno = 0;
+        if (fstat(filehandle->m_fd, stbuf) == -1)
+        {
+            return -errno;
+        }
         return 0;
     }
-    else
-    {
-        // Not really an error.
-        errno = 0;
-    }
 
     // This is a virtual file
-    LPCVIRTUALFILE virtualfile = find_original(&origpath);
-
-    assert(virtualfile != nullptr);
+    LPCVIRTUALFILE virtualfile = filehandle->m_virtualfile;
+    const std::string & origpath = virtualfile->m_origfile;
 
     bool no_check = false;
 
@@ -942,7 +1109,7 @@ static int ffmpegfs_fgetattr(const char *path, struct stat * stbuf, struct fuse_
         // Get size for resulting output file from regular file, otherwise it's a symbolic link.
         if (S_ISREG(stbuf->st_mode))
         {
-            Cache_Entry* cache_entry = reinterpret_cast<Cache_Entry*>(fi->fh);
+            Cache_Entry* cache_entry = filehandle->m_cache_entry;
 
             if (cache_entry == nullptr)
             {
@@ -984,6 +1151,7 @@ static int ffmpegfs_open(const char *path, struct fuse_file_info *fi)
 {
     std::string origpath;
     Cache_Entry* cache_entry;
+    LPFILEHANDLE filehandle;
 
     Logging::trace(path, "open");
 
@@ -1001,10 +1169,25 @@ static int ffmpegfs_open(const char *path, struct fuse_file_info *fi)
         errno = 0;
     }
 
+    filehandle = new(std::nothrow) FILEHANDLE;
+    if (filehandle == nullptr)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        Logging::error(path, "Out of memory opening file.");
+        return -ENOMEM;
+    }
+
+    filehandle->m_fd            = fd;
+    filehandle->m_virtualfile   = nullptr;
+    filehandle->m_cache_entry   = nullptr;
+
     if (fd != -1)
     {
-        close(fd);
-        // File is real and can be opened.
+        // File is real and can be opened. Keep it open for reading.
+        fi->fh = reinterpret_cast<uintptr_t>(filehandle);
         errno = 0;
         return 0;
     }
@@ -1014,6 +1197,8 @@ static int ffmpegfs_open(const char *path, struct fuse_file_info *fi)
 
     assert(virtualfile != nullptr);
 
+    filehandle->m_virtualfile   = virtualfile;
+
     switch (virtualfile->m_type)
     {
     case VIRTUALTYPE_SCRIPT:
@@ -1035,11 +1220,13 @@ static int ffmpegfs_open(const char *path, struct fuse_file_info *fi)
         cache_entry = transcoder_new(virtualfile, true);
         if (cache_entry == nullptr)
         {
-            return -errno;
+            int ret = -errno;
+            delete filehandle;
+            return ret;
         }
 
-        // Store transcoder in the fuse_file_info structure.
-        fi->fh = reinterpret_cast<uintptr_t>(cache_entry);
+        // Store transcoder in the file handle.
+        filehandle->m_cache_entry   = cache_entry;
         // Need this because we do not know the exact size in advance.
         fi->direct_io = 1;
         //        fi->keep_cache = 1;
@@ -1057,6 +1244,8 @@ static int ffmpegfs_open(const char *path, struct fuse_file_info *fi)
     }
     }
 
+    fi->fh = reinterpret_cast<uintptr_t>(filehandle);
+
     return 0;
 }
 
@@ -1071,21 +1260,23 @@ static int ffmpegfs_open(const char *path, struct fuse_file_info *fi)
  */
 static int ffmpegfs_read(const char *path, char *buf, size_t size, off_t _offset, struct fuse_file_info *fi)
 {
-    std::string origpath;
+    LPFILEHANDLE filehandle = reinterpret_cast<LPFILEHANDLE>(fi->fh);
     size_t offset = static_cast<size_t>(_offset);  // Cast OK: offset can never be < 0.
     int bytes_read = 0;
     Cache_Entry* cache_entry;
 
     Logging::trace(path, "Reading %1 bytes from %2.", size, offset);
 
-    translate_path(&origpath, path);
+    if (filehandle == nullptr)
+    {
+        Logging::error(path, "Tried to read from unopen file.");
+        return -EBADF;
+    }
 
-    int fd = open(origpath.c_str(), O_RDONLY);
-    if (fd != -1)
+    if (filehandle->m_fd != -1)
     {
         // If this is a real file, pass the call through.
-        bytes_read = static_cast<int>(pread(fd, buf, size, _offset));
-        close(fd);
+        bytes_read = static_cast<int>(pread(filehandle->m_fd, buf, size, _offset));
         if (bytes_read >= 0)
         {
             return bytes_read;
@@ -1095,19 +1286,9 @@ static int ffmpegfs_read(const char *path, char *buf, size_t size, off_t _offset
             return -errno;
         }
     }
-    else if (errno != ENOENT)
-    {
-        // File does exist, but can't be opened.
-        return -errno;
-    }
-    else
-    {
-        // File does not exist, and this is fine.
-        errno = 0;
-    }
 
-    LPCVIRTUALFILE virtualfile = find_original(&origpath);
     // This is a virtual file
+    LPCVIRTUALFILE virtualfile = filehandle->m_virtualfile;
     bool success = true;
 
     assert(virtualfile != nullptr);
@@ -1117,7 +1298,11 @@ static int ffmpegfs_read(const char *path, char *buf, size_t size, off_t _offset
     case VIRTUALTYPE_SCRIPT:
     {
         size_t bytes = size;
-        if (offset + bytes > index_buffer.size())
+        if (offset >= index_buffer.size())
+        {
+            bytes = 0;
+        }
+        else if (offset + bytes > index_buffer.size())
         {
             bytes = index_buffer.size() - offset;
         }
@@ -1141,18 +1326,15 @@ static int ffmpegfs_read(const char *path, char *buf, size_t size, off_t _offset
 #endif // USE_LIBBLURAY
     case VIRTUALTYPE_REGULAR:
     {
-        cache_entry = reinterpret_cast<Cache_Entry*>(fi->fh);
+        cache_entry = filehandle->m_cache_entry;
 
         if (cache_entry == nullptr)
         {
-            if (errno)
-            {
-                Logging::error(origpath.c_str(), "Tried to read from unopen file: (%1) %2", errno, strerror(errno));
-            }
-            return -errno;
+            Logging::error(path, "Tried to read from unopen file.");
+            return -EBADF;
         }
 
-        success = transcoder_read(cache_entry, buf, offset, size, &bytes_read);
+        success = transcoder_read(cache_entry, buf, offset, size, &bytes_read, filehandle);
 
         break;
     }
@@ -1175,6 +1357,87 @@ static int ffmpegfs_read(const char *path, char *buf, size_t size, off_t _offset
     }
 }
 
+#if FUSE_VERSION >= 29
+/**
+ * @brief Read data from an open file without copying it.
+ *
+ * Passthrough files and completely transcoded files are handed to FUSE as a file
+ * descriptor, so the data can be spliced from the file to the kernel. Files still
+ * being transcoded are read into memory with ffmpegfs_read().
+ *
+ * @param[in] path
+ * @param[out] bufp
+ * @param[in] size
+ * @param[in] _offset
+ * @param[in] fi
+ * @return On success, returns 0. On error, returns -errno.
+ */
+static int ffmpegfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t _offset, struct fuse_file_info *fi)
+{
+    LPFILEHANDLE filehandle = reinterpret_cast<LPFILEHANDLE>(fi->fh);
+    struct fuse_bufvec *src;
+    int fd = -1;
+    size_t bytes = 0;
+
+    src = static_cast<struct fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+    if (src == nullptr)
+    {
+        return -ENOMEM;
+    }
+
+    memset(src, 0, sizeof(struct fuse_bufvec));
+    src->count          = 1;
+    src->buf[0].fd      = -1;
+
+    if (filehandle != nullptr)
+    {
+        if (filehandle->m_fd != -1)
+        {
+            // Passthrough file, FUSE handles short reads at end of file
+            fd      = filehandle->m_fd;
+            bytes   = size;
+        }
+        else if (filehandle->m_cache_entry != nullptr && !transcoder_read_fd(filehandle->m_cache_entry, static_cast<size_t>(_offset), size, &fd, &bytes))
+        {
+            fd = -1;
+        }
+    }
+
+    if (fd != -1)
+    {
+        src->buf[0].flags   = static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        src->buf[0].fd      = fd;
+        src->buf[0].pos     = _offset;
+        src->buf[0].size    = bytes;
+
+        *bufp = src;
+        return 0;
+    }
+
+    void *mem = malloc(size);
+    if (mem == nullptr)
+    {
+        free(src);
+        return -ENOMEM;
+    }
+
+    int bytes_read = ffmpegfs_read(path, static_cast<char *>(mem), size, _offset, fi);
+    if (bytes_read < 0)
+    {
+        free(mem);
+        free(src);
+        return bytes_read;
+    }
+
+    // FUSE will free both mem and src
+    src->buf[0].mem     = mem;
+    src->buf[0].size    = static_cast<size_t>(bytes_read);
+
+    *bufp = src;
+    return 0;
+}
+#endif // FUSE_VERSION >= 29
+
 /**
  * @brief Get file system statistics
  * @param[in] path
@@ -1217,13 +1480,24 @@ static int ffmpegfs_statfs(const char *path, struct statvfs *stbuf)
  */
 static int ffmpegfs_release(const char *path, struct fuse_file_info *fi)
 {
-    Cache_Entry*     cache_entry = reinterpret_cast<Cache_Entry*>(fi->fh);
+    LPFILEHANDLE filehandle = reinterpret_cast<LPFILEHANDLE>(fi->fh);
 
     Logging::trace(path, "release");
 
-    if (cache_entry != nullptr)
+    if (filehandle != nullptr)
     {
-        transcoder_delete(cache_entry);
+        if (filehandle->m_fd != -1)
+        {
+            close(filehandle->m_fd);
+        }
+
+        if (filehandle->m_cache_entry != nullptr)
+        {
+            transcoder_delete(filehandle->m_cache_entry, filehandle);
+        }
+
+        delete filehandle;
+        fi->fh = 0;
     }
 
     return 0;
@@ -1254,6 +1528,162 @@ static void sighandler(int signum)
     }
 }
 
+/**
+ * @brief Queue all files in a directory and its subdirectories for cache warming.
+ *
+ * Waits while --warm_cache_jobs jobs are already queued or running.
+ *
+ * @param[in] origpath - Directory to scan, must end with a separator.
+ * @param[inout] found - Number of files found so far.
+ * @param[inout] queued - Number of files queued so far.
+ * @return Returns true to go on, false if the scan should end (cache full or shutdown).
+ */
+static bool warm_cache_dir(const std::string & origpath, unsigned int *found, unsigned int *queued)
+{
+    std::vector<std::string> subdirs;
+    DIR *dp;
+    struct dirent *de;
+    bool go_on = true;
+
+    dp = opendir(origpath.c_str());
+    if (dp == nullptr)
+    {
+        Logging::debug(origpath, "Cache warming: Unable to open directory: (%1) %2", errno, strerror(errno));
+        return true;
+    }
+
+    while (go_on && (de = readdir(dp)) != nullptr)
+    {
+        std::string filename(de->d_name);
+        std::string origfile;
+        struct stat st;
+
+        if (filename == "." || filename == "..")
+        {
+            continue;
+        }
+
+        origfile = origpath + filename;
+
+        if (lstat(origfile.c_str(), &st) == -1)
+        {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            subdirs.push_back(origfile);
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+        {
+            continue;
+        }
+
+        if (!transcoded_name(&filename))
+        {
+            // Passthrough file
+            continue;
+        }
+
+        LPVIRTUALFILE virtualfile = insert_file(VIRTUALTYPE_REGULAR, origpath + filename, origfile, &st);
+        if (virtualfile == nullptr)
+        {
+            continue;
+        }
+
+        (*found)++;
+
+        {
+            // Do not flood the thread pool, leave room for clients
+            std::unique_lock<std::mutex> lock(warm_mutex);
+            while (!warm_exit && transcoder_warm_running() >= params.m_warm_cache_jobs)
+            {
+                warm_cond.wait_for(lock, std::chrono::seconds(1));
+            }
+        }
+
+        if (warm_exit)
+        {
+            go_on = false;
+            break;
+        }
+
+        if (transcoder_warm(virtualfile))
+        {
+            (*queued)++;
+
+            if (!(*queued % 100))
+            {
+                Logging::info(nullptr, "Cache warming: %1 files found, %2 queued for transcoding so far.", *found, *queued);
+            }
+        }
+        else if (errno == ENOSPC)
+        {
+            Logging::info(nullptr, "Cache warming: Cache is full, stopping scan.");
+            go_on = false;
+        }
+    }
+
+    closedir(dp);
+
+    for (const std::string & subdir : subdirs)
+    {
+        if (!go_on)
+        {
+            break;
+        }
+
+        std::string path(subdir);
+        append_sep(&path);
+
+        go_on = warm_cache_dir(path, found, queued);
+    }
+
+    return go_on;
+}
+
+/**
+ * @brief Cache warming thread.
+ *
+ * Scans the base path and queues all files that have not been transcoded yet.
+ * The scan is repeated every cache maintenance interval, or run once if
+ * cache maintenance is disabled.
+ */
+static void warm_cache_thread()
+{
+    std::string basepath(params.m_basepath);
+
+    append_sep(&basepath);
+
+    do
+    {
+        unsigned int found = 0;
+        unsigned int queued = 0;
+
+        Logging::info(basepath, "Cache warming: Scanning for files to transcode.");
+
+        warm_cache_dir(basepath, &found, &queued);
+
+        if (warm_exit)
+        {
+            break;
+        }
+
+        Logging::info(basepath, "Cache warming: Scan complete, %1 files found, %2 queued for transcoding.", found, queued);
+
+        if (!params.m_cache_maintenance)
+        {
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(warm_mutex);
+        warm_cond.wait_for(lock, std::chrono::seconds(params.m_cache_maintenance), [] { return warm_exit.load(); });
+    }
+    while (!warm_exit);
+}
+
 /**
  * @brief Initialise filesystem
  * @param[in] conn - fuse_conn_info structure of FUSE. See FUSE docs for details.
@@ -1271,11 +1701,16 @@ static void *ffmpegfs_init(struct fuse_conn_info *conn)
     sa.sa_handler = sighandler;
     sigaction(SIGINT, &sa, &oldHandler);
 
-    // We need synchronous reads.
-    conn->async_read = 0;
-    //    conn->async_read = 1;
-    //	conn->want |= FUSE_CAP_ASYNC_READ;
-    //	conn->want |= FUSE_CAP_SPLICE_READ;
+    // Reads may come in parallel and out of order, transcoder_read() waits until the requested
+    // range is available. Passthrough files are read through the descriptor kept in the file handle.
+    conn->async_read = 1;
+#ifdef FUSE_CAP_ASYNC_READ
+    conn->want |= FUSE_CAP_ASYNC_READ;
+#endif
+#ifdef FUSE_CAP_SPLICE_READ
+    // Completely transcoded files can be spliced from the cache file.
+    conn->want |= FUSE_CAP_SPLICE_READ;
+#endif
 
     if (params.m_cache_maintenance)
     {
@@ -1290,6 +1725,8 @@ static void *ffmpegfs_init(struct fuse_conn_info *conn)
         prepare_script();
     }
 
+    attrcache.init(params.m_attr_cache_timeout);
+
     if (tp == nullptr)
     {
         tp = new(std::nothrow)thread_pool(params.m_max_threads);
@@ -1297,6 +1734,12 @@ static void *ffmpegfs_init(struct fuse_conn_info *conn)
 
     tp->init();
 
+    if (params.m_warm_cache)
+    {
+        warm_exit = false;
+        warm_thread = std::thread(warm_cache_thread);
+    }
+
     return nullptr;
 }
 
@@ -1311,6 +1754,15 @@ static void ffmpegfs_destroy(__attribute__((unused)) void * p)
 
     stop_cache_maintenance();
 
+    if (warm_thread.joinable())
+    {
+        warm_exit = true;
+        warm_cond.notify_all();
+        warm_thread.join();
+    }
+
+    log_statistics();
+
     transcoder_exit();
     transcoder_free();
 
@@ -1323,5 +1775,7 @@ static void ffmpegfs_destroy(__attribute__((unused)) void * p)
 
     index_buffer.clear();
 
+    attrcache.clear();
+
     Logging::info(nullptr, "%1 V%2 terminated", PACKAGE_NAME, PACKAGE_VERSION);
 }
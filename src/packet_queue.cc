@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Packet_Queue class implementation
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#include "packet_queue.h"
+
+static std::atomic<uint64_t> total_taken;       /**< @brief Number of packets taken from all queues */
+static std::atomic<uint64_t> total_fill_sum;    /**< @brief Sum of queue sizes when packets were taken from all queues */
+static std::atomic<uint64_t> total_empty_waits; /**< @brief Number of times pop() waited in all queues */
+static std::atomic<uint64_t> total_full_waits;  /**< @brief Number of times push() waited in all queues */
+
+Packet_Queue::Packet_Queue(size_t max_packets)
+    : m_max_packets(max_packets ? max_packets : 1)
+    , m_end(false)
+    , m_end_ret(AVERROR_EOF)
+    , m_abort(false)
+    , m_packets_taken(0)
+    , m_fill_sum(0)
+    , m_max_fill(0)
+    , m_empty_waits(0)
+    , m_full_waits(0)
+{
+}
+
+Packet_Queue::~Packet_Queue()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    clear();
+}
+
+int Packet_Queue::push(AVPacket *pkt)
+{
+    AVPacket tmp_pkt;
+
+    // Packets returned by the demuxer may point into its buffers, which are
+    // reused by the next read. Make sure the queued copy has its own data.
+#if LAVF_DEP_AV_COPY_PACKET
+    av_init_packet(&tmp_pkt);
+    tmp_pkt.data = nullptr;
+    tmp_pkt.size = 0;
+
+    int ret = av_packet_ref(&tmp_pkt, pkt);
+    av_packet_unref(pkt);
+#else
+    int ret = av_dup_packet(pkt);
+    tmp_pkt = *pkt;
+    av_init_packet(pkt);
+    pkt->data = nullptr;
+    pkt->size = 0;
+#endif
+    if (ret < 0)
+    {
+        av_packet_unref(&tmp_pkt);
+        return ret;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (!m_abort && m_packets.size() >= m_max_packets)
+    {
+        m_full_waits++;
+        total_full_waits++;
+        m_cond.wait(lock, [this] { return m_abort || m_packets.size() < m_max_packets; });
+    }
+
+    if (m_abort)
+    {
+        av_packet_unref(&tmp_pkt);
+        return AVERROR_EXIT;
+    }
+
+    m_packets.push_back(tmp_pkt);
+
+    if (m_max_fill < m_packets.size())
+    {
+        m_max_fill = m_packets.size();
+    }
+
+    lock.unlock();
+    m_cond.notify_all();
+
+    return 0;
+}
+
+void Packet_Queue::push_end(int ret)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_end       = true;
+        m_end_ret   = ret;
+    }
+
+    m_cond.notify_all();
+}
+
+int Packet_Queue::pop(AVPacket *pkt)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (m_packets.empty() && !m_end)
+    {
+        m_empty_waits++;
+        total_empty_waits++;
+        m_cond.wait(lock, [this] { return !m_packets.empty() || m_end; });
+    }
+
+    if (m_packets.empty())
+    {
+        // Same as the demuxer, keep returning EOF or the error
+        av_init_packet(pkt);
+        pkt->data = nullptr;
+        pkt->size = 0;
+        return m_end_ret;
+    }
+
+    m_fill_sum += m_packets.size();
+    m_packets_taken++;
+    total_fill_sum += m_packets.size();
+    total_taken++;
+
+    *pkt = m_packets.front();
+    m_packets.pop_front();
+
+    lock.unlock();
+    m_cond.notify_all();
+
+    return 0;
+}
+
+void Packet_Queue::abort()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_abort = true;
+    }
+
+    m_cond.notify_all();
+}
+
+void Packet_Queue::reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    clear();
+
+    m_end       = false;
+    m_end_ret   = AVERROR_EOF;
+    m_abort     = false;
+}
+
+void Packet_Queue::stats(uint64_t *packets, double *avg_fill, size_t *max_fill, uint64_t *empty_waits, uint64_t *full_waits)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    *packets        = m_packets_taken;
+    *avg_fill       = m_packets_taken ? static_cast<double>(m_fill_sum) / static_cast<double>(m_packets_taken) : 0;
+    *max_fill       = m_max_fill;
+    *empty_waits    = m_empty_waits;
+    *full_waits     = m_full_waits;
+}
+
+void Packet_Queue::total_stats(uint64_t *packets, double *avg_fill, uint64_t *empty_waits, uint64_t *full_waits)
+{
+    // Counters are read one by one, they may be slightly out of step with each other
+    *packets        = total_taken;
+    *avg_fill       = *packets ? static_cast<double>(total_fill_sum) / static_cast<double>(*packets) : 0;
+    *empty_waits    = total_empty_waits;
+    *full_waits     = total_full_waits;
+}
+
+void Packet_Queue::clear()
+{
+    while (!m_packets.empty())
+    {
+        av_packet_unref(&m_packets.front());
+        m_packets.pop_front();
+    }
+}
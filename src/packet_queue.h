@@ -0,0 +1,130 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Bounded packet queue between demuxer and transcoder thread
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+
+#pragma once
+
+#include "ffmpeg_utils.h"
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * @brief The #Packet_Queue class
+ *
+ * Passes packets read by the demuxer thread on to the transcoder thread.
+ * The demuxer waits while the queue is full, the transcoder while it is
+ * empty. The result of the last read (end of file or error) is kept at
+ * the end of the queue and returned once all packets have been taken.
+ *
+ * Counts how often either side had to wait and how full the queue was,
+ * to show which side holds up the other.
+ */
+class Packet_Queue
+{
+public:
+    /**
+     * @brief Construct Packet_Queue object.
+     * @param[in] max_packets - Max. number of packets queued.
+     */
+    explicit Packet_Queue(size_t max_packets);
+    /**
+     * @brief Destroy Packet_Queue object. Frees all packets left.
+     */
+    virtual ~Packet_Queue();
+
+    /**
+     * @brief Add a packet, wait while the queue is full.
+     * @param[in, out] pkt - Packet to add. Its data is taken over, pkt is unreferenced.
+     * @return Returns 0 on success, AVERROR_EXIT if the queue has been aborted, or another negative AVERROR.
+     */
+    int                     push(AVPacket *pkt);
+    /**
+     * @brief Mark end of input. Does not wait.
+     * @param[in] ret - Result of the last read, AVERROR_EOF or another negative AVERROR.
+     */
+    void                    push_end(int ret);
+    /**
+     * @brief Take the next packet, wait while the queue is empty.
+     * @param[out] pkt - Packet taken. Blank if there is none.
+     * @return Returns 0 on success, or the value passed to push_end() once all packets are taken.
+     */
+    int                     pop(AVPacket *pkt);
+    /**
+     * @brief Stop waiting in push(), make it return AVERROR_EXIT.
+     */
+    void                    abort();
+    /**
+     * @brief Drop all packets and the end mark, e.g. after seeking.
+     * @note The demuxer thread must not be running.
+     */
+    void                    reset();
+    /**
+     * @brief Get statistics.
+     * @param[out] packets - Number of packets taken.
+     * @param[out] avg_fill - Average number of packets queued when one was taken.
+     * @param[out] max_fill - Max. number of packets queued.
+     * @param[out] empty_waits - Number of times the transcoder waited for the demuxer.
+     * @param[out] full_waits - Number of times the demuxer waited for the transcoder.
+     */
+    void                    stats(uint64_t *packets, double *avg_fill, size_t *max_fill, uint64_t *empty_waits, uint64_t *full_waits);
+    /**
+     * @brief Get statistics of all queues since start.
+     * @param[out] packets - Number of packets taken.
+     * @param[out] avg_fill - Average number of packets queued when one was taken.
+     * @param[out] empty_waits - Number of times a transcoder waited for its demuxer.
+     * @param[out] full_waits - Number of times a demuxer waited for its transcoder.
+     */
+    static void             total_stats(uint64_t *packets, double *avg_fill, uint64_t *empty_waits, uint64_t *full_waits);
+
+protected:
+    /**
+     * @brief Free all queued packets.
+     * @note m_mutex must be locked by caller.
+     */
+    void                    clear();
+
+protected:
+    size_t                  m_max_packets;                  /**< @brief Max. number of packets queued */
+    std::deque<AVPacket>    m_packets;                      /**< @brief Queued packets */
+    std::mutex              m_mutex;                        /**< @brief Protects queue and statistics */
+    std::condition_variable m_cond;                         /**< @brief Signalled when packets are added or taken */
+    bool                    m_end;                          /**< @brief true if push_end() has been called */
+    int                     m_end_ret;                      /**< @brief Value passed to push_end() */
+    bool                    m_abort;                        /**< @brief Set by abort() */
+    uint64_t                m_packets_taken;                /**< @brief Number of packets taken */
+    uint64_t                m_fill_sum;                     /**< @brief Sum of queue sizes when packets were taken */
+    size_t                  m_max_fill;                     /**< @brief Max. number of packets queued */
+    uint64_t                m_empty_waits;                  /**< @brief Number of times pop() waited */
+    uint64_t                m_full_waits;                   /**< @brief Number of times push() waited */
+};
+
+#endif // PACKET_QUEUE_H
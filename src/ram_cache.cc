@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Ram_Cache class implementation
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#include "ram_cache.h"
+#include "buffer.h"
+#include "logging.h"
+
+#include <unistd.h>
+#include <algorithm>
+
+Ram_Cache::Ram_Cache(size_t max_size)
+    : m_max_size(max_size)
+    , m_size(0)
+    , m_reserved(0)
+    , m_writeback_size(0)
+    , m_exit(false)
+    , m_hits(0)
+    , m_misses(0)
+    , m_evictions(0)
+    , m_refused(0)
+{
+}
+
+Ram_Cache::~Ram_Cache()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        while (!m_entries.empty())
+        {
+            drop(m_entries.begin());
+        }
+
+        m_exit = true;
+    }
+
+    m_cond.notify_all();
+
+    // Thread writes back everything that is left before it exits
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+}
+
+size_t Ram_Cache::max_file_size() const
+{
+    return m_max_size / RAM_CACHE_MAX_FILE_SHARE;
+}
+
+RAM_DATA Ram_Cache::lookup(const std::string & cachefile)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_index.find(cachefile);
+    if (it == m_index.end())
+    {
+        m_misses++;
+        return nullptr;
+    }
+
+    m_hits++;
+
+    // Move to front of LRU list
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+
+    return it->second->m_data;
+}
+
+bool Ram_Cache::reserve(size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_size + m_reserved + m_writeback_size + size <= m_max_size)
+    {
+        m_reserved += size;
+        return true;
+    }
+
+    m_refused++;
+
+    // Dropped entries only free their memory once they are on disk, so this file
+    // goes to disk, but the next one will fit.
+    while (!m_entries.empty() && m_size + m_reserved + size > m_max_size)
+    {
+        drop(std::prev(m_entries.end()));
+        m_evictions++;
+    }
+
+    return false;
+}
+
+void Ram_Cache::unreserve(size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_reserved -= std::min(size, m_reserved);
+}
+
+void Ram_Cache::insert(const std::string & cachefile, const RAM_DATA & data, int fd, int lock_fd, size_t reserved)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_thread.joinable())
+    {
+        // Not in the constructor: the cache is created before ffmpegfs forks into the background
+        m_thread = std::thread(&Ram_Cache::writeback_thread, this);
+    }
+
+    auto it = m_index.find(cachefile);
+    if (it != m_index.end())
+    {
+        drop(it->second);
+    }
+
+    // Room has been made when the memory was reserved
+    m_reserved -= std::min(reserved, m_reserved);
+
+    RAM_ENTRY entry;
+
+    entry.m_cachefile   = cachefile;
+    entry.m_data        = data;
+    entry.m_fd          = fd;
+    entry.m_lock_fd     = lock_fd;
+
+    m_entries.push_front(entry);
+    m_index[cachefile] = m_entries.begin();
+    m_size += data->size();
+
+    Logging::trace(cachefile, "Kept in memory: %1 entries, %2 bytes, %3 bytes reserved, %4 bytes to write back.", m_entries.size(), m_size, m_reserved, m_writeback_size);
+}
+
+void Ram_Cache::remove(const std::string & cachefile)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_index.find(cachefile);
+    if (it == m_index.end())
+    {
+        return;
+    }
+
+    // File goes away, no need to write it back
+    if (it->second->m_fd != -1)
+    {
+        ::close(it->second->m_fd);
+        it->second->m_fd = -1;
+    }
+    if (it->second->m_lock_fd != -1)
+    {
+        ::close(it->second->m_lock_fd);
+        it->second->m_lock_fd = -1;
+    }
+
+    drop(it->second);
+}
+
+void Ram_Cache::stats(uint64_t *hits, uint64_t *misses, uint64_t *evictions, uint64_t *refused, size_t *entries, size_t *size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    *hits       = m_hits;
+    *misses     = m_misses;
+    *evictions  = m_evictions;
+    *refused    = m_refused;
+    *entries    = m_entries.size();
+    *size       = m_size + m_reserved + m_writeback_size;
+}
+
+void Ram_Cache::drop(RAM_LIST::iterator it)
+{
+    if (it->m_fd != -1)
+    {
+        // Still takes up memory until it has been written
+        m_writeback_size += it->m_data->size();
+        m_writeback.push_back(*it);
+        m_cond.notify_one();
+    }
+
+    m_size -= it->m_data->size();
+    m_index.erase(it->m_cachefile);
+    m_entries.erase(it);
+}
+
+void Ram_Cache::writeback_thread()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;)
+    {
+        m_cond.wait(lock, [this] { return m_exit || !m_writeback.empty(); });
+
+        if (m_writeback.empty())
+        {
+            break;  // m_exit is set and all is done
+        }
+
+        RAM_ENTRY entry = m_writeback.front();
+        size_t size = entry.m_data->size();
+        m_writeback.pop_front();
+
+        // Do not hold up lookups while waiting for the disk
+        lock.unlock();
+
+        Buffer::write_back(entry.m_cachefile, entry.m_data, entry.m_fd, entry.m_lock_fd);
+        entry.m_data = nullptr;
+
+        lock.lock();
+
+        m_writeback_size -= size;
+    }
+}
@@ -0,0 +1,173 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief In-memory cache of complete files
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#ifndef RAM_CACHE_H
+#define RAM_CACHE_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdint.h>
+
+#define RAM_CACHE_MAX_FILE_SHARE    8                                   /**< @brief Files larger than this fraction of the RAM cache size are not kept */
+
+typedef std::shared_ptr<const std::vector<uint8_t>> RAM_DATA;           /**< @brief Contents of a file kept in memory */
+
+/**
+ * @brief The #Ram_Cache class
+ *
+ * Keeps recently finished small files in memory, so that reads do not go to
+ * the cache file. Entries are found by cache file name, the least recently
+ * used entries are dropped first when the size limit would be exceeded.
+ *
+ * The size limit covers the entries, the memory reserved for files that are
+ * being transcoded into memory and the dropped entries that have not been
+ * written back yet. Files that do not fit are transcoded to disk.
+ *
+ * Files expected to fit are transcoded into memory, their cache files stay
+ * empty while the entry is in memory. When an entry is dropped, its file is
+ * written on a background thread, see Buffer::write_back(). Until then the
+ * entry holds the lock of the cache file, so other instances wait for it.
+ * Readers that still use the data of a dropped entry keep it until they are
+ * done.
+ *
+ * The thread is started with the first entry, i.e. not before the process
+ * has been forked into the background.
+ */
+class Ram_Cache
+{
+    typedef struct RAM_ENTRY                        /**< @brief Cache entry */
+    {
+        std::string     m_cachefile;                /**< @brief Name of cache file */
+        RAM_DATA        m_data;                     /**< @brief Contents of file */
+        int             m_fd;                       /**< @brief Handle of cache file to write back when dropped */
+        int             m_lock_fd;                  /**< @brief Handle of lock file, keeps the cache file locked until it has been written, -1 if none */
+    } RAM_ENTRY;
+
+    typedef std::list<RAM_ENTRY> RAM_LIST;          /**< @brief Entries, most recently used first */
+
+public:
+    /**
+     * @brief Construct Ram_Cache object.
+     * @param[in] max_size - Max. number of bytes to keep in memory.
+     */
+    explicit Ram_Cache(size_t max_size);
+    /**
+     * @brief Destroy Ram_Cache object. Writes back all entries.
+     */
+    virtual ~Ram_Cache();
+
+    /**
+     * @brief Get the size of the largest file that is kept.
+     * @return Returns the max. file size in bytes.
+     */
+    size_t          max_file_size() const;
+    /**
+     * @brief Look up a file.
+     * @param[in] cachefile - Name of cache file.
+     * @return Returns the contents of the file, or nullptr if it is not in memory.
+     */
+    RAM_DATA        lookup(const std::string & cachefile);
+    /**
+     * @brief Reserve memory for a file that is transcoded into memory.
+     *
+     * If the memory is not available, least recently used entries are dropped so
+     * that it will be once they have been written back, but the caller must write
+     * the file to disk.
+     *
+     * @param[in] size - Number of bytes to reserve.
+     * @return Returns true if the memory has been reserved; false if not.
+     */
+    bool            reserve(size_t size);
+    /**
+     * @brief Give back memory reserved with reserve().
+     * @param[in] size - Number of bytes to give back.
+     */
+    void            unreserve(size_t size);
+    /**
+     * @brief Add a file. Its memory must have been reserved before.
+     * @param[in] cachefile - Name of cache file.
+     * @param[in] data - Contents of file, must not be larger than max_file_size().
+     * @param[in] fd - Handle of cache file, data will be written to it and it will be closed when the entry is dropped.
+     * @param[in] lock_fd - Handle of lock file, will be closed after the data has been written. May be -1.
+     * @param[in] reserved - Number of bytes reserved for the file, the entry takes them over.
+     */
+    void            insert(const std::string & cachefile, const RAM_DATA & data, int fd, int lock_fd, size_t reserved);
+    /**
+     * @brief Remove a file without writing it back, e.g. because the cache file is deleted.
+     * @param[in] cachefile - Name of cache file.
+     */
+    void            remove(const std::string & cachefile);
+    /**
+     * @brief Get statistics.
+     * @param[out] hits - Number of lookups that found the file in memory.
+     * @param[out] misses - Number of lookups that did not.
+     * @param[out] evictions - Number of entries dropped to make room.
+     * @param[out] refused - Number of files that were written to disk because the memory was used up.
+     * @param[out] entries - Number of entries currently in memory.
+     * @param[out] size - Number of bytes currently in memory, including reserved memory and entries not yet written back.
+     */
+    void            stats(uint64_t *hits, uint64_t *misses, uint64_t *evictions, uint64_t *refused, size_t *entries, size_t *size);
+
+protected:
+    /**
+     * @brief Drop an entry and queue its file for write back.
+     * @note m_mutex must be locked by caller.
+     * @param[in] it - Entry to drop.
+     */
+    void            drop(RAM_LIST::iterator it);
+    /**
+     * @brief Write back dropped files until the cache is destroyed.
+     */
+    void            writeback_thread();
+
+protected:
+    size_t          m_max_size;                     /**< @brief Max. number of bytes kept in memory */
+    size_t          m_size;                         /**< @brief Number of bytes currently in memory */
+    size_t          m_reserved;                     /**< @brief Number of bytes reserved for files being transcoded into memory */
+    size_t          m_writeback_size;               /**< @brief Number of bytes of dropped entries not yet written back */
+    std::mutex      m_mutex;                        /**< @brief Protects entries and write back queue */
+    RAM_LIST        m_entries;                      /**< @brief Entries, most recently used first */
+    std::unordered_map<std::string, RAM_LIST::iterator> m_index;    /**< @brief Entries by cache file name */
+    std::deque<RAM_ENTRY> m_writeback;              /**< @brief Dropped entries to write back */
+    std::condition_variable m_cond;                 /**< @brief Signalled when files are queued for write back */
+    std::thread     m_thread;                       /**< @brief Write back thread, started with the first entry */
+    bool            m_exit;                         /**< @brief Set to stop the write back thread */
+    uint64_t        m_hits;                         /**< @brief Number of lookups that found the file */
+    uint64_t        m_misses;                       /**< @brief Number of lookups that did not find the file */
+    uint64_t        m_evictions;                    /**< @brief Number of entries dropped to make room */
+    uint64_t        m_refused;                      /**< @brief Number of reservations that failed */
+};
+
+#endif // RAM_CACHE_H
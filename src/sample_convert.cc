@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Fast audio sample format conversion implementation
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#include "sample_convert.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_CONVERT_X86                                  /**< @brief Build SSE2 and AVX2 versions, selected at run time */
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SAMPLE_CONVERT_NEON                                 /**< @brief Build NEON version, always available on AArch64 */
+#endif
+
+#define S16_SCALE       32768.0f                            /**< @brief Float to 16 bit scale factor, as 1 << 15 in libswresample */
+#define S16_MIN         -32768.0f                           /**< @brief Smallest 16 bit value as float */
+#define S16_MAX         32767.0f                            /**< @brief Largest 16 bit value as float */
+
+/**
+ * @brief Stereo kernels of one instruction set
+ */
+typedef struct SAMPLE_KERNELS
+{
+    const char *        m_name;                             /**< @brief Name of instruction set */
+    /**
+     * @brief Convert stereo planar float to interleaved 16 bit.
+     * @param[out] out - Interleaved output.
+     * @param[in] left - Left channel.
+     * @param[in] right - Right channel.
+     * @param[in] samples - Number of samples per channel.
+     */
+    void                (*m_fltp_to_s16)(int16_t *out, const float *left, const float *right, int samples);
+    /**
+     * @brief Convert stereo interleaved 16 bit to planar float.
+     * @param[out] left - Left channel.
+     * @param[out] right - Right channel.
+     * @param[in] in - Interleaved input.
+     * @param[in] samples - Number of samples per channel.
+     */
+    void                (*m_s16_to_fltp)(float *left, float *right, const int16_t *in, int samples);
+} SAMPLE_KERNELS;
+
+/**
+ * @brief Convert one float sample to 16 bit, same as libswresample.
+ * @param[in] sample - Float sample.
+ * @return Returns 16 bit sample.
+ */
+static inline int16_t flt_to_s16(float sample)
+{
+    long value = lrintf(sample * S16_SCALE);
+
+    if (value < -32768)
+    {
+        return -32768;
+    }
+    if (value > 32767)
+    {
+        return 32767;
+    }
+    return static_cast<int16_t>(value);
+}
+
+/**
+ * @brief Convert one 16 bit sample to float, same as libswresample.
+ * @param[in] sample - 16 bit sample.
+ * @return Returns float sample.
+ */
+static inline float s16_to_flt(int16_t sample)
+{
+    return sample * (1.0f / S16_SCALE);
+}
+
+static void stereo_fltp_to_s16_c(int16_t *out, const float *left, const float *right, int samples)
+{
+    for (int n = 0; n < samples; n++)
+    {
+        *out++ = flt_to_s16(left[n]);
+        *out++ = flt_to_s16(right[n]);
+    }
+}
+
+static void stereo_s16_to_fltp_c(float *left, float *right, const int16_t *in, int samples)
+{
+    for (int n = 0; n < samples; n++)
+    {
+        left[n]     = s16_to_flt(*in++);
+        right[n]    = s16_to_flt(*in++);
+    }
+}
+
+#ifdef SAMPLE_CONVERT_X86
+// Clamping before the conversion gives the same result as clipping after it.
+// With default MXCSR settings, cvtps2dq rounds to nearest, ties to even, as lrintf().
+
+__attribute__((target("sse2")))
+static void stereo_fltp_to_s16_sse2(int16_t *out, const float *left, const float *right, int samples)
+{
+    const __m128 scale  = _mm_set1_ps(S16_SCALE);
+    const __m128 lo     = _mm_set1_ps(S16_MIN);
+    const __m128 hi     = _mm_set1_ps(S16_MAX);
+    int n = 0;
+
+    for (; n + 8 <= samples; n += 8)
+    {
+        __m128i l0 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(left + n), scale), lo), hi));
+        __m128i l1 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(left + n + 4), scale), lo), hi));
+        __m128i r0 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(right + n), scale), lo), hi));
+        __m128i r1 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(right + n + 4), scale), lo), hi));
+        __m128i l = _mm_packs_epi32(l0, l1);
+        __m128i r = _mm_packs_epi32(r0, r1);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * n), _mm_unpacklo_epi16(l, r));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * n + 8), _mm_unpackhi_epi16(l, r));
+    }
+
+    stereo_fltp_to_s16_c(out + 2 * n, left + n, right + n, samples - n);
+}
+
+__attribute__((target("sse2")))
+static void stereo_s16_to_fltp_sse2(float *left, float *right, const int16_t *in, int samples)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / S16_SCALE);
+    int n = 0;
+
+    for (; n + 4 <= samples; n += 4)
+    {
+        // Each 32 bit word holds one left and right sample
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * n));
+        __m128i l = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+        __m128i r = _mm_srai_epi32(v, 16);
+
+        _mm_storeu_ps(left + n, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+        _mm_storeu_ps(right + n, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+    }
+
+    stereo_s16_to_fltp_c(left + n, right + n, in + 2 * n, samples - n);
+}
+
+__attribute__((target("avx2")))
+static void stereo_fltp_to_s16_avx2(int16_t *out, const float *left, const float *right, int samples)
+{
+    const __m256 scale  = _mm256_set1_ps(S16_SCALE);
+    const __m256 lo     = _mm256_set1_ps(S16_MIN);
+    const __m256 hi     = _mm256_set1_ps(S16_MAX);
+    int n = 0;
+
+    for (; n + 16 <= samples; n += 16)
+    {
+        __m256i l0 = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(left + n), scale), lo), hi));
+        __m256i l1 = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(left + n + 8), scale), lo), hi));
+        __m256i r0 = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(right + n), scale), lo), hi));
+        __m256i r1 = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(right + n + 8), scale), lo), hi));
+        // Packing works per 128 bit lane: samples 0-3, 8-11 | 4-7, 12-15.
+        // Interleaving per lane then puts samples 0-7 into the low and 8-15 into the high result.
+        __m256i l = _mm256_packs_epi32(l0, l1);
+        __m256i r = _mm256_packs_epi32(r0, r1);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * n), _mm256_unpacklo_epi16(l, r));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * n + 16), _mm256_unpackhi_epi16(l, r));
+    }
+
+    stereo_fltp_to_s16_sse2(out + 2 * n, left + n, right + n, samples - n);
+}
+
+__attribute__((target("avx2")))
+static void stereo_s16_to_fltp_avx2(float *left, float *right, const int16_t *in, int samples)
+{
+    const __m256 scale = _mm256_set1_ps(1.0f / S16_SCALE);
+    int n = 0;
+
+    for (; n + 8 <= samples; n += 8)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2 * n));
+        __m256i l = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+        __m256i r = _mm256_srai_epi32(v, 16);
+
+        _mm256_storeu_ps(left + n, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+        _mm256_storeu_ps(right + n, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+    }
+
+    stereo_s16_to_fltp_sse2(left + n, right + n, in + 2 * n, samples - n);
+}
+#endif // SAMPLE_CONVERT_X86
+
+#ifdef SAMPLE_CONVERT_NEON
+static void stereo_fltp_to_s16_neon(int16_t *out, const float *left, const float *right, int samples)
+{
+    const float32x4_t lo = vdupq_n_f32(S16_MIN);
+    const float32x4_t hi = vdupq_n_f32(S16_MAX);
+    int n = 0;
+
+    for (; n + 8 <= samples; n += 8)
+    {
+        // vcvtnq rounds to nearest, ties to even, as lrintf()
+        int32x4_t l0 = vcvtnq_s32_f32(vminnmq_f32(vmaxnmq_f32(vmulq_n_f32(vld1q_f32(left + n), S16_SCALE), lo), hi));
+        int32x4_t l1 = vcvtnq_s32_f32(vminnmq_f32(vmaxnmq_f32(vmulq_n_f32(vld1q_f32(left + n + 4), S16_SCALE), lo), hi));
+        int32x4_t r0 = vcvtnq_s32_f32(vminnmq_f32(vmaxnmq_f32(vmulq_n_f32(vld1q_f32(right + n), S16_SCALE), lo), hi));
+        int32x4_t r1 = vcvtnq_s32_f32(vminnmq_f32(vmaxnmq_f32(vmulq_n_f32(vld1q_f32(right + n + 4), S16_SCALE), lo), hi));
+        int16x8x2_t v;
+
+        v.val[0] = vcombine_s16(vqmovn_s32(l0), vqmovn_s32(l1));
+        v.val[1] = vcombine_s16(vqmovn_s32(r0), vqmovn_s32(r1));
+
+        vst2q_s16(out + 2 * n, v);
+    }
+
+    stereo_fltp_to_s16_c(out + 2 * n, left + n, right + n, samples - n);
+}
+
+static void stereo_s16_to_fltp_neon(float *left, float *right, const int16_t *in, int samples)
+{
+    const float scale = 1.0f / S16_SCALE;
+    int n = 0;
+
+    for (; n + 8 <= samples; n += 8)
+    {
+        int16x8x2_t v = vld2q_s16(in + 2 * n);
+
+        vst1q_f32(left + n, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[0]))), scale));
+        vst1q_f32(left + n + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[0]))), scale));
+        vst1q_f32(right + n, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[1]))), scale));
+        vst1q_f32(right + n + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[1]))), scale));
+    }
+
+    stereo_s16_to_fltp_c(left + n, right + n, in + 2 * n, samples - n);
+}
+#endif // SAMPLE_CONVERT_NEON
+
+/**
+ * @brief Select stereo kernels for this CPU.
+ * @return Returns the best kernels available.
+ */
+static const SAMPLE_KERNELS * select_kernels()
+{
+#ifdef SAMPLE_CONVERT_X86
+    static const SAMPLE_KERNELS avx2 = { "AVX2", stereo_fltp_to_s16_avx2, stereo_s16_to_fltp_avx2 };
+    static const SAMPLE_KERNELS sse2 = { "SSE2", stereo_fltp_to_s16_sse2, stereo_s16_to_fltp_sse2 };
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return &avx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return &sse2;
+    }
+#endif
+#ifdef SAMPLE_CONVERT_NEON
+    static const SAMPLE_KERNELS neon = { "NEON", stereo_fltp_to_s16_neon, stereo_s16_to_fltp_neon };
+
+    return &neon;
+#endif
+    static const SAMPLE_KERNELS c = { "C", stereo_fltp_to_s16_c, stereo_s16_to_fltp_c };
+
+    return &c;
+}
+
+/**
+ * @brief Get stereo kernels for this CPU, selected on first use.
+ * @return Returns the kernels.
+ */
+static const SAMPLE_KERNELS * kernels()
+{
+    static const SAMPLE_KERNELS * selected = select_kernels();
+
+    return selected;
+}
+
+static void fltp_to_s16_c(uint8_t * const *out, const uint8_t * const *in, int channels, int samples)
+{
+    int16_t *dst = reinterpret_cast<int16_t *>(out[0]);
+
+    for (int n = 0; n < samples; n++)
+    {
+        for (int ch = 0; ch < channels; ch++)
+        {
+            *dst++ = flt_to_s16(reinterpret_cast<const float *>(in[ch])[n]);
+        }
+    }
+}
+
+static void s16_to_fltp_c(uint8_t * const *out, const uint8_t * const *in, int channels, int samples)
+{
+    const int16_t *src = reinterpret_cast<const int16_t *>(in[0]);
+
+    for (int n = 0; n < samples; n++)
+    {
+        for (int ch = 0; ch < channels; ch++)
+        {
+            reinterpret_cast<float *>(out[ch])[n] = s16_to_flt(*src++);
+        }
+    }
+}
+
+static void fltp_to_s16(uint8_t * const *out, const uint8_t * const *in, int channels, int samples)
+{
+    if (channels == 2)
+    {
+        kernels()->m_fltp_to_s16(reinterpret_cast<int16_t *>(out[0]), reinterpret_cast<const float *>(in[0]), reinterpret_cast<const float *>(in[1]), samples);
+    }
+    else
+    {
+        fltp_to_s16_c(out, in, channels, samples);
+    }
+}
+
+static void s16_to_fltp(uint8_t * const *out, const uint8_t * const *in, int channels, int samples)
+{
+    if (channels == 2)
+    {
+        kernels()->m_s16_to_fltp(reinterpret_cast<float *>(out[0]), reinterpret_cast<float *>(out[1]), reinterpret_cast<const int16_t *>(in[0]), samples);
+    }
+    else
+    {
+        s16_to_fltp_c(out, in, channels, samples);
+    }
+}
+
+SAMPLE_CONVERT_FUNC get_sample_converter(AVSampleFormat in_sample_fmt, AVSampleFormat out_sample_fmt)
+{
+    if (in_sample_fmt == AV_SAMPLE_FMT_FLTP && out_sample_fmt == AV_SAMPLE_FMT_S16)
+    {
+        return fltp_to_s16;
+    }
+    if (in_sample_fmt == AV_SAMPLE_FMT_S16 && out_sample_fmt == AV_SAMPLE_FMT_FLTP)
+    {
+        return s16_to_fltp;
+    }
+    return nullptr;
+}
+
+SAMPLE_CONVERT_FUNC get_sample_converter_c(AVSampleFormat in_sample_fmt, AVSampleFormat out_sample_fmt)
+{
+    if (in_sample_fmt == AV_SAMPLE_FMT_FLTP && out_sample_fmt == AV_SAMPLE_FMT_S16)
+    {
+        return fltp_to_s16_c;
+    }
+    if (in_sample_fmt == AV_SAMPLE_FMT_S16 && out_sample_fmt == AV_SAMPLE_FMT_FLTP)
+    {
+        return s16_to_fltp_c;
+    }
+    return nullptr;
+}
+
+const char * get_sample_converter_name()
+{
+    return kernels()->m_name;
+}
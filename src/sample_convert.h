@@ -0,0 +1,80 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * @brief Fast audio sample format conversion
+ *
+ * Converts between the sample formats most decoders and encoders use,
+ * planar float and interleaved 16 bit, without the resampler when sample
+ * rate and channel layout stay the same. Stereo is converted with SSE2,
+ * AVX2 or NEON, whichever the CPU supports, other channel counts in C.
+ *
+ * Results are the same as with libswresample: floats are scaled by 32768,
+ * rounded to nearest (ties to even) and clipped to 16 bits, 16 bit samples
+ * are scaled by 1/32768.
+ *
+ * @ingroup ffmpegfs
+ *
+ * @author Norbert Schlia (nschlia@oblivion-software.de)
+ * @copyright Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ */
+
+#ifndef SAMPLE_CONVERT_H
+#define SAMPLE_CONVERT_H
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/samplefmt.h>
+#ifdef __cplusplus
+}
+#endif
+
+/**
+ * @brief Sample conversion function
+ * @param[out] out - Output planes, one for interleaved formats.
+ * @param[in] in - Input planes, one for interleaved formats.
+ * @param[in] channels - Number of channels.
+ * @param[in] samples - Number of samples per channel.
+ */
+typedef void (*SAMPLE_CONVERT_FUNC)(uint8_t * const *out, const uint8_t * const *in, int channels, int samples);
+
+/**
+ * @brief Get fast conversion function for a pair of sample formats.
+ * @param[in] in_sample_fmt - Input sample format.
+ * @param[in] out_sample_fmt - Output sample format.
+ * @return Returns the conversion function, or nullptr if this conversion is not supported.
+ */
+SAMPLE_CONVERT_FUNC     get_sample_converter(AVSampleFormat in_sample_fmt, AVSampleFormat out_sample_fmt);
+/**
+ * @brief Get plain C conversion function for a pair of sample formats, e.g. to compare results.
+ * @param[in] in_sample_fmt - Input sample format.
+ * @param[in] out_sample_fmt - Output sample format.
+ * @return Returns the conversion function, or nullptr if this conversion is not supported.
+ */
+SAMPLE_CONVERT_FUNC     get_sample_converter_c(AVSampleFormat in_sample_fmt, AVSampleFormat out_sample_fmt);
+/**
+ * @brief Get name of instruction set used for stereo conversion.
+ * @return Returns "AVX2", "SSE2", "NEON" or "C".
+ */
+const char *            get_sample_converter_name();
+
+#endif // SAMPLE_CONVERT_H
@@ -33,11 +33,21 @@
 #include "config.h"
 
 thread_pool::thread_pool(unsigned int num_threads)
-    : m_queue_shutdown(false)
+    : m_jobs_started(0)
+    , m_queue_shutdown(false)
     , m_num_threads(num_threads)
     , m_cur_threads(0)
-
+    , m_threads_running(0)
+    , m_threads_idle(0)
+    , m_overflow_threads(0)
+    , m_preempt_ended(false)
 {
+    for (int priority = 0; priority < THREAD_PRIORITY_MAX; priority++)
+    {
+        m_stats[priority].m_jobs        = 0;
+        m_stats[priority].m_wait_total  = 0;
+        m_stats[priority].m_wait_max    = 0;
+    }
 }
 
 thread_pool::~thread_pool()
@@ -50,50 +60,188 @@ void thread_pool::loop_function_starter(thread_pool & tp)
     tp.loop_function();
 }
 
-void thread_pool::loop_function()
+void thread_pool::loop_function(bool overflow /*= false*/)
 {
-    unsigned int thread_no = ++m_cur_threads;
+    unsigned int thread_no = overflow ? 0 : ++m_cur_threads;
 
-    Logging::trace(nullptr, "Starting pool thread no. %1 with id 0x%<%" FFMPEGFS_FORMAT_PTHREAD_T ">2.", thread_no, pthread_self());
+    if (overflow)
+    {
+        Logging::trace(nullptr, "Starting extra thread with id 0x%<%" FFMPEGFS_FORMAT_PTHREAD_T ">1.", pthread_self());
+    }
+    else
+    {
+        Logging::trace(nullptr, "Starting pool thread no. %1 with id 0x%<%" FFMPEGFS_FORMAT_PTHREAD_T ">2.", thread_no, pthread_self());
+    }
 
     while (true)
     {
         THREADINFO info;
+        RUNNINGJOBS::iterator running;
         {
             std::unique_lock<std::mutex> lock(m_queue_mutex);
-            m_queue_condition.wait(lock, [this]{ return (!m_thread_queue.empty() || m_queue_shutdown); });
 
-            if (m_queue_shutdown)
+            if (overflow)
+            {
+                // Extra threads only run jobs that preempt others
+                if (m_queue_shutdown || top_priority() <= bottom_priority())
+                {
+                    m_overflow_threads--;
+                    m_overflow_condition.notify_all();
+                    m_preempt_condition.notify_all();
+                    break;
+                }
+            }
+            else
             {
-                lock.unlock();
-                break;
+                m_threads_idle++;
+                m_queue_condition.wait(lock, [this]{ return (top_priority() >= 0 || m_queue_shutdown); });
+                m_threads_idle--;
+
+                if (m_queue_shutdown)
+                {
+                    lock.unlock();
+                    break;
+                }
             }
 
-            Logging::trace(nullptr, "Starting job using pool thread no. %1 with id 0x%<%" FFMPEGFS_FORMAT_PTHREAD_T ">2.", thread_no, pthread_self());
-            info = m_thread_queue.front();
-            m_thread_queue.pop();
+            std::deque<THREADINFO> & queue = m_thread_queue[top_priority()];
+
+            info = queue.front();
+            queue.pop_front();
+
+            RUNNINGJOB job;
+
+            job.m_priority  = info.m_priority;
+            job.m_started   = ++m_jobs_started;
+            job.m_thread    = std::this_thread::get_id();
+
+            running = m_running_jobs.insert(std::make_pair(info.m_tag != nullptr ? info.m_tag : info.m_opaque, job));
+            m_threads_running++;
+
+            int64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - info.m_queued).count();
+            JOBSTAT & stats = m_stats[info.m_priority];
+
+            stats.m_jobs++;
+            stats.m_wait_total += wait;
+            if (stats.m_wait_max < wait)
+            {
+                stats.m_wait_max = wait;
+            }
+
+            Logging::trace(info.m_name, "Starting %1 priority job after %2 ms in queue using thread id 0x%<%" FFMPEGFS_FORMAT_PTHREAD_T ">3.", priority_name(info.m_priority), wait / 1000, pthread_self());
         }
 
         info.m_thread_func(info.m_opaque);
+
+        {
+            std::lock_guard<std::mutex> lock(m_queue_mutex);
+
+            m_running_jobs.erase(running);
+            m_threads_running--;
+        }
+
+        m_preempt_condition.notify_all();
     }
 
-    Logging::trace(nullptr, "Exiting pool thread no. %1 with id 0x%<%" FFMPEGFS_FORMAT_PTHREAD_T ">2.", thread_no, pthread_self());
+    if (overflow)
+    {
+        Logging::trace(nullptr, "Exiting extra thread with id 0x%<%" FFMPEGFS_FORMAT_PTHREAD_T ">1.", pthread_self());
+    }
+    else
+    {
+        Logging::trace(nullptr, "Exiting pool thread no. %1 with id 0x%<%" FFMPEGFS_FORMAT_PTHREAD_T ">2.", thread_no, pthread_self());
+    }
 }
 
-bool thread_pool::schedule_thread(void (*thread_func)(void *), void *opaque)
+int thread_pool::top_priority() const
 {
-    if (!m_queue_shutdown)
+    for (int priority = THREAD_PRIORITY_MAX - 1; priority >= 0; priority--)
     {
-        Logging::trace(nullptr, "Queueing new thread. %1 threads already in queue.", m_thread_pool.size());
+        if (!m_thread_queue[priority].empty())
+        {
+            return priority;
+        }
+    }
+    return -1;
+}
+
+int thread_pool::bottom_priority() const
+{
+    int bottom = THREAD_PRIORITY_MAX;
 
+    for (auto it = m_running_jobs.cbegin(); it != m_running_jobs.cend(); ++it)
+    {
+        if (bottom > it->second.m_priority)
+        {
+            bottom = it->second.m_priority;
+        }
+    }
+    return bottom;
+}
+
+void thread_pool::check_overflow()
+{
+    size_t queued = 0;
+    int top = top_priority();
+
+    if (top < 0 || m_thread_pool.empty())
+    {
+        return;
+    }
+
+    for (int priority = 0; priority < THREAD_PRIORITY_MAX; priority++)
+    {
+        queued += m_thread_queue[priority].size();
+    }
+
+    if (queued <= m_threads_idle)
+    {
+        // A pool thread will pick up the job
+        return;
+    }
+
+    // Start one extra thread per running job that will be preempted
+    unsigned int preemptable = 0;
+    for (auto it = m_running_jobs.cbegin(); it != m_running_jobs.cend(); ++it)
+    {
+        if (it->second.m_priority < top)
+        {
+            preemptable++;
+        }
+    }
+
+    if (m_overflow_threads >= preemptable)
+    {
+        return;
+    }
+
+    m_overflow_threads++;
+
+    Logging::debug(nullptr, "All threads busy, starting extra thread for %1 priority job.", priority_name(static_cast<THREAD_PRIORITY>(top)));
+
+    std::thread(&thread_pool::loop_function, this, true).detach();
+}
+
+bool thread_pool::schedule_thread(void (*thread_func)(void *), void *opaque, THREAD_PRIORITY priority /*= THREAD_PRIORITY_NORMAL*/, const void *tag /*= nullptr*/, const std::string & name /*= ""*/)
+{
+    if (!m_queue_shutdown)
+    {
         {
             std::lock_guard<std::mutex> lock(m_queue_mutex);
 
             THREADINFO info;
 
+            Logging::trace(name, "Queueing new %1 priority thread. %2 threads running.", priority_name(priority), m_threads_running);
+
             info.m_thread_func  = thread_func;
             info.m_opaque       = opaque;
-            m_thread_queue.push(info);
+            info.m_tag          = tag;
+            info.m_priority     = priority;
+            info.m_name         = name;
+            info.m_queued       = std::chrono::steady_clock::now();
+            m_thread_queue[priority].push_back(info);
+
+            check_overflow();
         }
 
         m_queue_condition.notify_one();
@@ -106,6 +254,183 @@ bool thread_pool::schedule_thread(void (*thread_func)(void *), void *opaque)
     }
 }
 
+bool thread_pool::boost(const void *tag, THREAD_PRIORITY priority /*= THREAD_PRIORITY_INTERACTIVE*/)
+{
+    std::unique_lock<std::mutex> lock(m_queue_mutex);
+    bool boosted = false;
+    bool resume = false;
+
+    auto range = m_running_jobs.equal_range(tag);
+    for (auto running = range.first; running != range.second; ++running)
+    {
+        if (running->second.m_priority < priority)
+        {
+            running->second.m_priority = priority;
+            resume = true;
+        }
+    }
+
+    for (int queue_priority = 0; queue_priority < priority; queue_priority++)
+    {
+        std::deque<THREADINFO> & queue = m_thread_queue[queue_priority];
+
+        for (auto it = queue.begin(); it != queue.end();)
+        {
+            if (it->m_tag != tag)
+            {
+                ++it;
+                continue;
+            }
+
+            THREADINFO info = *it;
+
+            Logging::debug(info.m_name, "Raising job priority from %1 to %2.", priority_name(info.m_priority), priority_name(priority));
+
+            it = queue.erase(it);
+
+            // Keep the original queue time so the wait statistics are not skewed
+            info.m_priority = priority;
+            std::deque<THREADINFO> & new_queue = m_thread_queue[priority];
+            auto pos = new_queue.begin();
+            while (pos != new_queue.end() && pos->m_queued <= info.m_queued)
+            {
+                ++pos;
+            }
+            new_queue.insert(pos, info);
+
+            boosted = true;
+        }
+    }
+
+    if (boosted)
+    {
+        check_overflow();
+    }
+
+    lock.unlock();
+
+    if (resume)
+    {
+        m_preempt_condition.notify_all();
+    }
+
+    return (boosted || resume);
+}
+
+thread_pool::RUNNINGJOBS::const_iterator thread_pool::find_running(const void *tag) const
+{
+    std::thread::id self = std::this_thread::get_id();
+    auto range = m_running_jobs.equal_range(tag);
+
+    for (auto running = range.first; running != range.second; ++running)
+    {
+        if (running->second.m_thread == self)
+        {
+            return running;
+        }
+    }
+
+    return m_running_jobs.cend();
+}
+
+bool thread_pool::is_preempted(const void *tag) const
+{
+    if (!m_overflow_threads || m_preempt_ended || m_queue_shutdown)
+    {
+        return false;
+    }
+
+    auto running = find_running(tag);
+    if (running == m_running_jobs.cend())
+    {
+        return false;
+    }
+
+    const RUNNINGJOB & job = running->second;
+    int top = top_priority();
+    unsigned int lower = 0;
+
+    for (auto it = m_running_jobs.cbegin(); it != m_running_jobs.cend(); ++it)
+    {
+        if (top < it->second.m_priority)
+        {
+            top = it->second.m_priority;
+        }
+
+        // Count jobs that give way before this one: lower priority, or same priority but started later
+        if (it->second.m_priority < job.m_priority || (it->second.m_priority == job.m_priority && it->second.m_started > job.m_started))
+        {
+            lower++;
+        }
+    }
+
+    if (top <= job.m_priority)
+    {
+        // No job with a higher priority
+        return false;
+    }
+
+    // Each extra thread takes the place of exactly one of the lowest priority jobs
+    return (lower < m_overflow_threads);
+}
+
+bool thread_pool::preempted(const void *tag)
+{
+    std::lock_guard<std::mutex> lock(m_queue_mutex);
+
+    return is_preempted(tag);
+}
+
+void thread_pool::suspend(const void *tag)
+{
+    std::unique_lock<std::mutex> lock(m_queue_mutex);
+
+    m_preempt_condition.wait(lock, [this, tag]{ return !is_preempted(tag); });
+}
+
+void thread_pool::end_preemption()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_queue_mutex);
+        m_preempt_ended = true;
+    }
+
+    m_preempt_condition.notify_all();
+}
+
+void thread_pool::wait_stats(THREAD_PRIORITY priority, uint64_t *jobs, int64_t *wait_avg, int64_t *wait_max)
+{
+    std::lock_guard<std::mutex> lock(m_queue_mutex);
+    const JOBSTAT & stats = m_stats[priority];
+
+    *jobs       = stats.m_jobs;
+    *wait_avg   = stats.m_jobs ? stats.m_wait_total / static_cast<int64_t>(stats.m_jobs) : 0;
+    *wait_max   = stats.m_wait_max;
+}
+
+const char * thread_pool::priority_name(THREAD_PRIORITY priority)
+{
+    switch (priority)
+    {
+    case THREAD_PRIORITY_BACKGROUND:
+    {
+        return "background";
+    }
+    case THREAD_PRIORITY_NORMAL:
+    {
+        return "normal";
+    }
+    case THREAD_PRIORITY_INTERACTIVE:
+    {
+        return "interactive";
+    }
+    default:
+    {
+        return "invalid";
+    }
+    }
+}
+
 unsigned int thread_pool::current_running() const
 {
     return m_threads_running;
@@ -114,8 +439,14 @@ unsigned int thread_pool::current_running() const
 unsigned int thread_pool::current_queued()
 {
     std::lock_guard<std::mutex> lock(m_queue_mutex);
+    size_t queued = 0;
+
+    for (int priority = 0; priority < THREAD_PRIORITY_MAX; priority++)
+    {
+        queued += m_thread_queue[priority].size();
+    }
 
-    return static_cast<unsigned int>(m_thread_queue.size());
+    return static_cast<unsigned int>(queued);
 }
 
 unsigned int thread_pool::pool_size() const
@@ -142,13 +473,29 @@ void thread_pool::tear_down(bool silent)
 {
     if (!silent)
     {
-        Logging::debug(nullptr, "Tearing down thread pool. %1 threads still in queue.", m_thread_queue.size());
+        Logging::debug(nullptr, "Tearing down thread pool. %1 threads still in queue.", current_queued());
+
+        for (int priority = 0; priority < THREAD_PRIORITY_MAX; priority++)
+        {
+            uint64_t jobs;
+            int64_t wait_avg;
+            int64_t wait_max;
+
+            wait_stats(static_cast<THREAD_PRIORITY>(priority), &jobs, &wait_avg, &wait_max);
+
+            Logging::debug(nullptr, "Queue wait time for %1 priority: %2 jobs, average %3 ms, maximum %4 ms.", priority_name(static_cast<THREAD_PRIORITY>(priority)), jobs, wait_avg / 1000, wait_max / 1000);
+        }
     }
 
-    m_queue_mutex.lock();
-    m_queue_shutdown = true;
-    m_queue_mutex.unlock();
-    m_queue_condition.notify_all();
+    {
+        std::unique_lock<std::mutex> lock(m_queue_mutex);
+        m_queue_shutdown = true;
+        m_queue_condition.notify_all();
+        m_preempt_condition.notify_all();
+
+        // Wait for extra threads
+        m_overflow_condition.wait(lock, [this]{ return !m_overflow_threads; });
+    }
 
     while (!m_thread_pool.empty())
     {
@@ -156,4 +503,3 @@ void thread_pool::tear_down(bool silent)
         m_thread_pool.pop_back();
     }
 }
-
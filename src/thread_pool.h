@@ -4,13 +4,34 @@
 #include <iostream>
 #include <thread>
 #include <vector>
-#include <queue>
+#include <deque>
+#include <map>
+#include <string>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 #include <unistd.h>
 
+/**
+  * Job priorities
+  */
+typedef enum THREAD_PRIORITY
+{
+    THREAD_PRIORITY_BACKGROUND = 0,     /**< @brief Nobody is waiting, e.g. pre-transcode of files */
+    THREAD_PRIORITY_NORMAL,             /**< @brief File has been opened */
+    THREAD_PRIORITY_INTERACTIVE,        /**< @brief A reader is blocked waiting for data */
+    THREAD_PRIORITY_MAX                 /**< @brief Number of priority classes, must be last */
+} THREAD_PRIORITY;
+
 /**
  * @brief The thread_pool class.
+ *
+ * Jobs are started by priority, and in order of arrival within one priority class.
+ * If all pool threads are busy and a job is waiting with a higher priority than
+ * one of the running jobs, an extra thread is started for it. The lower priority
+ * job should then call suspend() while preempted() returns true, so that the
+ * number of active jobs does not grow beyond the pool size. Only as many jobs
+ * as there are extra threads are preempted, lowest priority first.
  */
 class thread_pool
 {
@@ -18,8 +39,28 @@ class thread_pool
     {
         void (*m_thread_func)(void *);              /**< Job function pointer */
         void *m_opaque;                             /**< Parameter for job function */
+        const void *m_tag;                          /**< Job identifier for boost() and preempted() */
+        THREAD_PRIORITY m_priority;                 /**< Job priority */
+        std::string m_name;                         /**< Job name, for logging */
+        std::chrono::steady_clock::time_point m_queued; /**< Time the job was queued */
     } THREADINFO;
 
+    typedef struct RUNNINGJOB                       /**< Running job info structure */
+    {
+        THREAD_PRIORITY m_priority;                 /**< Job priority */
+        uint64_t m_started;                         /**< Start sequence number, later jobs are preempted first */
+        std::thread::id m_thread;                   /**< Thread running the job, tells jobs with the same tag apart */
+    } RUNNINGJOB;
+
+    typedef std::multimap<const void *, RUNNINGJOB> RUNNINGJOBS;   /**< Running jobs by tag, several jobs may share one */
+
+    typedef struct JOBSTAT                          /**< Queue wait time statistics */
+    {
+        uint64_t m_jobs;                            /**< Number of jobs started */
+        int64_t m_wait_total;                       /**< Sum of queue wait times in microseconds */
+        int64_t m_wait_max;                         /**< Maximum queue wait time in microseconds */
+    } JOBSTAT;
+
 public:
     /**
      * @brief Construct a thread_pool object.
@@ -45,9 +86,51 @@ public:
      * @brief Schedule a new thread from pool.
      * @param[in] thread_func - Thread function to start.
      * @param[in] opaque - Parameter passed to thread function.
+     * @param[in] priority - Job priority, one of the THREAD_PRIORITY values.
+     * @param[in] tag - Optional: Job identifier to find the job later with boost() or preempted(). Several jobs may use the same tag.
+     * @param[in] name - Optional: Job name, used for logging.
      * @return Returns true if thread was successfully scheduled, fals if not.
      */
-    bool            schedule_thread(void (*thread_func)(void *), void *opaque);
+    bool            schedule_thread(void (*thread_func)(void *), void *opaque, THREAD_PRIORITY priority = THREAD_PRIORITY_NORMAL, const void *tag = nullptr, const std::string & name = "");
+    /**
+     * @brief Raise the priority of queued and running jobs.
+     *
+     * Queued jobs are moved to the new priority class, running jobs will no longer
+     * be preempted by jobs of the new priority. Applies to all jobs with the tag.
+     * Priorities will never be lowered.
+     *
+     * @param[in] tag - Job identifier as passed to schedule_thread().
+     * @param[in] priority - New job priority.
+     * @return Returns true if the priority was raised, false if no job was found or all already had that priority.
+     */
+    bool            boost(const void *tag, THREAD_PRIORITY priority = THREAD_PRIORITY_INTERACTIVE);
+    /**
+     * @brief Check if the calling job should give way to jobs with higher priority.
+     * @param[in] tag - Job identifier as passed to schedule_thread().
+     * @return Returns true if the job should suspend, false if it may go on.
+     */
+    bool            preempted(const void *tag);
+    /**
+     * @brief Suspend the calling job while it is preempted.
+     *
+     * Returns when a preempting job has finished, the job's priority has been raised,
+     * or end_preemption() or tear_down() has been called.
+     *
+     * @param[in] tag - Job identifier as passed to schedule_thread().
+     */
+    void            suspend(const void *tag);
+    /**
+     * @brief Resume all suspended jobs and never preempt a job again, e.g. on exit.
+     */
+    void            end_preemption();
+    /**
+     * @brief Get queue wait time statistics for a priority class.
+     * @param[in] priority - Priority class to query.
+     * @param[out] jobs - Number of jobs started.
+     * @param[out] wait_avg - Average queue wait time in microseconds.
+     * @param[out] wait_max - Maximum queue wait time in microseconds.
+     */
+    void            wait_stats(THREAD_PRIORITY priority, uint64_t *jobs, int64_t *wait_avg, int64_t *wait_max);
     /**
      * @brief Get number of currently running threads.
      * @return Returns number of currently running threads.
@@ -63,6 +146,12 @@ public:
      * @return Return current pool size.
      */
     unsigned int    pool_size() const;
+    /**
+     * @brief Get the name of a priority class.
+     * @param[in] priority - Priority class.
+     * @return Returns the name of the priority class.
+     */
+    static const char * priority_name(THREAD_PRIORITY priority);
 
 private:
     /**
@@ -72,18 +161,58 @@ private:
     static void     loop_function_starter(thread_pool &tp);
     /**
      * @brief Start loop function
+     * @param[in] overflow - If true, this is an extra thread that ends when no more preempting jobs are queued.
+     */
+    void            loop_function(bool overflow = false);
+    /**
+     * @brief Start extra thread if a queued job has a higher priority than a running one.
+     * @note m_queue_mutex must be locked by caller.
+     */
+    void            check_overflow();
+    /**
+     * @brief Get the highest priority of all queued jobs.
+     * @note m_queue_mutex must be locked by caller.
+     * @return Returns highest priority, or -1 if the queue is empty.
+     */
+    int             top_priority() const;
+    /**
+     * @brief Get the lowest priority of all running jobs.
+     * @note m_queue_mutex must be locked by caller.
+     * @return Returns lowest priority, or THREAD_PRIORITY_MAX if no job is running.
+     */
+    int             bottom_priority() const;
+    /**
+     * @brief Check if the calling job should give way to jobs with higher priority.
+     * @note m_queue_mutex must be locked by caller.
+     * @param[in] tag - Job identifier as passed to schedule_thread().
+     * @return Returns true if the job should suspend, false if it may go on.
+     */
+    bool            is_preempted(const void *tag) const;
+    /**
+     * @brief Find the running job of the calling thread.
+     * @note m_queue_mutex must be locked by caller.
+     * @param[in] tag - Job identifier as passed to schedule_thread().
+     * @return Returns the job, or m_running_jobs.end() if the calling thread does not run a job with this tag.
      */
-    void            loop_function();
+    RUNNINGJOBS::const_iterator find_running(const void *tag) const;
 
 protected:
     std::vector<std::thread>    m_thread_pool;      /**< Thread pool */
     std::mutex                  m_queue_mutex;      /**< Mutex for critical section */
     std::condition_variable     m_queue_condition;  /**< Condition for critical section */
-    std::queue<THREADINFO>      m_thread_queue;     /**< Thread queue parameters */
+    std::deque<THREADINFO>      m_thread_queue[THREAD_PRIORITY_MAX];    /**< Thread queue parameters, one per priority */
+    RUNNINGJOBS                 m_running_jobs;     /**< Priorities of running jobs by tag */
+    uint64_t                    m_jobs_started;     /**< Number of jobs started, gives the start sequence of running jobs */
+    JOBSTAT                     m_stats[THREAD_PRIORITY_MAX];           /**< Queue wait time statistics, one per priority */
     volatile bool               m_queue_shutdown;   /**< If true all threads have been shut down */
     unsigned int                m_num_threads;      /**< Max. number of threads. Defaults to 4x number of CPU cores. */
     unsigned int                m_cur_threads;      /**< Current number of threads. */
     volatile unsigned int       m_threads_running;  /**< Currently running threads. */
+    unsigned int                m_threads_idle;     /**< Pool threads waiting for a job. */
+    unsigned int                m_overflow_threads; /**< Extra threads started for preempting jobs. */
+    std::condition_variable     m_overflow_condition; /**< Signalled when an extra thread ends */
+    std::condition_variable     m_preempt_condition; /**< Signalled when a job ends or is boosted, so that suspended jobs check if they may go on */
+    volatile bool               m_preempt_ended;    /**< If true, no job will be preempted anymore */
 };
 
 #endif // THREAD_POOL_H
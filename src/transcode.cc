@@ -38,9 +38,14 @@
 #include "logging.h"
 #include "cache_entry.h"
 #include "thread_pool.h"
+#include "ram_cache.h"
 
 #include <unistd.h>
+#include <time.h>
 #include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
 
 /**
   * @brief THREAD_DATA struct to pass data from parent to child thread
@@ -51,20 +56,163 @@ typedef struct THREAD_DATA
     std::condition_variable m_cond;             /**< @brief Condition when thread is running */
     std::atomic_bool        m_lock_guard;       /**< @brief Lock guard to avoid spurious or missed unlocks */
     bool                    m_initialised;      /**< @brief True when this object is completely initialised */
+    bool                    m_background;       /**< @brief True if started by transcoder_warm(), nobody is waiting for the thread */
     void *                  m_arg;              /**< @brief Opaque argument pointer. Will not be freed by child thread. */
 } THREAD_DATA;
 
+/**
+  * @brief Segments of a file that is transcoded in parallel, shared by all jobs working on it
+  */
+typedef struct SEGMENT_JOB
+{
+    Cache_Entry *           m_cache_entry;      /**< @brief Cache entry of the file */
+    std::vector<size_t>     m_starts;           /**< @brief Start offsets of the segments in the output file */
+    size_t                  m_next;             /**< @brief Next segment not yet claimed by a job */
+    unsigned int            m_running;          /**< @brief Number of helper jobs working on segments */
+    std::mutex              m_mutex;            /**< @brief Access mutex */
+    std::condition_variable m_cond;             /**< @brief Signalled when a helper job ends */
+} SEGMENT_JOB;
+
 static Cache *cache;                            /**< @brief Global cache manager object */
+Ram_Cache* ramcache;                            /**< @brief In-memory cache of complete files, nullptr if disabled */
 static volatile bool thread_exit;               /**< @brief Used for shutdown: if true, exit all thread */
 
+static std::atomic_uint warm_running;           /**< @brief Number of cache warming jobs queued or running */
+
+static std::atomic<uint64_t> wakeup_count;      /**< @brief Number of reader wake-ups on buffer progress */
+static std::atomic<int64_t> wakeup_latency;     /**< @brief Sum of reader wake-up latencies in microseconds */
+static std::atomic<int64_t> wakeup_latency_max; /**< @brief Maximum reader wake-up latency in microseconds */
+
+static std::mutex cpu_mutex;                    /**< @brief Protects the CPU time accounting below */
+static unsigned int cpu_jobs;                   /**< @brief Number of transcodes the process CPU time is shared by */
+static int64_t cpu_last;                        /**< @brief Process CPU time at the last update in microseconds */
+static int64_t cpu_share;                       /**< @brief Process CPU time per transcode since start up in microseconds */
+
+#define PROGRESS_WAIT_TIMEOUT  100              /**< @brief Time in ms to wait for buffer progress before checking for interrupts */
+#define CHECKPOINT_INTERVAL    (64 * 1024 * 1024) /**< @brief Save resume checkpoint every this many bytes */
+#define MIN_SEGMENT_SIZE       (16 * 1024 * 1024) /**< @brief Do not split files into segments smaller than this */
+
 static void transcoder_thread(void *arg);
+static void segment_thread(void *arg);
+/**
+ * @brief Compress a complete cache file, see Buffer::compress().
+ * @param[in] arg - Corresponding Cache_Entry object. The job owns a reference to it and drops it when done.
+ */
+static void compress_thread(void *arg);
+/**
+ * @brief Claim the next segment that nobody is working on.
+ * @param[in] job - Segment job of the file.
+ * @param[out] segment - Index of the segment claimed.
+ * @return Returns true if a segment was claimed, false if all are taken.
+ */
+static bool claim_segment(SEGMENT_JOB *job, size_t *segment);
+/**
+ * @brief Transcode one segment of a file.
+ * @param[in] job - Segment job of the file.
+ * @param[in] transcoder - Transcoder to use.
+ * @param[in] segment - Index of the segment.
+ * @param[in] tag - Thread pool job identifier, used to check for preemption.
+ * @return On success returns 0; on error negative AVERROR.
+ */
+static int transcode_segment(SEGMENT_JOB *job, FFmpeg_Transcoder *transcoder, size_t segment, const void *tag);
+/**
+ * @brief Transcode a file in segments, in parallel on the thread pool.
+ *
+ * The calling job works on segments itself, so that it never waits for helper
+ * jobs that are still queued. Parts that helpers fail to transcode are filled
+ * in afterwards.
+ *
+ * @param[in] cache_entry - corresponding cache entry
+ * @param[in] transcoder - Transcoder of the calling job.
+ * @param[in] starts - Start offsets of the segments, see FFmpeg_Transcoder::split_segments().
+ * @param[in] priority - Thread pool priority for the helper jobs.
+ * @return On success returns 0; on error negative AVERROR.
+ */
+static int transcode_segments(Cache_Entry *cache_entry, FFmpeg_Transcoder *transcoder, const std::vector<size_t> & starts, THREAD_PRIORITY priority);
+/**
+ * @brief Check if a range of the file has already been transcoded.
+ * @param[in] cache_entry - corresponding cache entry
+ * @param[in] offset - byte offset to start reading at
+ * @param[in] len - length of data chunk to be read.
+ * @return Returns true if the data is available, false if not.
+ */
+static bool is_available(Cache_Entry* cache_entry, size_t offset, size_t len);
 static bool transcode_until(Cache_Entry* cache_entry, size_t offset, size_t len);
+/**
+ * @brief Wait until the instance that owns the cache file has transcoded enough.
+ *
+ * If the owner goes away before the file is complete, this instance takes over
+ * and starts transcoding itself.
+ *  @param[in] cache_entry - corresponding cache entry
+ *  @param[in] offset - byte offset to start reading at
+ *  @param[in] len - length of data chunk to be read.
+ * @return On success, returns true. Returns false if an error occurred.
+ */
+static bool follow_until(Cache_Entry* cache_entry, size_t offset, size_t len);
+/**
+ * @brief Wait until a stream has been transcoded far enough.
+ *
+ * If the data has already dropped out of the ring buffer and nobody else is
+ * reading the stream, the transcoder is stopped and the stream starts over from
+ * the beginning. If others are reading, the read fails with ESPIPE instead.
+ *  @param[in] cache_entry - corresponding cache entry
+ *  @param[in] offset - byte offset to start reading at
+ *  @param[in] len - length of data chunk to be read.
+ *  @param[in] reader - Identifies the reader, as passed to Buffer::stream_read().
+ * @return On success, returns true. Returns false if an error occurred, errno is set.
+ */
+static bool stream_until(Cache_Entry* cache_entry, size_t offset, size_t len, const void *reader);
+/**
+ * @brief Start the transcoder thread for a cache entry.
+ *
+ * Returns after the transcoder has opened its input and output files.
+ * The cache entry must be locked by the caller.
+ *  @param[in] cache_entry - corresponding cache entry
+ * @return On success, returns 0. On error, returns the errno value.
+ */
+static int start_transcoder(Cache_Entry* cache_entry);
+static void record_wakeup_latency(int64_t latency);
+/**
+ * @brief Start accounting the CPU time of a transcode.
+ *
+ * Codec worker threads, the demuxer thread and segment helpers are not
+ * known by thread id, and thread CPU clocks miss them. Instead, the CPU
+ * time of the whole process is shared evenly by all transcodes running
+ * at the time it was used.
+ *
+ * @return Returns the value to pass to cpu_account_end().
+ */
+static int64_t cpu_account_start();
+/**
+ * @brief End accounting the CPU time of a transcode.
+ * @param[in] start - Value returned by cpu_account_start().
+ * @return Returns the share of process CPU time of the transcode in ms.
+ */
+static int64_t cpu_account_end(int64_t start);
+/**
+ * @brief Add the process CPU time used since the last call to the share of each running transcode.
+ * @note cpu_mutex must be locked by caller.
+ */
+static void cpu_account_update();
 static int transcode_finish(Cache_Entry* cache_entry, FFmpeg_Transcoder *transcoder);
 
+static bool is_available(Cache_Entry* cache_entry, size_t offset, size_t len)
+{
+    if (params.m_seek_ahead || params.m_split_encode > 1 || cache_entry->m_buffer->is_stream())
+    {
+        // With seek ahead or segments, the buffer may contain holes. Streams only keep the last part.
+        return cache_entry->m_buffer->is_filled(offset, len);
+    }
+
+    return (cache_entry->m_buffer->tell() >= offset + len);
+}
+
 /**
  * @brief Transcode the buffer until the buffer has enough or until an error occurs.
  * The buffer needs at least 'end' bytes before transcoding stops. Returns true
- * if no errors and false otherwise.
+ * if no errors and false otherwise. @n
+ * Blocks on the buffer's progress condition instead of polling, waking up at
+ * least every #PROGRESS_WAIT_TIMEOUT ms to check if the request was interrupted.
  *  @param[in] cache_entry - corresponding cache entry
  *  @param[in] offset - byte offset to start reading at
  *  @param[in] len - length of data chunk to be read.
@@ -75,18 +223,35 @@ static bool transcode_until(Cache_Entry* cache_entry, size_t offset, size_t len)
     size_t end = offset + len; // Cast OK: offset will never be < 0.
     bool success = true;
 
-    if (cache_entry->m_cache_info.m_finished || cache_entry->m_buffer->tell() >= end)
+    if (cache_entry->m_cache_info.m_finished || is_available(cache_entry, offset, len))
     {
         return true;
     }
 
+    if (cache_entry->m_buffer->is_follower())
+    {
+        return follow_until(cache_entry, offset, len);
+    }
+
+    if (params.m_seek_ahead && cache_entry->m_is_decoding)
+    {
+        size_t pos = cache_entry->m_buffer->tell();
+
+        if (offset < pos || offset - pos > params.m_seek_ahead)
+        {
+            // Too far away from the current encoder position: Ask transcoder to skip there.
+            cache_entry->m_seek_to = offset;
+        }
+    }
+
     try
     {
         // Wait until decoder thread has reached the desired position
         if (cache_entry->m_is_decoding)
         {
             bool reported = false;
-            while (!cache_entry->m_cache_info.m_finished && !cache_entry->m_cache_info.m_error && cache_entry->m_buffer->tell() < end)
+            unsigned int seq = cache_entry->m_buffer->progress_seq();
+            while (!cache_entry->m_cache_info.m_finished && !cache_entry->m_cache_info.m_error && !is_available(cache_entry, offset, len))
             {
                 if (fuse_interrupted())
                 {
@@ -104,8 +269,17 @@ static bool transcode_until(Cache_Entry* cache_entry, size_t offset, size_t len)
                 {
                     Logging::trace(cache_entry->destname(), "Cache miss at offset %<%11zu>1 (length %<%6u>2), remaining %3.", offset, len, format_size_ex(cache_entry->m_buffer->size() - end).c_str());
                     reported = true;
+
+                    // Someone is waiting for this file, make sure it gets served first
+                    tp->boost(cache_entry);
+                }
+
+                int64_t latency;
+                if (cache_entry->m_buffer->wait_progress(seq, std::chrono::milliseconds(PROGRESS_WAIT_TIMEOUT), &latency) && latency)
+                {
+                    record_wakeup_latency(latency);
                 }
-                sleep(0);
+                seq = cache_entry->m_buffer->progress_seq();
             }
 
             if (reported)
@@ -123,6 +297,311 @@ static bool transcode_until(Cache_Entry* cache_entry, size_t offset, size_t len)
     return success;
 }
 
+static bool follow_until(Cache_Entry* cache_entry, size_t offset, size_t len)
+{
+    bool reported = false;
+
+    for (;;)
+    {
+        cache_entry->lock();
+
+        SHARED_STATE state = cache_entry->m_buffer->follow();
+
+        if (state == SHARED_STATE_ORPHANED)
+        {
+            // Owner has gone away, do it ourselves. Only uncompressed audio can be resumed where it was left.
+            if (!cache_entry->resumable())
+            {
+                cache_entry->clear();
+            }
+            cache_entry->m_cache_info.m_finished    = false;
+            cache_entry->m_cache_info.m_error       = false;
+            cache_entry->m_cache_info.m_errno       = 0;
+            cache_entry->m_cache_info.m_averror     = 0;
+
+            Logging::info(cache_entry->filename(), "Taking over transcoding from another instance.");
+
+            int ret = start_transcoder(cache_entry);
+            if (ret)
+            {
+                cache_entry->m_is_decoding          = false;
+                cache_entry->m_cache_info.m_errno   = ret;
+                cache_entry->unlock();
+                return false;
+            }
+        }
+
+        cache_entry->unlock();
+
+        switch (state)
+        {
+        case SHARED_STATE_NONE:
+        case SHARED_STATE_ORPHANED:
+        {
+            // This instance is transcoding now
+            return transcode_until(cache_entry, offset, len);
+        }
+        case SHARED_STATE_FINISHED:
+        {
+            cache_entry->m_cache_info.m_encoded_filesize    = cache_entry->m_buffer->buffer_watermark();
+            cache_entry->m_cache_info.m_disk_size           = cache_entry->m_cache_info.m_encoded_filesize;
+            cache_entry->m_cache_info.m_finished            = true;
+            return true;
+        }
+        case SHARED_STATE_ABORTED:
+        {
+            if (is_available(cache_entry, offset, len))
+            {
+                return true;
+            }
+            Logging::error(cache_entry->destname(), "Transcoding by another instance failed.");
+            cache_entry->m_cache_info.m_error   = true;
+            cache_entry->m_cache_info.m_errno   = EIO;
+            return false;
+        }
+        case SHARED_STATE_RUNNING:
+        {
+            break;
+        }
+        }
+
+        if (is_available(cache_entry, offset, len))
+        {
+            if (reported)
+            {
+                Logging::trace(cache_entry->destname(), "Cache hit  at offset %<%11zu>1 (length %<%6u>2), written by another instance.", offset, len);
+            }
+            return true;
+        }
+
+        if (fuse_interrupted())
+        {
+            Logging::info(cache_entry->destname(), "Client has gone away.");
+            return false;
+        }
+
+        if (thread_exit)
+        {
+            Logging::warning(cache_entry->destname(), "Received thread exit.");
+            return false;
+        }
+
+        if (!reported)
+        {
+            Logging::trace(cache_entry->destname(), "Cache miss at offset %<%11zu>1 (length %<%6u>2), waiting for another instance.", offset, len);
+            reported = true;
+        }
+
+        // The owner cannot wake us up, poll its progress
+        std::this_thread::sleep_for(std::chrono::milliseconds(PROGRESS_WAIT_TIMEOUT));
+    }
+}
+
+static bool stream_until(Cache_Entry* cache_entry, size_t offset, size_t len, const void *reader)
+{
+    bool reported = false;
+    unsigned int seq = cache_entry->m_buffer->progress_seq();
+
+    for (;;)
+    {
+        bool dropped = (offset < cache_entry->m_buffer->stream_start());
+
+        if (!dropped && (cache_entry->m_cache_info.m_finished || is_available(cache_entry, offset, len)))
+        {
+            if (reported)
+            {
+                Logging::trace(cache_entry->destname(), "Cache hit  at offset %<%11zu>1 (length %<%6u>2), remaining %3.", offset, len, format_size_ex(cache_entry->m_buffer->size() - (offset + len)).c_str());
+            }
+            return true;
+        }
+
+        if (cache_entry->m_cache_info.m_error)
+        {
+            errno = cache_entry->m_cache_info.m_errno ? cache_entry->m_cache_info.m_errno : EIO;
+            return false;
+        }
+
+        if (fuse_interrupted())
+        {
+            Logging::info(cache_entry->destname(), "Client has gone away.");
+            errno = EIO;
+            return false;
+        }
+
+        if (thread_exit)
+        {
+            Logging::warning(cache_entry->destname(), "Received thread exit.");
+            errno = EIO;
+            return false;
+        }
+
+        if (dropped && !cache_entry->m_buffer->stream_sole_reader(reader))
+        {
+            // Starting over would pull the data from under the others
+            Logging::warning(cache_entry->destname(), "Offset %1 has already dropped out of the stream buffer, other clients are still reading.", offset);
+            errno = ESPIPE;
+            return false;
+        }
+
+        cache_entry->lock();
+
+        // Not running any more, e.g. finished or stopped to start over. Wait until its thread has ended.
+        std::unique_lock<std::recursive_mutex> active(cache_entry->m_active_mutex, std::defer_lock);
+
+        if (!cache_entry->m_is_decoding && active.try_lock())
+        {
+            active.unlock();
+
+            Logging::info(cache_entry->destname(), "Starting stream over to read offset %1.", offset);
+
+            cache_entry->m_buffer->clear();
+            cache_entry->m_restart                  = false;
+            cache_entry->m_cache_info.m_finished    = false;
+            cache_entry->m_cache_info.m_error       = false;
+            cache_entry->m_cache_info.m_errno       = 0;
+            cache_entry->m_cache_info.m_averror     = 0;
+
+            int ret = start_transcoder(cache_entry);
+            if (ret)
+            {
+                cache_entry->m_is_decoding          = false;
+                cache_entry->m_cache_info.m_errno   = ret;
+                cache_entry->unlock();
+                errno = ret;
+                return false;
+            }
+        }
+        else if (dropped && !cache_entry->m_restart)
+        {
+            // Ask the transcoder to stop, next time round it is started again
+            Logging::debug(cache_entry->destname(), "Offset %1 has already dropped out of the stream buffer.", offset);
+            cache_entry->m_restart = true;
+        }
+
+        cache_entry->unlock();
+
+        if (!reported)
+        {
+            Logging::trace(cache_entry->destname(), "Cache miss at offset %<%11zu>1 (length %<%6u>2), remaining %3.", offset, len, format_size_ex(cache_entry->m_buffer->size() - (offset + len)).c_str());
+            reported = true;
+
+            // Someone is waiting for this file, make sure it gets served first
+            tp->boost(cache_entry);
+        }
+
+        int64_t latency;
+        if (cache_entry->m_buffer->wait_progress(seq, std::chrono::milliseconds(PROGRESS_WAIT_TIMEOUT), &latency) && latency)
+        {
+            record_wakeup_latency(latency);
+        }
+        seq = cache_entry->m_buffer->progress_seq();
+    }
+}
+
+static int start_transcoder(Cache_Entry* cache_entry)
+{
+    Logging::debug(cache_entry->filename(), "Starting decoder thread.");
+
+    if (cache_entry->m_cache_info.m_error)
+    {
+        // If error occurred last time, clear cache
+        cache_entry->clear();
+    }
+
+    THREAD_DATA* thread_data = new(std::nothrow) THREAD_DATA;
+    if (thread_data == nullptr)
+    {
+        return ENOMEM;
+    }
+
+    // Must decode the file, otherwise simply use cache
+    cache_entry->m_is_decoding = true;
+
+    thread_data->m_initialised  = false;
+    thread_data->m_background   = false;
+    thread_data->m_arg          = cache_entry;
+    thread_data->m_lock_guard   = false;
+
+    {
+        std::unique_lock<std::mutex> lock(thread_data->m_mutex);
+
+        tp->schedule_thread(&transcoder_thread, thread_data, THREAD_PRIORITY_NORMAL, cache_entry, cache_entry->filename());
+
+        while (!thread_data->m_lock_guard)
+        {
+            thread_data->m_cond.wait(lock);
+        }
+    }
+
+    Logging::debug(cache_entry->filename(), "Decoder thread is running.");
+
+    if (cache_entry->m_cache_info.m_error)
+    {
+        Logging::trace(cache_entry->filename(), "Decoder error!");
+        int ret = cache_entry->m_cache_info.m_errno;
+        if (!ret)
+        {
+            ret = EIO; // Must return anything...
+        }
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Add a reader wake-up latency to the statistics.
+ * @param[in] latency - Time in microseconds between buffer progress and reader wake-up.
+ */
+static void record_wakeup_latency(int64_t latency)
+{
+    wakeup_count++;
+    wakeup_latency += latency;
+
+    int64_t max = wakeup_latency_max;
+    while (latency > max && !wakeup_latency_max.compare_exchange_weak(max, latency))
+    {
+    }
+}
+
+static void cpu_account_update()
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == -1)
+    {
+        return;
+    }
+
+    int64_t now = static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+
+    if (cpu_jobs)
+    {
+        cpu_share += (now - cpu_last) / cpu_jobs;
+    }
+    cpu_last = now;
+}
+
+static int64_t cpu_account_start()
+{
+    std::lock_guard<std::mutex> lock(cpu_mutex);
+
+    cpu_account_update();
+    cpu_jobs++;
+
+    return cpu_share;
+}
+
+static int64_t cpu_account_end(int64_t start)
+{
+    std::lock_guard<std::mutex> lock(cpu_mutex);
+
+    cpu_account_update();
+    cpu_jobs--;
+
+    return (cpu_share - start) / 1000;
+}
+
 /**
  * @brief Close the input file and free everything but the initial buffer.
  * @param[in] cache_entry - corresponding cache entry
@@ -131,7 +610,15 @@ static bool transcode_until(Cache_Entry* cache_entry, size_t offset, size_t len)
  */
 static int transcode_finish(Cache_Entry* cache_entry, FFmpeg_Transcoder *transcoder)
 {
-    int res = transcoder->encode_finish();
+    size_t exact_size = 0;
+
+    if (params.m_exact_size)
+    {
+        // Pad file to the size that has been reported to the user
+        exact_size = cache_entry->m_cache_info.m_predicted_filesize ? cache_entry->m_cache_info.m_predicted_filesize : transcoder->predicted_filesize();
+    }
+
+    int res = transcoder->encode_finish(exact_size);
     if (res < 0)
     {
         return res;
@@ -139,17 +626,32 @@ static int transcode_finish(Cache_Entry* cache_entry, FFmpeg_Transcoder *transco
 
     // Check encoded buffer size.
     cache_entry->m_cache_info.m_encoded_filesize    = cache_entry->m_buffer->buffer_watermark();
+    cache_entry->m_cache_info.m_disk_size           = cache_entry->m_cache_info.m_encoded_filesize;
     cache_entry->m_cache_info.m_finished 			= true;
     cache_entry->m_is_decoding                      = false;
     cache_entry->m_cache_info.m_errno               = 0;
     cache_entry->m_cache_info.m_averror             = 0;
 
+    int64_t duration = cache_entry->virtualfile()->m_duration;
+    if (duration > 0 && duration != AV_NOPTS_VALUE)
+    {
+        cache_entry->m_cache_info.m_duration        = duration;
+        cache_entry->m_cache_info.m_output_bitrate  = static_cast<int64_t>(cache_entry->m_cache_info.m_encoded_filesize * 8 * AV_TIME_BASE / static_cast<uint64_t>(duration));
+    }
+
+    cache_entry->m_buffer->notify_progress();       // Wake up readers waiting beyond EOF
+    cache_entry->m_buffer->publish(SHARED_STATE_FINISHED);  // Tell other instances following the file
+
     Logging::debug(transcoder->destname(), "Finishing file.");
 
     if (!cache_entry->m_buffer->reserve(cache_entry->m_cache_info.m_encoded_filesize))
     {
         Logging::debug(transcoder->destname(), "Unable to truncate buffer.");
     }
+    else if (!cache_entry->m_buffer->finish())
+    {
+        Logging::debug(transcoder->destname(), "Unable to remove index of complete file.");
+    }
 
     Logging::debug(transcoder->destname(), "Predicted size: %1 Final: %2 Diff: %3 (%4%).",
                    format_size_ex(cache_entry->m_cache_info.m_predicted_filesize).c_str(),
@@ -157,7 +659,32 @@ static int transcode_finish(Cache_Entry* cache_entry, FFmpeg_Transcoder *transco
                    format_result_size_ex(cache_entry->m_cache_info.m_encoded_filesize, cache_entry->m_cache_info.m_predicted_filesize).c_str(),
                    static_cast<double>((cache_entry->m_cache_info.m_encoded_filesize * 1000 / (cache_entry->m_cache_info.m_predicted_filesize + 1)) + 5) / 10);
 
-    cache_entry->flush();
+    if (cache_entry->compressible())
+    {
+        cache_entry->flush();
+
+        // Compress when there is nothing more urgent to do. Readers are served from the
+        // uncompressed file until then. The cache entry is the tag of this transcoder
+        // job, use the buffer as tag so that readers boosting the file do not boost this.
+        if (cache_entry->open(false))
+        {
+            if (!tp->schedule_thread(&compress_thread, cache_entry, THREAD_PRIORITY_BACKGROUND, cache_entry->m_buffer, cache_entry->filename()))
+            {
+                Logging::warning(transcoder->destname(), "Unable to queue compression of cache file, keeping it uncompressed.");
+
+                Cache_Entry *reference = cache_entry;
+                cache->close(&reference);
+            }
+        }
+    }
+    else if (!cache_entry->m_buffer->keep_in_ram())
+    {
+        // Not kept in memory, write it to disk now
+        cache_entry->flush();
+    }
+
+    // Final size is known now
+    invalidate_attr(cache_entry->virtualfile());
 
     return 0;
 }
@@ -199,6 +726,18 @@ bool transcoder_init(void)
             return false;
         }
     }
+
+    if (ramcache == nullptr && params.m_ram_cache_size && !params.m_disable_cache)
+    {
+        Logging::debug(nullptr, "Creating RAM cache.");
+        ramcache = new(std::nothrow) Ram_Cache(params.m_ram_cache_size);
+        if (ramcache == nullptr)
+        {
+            Logging::error(nullptr, "Unable to create RAM cache. Out of memory.");
+            std::fprintf(stderr, "ERROR: Creating RAM cache. Out of memory.\n");
+            return false;
+        }
+    }
     return true;
 }
 
@@ -212,6 +751,15 @@ void transcoder_free(void)
         Logging::debug(nullptr, "Deleting media file cache.");
         delete p1;
     }
+
+    Ram_Cache *p2 = ramcache;
+    ramcache = nullptr;
+
+    if (p2 != nullptr)
+    {
+        // Writes back all files still in memory
+        delete p2;
+    }
 }
 
 bool transcoder_cached_filesize(LPVIRTUALFILE virtualfile, struct stat *stbuf)
@@ -293,6 +841,10 @@ bool transcoder_predict_filesize(LPVIRTUALFILE virtualfile, Cache_Entry* cache_e
     if (transcoder->open_input_file(virtualfile) >= 0)
     {
         cache_entry->m_cache_info.m_predicted_filesize  = transcoder->predicted_filesize();
+        if (virtualfile->m_duration > 0 && virtualfile->m_duration != AV_NOPTS_VALUE)
+        {
+            cache_entry->m_cache_info.m_duration        = virtualfile->m_duration;
+        }
 
         transcoder->close();
 
@@ -331,55 +883,31 @@ Cache_Entry* transcoder_new(LPVIRTUALFILE virtualfile, bool begin_transcode)
             // Disable cache
             cache_entry->clear();
         }
-        else if (!cache_entry->m_is_decoding && cache_entry->outdated())
+        else if (!cache_entry->m_is_decoding && !cache_entry->m_buffer->is_follower() && cache_entry->outdated())
         {
             cache_entry->clear();
         }
 
-        if (!cache_entry->m_is_decoding && !cache_entry->m_cache_info.m_finished)
+        if (cache_entry->m_buffer->is_follower())
+        {
+            // Another instance is transcoding the file, its progress is picked up while reading.
+            // Instances with other settings use other cache files, but the source may have changed
+            // since the other instance started.
+            if (cache_entry->outdated())
+            {
+                Logging::error(cache_entry->filename(), "File is being transcoded by another instance from an outdated source, try again later.");
+                throw static_cast<int>(EAGAIN);
+            }
+            Logging::info(cache_entry->filename(), "File is being transcoded by another instance, reading its cache file.");
+            cache_entry->m_cache_info.m_finished = false;
+        }
+        else if (!cache_entry->m_is_decoding && !cache_entry->m_cache_info.m_finished)
         {
             if (begin_transcode)
             {
-                int ret;
-
-                Logging::debug(cache_entry->filename(), "Starting decoder thread.");
-
-                if (cache_entry->m_cache_info.m_error)
-                {
-                    // If error occurred last time, clear cache
-                    cache_entry->clear();
-                }
-
-                // Must decode the file, otherwise simply use cache
-                cache_entry->m_is_decoding = true;
-
-                THREAD_DATA* thread_data = new(std::nothrow) THREAD_DATA;
-
-                thread_data->m_initialised  = false;
-                thread_data->m_arg          = cache_entry;
-                thread_data->m_lock_guard    = false;
-
-                {
-                    std::unique_lock<std::mutex> lock(thread_data->m_mutex);
-
-                    tp->schedule_thread(&transcoder_thread, thread_data);
-
-                    while (!thread_data->m_lock_guard)
-                    {
-                        thread_data->m_cond.wait(lock);
-                    }
-                }
-
-                Logging::debug(cache_entry->filename(), "Decoder thread is running.");
-
-                if (cache_entry->m_cache_info.m_error)
+                int ret = start_transcoder(cache_entry);
+                if (ret)
                 {
-                    Logging::trace(cache_entry->filename(), "Decoder error!");
-                    ret = cache_entry->m_cache_info.m_errno;
-                    if (!ret)
-                    {
-                        ret = EIO; // Must return anything...
-                    }
                     throw ret;
                 }
             }
@@ -393,6 +921,11 @@ Cache_Entry* transcoder_new(LPVIRTUALFILE virtualfile, bool begin_transcode)
         }
         else if (begin_transcode)
         {
+            if (cache_entry->m_is_decoding)
+            {
+                // Someone is waiting for this file now, no longer a background job
+                tp->boost(cache_entry, THREAD_PRIORITY_NORMAL);
+            }
             Logging::trace(cache_entry->destname(), "Reading file from cache.");
         }
 
@@ -400,17 +933,137 @@ Cache_Entry* transcoder_new(LPVIRTUALFILE virtualfile, bool begin_transcode)
     }
     catch (int _errno)
     {
-        cache_entry->m_is_decoding = false;
-        cache_entry->unlock();
-        cache->close(&cache_entry, CLOSE_CACHE_DELETE);
-        cache_entry = nullptr;  // Make sure to return NULL here even if the cache could not be deleted now (still in use)
-        errno = _errno;         // Restore last errno
+        cache_entry->m_is_decoding = false;
+        cache_entry->unlock();
+        cache->close(&cache_entry, CLOSE_CACHE_DELETE);
+        cache_entry = nullptr;  // Make sure to return NULL here even if the cache could not be deleted now (still in use)
+        errno = _errno;         // Restore last errno
+    }
+
+    return cache_entry;
+}
+
+bool transcoder_warm(LPVIRTUALFILE virtualfile)
+{
+    Cache_Entry* cache_entry = cache->open(virtualfile);
+    if (cache_entry == nullptr)
+    {
+        return false;
+    }
+
+    bool queued = false;
+
+    errno = 0;
+
+    cache_entry->lock();
+
+    try
+    {
+        // Only read the cache info for now, do not create a cache file yet
+        if (!cache_entry->open(false))
+        {
+            throw false;
+        }
+
+        if (cache_entry->m_is_decoding || cache_entry->ref_count() > 1)
+        {
+            // Already being transcoded or in use
+            throw true;
+        }
+
+        if (cache_entry->m_buffer->is_stream())
+        {
+            // Streams are not cached, nothing to warm up
+            throw true;
+        }
+
+        if (cache_entry->outdated())
+        {
+            cache_entry->clear();
+        }
+
+        if (cache_entry->m_cache_info.m_finished)
+        {
+            // Nothing to do
+            throw true;
+        }
+
+        if (!cache_entry->m_cache_info.m_predicted_filesize && !transcoder_predict_filesize(virtualfile, cache_entry))
+        {
+            throw false;
+        }
+
+        if (!cache->has_room(cache_entry->m_cache_info.m_predicted_filesize))
+        {
+            errno = ENOSPC;
+            throw false;
+        }
+
+        // Reopen to create the cache file. This reference is handed over to the transcoder thread.
+        cache_entry->close(CLOSE_CACHE_NOOPT);
+        if (!cache_entry->open(true))
+        {
+            throw false;
+        }
+
+        if (cache_entry->m_cache_info.m_error)
+        {
+            // If error occurred last time, clear cache
+            cache_entry->clear();
+        }
+
+        THREAD_DATA* thread_data = new(std::nothrow) THREAD_DATA;
+        if (thread_data == nullptr)
+        {
+            errno = ENOMEM;
+            throw false;
+        }
+
+        thread_data->m_initialised  = false;
+        thread_data->m_background   = true;
+        thread_data->m_arg          = cache_entry;
+        thread_data->m_lock_guard   = false;
+
+        cache_entry->m_is_decoding = true;
+        warm_running++;
+
+        if (!tp->schedule_thread(&transcoder_thread, thread_data, THREAD_PRIORITY_BACKGROUND, cache_entry, cache_entry->filename()))
+        {
+            warm_running--;
+            cache_entry->m_is_decoding = false;
+            delete thread_data;
+            errno = EIO;
+            throw false;
+        }
+
+        Logging::debug(cache_entry->filename(), "Queued for cache warming.");
+
+        queued = true;
+    }
+    catch (bool _success)
+    {
+        if (!_success)
+        {
+            Logging::debug(cache_entry->filename(), "Not queued for cache warming: (%1) %2", errno, strerror(errno));
+        }
+    }
+
+    cache_entry->unlock();
+
+    if (!queued)
+    {
+        cache->close(&cache_entry);
     }
 
-    return cache_entry;
+    return queued;
 }
 
-bool transcoder_read(Cache_Entry* cache_entry, char* buff, size_t offset, size_t len, int * bytes_read)
+unsigned int transcoder_warm_running(void)
+{
+    return warm_running;
+}
+
+bool transcoder_read(Cache_Entry* cache_entry, char* buff, size_t offset, size_t len, int * bytes_read, const void *reader)
 {
     bool success = true;
 
@@ -422,6 +1075,12 @@ bool transcoder_read(Cache_Entry* cache_entry, char* buff, size_t offset, size_t
     // Update read counter
     cache_entry->update_read_count();
 
+    if (cache_entry->m_buffer->is_stream())
+    {
+        // Holds up the transcoder if this is the slowest reader
+        cache_entry->m_buffer->stream_read(reader, offset);
+    }
+
     try
     {
         if (!cache_entry->m_cache_info.m_finished)
@@ -477,9 +1136,15 @@ bool transcoder_read(Cache_Entry* cache_entry, char* buff, size_t offset, size_t
         // Set last access time
         cache_entry->m_cache_info.m_access_time = time(nullptr);
 
-        bool success = transcode_until(cache_entry, offset, len);
-
-        if (!success)
+        if (cache_entry->m_buffer->is_stream())
+        {
+            // Sets errno itself, a read that is too late only fails for this reader
+            if (!stream_until(cache_entry, offset, len, reader))
+            {
+                throw false;
+            }
+        }
+        else if (!transcode_until(cache_entry, offset, len))
         {
             errno = cache_entry->m_cache_info.m_errno ? cache_entry->m_cache_info.m_errno : EIO;
             throw false;
@@ -518,8 +1183,42 @@ bool transcoder_read(Cache_Entry* cache_entry, char* buff, size_t offset, size_t
     return success;
 }
 
-void transcoder_delete(Cache_Entry* cache_entry)
+bool transcoder_read_fd(Cache_Entry* cache_entry, size_t offset, size_t len, int *fd, size_t *bytes)
+{
+    if (!cache_entry->m_cache_info.m_finished)
+    {
+        return false;
+    }
+
+    int cache_fd = cache_entry->m_buffer->fd();
+    if (cache_fd == -1)
+    {
+        return false;
+    }
+
+    Logging::trace(cache_entry->destname(), "Reading %1 bytes from offset %2 of cache file.", len, offset);
+
+    // Store access time
+    cache_entry->update_access();
+
+    // Update read counter
+    cache_entry->update_read_count();
+
+    size_t size = cache_entry->m_buffer->buffer_watermark();
+
+    *fd     = cache_fd;
+    *bytes  = (offset < size) ? std::min(len, size - offset) : 0;
+
+    return true;
+}
+
+void transcoder_delete(Cache_Entry* cache_entry, const void *reader)
 {
+    if (cache_entry->m_buffer->is_stream())
+    {
+        cache_entry->m_buffer->stream_detach(reader);
+    }
+
     cache->close(&cache_entry);
 }
 
@@ -541,6 +1240,12 @@ size_t transcoder_buffer_tell(Cache_Entry* cache_entry)
 void transcoder_exit(void)
 {
     thread_exit = true;
+
+    if (tp != nullptr)
+    {
+        // Wake up jobs suspended in favour of others
+        tp->end_preemption();
+    }
 }
 
 bool transcoder_cache_maintenance(void)
@@ -567,6 +1272,252 @@ bool transcoder_cache_clear(void)
     }
 }
 
+void transcoder_log_stats(void)
+{
+    if (tp != nullptr)
+    {
+        for (int priority = 0; priority < THREAD_PRIORITY_MAX; priority++)
+        {
+            uint64_t jobs;
+            int64_t wait_avg;
+            int64_t wait_max;
+
+            tp->wait_stats(static_cast<THREAD_PRIORITY>(priority), &jobs, &wait_avg, &wait_max);
+
+            if (jobs)
+            {
+                Logging::info(nullptr, "Queue wait time for %1 priority: %2 jobs, average %3 ms, maximum %4 ms.", thread_pool::priority_name(static_cast<THREAD_PRIORITY>(priority)), jobs, wait_avg / 1000, wait_max / 1000);
+            }
+        }
+    }
+
+    if (wakeup_count)
+    {
+        Logging::info(nullptr, "Reader wake-up latency: %1 wake-ups, average %2 us, maximum %3 us.",
+                      static_cast<uint64_t>(wakeup_count),
+                      static_cast<int64_t>(wakeup_latency / static_cast<int64_t>(wakeup_count)),
+                      static_cast<int64_t>(wakeup_latency_max));
+    }
+
+    if (ramcache != nullptr)
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t refused;
+        size_t entries;
+        size_t size;
+
+        ramcache->stats(&hits, &misses, &evictions, &refused, &entries, &size);
+
+        Logging::info(nullptr, "RAM cache: %1 lookups, %2 hits (%3% hit rate), %4 evictions, %5 files written to disk for lack of memory, %6 entries with %7 left.",
+                      hits + misses,
+                      hits,
+                      hits + misses ? 100 * hits / (hits + misses) : 0,
+                      evictions,
+                      refused,
+                      entries,
+                      format_size(size).c_str());
+    }
+
+    {
+        uint64_t packets;
+        double avg_fill;
+        uint64_t empty_waits;
+        uint64_t full_waits;
+
+        Packet_Queue::total_stats(&packets, &avg_fill, &empty_waits, &full_waits);
+
+        if (packets)
+        {
+            Logging::info(nullptr, "Demuxer queues: %1 packets, %<%.1f>2 queued on average. Transcoders waited for their demuxer %3 times, demuxers waited for their transcoder %4 times.", packets, avg_fill, empty_waits, full_waits);
+        }
+    }
+}
+
+static bool claim_segment(SEGMENT_JOB *job, size_t *segment)
+{
+    std::lock_guard<std::mutex> lock(job->m_mutex);
+
+    if (thread_exit || job->m_next >= job->m_starts.size())
+    {
+        return false;
+    }
+
+    *segment = job->m_next++;
+
+    return true;
+}
+
+static int transcode_segment(SEGMENT_JOB *job, FFmpeg_Transcoder *transcoder, size_t segment, const void *tag)
+{
+    size_t start = job->m_starts[segment];
+    size_t end = segment + 1 < job->m_starts.size() ? job->m_starts[segment + 1] : SIZE_MAX;
+    int averror;
+
+    averror = transcoder->seek_segment(start, end);
+
+    while (averror >= 0 && !transcoder->segment_done() && !thread_exit)
+    {
+        int status = 0;
+
+        averror = transcoder->process_single_fr(status);
+        if (status < 0)
+        {
+            return (averror < 0 ? averror : AVERROR(EIO));
+        }
+
+        tp->suspend(tag);
+    }
+
+    return (averror < 0 ? averror : 0);
+}
+
+static int transcode_segments(Cache_Entry *cache_entry, FFmpeg_Transcoder *transcoder, const std::vector<size_t> & starts, THREAD_PRIORITY priority)
+{
+    std::shared_ptr<SEGMENT_JOB> job = std::make_shared<SEGMENT_JOB>();
+    size_t segment;
+    int averror = 0;
+
+    job->m_cache_entry  = cache_entry;
+    job->m_starts       = starts;
+    job->m_next         = 0;
+    job->m_running      = 0;
+
+    Logging::info(cache_entry->destname(), "Transcoding in %1 segments.", starts.size());
+
+    for (size_t n = 1; n < starts.size(); n++)
+    {
+        std::shared_ptr<SEGMENT_JOB> *arg = new(std::nothrow) std::shared_ptr<SEGMENT_JOB>(job);
+
+        // Same tag as the transcoder job, so that readers boosting the file also boost its helpers
+        if (arg == nullptr || !tp->schedule_thread(&segment_thread, arg, priority, cache_entry, cache_entry->filename()))
+        {
+            // Do what we have got
+            delete arg;
+            break;
+        }
+    }
+
+    while (averror >= 0 && claim_segment(job.get(), &segment))
+    {
+        averror = transcode_segment(job.get(), transcoder, segment, cache_entry);
+    }
+
+    {
+        // Helpers use our cache entry, wait until they are done
+        std::unique_lock<std::mutex> lock(job->m_mutex);
+
+        while (job->m_running)
+        {
+            job->m_cond.wait(lock);
+        }
+
+        // Make sure queued helpers do not start working now
+        job->m_next = job->m_starts.size();
+    }
+
+    if (averror < 0)
+    {
+        return averror;
+    }
+
+    if (thread_exit)
+    {
+        return 0;
+    }
+
+    return transcoder->end_segments();
+}
+
+/**
+ * @brief Segment helper thread
+ * @param[in] arg - Pointer to a shared pointer to the SEGMENT_JOB object of the file. Will be freed by this thread.
+ */
+static void segment_thread(void *arg)
+{
+    std::shared_ptr<SEGMENT_JOB> job(*static_cast<std::shared_ptr<SEGMENT_JOB> *>(arg));
+    FFmpeg_Transcoder *transcoder = nullptr;
+    size_t segment;
+    int averror = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(job->m_mutex);
+
+        if (thread_exit || job->m_next >= job->m_starts.size())
+        {
+            // Nothing left to do
+            delete static_cast<std::shared_ptr<SEGMENT_JOB> *>(arg);
+            return;
+        }
+
+        job->m_running++;
+    }
+
+    Cache_Entry *cache_entry = job->m_cache_entry;
+
+    transcoder = new(std::nothrow) FFmpeg_Transcoder;
+    if (transcoder == nullptr)
+    {
+        averror = AVERROR(ENOMEM);
+    }
+    else
+    {
+        averror = transcoder->open_input_file(cache_entry->virtualfile());
+        if (averror >= 0)
+        {
+            averror = transcoder->open_output_file(cache_entry->m_buffer, true);
+        }
+    }
+
+    while (averror >= 0 && claim_segment(job.get(), &segment))
+    {
+        averror = transcode_segment(job.get(), transcoder, segment, cache_entry);
+    }
+
+    if (averror < 0)
+    {
+        Logging::warning(cache_entry->destname(), "Segment transcoder failed, the rest will be transcoded sequentially (error '%1').", ffmpeg_geterror(averror).c_str());
+    }
+
+    if (transcoder != nullptr)
+    {
+        transcoder->close();
+        delete transcoder;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job->m_mutex);
+
+        job->m_running--;
+    }
+    job->m_cond.notify_all();
+
+    delete static_cast<std::shared_ptr<SEGMENT_JOB> *>(arg);
+}
+
+static void compress_thread(void *arg)
+{
+    Cache_Entry *cache_entry = static_cast<Cache_Entry *>(arg);
+
+    if (!thread_exit)
+    {
+        if (cache_entry->m_buffer->compress())
+        {
+            cache_entry->lock();
+            cache_entry->m_cache_info.m_disk_size = cache_entry->m_buffer->disk_size();
+            cache_entry->unlock();
+        }
+        else
+        {
+            Logging::warning(cache_entry->destname(), "Unable to compress cache file, keeping it uncompressed.");
+        }
+    }
+
+    // Drop the reference transcode_finish() handed over to us, this also stores the new size in the index
+    cache->close(&cache_entry);
+}
+
 /**
  * @brief Transcoding thread
  * @param[in] arg - Corresponding Cache_Entry object.
@@ -580,6 +1531,12 @@ static void transcoder_thread(void *arg)
     int syserror = 0;
     bool timeout = false;
     bool success = true;
+    bool resumable = false;
+    bool resumed = false;
+    bool restart = false;
+    bool stream = cache_entry->m_buffer->is_stream();
+    std::chrono::steady_clock::time_point wall_start = std::chrono::steady_clock::now();
+    int64_t cpu_start = cpu_account_start();
 
     std::unique_lock<std::recursive_mutex> lock(cache_entry->m_active_mutex);
 
@@ -598,29 +1555,61 @@ static void transcoder_thread(void *arg)
             throw (static_cast<int>(errno));
         }
 
+        // When resuming an interrupted run, add up the times of both runs
+        resumed = (cache_entry->m_buffer->buffer_watermark() > 0);
+
         averror = transcoder->open_input_file(cache_entry->virtualfile());
         if (averror < 0)
         {
             throw (static_cast<int>(errno));
         }
 
-        if (!cache->maintenance(transcoder->predicted_filesize()))
+        if (thread_data->m_background)
+        {
+            // Warming the cache must not push out entries that have actually been used
+            if (!cache->has_room(transcoder->predicted_filesize()))
+            {
+                Logging::info(cache_entry->filename(), "Cache is full, cache warming skipped.");
+                throw (static_cast<int>(ENOSPC));
+            }
+        }
+        else if (!stream && !cache->maintenance(transcoder->predicted_filesize()))
         {
             throw (static_cast<int>(errno));
         }
 
+        // Buffer may contain data from an interrupted run. Header goes to the start anyway.
+        cache_entry->m_buffer->seek(0, SEEK_SET);
+
         averror = transcoder->open_output_file(cache_entry->m_buffer);
         if (averror < 0)
         {
             throw (static_cast<int>(errno));
         }
 
+        std::vector<size_t> starts;
+        bool split = !stream && params.m_split_encode > 1 && transcoder->split_segments(params.m_split_encode, MIN_SEGMENT_SIZE, &starts);
+
+        if (!split)
+        {
+            averror = transcoder->resume();
+            if (averror < 0)
+            {
+                throw (static_cast<int>(EIO));
+            }
+        }
+
+        resumable = !stream && transcoder->can_seek_ahead();
+
+        // Only checkpoints of resumable files must be on disk
+        cache_entry->m_buffer->set_resumable(resumable);
+
         memcpy(&cache_entry->m_id3v1, transcoder->id3v1tag(), sizeof(ID3v1));
 
         thread_data->m_initialised = true;
 
         bool unlocked = false;
-        if (!params.m_prebuffer_size)
+        if (!params.m_prebuffer_size || split)
         {
             // Unlock frame set from beginning
             unlocked = true;
@@ -632,16 +1621,71 @@ static void transcoder_thread(void *arg)
             Logging::debug(cache_entry->destname(), "Pre-buffering up to %1 bytes.", params.m_prebuffer_size);
         }
 
+        if (split)
+        {
+            // Readers wait for the parts they need, no pre-buffering.
+            averror = transcode_segments(cache_entry, transcoder, starts, thread_data->m_background ? THREAD_PRIORITY_BACKGROUND : THREAD_PRIORITY_NORMAL);
+            if (averror < 0)
+            {
+                throw (static_cast<int>(EIO));
+            }
+        }
+
+        size_t checkpoint = cache_entry->m_buffer->buffer_watermark();
+
         while (!cache_entry->m_cache_info.m_finished && !(timeout = cache_entry->decode_timeout()) && !thread_exit)
         {
             int status = 0;
 
-            if (cache_entry->ref_count() > 1)
+            if (cache_entry->ref_count() > (thread_data->m_background ? 2 : 1))
             {
                 // Set last access time
                 cache_entry->update_access(false);
             }
 
+            if (stream)
+            {
+                // Wait until the slowest reader has made room in the ring buffer
+                unsigned int seq = cache_entry->m_buffer->progress_seq();
+
+                while (cache_entry->m_buffer->stream_full() && !cache_entry->m_restart && !thread_exit && !(timeout = cache_entry->decode_timeout()))
+                {
+                    if (!unlocked)
+                    {
+                        // Pre-buffer does not fit, let the reader in
+                        unlocked = true;
+                        thread_data->m_lock_guard = true;
+                        thread_data->m_cond.notify_all();  // signal that we are running
+                    }
+
+                    cache_entry->m_buffer->wait_progress(seq, std::chrono::milliseconds(PROGRESS_WAIT_TIMEOUT));
+                    seq = cache_entry->m_buffer->progress_seq();
+                }
+
+                if (timeout || thread_exit)
+                {
+                    break;
+                }
+
+                if (cache_entry->m_restart)
+                {
+                    restart = true;
+                    break;
+                }
+            }
+
+            size_t seek_to = cache_entry->m_seek_to.exchange(0);
+            if (seek_to)
+            {
+                averror = transcoder->seek_ahead(seek_to);
+                if (averror < 0)
+                {
+                    syserror = EIO;
+                    success = false;
+                    break;
+                }
+            }
+
             averror = transcoder->process_single_fr(status);
             if (status < 0)
             {
@@ -657,6 +1701,13 @@ static void transcoder_thread(void *arg)
                 break;
             }
 
+            if (resumable && cache_entry->m_buffer->buffer_watermark() >= checkpoint + CHECKPOINT_INTERVAL)
+            {
+                // Save data and index so we can carry on from here after a crash
+                checkpoint = cache_entry->m_buffer->buffer_watermark();
+                cache_entry->flush();
+            }
+
             if (!unlocked && cache_entry->m_buffer->buffer_watermark() > params.m_prebuffer_size)
             {
                 unlocked = true;
@@ -665,6 +1716,22 @@ static void transcoder_thread(void *arg)
                 thread_data->m_cond.notify_all();       // signal that we are running
             }
 
+            if (tp->preempted(cache_entry))
+            {
+                if (!unlocked && params.m_prebuffer_size)
+                {
+                    unlocked = true;
+                    thread_data->m_lock_guard = true;
+                    thread_data->m_cond.notify_all();  // signal that we are running
+                }
+
+                Logging::info(cache_entry->destname(), "Transcoding suspended in favour of a job with higher priority.");
+
+                tp->suspend(cache_entry);
+
+                Logging::info(cache_entry->destname(), "Transcoding resumed.");
+            }
+
             if (cache_entry->ref_count() <= 1 && cache_entry->suspend_timeout())
             {
                 if (!unlocked && params.m_prebuffer_size)
@@ -707,6 +1774,8 @@ static void transcoder_thread(void *arg)
         cache_entry->m_cache_info.m_errno       = success ? 0 : (syserror ? syserror : EIO);    // Preserve errno
         cache_entry->m_cache_info.m_averror     = success ? 0 : averror;                        // Preserve averror
 
+        cache_entry->m_buffer->notify_progress();   // Wake up waiting readers
+
         thread_data->m_lock_guard = true;
         thread_data->m_cond.notify_all();           // unlock main thread
     }
@@ -715,13 +1784,48 @@ static void transcoder_thread(void *arg)
 
     delete transcoder;
 
-    if (timeout || thread_exit)
     {
+        // Keep track of transcoding costs, also for interrupted runs as they will be resumed
+        int64_t transcode_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wall_start).count();
+        int64_t cpu_time = cpu_account_end(cpu_start);
+
+        if (!resumed)
+        {
+            cache_entry->m_cache_info.m_transcode_time  = 0;
+            cache_entry->m_cache_info.m_cpu_time        = 0;
+        }
+        cache_entry->m_cache_info.m_transcode_time      += transcode_time;
+        cache_entry->m_cache_info.m_cpu_time            += cpu_time;
+    }
+
+    if (restart)
+    {
+        // A reader wants data that has already dropped out of the stream buffer. It starts the stream over.
+        cache_entry->m_cache_info.m_finished    = false;
+        cache_entry->m_cache_info.m_error       = false;
+        cache_entry->m_cache_info.m_errno       = 0;
+        cache_entry->m_cache_info.m_averror     = 0;
+        cache_entry->m_is_decoding              = false;
+
+        cache_entry->m_buffer->notify_progress();   // Wake up waiting readers
+
+        Logging::info(cache_entry->destname(), "Stream stopped to start over.");
+    }
+    else if (timeout || thread_exit)
+    {
+        // If the file can be resumed, keep what we have and carry on next time it is opened.
+        // Streams start over when they are read again.
+        resumable = resumable && success;
+
+        bool restartable = resumable || (stream && success);
+
         cache_entry->m_is_decoding              = false;
         cache_entry->m_cache_info.m_finished    = false;
-        cache_entry->m_cache_info.m_error       = true;
-        cache_entry->m_cache_info.m_errno       = EIO;      // Report I/O error
-        cache_entry->m_cache_info.m_averror     = averror;  // Preserve averror
+        cache_entry->m_cache_info.m_error       = !restartable;
+        cache_entry->m_cache_info.m_errno       = restartable ? 0 : EIO;        // Report I/O error
+        cache_entry->m_cache_info.m_averror     = restartable ? 0 : averror;    // Preserve averror
+
+        cache_entry->m_buffer->notify_progress();   // Wake up waiting readers
 
         if (timeout)
         {
@@ -731,6 +1835,11 @@ static void transcoder_thread(void *arg)
         {
             Logging::info(cache_entry->destname(), "Thread exit! Transcoding aborted.");
         }
+
+        if (resumable)
+        {
+            Logging::info(cache_entry->destname(), "Transcoding will be resumed at %1 when the file is opened again.", format_size(cache_entry->m_buffer->buffer_watermark()).c_str());
+        }
     }
     else
     {
@@ -739,12 +1848,17 @@ static void transcoder_thread(void *arg)
         cache_entry->m_cache_info.m_errno           = success ? 0 : (syserror ? syserror : EIO);    // Preserve errno
         cache_entry->m_cache_info.m_averror         = success ? 0 : averror;                        // Preserve averror
 
+        cache_entry->m_buffer->notify_progress();   // Wake up waiting readers
+
         if (success)
         {
             Logging::info(cache_entry->destname(), "Transcoding completed successfully.");
+            Logging::debug(cache_entry->destname(), "Transcoding took %1 ms, CPU time %2 ms.", cache_entry->m_cache_info.m_transcode_time, cache_entry->m_cache_info.m_cpu_time);
         }
         else
         {
+            cache_entry->m_buffer->publish(SHARED_STATE_ABORTED);   // Tell other instances following the file
+
             Logging::error(cache_entry->destname(), "Transcoding exited with error.");
             if (cache_entry->m_cache_info.m_errno)
             {
@@ -757,7 +1871,14 @@ static void transcoder_thread(void *arg)
         }
     }
 
-    cache->close(&cache_entry, timeout ? CLOSE_CACHE_DELETE : CLOSE_CACHE_NOOPT);
+    if (thread_data->m_background)
+    {
+        // Drop the reference transcoder_warm() handed over to us
+        cache->close(&cache_entry);
+        warm_running--;
+    }
+
+    cache->close(&cache_entry, (timeout && !resumable) ? CLOSE_CACHE_DELETE : CLOSE_CACHE_NOOPT);
 
     delete thread_data;
 
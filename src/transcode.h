@@ -73,6 +73,20 @@ bool            transcoder_predict_filesize(LPVIRTUALFILE virtualfile, Cache_Ent
  *  @return On success, returns cache entry object. On error, returns nullptr and sets errno accordingly.
  */
 Cache_Entry*    transcoder_new(LPVIRTUALFILE virtualfile, bool begin_transcode);
+/** @brief Queue a background transcode to warm the cache
+ *
+ * Starts a low priority transcoder job if the file has no finished cache entry yet
+ * and fits into the cache without pruning other entries. Does not wait for the job
+ * to start. Interactive jobs take precedence over cache warming.
+ *
+ *  @param[in] virtualfile - virtual file object to transcode
+ *  @return Returns true if a job was queued, false if not. On error errno is set accordingly.
+ */
+bool            transcoder_warm(LPVIRTUALFILE virtualfile);
+/** @brief Get the number of cache warming jobs
+ *  @return Returns the number of queued or running cache warming jobs.
+ */
+unsigned int    transcoder_warm_running(void);
 /** @brief Read some bytes into the internal buffer and into the given buffer.
  *  @note buff must be large enough to hold len number of bytes.
  *  @note Returns number of bytes read, may be less than len bytes.
@@ -81,9 +95,24 @@ Cache_Entry*    transcoder_new(LPVIRTUALFILE virtualfile, bool begin_transcode);
  *  @param[in] offset - byte offset to start reading at
  *  @param[in] len - length of data chunk to be read.
  *  @param[out] bytes_read - Bytes read from transcoder.
+ *  @param[in] reader - Identifies the reader, e.g. the file handle. Streams are held up by their slowest reader.
  *  @return On success, returns true. On error, returns false and sets errno accordingly.
  */
-bool            transcoder_read(Cache_Entry* cache_entry, char* buff, size_t offset, size_t len, int *bytes_read);
+bool            transcoder_read(Cache_Entry* cache_entry, char* buff, size_t offset, size_t len, int *bytes_read, const void *reader = nullptr);
+/** @brief Get the cache file to read from if the file has been completely transcoded.
+ *
+ * Allows passing data directly from the cache file to the kernel without copying
+ * it through user space.
+ *
+ *  @param[in] cache_entry - corresponding cache entry
+ *  @param[in] offset - byte offset to start reading at
+ *  @param[in] len - length of data chunk to be read.
+ *  @param[out] fd - File descriptor of the cache file.
+ *  @param[out] bytes - Number of bytes that can be read at offset, may be less than len.
+ *  @return Returns true if data can be read from fd. Returns false if the file is not
+ *  completely transcoded yet, use transcoder_read() instead.
+ */
+bool            transcoder_read_fd(Cache_Entry* cache_entry, size_t offset, size_t len, int *fd, size_t *bytes);
 /** @brief Free the cache entry structure.
  *
  * Call this to free the cache entry structure. @n
@@ -91,8 +120,9 @@ bool            transcoder_read(Cache_Entry* cache_entry, char* buff, size_t off
  * use by another thread, the cache entry may no longer be valid.
  *
  *  @param[in] cache_entry - corresponding cache entry
+ *  @param[in] reader - Reader as passed to transcoder_read(), no longer holds up the stream.
  */
-void            transcoder_delete(Cache_Entry* cache_entry);
+void            transcoder_delete(Cache_Entry* cache_entry, const void *reader = nullptr);
 /** @brief Return size of output file, as computed by encoder.
  *
  * Returns the file size, either the predicted size (which may be inaccurate) or
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * Measures lookup throughput of the virtual file index against a locked std::map.
+ *
+ * usage: bench_file_index [files] [threads] [lookups per thread]
+ */
+
+#include "file_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+/**
+ * @brief Create the name of a test file.
+ * @param[in] n - File number.
+ * @return Returns virtual file path, 1000 files per directory.
+ */
+static std::string test_filename(unsigned int n)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "/srv/music/artist%04u/album%02u/track%04u.mp4", n / 10000, (n / 1000) % 10, n % 1000);
+
+    return path;
+}
+
+/**
+ * @brief Run lookups on several threads.
+ * @param[in] lookup - Function that looks up one file, returns true if found.
+ * @param[in] paths - File paths to look up.
+ * @param[in] threads - Number of threads.
+ * @param[in] lookups - Number of lookups per thread.
+ * @param[out] found - Number of files found.
+ * @return Returns elapsed time in seconds.
+ */
+template <typename F>
+static double run(F lookup, const std::vector<std::string> & paths, unsigned int threads, unsigned int lookups, uint64_t *found)
+{
+    std::vector<std::thread> pool;
+    std::atomic<uint64_t> hits(0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        pool.push_back(std::thread([&, t]()
+        {
+            uint64_t local_hits = 0;
+            uint32_t seed = t * 2654435761U + 1;
+
+            for (unsigned int n = 0; n < lookups; n++)
+            {
+                seed = seed * 1664525U + 1013904223U;
+                if (lookup(paths[seed % paths.size()]))
+                {
+                    local_hits++;
+                }
+            }
+            hits += local_hits;
+        }));
+    }
+
+    for (std::thread & thread : pool)
+    {
+        thread.join();
+    }
+
+    *found = hits;
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int files      = argc > 1 ? static_cast<unsigned int>(atoi(argv[1])) : 1000000;
+    unsigned int threads    = argc > 2 ? static_cast<unsigned int>(atoi(argv[2])) : 32;
+    unsigned int lookups    = argc > 3 ? static_cast<unsigned int>(atoi(argv[3])) : 1000000;
+    std::vector<std::string> paths;
+    File_Index index;
+    std::map<std::string, VIRTUALFILE> map;
+    std::recursive_mutex map_mutex;
+    VIRTUALFILE virtualfile;
+    uint64_t found;
+    double secs;
+
+    paths.reserve(files);
+    for (unsigned int n = 0; n < files; n++)
+    {
+        paths.push_back(test_filename(n));
+        virtualfile.m_origfile = paths.back();
+        index.insert(paths.back(), virtualfile);
+        map.insert(std::make_pair(paths.back(), virtualfile));
+    }
+
+    printf("%u files, %u threads, %u lookups per thread\n", files, threads, lookups);
+
+    secs = run([&](const std::string & path)
+    {
+        std::lock_guard<std::recursive_mutex> lock(map_mutex);
+        return map.find(path) != map.end();
+    }, paths, threads, lookups, &found);
+
+    printf("std::map:   %10.0f lookups/s (%llu found)\n", static_cast<double>(threads) * lookups / secs, static_cast<unsigned long long>(found));
+
+    secs = run([&](const std::string & path)
+    {
+        return index.find(path) != nullptr;
+    }, paths, threads, lookups, &found);
+
+    printf("File_Index: %10.0f lookups/s (%llu found)\n", static_cast<double>(threads) * lookups / secs, static_cast<unsigned long long>(found));
+
+    std::vector<LPVIRTUALFILE> dir;
+    size_t count = index.list_dir("/srv/music/artist0000/album00/", &dir);
+
+    printf("Directory listing: %zu files\n", count);
+
+    return (found == static_cast<uint64_t>(threads) * lookups && count == std::min(files, 1000u)) ? 0 : 1;
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * Compares stereo sample format conversion with libswresample, the fast path and plain C.
+ *
+ * usage: bench_sample_convert [frames] [samples per frame]
+ *
+ * Converts planar float to 16 bit and back, checks that the results are the
+ * same as libswresample's and prints the samples per second each one achieves.
+ * Returns 1 if any result differs.
+ */
+
+#include "sample_convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+#define CHANNELS    2                           /**< @brief Stereo */
+#define SAMPLE_RATE 48000                       /**< @brief Sample rate, same for input and output */
+
+/**
+ * @brief Get next pseudo random number, same sequence on every run.
+ * @param[in, out] seed - Generator state.
+ * @return Returns a number between 0 and 1.
+ */
+static double next_random(uint64_t *seed)
+{
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return static_cast<double>(*seed >> 11) / static_cast<double>(1ULL << 53);
+}
+
+/**
+ * @brief Convert all frames.
+ * @param[in] convert - Function that converts one frame.
+ * @param[in] frames - Number of frames.
+ * @return Returns elapsed time in seconds.
+ */
+template <typename F>
+static double run(F convert, unsigned int frames)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int n = 0; n < frames; n++)
+    {
+        convert(n);
+    }
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Benchmark one conversion.
+ * @param[in] in_fmt - Input sample format.
+ * @param[in] out_fmt - Output sample format.
+ * @param[in] input - Input planes of all frames, one for interleaved formats.
+ * @param[in] frames - Number of frames.
+ * @param[in] frame_size - Samples per channel and frame.
+ * @return Returns true if the results are the same as libswresample's.
+ */
+static bool bench(AVSampleFormat in_fmt, AVSampleFormat out_fmt, const std::vector<std::vector<uint8_t>> & input, unsigned int frames, int frame_size)
+{
+    size_t in_planes = av_sample_fmt_is_planar(in_fmt) ? CHANNELS : 1;
+    size_t out_planes = av_sample_fmt_is_planar(out_fmt) ? CHANNELS : 1;
+    size_t in_frame_bytes = input[0].size() / frames;
+    size_t out_frame_bytes = static_cast<size_t>(frame_size * av_get_bytes_per_sample(out_fmt)) * (CHANNELS / out_planes);
+    std::vector<std::vector<uint8_t>> out_swr(out_planes, std::vector<uint8_t>(out_frame_bytes * frames));
+    std::vector<std::vector<uint8_t>> out_fast(out_planes, std::vector<uint8_t>(out_frame_bytes * frames));
+    std::vector<std::vector<uint8_t>> out_c(out_planes, std::vector<uint8_t>(out_frame_bytes * frames));
+    SAMPLE_CONVERT_FUNC fast = get_sample_converter(in_fmt, out_fmt);
+    SAMPLE_CONVERT_FUNC c = get_sample_converter_c(in_fmt, out_fmt);
+    SwrContext *swr_ctx;
+    bool exact = true;
+    double secs;
+
+    swr_ctx = swr_alloc_set_opts(nullptr,
+                                 AV_CH_LAYOUT_STEREO, out_fmt, SAMPLE_RATE,
+                                 AV_CH_LAYOUT_STEREO, in_fmt, SAMPLE_RATE,
+                                 0, nullptr);
+    if (swr_ctx == nullptr || swr_init(swr_ctx) < 0 || fast == nullptr || c == nullptr)
+    {
+        fprintf(stderr, "Could not set up conversion %s -> %s.\n", av_get_sample_fmt_name(in_fmt), av_get_sample_fmt_name(out_fmt));
+        swr_free(&swr_ctx);
+        return false;
+    }
+
+    // Point to frame n in each plane
+    auto in_ptrs = [&](unsigned int n, const uint8_t **ptrs)
+    {
+        for (size_t p = 0; p < in_planes; p++)
+        {
+            ptrs[p] = input[p].data() + n * in_frame_bytes;
+        }
+    };
+    auto out_ptrs = [&](std::vector<std::vector<uint8_t>> & out, unsigned int n, uint8_t **ptrs)
+    {
+        for (size_t p = 0; p < out_planes; p++)
+        {
+            ptrs[p] = out[p].data() + n * out_frame_bytes;
+        }
+    };
+
+    printf("%s -> %s:\n", av_get_sample_fmt_name(in_fmt), av_get_sample_fmt_name(out_fmt));
+
+    secs = run([&](unsigned int n)
+    {
+        const uint8_t *in[CHANNELS];
+        uint8_t *out[CHANNELS];
+
+        in_ptrs(n, in);
+        out_ptrs(out_swr, n, out);
+        swr_convert(swr_ctx, out, frame_size, in, frame_size);
+    }, frames);
+    printf("  swresample: %12.0f samples/s\n", static_cast<double>(frames) * frame_size / secs);
+
+    secs = run([&](unsigned int n)
+    {
+        const uint8_t *in[CHANNELS];
+        uint8_t *out[CHANNELS];
+
+        in_ptrs(n, in);
+        out_ptrs(out_fast, n, out);
+        fast(out, in, CHANNELS, frame_size);
+    }, frames);
+    printf("  %-10s: %12.0f samples/s\n", get_sample_converter_name(), static_cast<double>(frames) * frame_size / secs);
+
+    secs = run([&](unsigned int n)
+    {
+        const uint8_t *in[CHANNELS];
+        uint8_t *out[CHANNELS];
+
+        in_ptrs(n, in);
+        out_ptrs(out_c, n, out);
+        c(out, in, CHANNELS, frame_size);
+    }, frames);
+    printf("  %-10s: %12.0f samples/s\n", "C", static_cast<double>(frames) * frame_size / secs);
+
+    for (size_t p = 0; p < out_planes; p++)
+    {
+        if (out_fast[p] != out_swr[p] || out_c[p] != out_swr[p])
+        {
+            exact = false;
+        }
+    }
+
+    printf("  Same as swresample: %s\n\n", exact ? "yes" : "NO");
+
+    swr_free(&swr_ctx);
+
+    return exact;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int frames = static_cast<unsigned int>(argc > 1 ? atoi(argv[1]) : 20000);
+    int frame_size = argc > 2 ? atoi(argv[2]) : 1152;
+    size_t samples = static_cast<size_t>(frame_size) * frames;
+    std::vector<std::vector<uint8_t>> fltp(CHANNELS, std::vector<uint8_t>(samples * sizeof(float)));
+    std::vector<std::vector<uint8_t>> s16(1, std::vector<uint8_t>(samples * CHANNELS * sizeof(int16_t)));
+    uint64_t seed = 1;
+    bool exact = true;
+
+    if (!frames || frame_size <= 0)
+    {
+        fprintf(stderr, "usage: bench_sample_convert [frames] [samples per frame]\n");
+        return 1;
+    }
+
+    for (size_t n = 0; n < samples; n++)
+    {
+        for (size_t ch = 0; ch < CHANNELS; ch++)
+        {
+            // Mostly in range, some clipping, some exactly between two 16 bit values
+            float value = static_cast<float>(next_random(&seed) * 2.2 - 1.1);
+
+            if (n % 7 == 0)
+            {
+                value = (static_cast<float>(static_cast<int>(next_random(&seed) * 65536) - 32768) + 0.5f) / 32768;
+            }
+
+            reinterpret_cast<float *>(fltp[ch].data())[n] = value;
+            reinterpret_cast<int16_t *>(s16[0].data())[n * CHANNELS + ch] = static_cast<int16_t>(static_cast<int>(next_random(&seed) * 65536) - 32768);
+        }
+    }
+
+    printf("%u frames of %d samples, %d channels\n\n", frames, frame_size, CHANNELS);
+
+    exact &= bench(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, fltp, frames, frame_size);
+    exact &= bench(AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP, s16, frames, frame_size);
+
+    return exact ? 0 : 1;
+}
@@ -25,6 +25,8 @@ set -e
 trap cleanup EXIT
 trap ffmpegfserr USR1
 DESTTYPE=$1
+# Optional: Additional ffmpegfs options
+EXTRAOPTS=$2
 # Map filenames
 if [ "${DESTTYPE}" == "prores" ];
 then
@@ -37,7 +39,7 @@ DIRNAME="$(mktemp -d)"
 CACHEPATH="$(mktemp -d)"
 
 #--disable_cache
-( ffmpegfs -f "$SRCDIR" "$DIRNAME" --logfile=$0_${DESTTYPE}.builtin.log --log_maxlevel=TRACE --cachepath="$CACHEPATH" --desttype=${DESTTYPE} > /dev/null || kill -USR1 $$ ) &
+( ffmpegfs -f "$SRCDIR" "$DIRNAME" --logfile=$0_${DESTTYPE}.builtin.log --log_maxlevel=TRACE --cachepath="$CACHEPATH" --desttype=${DESTTYPE} ${EXTRAOPTS} > /dev/null || kill -USR1 $$ ) &
 while ! mount | grep -q "$DIRNAME" ; do
     sleep 0.1
 done
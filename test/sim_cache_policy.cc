@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2017-2019 Norbert Schlia (nschlia@oblivion-software.de)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file
+ * Replays an access log against the cache eviction policies and compares hit ratios.
+ *
+ * usage: sim_cache_policy [cache size in MB] [access log]
+ *
+ * Each line of the access log reads "time size cost file": Unix time of the access,
+ * size of the transcoded file in bytes, time to transcode it in ms and the file name.
+ * Lines starting with # are ignored. Without a log, a mix of often played music files
+ * and rarely watched, large video files is generated.
+ */
+
+#include "cache_policy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <unordered_map>
+
+/**
+ * @brief One access of the log
+ */
+typedef struct ACCESS
+{
+    time_t          m_time;                     /**< @brief Time of access */
+    size_t          m_size;                     /**< @brief Size of transcoded file */
+    int64_t         m_cost;                     /**< @brief Time to transcode the file in ms */
+    std::string     m_filename;                 /**< @brief File name */
+} ACCESS;
+
+/**
+ * @brief Read an access log.
+ * @param[in] logfile - Name of log file.
+ * @param[out] accesses - Accesses read.
+ * @return Returns true on success, false if the file could not be opened.
+ */
+static bool read_log(const char *logfile, std::vector<ACCESS> *accesses)
+{
+    FILE *fp = fopen(logfile, "r");
+    char line[4096];
+
+    if (fp == nullptr)
+    {
+        fprintf(stderr, "%s: %s\n", logfile, strerror(errno));
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), fp) != nullptr)
+    {
+        long long t;
+        unsigned long long size;
+        long long cost;
+        int pos = 0;
+
+        if (line[0] == '#' || sscanf(line, "%lld %llu %lld %n", &t, &size, &cost, &pos) < 3 || !pos)
+        {
+            continue;
+        }
+
+        ACCESS access;
+
+        access.m_time       = static_cast<time_t>(t);
+        access.m_size       = static_cast<size_t>(size);
+        access.m_cost       = static_cast<int64_t>(cost);
+        access.m_filename   = line + pos;
+        access.m_filename.erase(access.m_filename.find_last_not_of("\r\n") + 1);
+
+        accesses->push_back(access);
+    }
+
+    fclose(fp);
+
+    return true;
+}
+
+/**
+ * @brief Get next pseudo random number, same sequence on every run.
+ * @param[in, out] seed - Generator state.
+ * @return Returns a number between 0 and 1.
+ */
+static double next_random(uint64_t *seed)
+{
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return static_cast<double>(*seed >> 11) / static_cast<double>(1ULL << 53);
+}
+
+/**
+ * @brief Generate a library of music and video files and Zipf distributed accesses.
+ * @param[in] count - Number of accesses.
+ * @param[out] accesses - Accesses generated.
+ */
+static void generate_log(unsigned int count, std::vector<ACCESS> *accesses)
+{
+    const unsigned int music_files = 2000;
+    const unsigned int video_files = 100;
+    std::vector<ACCESS> files;
+    std::vector<double> cdf;
+    uint64_t seed = 1;
+    double sum = 0;
+
+    for (unsigned int n = 0; n < music_files + video_files; n++)
+    {
+        ACCESS file;
+        char name[64];
+
+        if (n < music_files)
+        {
+            // 4 to 12 MB, transcoded at about 1.5 MB per second
+            snprintf(name, sizeof(name), "music/track%05u.mp3", n);
+            file.m_size = static_cast<size_t>((4 + 8 * next_random(&seed)) * 1024 * 1024);
+            file.m_cost = static_cast<int64_t>(file.m_size / 1500);
+        }
+        else
+        {
+            // 2 to 40 GB, transcoded at about 20 MB per second
+            snprintf(name, sizeof(name), "video/movie%05u.mp4", n);
+            file.m_size = static_cast<size_t>((2 + 38 * next_random(&seed)) * 1024 * 1024 * 1024);
+            file.m_cost = static_cast<int64_t>(file.m_size / 20000);
+        }
+        file.m_filename = name;
+        file.m_time     = 0;
+
+        files.push_back(file);
+    }
+
+    // Shuffle so that popularity does not depend on file type
+    for (size_t n = files.size() - 1; n > 0; n--)
+    {
+        std::swap(files[n], files[static_cast<size_t>(next_random(&seed) * (n + 1))]);
+    }
+
+    for (size_t n = 0; n < files.size(); n++)
+    {
+        sum += 1 / pow(n + 1, 0.8);
+        cdf.push_back(sum);
+    }
+
+    for (unsigned int n = 0; n < count; n++)
+    {
+        double r = next_random(&seed) * sum;
+        size_t idx = static_cast<size_t>(std::lower_bound(cdf.begin(), cdf.end(), r) - cdf.begin());
+
+        ACCESS access = files[std::min(idx, files.size() - 1)];
+
+        access.m_time = static_cast<time_t>(n) * 60;    // One access per minute
+
+        accesses->push_back(access);
+    }
+}
+
+/**
+ * @brief Replay accesses against a cache using a policy.
+ * @param[in] policy - Eviction policy.
+ * @param[in] accesses - Accesses to replay.
+ * @param[in] capacity - Cache size in bytes.
+ */
+static void simulate(Cache_Policy *policy, const std::vector<ACCESS> & accesses, size_t capacity)
+{
+    std::unordered_map<std::string, CACHE_CANDIDATE> cache;
+    size_t total_size = 0;
+    uint64_t hits = 0;
+    uint64_t bytes = 0;
+    uint64_t hit_bytes = 0;
+    int64_t cost = 0;
+    int64_t hit_cost = 0;
+    uint64_t evictions = 0;
+
+    for (const ACCESS & access : accesses)
+    {
+        bytes   += access.m_size;
+        cost    += access.m_cost;
+
+        auto it = cache.find(access.m_filename);
+        if (it != cache.end())
+        {
+            it->second.m_access_time = access.m_time;
+            it->second.m_hit_count++;
+
+            hits++;
+            hit_bytes   += access.m_size;
+            hit_cost    += access.m_cost;
+            continue;
+        }
+
+        if (access.m_size > capacity)
+        {
+            continue;
+        }
+
+        if (total_size + access.m_size > capacity)
+        {
+            // Make room like Cache::prune_cache_size() before the file is added
+            std::vector<CACHE_CANDIDATE> candidates;
+
+            candidates.reserve(cache.size());
+            for (const auto & entry : cache)
+            {
+                candidates.push_back(entry.second);
+            }
+
+            policy->sort(&candidates);
+
+            for (const CACHE_CANDIDATE & candidate : candidates)
+            {
+                policy->evicted(candidate, access.m_time);
+                total_size -= candidate.m_size;
+                cache.erase(candidate.m_filename);
+                evictions++;
+
+                if (total_size + access.m_size <= capacity)
+                {
+                    break;
+                }
+            }
+        }
+
+        CACHE_CANDIDATE candidate;
+
+        candidate.m_filename    = access.m_filename;
+        candidate.m_size        = access.m_size;
+        candidate.m_access_time = access.m_time;
+        candidate.m_hit_count   = 1;
+        candidate.m_cost        = access.m_cost;
+
+        cache[access.m_filename] = candidate;
+        total_size += access.m_size;
+    }
+
+    printf("%-5s %9.2f%% %9.2f%% %9.2f%% %10llu\n",
+           policy->name(),
+           accesses.empty() ? 0. : 100. * hits / accesses.size(),
+           bytes ? 100. * hit_bytes / bytes : 0.,
+           cost ? 100. * hit_cost / cost : 0.,
+           static_cast<unsigned long long>(evictions));
+}
+
+int main(int argc, char **argv)
+{
+    size_t capacity = static_cast<size_t>(argc > 1 ? atoll(argv[1]) : 100 * 1024) * 1024 * 1024;
+    std::vector<ACCESS> accesses;
+
+    if (argc > 2)
+    {
+        if (!read_log(argv[2], &accesses))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        generate_log(100000, &accesses);
+    }
+
+    printf("%zu accesses, cache size %zu MB\n\n", accesses.size(), capacity / (1024 * 1024));
+    printf("%-5s %10s %10s %10s %10s\n", "", "Hits", "Byte hits", "Time saved", "Evictions");
+
+    for (CACHE_POLICY type : { CACHE_POLICY_LRU, CACHE_POLICY_LFU, CACHE_POLICY_GDSF })
+    {
+        Cache_Policy *policy = Cache_Policy::create(type);
+
+        if (policy == nullptr)
+        {
+            return 1;
+        }
+
+        simulate(policy, accesses, capacity);
+
+        delete policy;
+    }
+
+    return 0;
+}